@@ -8,14 +8,28 @@
  #include "freertos/FreeRTOS.h"
  #include "freertos/queue.h"
  #include "fifo.h"
+ #include "afsk_demod.h"
 
  #define AFSK_RESOLUTION 38400 
- #define AFSK_BITRATE 1200
- #define AFSK_SAMPLERATE 9600
  
  #define AFSK_MARK  1200
  #define AFSK_SPACE 2200
  
+ /* Number of demodulators (pre-filter variants) */
+ #define AFSK_DEMODULATORS 3
+ 
+ /* Decoder statistics */
+ typedef struct {
+    uint32_t frames;       // Frames captured (squelch open)
+    uint32_t decoded;      // Frames successfully decoded
+    uint32_t usec;         // Total CPU time used for demodulation
+    uint32_t demod[AFSK_DEMODULATORS];  // Frames decoded first by each demodulator
+    int8_t   snr;          // Signal/noise ratio (dB) of last frame
+    uint32_t lat_n;        // Frames with latency measured
+    uint32_t lat_usec;     // Total latency from closing flag to delivery
+    uint32_t lat_max;      // Max latency
+ } afsk_stats_t;
+ 
  void tone_init(void);
  void tone_start(void);
  void tone_setHigh(bool hi);
@@ -39,21 +53,29 @@
  void afsk_rx_newFrame(void); 
  void afsk_rx_nextFrame(void);
  void afsk_PTT(bool on);
- bool afsk_dcd(int8_t sample);
+ bool afsk_dcd_block(const int8_t in[], int8_t tmp[], uint16_t n);
+ int8_t afsk_dcd_snr(void);
  void afsk_dcd_reset();
  bool afsk_isRxMode(); 
  bool afsk_isSquelchOff();
  void afsk_setSquelchOff(bool off);
 
  void afsk_setSoftSq(uint16_t sq);
+ void afsk_setParallel(bool on);
+ void afsk_setStreaming(bool on);
+ void afsk_rx_getStats(afsk_stats_t* st);
+ int64_t afsk_rx_frameEnd(void);
+ void afsk_fir_bench(uint32_t cycles[FIR_FILTERS]);
 
  void   rxSampler_init();
  void   rxSampler_start(); 
  void   rxSampler_stop();
  int    rxSampler_length();
  int    rxSampler_getFrame();
+ int    rxSampler_getFragment(int8_t** samples, bool* carrier);
  int8_t rxSampler_get();
  bool   rxSampler_put(int8_t sample);
+ void   rxSampler_push(int8_t sample);
  bool   rxSampler_eof();
  void   rxSampler_reset();
  void   rxSampler_reInit();
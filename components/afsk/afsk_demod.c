@@ -0,0 +1,424 @@
+/* 
+ * Copyright (C) 2026 Øyvind Hanssen, LA7ECA
+ *
+ * Arctic Tracker - AFSK Demodulation
+ * FIR filters, tone detection and bit synchronisation. 
+ *
+ * Arctic Tracker is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details: 
+ * <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Partly based on code from BertOS AFSK decoder. 
+ *    Originally by Develer S.r.l. (http://www.develer.com/), GPLv2 licensed.
+ * 
+ * Note: This file should not depend on FreeRTOS or ESP-IDF. It is 
+ * also used by the host test program (test.c). 
+ */
+
+#include <string.h>
+#include "afsk_demod.h"
+
+
+#define SAMPLESPERBIT (AFSK_SAMPLERATE / AFSK_BITRATE)   // How many DAC/ADC samples constitute one bit (8).
+
+/* Phase sync constants */
+#define PHASE_BITS   8                              // How much to increment phase counter each sample
+#define PHASE_INC    1                              // Nudge by an eigth of a sample each adjustment
+#define PHASE_MAX    (SAMPLESPERBIT * PHASE_BITS)   // Resolution of our phase counter = 64
+#define PHASE_THRESHOLD  (PHASE_MAX / 2)            // Target transition point of our phase window
+
+/* Detect transition */
+#define BITS_DIFFER(bits1, bits2) (((bits1)^(bits2)) & 0x01)
+#define TRANSITION_FOUND(bits) BITS_DIFFER((bits), (bits) >> 1)
+
+#define ABS(x) ((x) < 0 ? -(x) : (x))
+
+
+
+/************************************************
+ * FIR filtering
+ ************************************************/
+
+/*
+ * Dot product of the delay line and the coefficients, one function 
+ * for each tap count in use. The loop count is a constant so the 
+ * compiler can unroll it and keep things in registers. The sum is 
+ * kept in 32 bits (the result is truncated to 16 bits as before). 
+ */
+typedef int32_t (*fir_dot_t)(const int16_t* x, const int8_t* c);
+
+#define FIR_DOT(n) \
+  static int32_t fir_dot_##n(const int16_t* x, const int8_t* c) { \
+    int32_t y0 = 0, y1 = 0; \
+    int i; \
+    for (i = 0; i+1 < (n); i += 2) { \
+      y0 += x[i] * c[i]; \
+      y1 += x[i+1] * c[i+1]; \
+    } \
+    if ((n) & 1) \
+      y0 += x[i] * c[i]; \
+    return y0 + y1; \
+  }
+
+FIR_DOT(5)
+FIR_DOT(8)
+FIR_DOT(11)
+FIR_DOT(30)
+FIR_DOT(40)
+
+#define FIR_TAPS(n) .taps = (n), .dot = fir_dot_##n
+
+
+typedef struct FIR
+{
+  int8_t taps;
+  fir_dot_t dot;
+  int8_t coef[FIR_MAX_TAPS];
+} FIR;
+
+
+// Tool for designing filters: http://t-filter.engineerjs.com/
+
+static const FIR fir_table[] =
+{
+   /* 1200 Hz bandpass filter */
+  [FIR_1200_BP] = {
+    FIR_TAPS(11),
+    .coef = {
+      -12, -16, -15, 0, 20, 29, 20, 0, -15, -16, -12
+    }
+  },
+  
+  /* 2200 Hz bandpass filter */
+  [FIR_2200_BP] = {
+    FIR_TAPS(11),
+    .coef = {
+      11, 15, -8, -26, 4, 30, 4, -26, -8, 15, 11
+    }
+  },
+
+  /* 1200-2200 Hz bandpass filter */
+  [FIR_12_22_BP] = {
+    FIR_TAPS(30),
+    .coef = {
+        3,4,-2,-5,-3,1,-2,-3,7,19,8,-24,-37,-4,38,38,-4,-37,-24,8,19,7,-3,-2,1,-3,-5,-2,4,3
+    }
+  },
+  
+  
+  /* Lowpass filter to 1200 Hz */
+  [FIR_1200_LP] = {
+    FIR_TAPS(8),
+    .coef = {
+      -9, 3, 26, 47, 47, 26, 3, -9
+    }
+  },  
+  
+  /* Pre-emphasis filter */
+  [FIR_PREEMP] = {
+    FIR_TAPS(5),
+    .coef = {
+      -18, -29, 93, -29, -18
+    }
+  },  
+  
+  /* De-emphasis filter */
+  [FIR_DEEMP] = {
+    FIR_TAPS(5),
+    .coef = {
+      6, 39, 60, 39, 6
+    }
+  },
+  
+
+  /* 1200 Hz bandpass filter */
+  [FIR_1200_BP2] = {
+    FIR_TAPS(40),
+    .coef = {
+       -1,-1,0,1,3,3,0,-4,-6,-5,1,7,10,6,-2,-10,-12,-6,5,12,12,5,-6,-12,-10,-2,6,10,7,1,-5,-6,-4,0,3,3,1,0,-1,-1
+    }
+  },
+  
+  /* 2200 Hz bandpass filter */
+  [FIR_2200_BP2] = {
+    FIR_TAPS(40),
+    .coef = {
+      -1,0,2,1,-2,-1,3,3,-3,-5,3,6,-1,-8,-1,9,3,-8,-5,7,7,-5,-8,3,9,-1,-8,-1,6,3,-5,-3,3,3,-1,-2,1,2,0,-1
+    }
+  },
+  
+};
+
+
+
+/*
+ * Put a sample into the delay line. The delay line is a ring 
+ * buffer where each sample is stored twice (at pos and pos+taps). 
+ * buf[pos] is the newest sample and buf[pos..pos+taps-1] is always 
+ * a contiguous window, so the dot product needs no wrap-around. 
+ */
+static inline const int16_t* fir_put(const FIR* f, fir_mem_t* m, int8_t s)
+{
+  if (m->pos == 0 || m->pos > f->taps)
+    m->pos = f->taps;
+  m->pos--;
+  m->buf[m->pos] = m->buf[m->pos + f->taps] = s;
+  return &m->buf[m->pos];
+}
+
+
+
+/*
+ * FIR filter function. Apply sample to the given filter,
+ * using the given filter memory (delay line).
+ */
+int8_t fir_filter(int8_t s, enum fir_filters f, fir_mem_t* m)
+{
+  if (f==FIR_NONE)
+    return s;
+  const FIR* fir = &fir_table[f];
+  int16_t y = (int16_t) fir->dot(fir_put(fir, m, s), fir->coef);
+  return (int8_t) (y / 128);
+}
+
+
+
+/*
+ * Apply a block of n samples to the given filter. 
+ * in and out may be the same array. 
+ */
+void fir_process_block(enum fir_filters f, fir_mem_t* m, const int8_t in[], int8_t out[], uint16_t n)
+{
+  uint16_t i;
+  if (f==FIR_NONE) {
+    if (out != in)
+      memcpy(out, in, n);
+    return;
+  }
+  const FIR* fir = &fir_table[f];
+  for (i=0; i<n; i++) {
+    int16_t y = (int16_t) fir->dot(fir_put(fir, m, in[i]), fir->coef);
+    out[i] = (int8_t) (y / 128);
+  }
+}
+
+
+
+/*
+ * Number of taps of a filter
+ */
+uint8_t fir_taps(enum fir_filters f)
+{
+  return (f==FIR_NONE ? 0 : fir_table[f].taps);
+}
+
+
+
+/*
+ * Goertzel coefficients (2*cos(2*pi*f/samplerate)) for 1200 and
+ * 2200 Hz in Q14 fixed point. 
+ */
+#define GOERTZEL_Q 14
+#define GOERTZEL_1200 23170
+#define GOERTZEL_2200 4277
+
+
+/*
+ * Run Goertzel filters for the mark and space frequencies over
+ * n samples. Return the power of the strongest of the two, 
+ * scaled to power per sample. 
+ */
+static uint32_t goertzel2(const int8_t in[], uint16_t n)
+{
+  int32_t a1 = 0, a2 = 0, b1 = 0, b2 = 0, t;
+  uint16_t i;
+  for (i=0; i<n; i++) {
+    t = in[i] + ((GOERTZEL_1200 * a1) >> GOERTZEL_Q) - a2;
+    a2 = a1; a1 = t;
+    t = in[i] + ((GOERTZEL_2200 * b1) >> GOERTZEL_Q) - b2;
+    b2 = b1; b1 = t;
+  }
+  int32_t pa = a1*a1 + a2*a2 - ((GOERTZEL_1200 * a1) >> GOERTZEL_Q) * a2;
+  int32_t pb = b1*b1 + b2*b2 - ((GOERTZEL_2200 * b1) >> GOERTZEL_Q) * b2;
+  
+  /* A tone with amplitude A gives |X|^2 = (n*A/2)^2 and power A^2/2 */
+  return (uint32_t) (2 * (pa > pb ? pa : pb) / (n*n));
+}
+
+
+
+/*
+ * Signal/noise ratio in dB. Integer only: 10*log10(x) is 
+ * computed as 3.01*log2(x) with log2 in 1/16 steps. 
+ */
+static int32_t log2_q4(uint32_t x)
+{
+  if (x == 0)
+    return 0;
+  int b = 31 - __builtin_clz(x);
+  uint32_t frac = (b >= 4 ? x >> (b-4) : x << (4-b)) & 0x0f;
+  return b*16 + frac;
+}
+
+
+int8_t dcd_snr(uint32_t signal, uint32_t noise)
+{
+  if (noise == 0)
+    noise = 1;
+  int32_t db = (log2_q4(signal) - log2_q4(noise)) * 301 / 1600;
+  return (int8_t) (db > 127 ? 127 : (db < -128 ? -128 : db));
+}
+
+
+
+/*******************************************
+  Carrier detect, reset state.                           
+ *******************************************/
+
+void dcd_init(dcd_t* d)
+{
+  memset(d, 0, sizeof(dcd_t));
+}
+
+
+
+/*******************************************************
+  Carrier detect for a block of n samples. tmp is a 
+  work area of at least n samples. Return true if 
+  carrier is present. Level, signal, noise and snr are 
+  updated for the block. No floating point is used.
+ *******************************************************/
+
+bool dcd_block(dcd_t* d, const int8_t in[], int8_t tmp[], uint16_t n, uint16_t threshold)
+{
+  uint32_t energy = 0, signal = 0;
+  int32_t sum = 0;
+  uint64_t sumsq = 0;
+  uint16_t i, k;
+  
+  if (n == 0)
+    return d->carrier;
+  
+  /* Energy of bandpass filtered signal. Used for squelch */
+  fir_process_block(FIR_12_22_BP, &d->mem, in, tmp, n);
+  for (i=0; i<n; i++)
+    energy += tmp[i] * tmp[i];
+  d->level = (uint16_t) (energy / n);
+  d->carrier = (d->level > threshold);
+  
+  /* 
+   * Mark/space power and total power (without DC) of input. The
+   * tone changes from bit to bit so the Goertzel filters run 
+   * over a window of one bit at a time, and the strongest tone 
+   * of each window counts as signal. 
+   */
+  for (i=0; i<n; i += k) {
+    k = (n-i > SAMPLESPERBIT ? SAMPLESPERBIT : n-i);
+    signal += goertzel2(in+i, k) * k;
+  }
+  for (i=0; i<n; i++) {
+    sum += in[i];
+    sumsq += in[i] * in[i];
+  }
+  uint32_t total = (uint32_t) ((sumsq - (int64_t) sum*sum / n) / n);
+  d->signal = signal / n;
+  d->noise = (total > d->signal ? total - d->signal : 0);
+  d->snr = dcd_snr(d->signal, d->noise);
+  return d->carrier;
+}
+
+
+
+/*******************************************
+  Initialise a demodulator                           
+ *******************************************/
+
+void afsk_demod_init(Demod* d, enum fir_filters filter)
+{
+  memset(d, 0, sizeof(Demod));
+  d->filter = filter;
+  hdlc_rx_init(&d->hdlc);
+}
+
+
+
+/***************************************************************
+  This routine should be called for each sample taken from 
+  the radio receiver audio. Return the decoded bit (0 or 1) 
+  when the end of a bit period is reached. Otherwise -1. 
+****************************************************************/
+
+int8_t afsk_demod_sample(Demod* d, int8_t sample) 
+{
+    AfskRx* afsk = &d->afsk;
+
+    afsk->iirY[0] = fir_filter(sample, FIR_1200_BP, &d->mem[MEM_1200]);
+    afsk->iirY[1] = fir_filter(sample, FIR_2200_BP, &d->mem[MEM_2200]);
+    
+    afsk->iirY[0] = ABS(afsk->iirY[0]);
+    afsk->iirY[1] = ABS(afsk->iirY[1]);
+    
+    afsk->sampled_bits <<= 1;
+    afsk->sampled_bits |= (fir_filter(afsk->iirY[1] - afsk->iirY[0], FIR_1200_LP, &d->mem[MEM_LP]) > 0 ? 1 : 0);
+
+    
+    /* 
+     * If there is a transition, adjust the phase of our sampler
+     * to stay in sync with the transmitter. 
+     */ 
+    if (TRANSITION_FOUND(afsk->sampled_bits)) {
+        if (afsk->curr_phase < PHASE_THRESHOLD) {
+            afsk->curr_phase += PHASE_INC;
+        } else {
+            afsk->curr_phase -= PHASE_INC;
+        }
+    }
+
+    afsk->curr_phase += PHASE_BITS;
+
+    /* Check if we have reached the end of
+     * our sampling window.
+     */ 
+    if (afsk->curr_phase >= PHASE_MAX) 
+    { 
+        afsk->curr_phase %= PHASE_MAX;
+
+        /* Shift left to make room for the next bit */
+        afsk->found_bits <<= 1;
+
+        /*
+         * Determine bit value by reading the last 3 sampled bits.
+         * If the number of ones is two or greater, the bit value is a 1,
+         * otherwise is a 0.
+         * This algorithm presumes that there are 8 samples per bit.
+         */
+        uint8_t bits = afsk->sampled_bits & 0x0f;
+        if ( bits == 0x07       // 0111, 3 bits set to 1
+                || bits == 0x0f // 1111 
+                || bits == 0x0b // 1011
+                || bits == 0x0d // 1101
+                || bits == 0x0e // 1110
+                || bits == 0x03
+           )
+           afsk->found_bits |= 1;
+    
+        
+        /* 
+         * Now we can pass the actual bit to the HDLC parser.
+         * We are using NRZI coding, so if 2 consecutive bits
+         * have the same value, we have a 1, otherwise a 0.
+         * We use the TRANSITION_FOUND function to determine this.
+         */
+        return !TRANSITION_FOUND(afsk->found_bits);
+    }
+    return -1;
+}
@@ -0,0 +1,113 @@
+/*
+ * AFSK demodulator core: FIR filters, tone detection and bit 
+ * synchronisation. No dependencies on FreeRTOS or the hardware, 
+ * so it can also be built and tested on a host computer. 
+ * By LA7ECA, ohanssen@acm.org
+ */
+
+#if !defined __AFSK_DEMOD_H__
+#define __AFSK_DEMOD_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "hdlc_rx.h"
+
+#define AFSK_BITRATE 1200
+#define AFSK_SAMPLERATE 9600
+
+#define FIR_MAX_TAPS 60
+
+
+enum fir_filters
+{
+  FIR_NONE=-1,
+  FIR_1200_BP=0,
+  FIR_2200_BP=1,
+  FIR_12_22_BP=2,
+  FIR_1200_LP=3,
+  FIR_PREEMP=4,
+  FIR_DEEMP=5,
+  FIR_1200_BP2=6,
+  FIR_2200_BP2=7,
+};
+
+#define FIR_FILTERS 8
+
+
+/*
+ * Delay line of a FIR filter. A ring buffer with each sample 
+ * stored twice, see fir_put() in afsk_demod.c. Zero it to reset. 
+ */
+typedef struct _fir_mem {
+   uint8_t pos; 
+   int16_t buf[2*FIR_MAX_TAPS];
+} fir_mem_t;
+
+
+/*********************************************************
+ * This is our primary modem struct. It defines
+ * the values we need to demodulate data.
+ *********************************************************/
+
+typedef struct AfskRx
+{
+   int16_t iirX[2];         // Filter X cells
+   int16_t iirY[2];         // Filter Y cells
+  
+   uint8_t sampled_bits;    // Bits sampled by the demodulator (at ADC speed)
+   int8_t  curr_phase;      // Current phase of the demodulator
+   uint8_t found_bits;      // Actual found bits at correct bitrate
+  
+   bool    cd;              // Carrier detect 
+   uint8_t cd_state;
+  
+} AfskRx;
+
+
+/*********************************************************
+ * A demodulator. Each has its own state, its own FIR
+ * filter memory and a pre-filter (a filter applied to the
+ * samples before demodulation). When decoding in parallel,
+ * each demodulator also has its own HDLC receiver.
+ *********************************************************/
+
+enum fir_mem { MEM_PRE=0, MEM_1200=1, MEM_2200=2, MEM_LP=3 };
+
+typedef struct Demod
+{
+   AfskRx  afsk;
+   enum fir_filters filter;
+   fir_mem_t mem[4];
+   uint8_t octet;
+   uint8_t bit_count;
+   hdlc_rx_t hdlc;
+} Demod;
+
+
+/*********************************************************
+ * Carrier detect. Processes a block of samples at a time. 
+ * The energy of the bandpass filtered signal is compared 
+ * with a threshold (soft squelch). Goertzel filters at the 
+ * mark and space frequencies give a signal/noise estimate.
+ *********************************************************/
+
+typedef struct _dcd {
+   fir_mem_t mem;
+   uint16_t  level;      // Mean energy per sample after bandpass filter 
+   uint32_t  signal;     // Mean power at 1200 and 2200 Hz  
+   uint32_t  noise;      // Mean power of the rest  
+   int8_t    snr;        // Signal/noise ratio (dB) 
+   bool      carrier; 
+} dcd_t;
+
+
+int8_t  fir_filter(int8_t s, enum fir_filters f, fir_mem_t* m);
+void    fir_process_block(enum fir_filters f, fir_mem_t* m, const int8_t in[], int8_t out[], uint16_t n);
+uint8_t fir_taps(enum fir_filters f);
+void    dcd_init(dcd_t* d);
+bool    dcd_block(dcd_t* d, const int8_t in[], int8_t tmp[], uint16_t n, uint16_t threshold);
+int8_t  dcd_snr(uint32_t signal, uint32_t noise);
+void   afsk_demod_init(Demod* d, enum fir_filters filter);
+int8_t afsk_demod_sample(Demod* d, int8_t sample);
+
+#endif
@@ -25,6 +25,7 @@
 #if !defined(ARCTIC4_UHF)
 
 #include <string.h>
+#include <stdlib.h>
 #include "afsk.h"
 #include "hdlc.h"
 #include "ui.h"
@@ -32,229 +33,68 @@
 #include "radio.h"
 #include "system.h"
 #include "config.h"
+#include "esp_timer.h"
+#include "esp_cpu.h"
 
 #define TAG "afsk-rx"
 
 
-#define SAMPLESPERBIT (AFSK_SAMPLERATE / AFSK_BITRATE)   // How many DAC/ADC samples constitute one bit (8).
-
-/* Phase sync constants */
-#define PHASE_BITS   8                              // How much to increment phase counter each sample
-#define PHASE_INC    1                              // Nudge by an eigth of a sample each adjustment
-#define PHASE_MAX    (SAMPLESPERBIT * PHASE_BITS)   // Resolution of our phase counter = 64
-#define PHASE_THRESHOLD  (PHASE_MAX / 2)            // Target transition point of our phase window
-
-/* Detect transition */
-#define BITS_DIFFER(bits1, bits2) (((bits1)^(bits2)) & 0x01)
-#define TRANSITION_FOUND(bits) BITS_DIFFER((bits), (bits) >> 1)
-
-#define ABS(x) ((x) < 0 ? -(x) : (x))
-#define FIR_MAX_TAPS 60
-
-
 /* Queue of decoded bits. To be used by HDLC packet decoder */
 static fifo_t iq; 
 
+/* Octets not yet put into the queue. They are put in batches */
+static uint8_t octets[AFSK_RX_QUEUE_SIZE];
+static uint8_t noctets = 0;
+
 
 /* Semaphore to signal availability of afsk frames */
-static semaphore_t afsk_frames; 
+static semaphore_t afsk_frames;
 static uint16_t softsq;
+static bool parallel;
+static bool streaming, instream;
+static afsk_stats_t stats;
 
+/* Time when the current fragment was received and samples left in it */
+static int64_t frag_time; 
+static uint16_t frag_left;
 
-/*********************************************************
- * This is our primary modem struct. It defines
- * the values we need to demodulate data.
- *********************************************************/
+/* Time of the last sample of the most recent frame (for latency tracing) */
+static int64_t rx_end;
+#define SAMPLES2USEC(n) ((int64_t) (n) * 1000000 / AFSK_SAMPLERATE)
 
-typedef struct AfskRx
-{
-   int16_t iirX[2];         // Filter X cells
-   int16_t iirY[2];         // Filter Y cells
-  
-   uint8_t sampled_bits;    // Bits sampled by the demodulator (at ADC speed)
-   int8_t  curr_phase;      // Current phase of the demodulator
-   uint8_t found_bits;      // Actual found bits at correct bitrate
-  
-   bool    cd;              // Carrier detect 
-   uint8_t cd_state;
-  
-} AfskRx;
 
-static AfskRx afsk;
+/* Pre-filters for the demodulators, in the order they are tried */
+static const enum fir_filters demod_filter[AFSK_DEMODULATORS] =
+    { FIR_NONE, FIR_PREEMP, FIR_DEEMP };
 
+static Demod demod[AFSK_DEMODULATORS];
+static dcd_t dcd;
 
 
-/************************************************
- * FIR filtering 
- ************************************************/
-
-typedef struct FIR
-{
-  int8_t taps;
-  int8_t coef[FIR_MAX_TAPS];
-  int16_t mem[FIR_MAX_TAPS];
-} FIR;
-
-
-enum fir_filters
-{
-  FIR_NONE=-1,
-  FIR_1200_BP=0,
-  FIR_2200_BP=1,
-  FIR_12_22_BP=2,
-  FIR_1200_LP=3,
-  FIR_PREEMP=4,
-  FIR_DEEMP=5,
-  FIR_1200_BP2=6,
-  FIR_2200_BP2=7,
-};
-
 
 /************************************************
  * Static functions
  ************************************************/
 
-static void add_bit(bool bit);
-static void afsk_process_sample(int8_t curr_sample);
+static void add_bit(Demod* d, int8_t bit);
 static void afsk_rxdecoder(void* arg);
 static void doFrame(enum fir_filters f);
+static void doFrameParallel(int first, int last);
+static void doStream(void);
 static void checkFrame();
    
 
 
-// Tool for designing filters: http://t-filter.engineerjs.com/
-
-static FIR fir_table[] =
-{
-   /* 1200 Hz bandpass filter */
-  [FIR_1200_BP] = {
-    .taps = 11,
-    .coef = {
-      -12, -16, -15, 0, 20, 29, 20, 0, -15, -16, -12
-    },
-    .mem = {
-      0,
-    },
-  },
-  
-  /* 2200 Hz bandpass filter */
-  [FIR_2200_BP] = {
-    .taps = 11,
-    .coef = {
-      11, 15, -8, -26, 4, 30, 4, -26, -8, 15, 11
-    },
-    .mem = {
-      0,
-    },
-  },
-
-  /* 1200-2200 Hz bandpass filter */
-  [FIR_12_22_BP] = {
-    .taps = 30,
-    .coef = {
-        3,4,-2,-5,-3,1,-2,-3,7,19,8,-24,-37,-4,38,38,-4,-37,-24,8,19,7,-3,-2,1,-3,-5,-2,4,3
-    },
-    .mem = {
-      0,
-    },
-  },
-  
-  
-  /* Lowpass filter to 1200 Hz */
-  [FIR_1200_LP] = {
-    .taps = 8,
-    .coef = {
-      -9, 3, 26, 47, 47, 26, 3, -9
-    },
-    .mem = {
-      0,
-    },
-  },  
-  
-  /* Pre-emphasis filter */
-  [FIR_PREEMP] = {
-    .taps = 5,
-    .coef = {
-      -18, -29, 93, -29, -18
-    },
-    .mem = {
-      0,
-    },
-  },  
-  
-  /* De-emphasis filter */
-  [FIR_DEEMP] = {
-    .taps = 5,
-    .coef = {
-      6, 39, 60, 39, 6
-    },
-    .mem = {
-      0,
-    },
-  },
-  
-
-  /* 1200 Hz bandpass filter */
-  [FIR_1200_BP2] = {
-    .taps = 40,
-    .coef = {
-       -1,-1,0,1,3,3,0,-4,-6,-5,1,7,10,6,-2,-10,-12,-6,5,12,12,5,-6,-12,-10,-2,6,10,7,1,-5,-6,-4,0,3,3,1,0,-1,-1
-    },
-    .mem = {
-      0,
-    },
-  },
-  
-  /* 2200 Hz bandpass filter */
-  [FIR_2200_BP2] = {
-    .taps = 40,
-    .coef = {
-      -1,0,2,1,-2,-1,3,3,-3,-5,3,6,-1,-8,-1,9,3,-8,-5,7,7,-5,-8,3,9,-1,-8,-1,6,3,-5,-3,3,3,-1,-2,1,2,0,-1
-    },
-    .mem = {
-      0,
-    },
-  },
-  
-};
-
-
-/*
- * FIR filter function. Apply sample to the given filter
- */
-static int8_t fir_filter(int8_t s, enum fir_filters f)
-{
-  if (f==FIR_NONE)
-    return s;
-  int8_t Q = fir_table[f].taps - 1;
-  int8_t *B = fir_table[f].coef;
-  int16_t *Bmem = fir_table[f].mem;
-  
-  int8_t i;
-  int16_t y;
-  
-  Bmem[0] = s;
-  y = 0;
-  
-  for (i = Q; i >= 0; i--)
-  {
-    y += Bmem[i] * B[i];
-    Bmem[i + 1] = Bmem[i];
-  }
-  
-  return (int8_t) (y / 128);
-}
-
-
-
 /*******************************************
   Modem Initialization                             
  *******************************************/
 
 fifo_t* afsk_rx_init() 
 { 
-  /* Allocate memory for struct */
-  memset(&afsk, 0, sizeof(afsk));
+  /* Initialise demodulators */
+  for (int i=0; i<AFSK_DEMODULATORS; i++)
+    afsk_demod_init(&demod[i], demod_filter[i]);
+  memset(&stats, 0, sizeof(stats));
 
   afsk_frames = sem_create(0);
   fifo_init(&iq, AFSK_RX_QUEUE_SIZE); 
@@ -265,6 +105,8 @@ fifo_t* afsk_rx_init()
         STACK_AFSK_RXDECODER, NULL, NORMALPRIO+1, NULL, CORE_AFSK_RXDECODER);
 
   softsq = (uint16_t) get_i32_param("SOFTSQ", DFL_SOFTSQ);
+  parallel = GET_BOOL_PARAM("AFSK.PAR.on", DFL_AFSK_PAR_ON);
+  streaming = GET_BOOL_PARAM("AFSK.STREAM.on", DFL_AFSK_STREAM_ON);
   return&iq;
 }
 
@@ -282,39 +124,94 @@ void afsk_setSoftSq(uint16_t sq)
 { softsq = sq; }
 
 
+/* Decode with all demodulators in parallel (single pass) */
+void afsk_setParallel(bool on)
+{ parallel = on; }
+
+
+/* Decode while receiving instead of after the frame */
+void afsk_setStreaming(bool on)
+{ streaming = on; }
+
+
+/* Decoding statistics */
+void afsk_rx_getStats(afsk_stats_t* st)
+{ *st = stats; }
+
+
+/* Time (usec) of the last sample of the most recent frame */
+int64_t afsk_rx_frameEnd()
+{ return rx_end; }
 
-static uint16_t flevel = 0, ndcd=0;
-static bool prev_dcd=false, prev2_dcd=false, dcd=false, result=false;
 
-bool afsk_dcd(int8_t inp) {
 
-    /* 
-     * Put the sample through the bandpass filter.
-     */ 
-    int8_t fsample = fir_filter(inp, FIR_12_22_BP);
-    flevel = flevel * 0.5 + (fsample * fsample) * 0.5; 
+/*******************************************
+  Benchmark the FIR filters. Return CPU 
+  cycles per sample for each filter. 
+ *******************************************/
 
-    dcd = (flevel > softsq);
-    if (!dcd && !prev_dcd && !prev2_dcd)
-      result = false; 
-    else if (dcd && prev_dcd && prev2_dcd)
-      result = true; 
-    prev2_dcd = prev_dcd;
-    prev_dcd = dcd;
+#define BENCH_BLOCK 256
+#define BENCH_ROUNDS 16
+
+void afsk_fir_bench(uint32_t cycles[FIR_FILTERS])
+{
+  int8_t *buf = malloc(BENCH_BLOCK);
+  fir_mem_t *mem = malloc(sizeof(fir_mem_t));
+  if (buf == NULL || mem == NULL) 
+    goto out;
+  for (int i=0; i<BENCH_BLOCK; i++)
+    buf[i] = (int8_t) rand_u8();
   
-    return result; 
+  for (int f=0; f<FIR_FILTERS; f++) {
+    memset(mem, 0, sizeof(fir_mem_t));
+    uint32_t start = esp_cpu_get_cycle_count();
+    for (int i=0; i<BENCH_ROUNDS; i++)
+      fir_process_block(f, mem, buf, buf, BENCH_BLOCK);
+    cycles[f] = (esp_cpu_get_cycle_count() - start) / (BENCH_BLOCK * BENCH_ROUNDS);
+  }
+out:
+  free(buf);
+  free(mem);
 }
 
 
 
+/*******************************************************
+  Carrier detect for a block of samples from the ADC. 
+  tmp is a work area of at least n samples. The signal 
+  and noise estimates are accumulated over the blocks 
+  with carrier, to give the SNR of the frame. 
+ *******************************************************/
+
+static uint32_t frame_signal = 0, frame_noise = 0;
+static bool prev_carrier = false;
+
+
+bool afsk_dcd_block(const int8_t in[], int8_t tmp[], uint16_t n) {
+    bool carrier = dcd_block(&dcd, in, tmp, n, softsq);
+    if (carrier) {
+        if (!prev_carrier)
+            frame_signal = frame_noise = 0;
+        frame_signal += dcd.signal;
+        frame_noise += dcd.noise;
+    }
+    prev_carrier = carrier;
+    return carrier;
+}
+
+
+
+/* Signal/noise ratio (dB) of the last frame */
+int8_t afsk_dcd_snr() {
+    return dcd_snr(frame_signal, frame_noise);
+}
+
+
 
 void afsk_dcd_reset() {
-    flevel = 0;
-    ndcd = 0;
-    prev_dcd = false;
-    prev2_dcd = false;
-    dcd = false;
-    result = false;
+    dcd_init(&dcd);
+    frame_signal = frame_noise = 0;
+    prev_carrier = false;
 }
 
 
@@ -334,8 +231,13 @@ static void afsk_rxdecoder(void* arg)
             sem_down(afsk_frames);
         }
       
-        /* Get the frame from ADC sampler */
         rxSampler_start(); 
+        if (streaming) {
+          doStream();
+          continue;
+        }
+        
+        /* Get the frame from ADC sampler */
         int n = rxSampler_getFrame();
    
         if (afsk_isSquelchOff() ) {
@@ -348,32 +250,40 @@ static void afsk_rxdecoder(void* arg)
         }
         if (n==0)
           continue;
-        rxSampler_stop(); 
+        frag_time = rx_end = esp_timer_get_time(); 
+        frag_left = 0;
+        rxSampler_stop();  
         rxSampler_start();
         rxSampler_readLast();
-        
+                
         hdlc_next_frame();
-        checkFrame(); 
-        
-        /* Decode the frame */
-        doFrame(FIR_NONE);
-        sleepMs(6);
-        if (hdlc_isSuccess()) {
-          ESP_LOGD(TAG, "Decode attempt 1: Success");
+        checkFrame();
+        stats.frames++;
+        stats.snr = afsk_dcd_snr();
+
+        if (parallel) {
+          /* Decode the frame with all demodulators in one pass */
+          int64_t t = esp_timer_get_time();
+          doFrameParallel(0, AFSK_DEMODULATORS);
+          stats.usec += (uint32_t) (esp_timer_get_time() - t);
+          if (hdlc_isSuccess())
+            stats.decoded++;
           continue;
         }
-        
-        doFrame(FIR_PREEMP);
-        sleepMs(6);
-        if (hdlc_isSuccess()) {
-          ESP_LOGD(TAG, "Decode attempt 2: Success");
-          continue;
+
+        /* Decode the frame. Try one pre-filter at a time */
+        for (int i=0; i<AFSK_DEMODULATORS; i++) {
+          int64_t t = esp_timer_get_time();
+          doFrame(demod_filter[i]);
+          stats.usec += (uint32_t) (esp_timer_get_time() - t);
+          sleepMs(6);
+          if (hdlc_isSuccess()) {
+            ESP_LOGD(TAG, "Decode attempt %d: Success", i+1);
+            stats.decoded++;
+            stats.demod[i]++;
+            break;
+          }
         }
-        
-        doFrame(FIR_DEEMP);
-        sleepMs(6);
-        if (hdlc_isSuccess()) 
-          ESP_LOGD(TAG, "Decode attempt 3: Success");
         sleepMs(6);
     }
 }
@@ -431,106 +341,174 @@ static void checkFrame() {
  ***************************************************/
 
 static void doFrame(enum fir_filters filt) {
+    Demod* d = &demod[0];
+    d->filter = filt;
     rxSampler_reset();
-    while (!rxSampler_eof()) {     
+    while (!rxSampler_eof()) {
         int8_t sample = rxSampler_get();
-        int8_t filtered = fir_filter(sample, filt);
-        afsk_process_sample(filtered);
+        int8_t filtered = fir_filter(sample, filt, &d->mem[MEM_PRE]);
+        add_bit(d, afsk_demod_sample(d, filtered));
     }
-    /* 
+    /*
      * Add 0-samples after the end of the frame to flush filters
      */
     for (int i=0; i<16; i++)
-        afsk_process_sample(0);
+        add_bit(d, afsk_demod_sample(d, 0));
+    
+    /* Put the last octets into the queue */
+    if (noctets > 0) {
+        fifo_put_n(&iq, octets, noctets);
+        noctets = 0;
+    }
 }
 
 
 
-/***************************************************************
-  This routine should be called for each sample taken from 
-  the radio receiver audio. 
-****************************************************************/
+/***************************************************
+  Process the samples of the current frame with 
+  demodulators first to last-1 in one pass. Each 
+  demodulator has its own pre-filter and HDLC receiver. 
+  The first to get a valid frame delivers it, the 
+  others are suppressed as duplicates.
+ ***************************************************/
 
-static void afsk_process_sample(int8_t sample) 
-{
-    afsk.iirY[0] = fir_filter(sample, FIR_1200_BP);
-    afsk.iirY[1] = fir_filter(sample, FIR_2200_BP);
-    
-    afsk.iirY[0] = ABS(afsk.iirY[0]);
-    afsk.iirY[1] = ABS(afsk.iirY[1]);
-    
-    afsk.sampled_bits <<= 1;
-    afsk.sampled_bits |= (fir_filter(afsk.iirY[1] - afsk.iirY[0], FIR_1200_LP) > 0 ? 1 : 0);
+static void doFrameParallel(int first, int last) {
+    int i, j;
+    for (i=first; i<last; i++) {
+        demod[i].filter = demod_filter[i];
+        hdlc_rx_init(&demod[i].hdlc);
+    }
+    rxSampler_reset();
+    while (!rxSampler_eof()) {
+        int8_t sample = rxSampler_get();
+        for (i=first; i<last; i++) {
+            Demod* d = &demod[i];
+            add_bit(d, afsk_demod_sample(d, fir_filter(sample, d->filter, &d->mem[MEM_PRE])));
+        }
+    }
+    for (j=0; j<16; j++)
+        for (i=first; i<last; i++)
+            add_bit(&demod[i], afsk_demod_sample(&demod[i], 0));
+}
 
+
+
+/***************************************************
+  Streaming mode: Demodulate the samples as they 
+  arrive from the ADC, and deliver frames as soon as 
+  the closing flag is received. If not in parallel 
+  mode, only the first demodulator runs live. The 
+  others are tried on the samples kept in the 
+  sampler's window, if nothing was decoded when the 
+  carrier is lost. Returns when squelch is closed. 
+ ***************************************************/
+
+static void endBurst(int live) {
+    int i, j;
+    frag_time = esp_timer_get_time();
+    frag_left = 0;
+    for (j=0; j<16; j++)
+        for (i=0; i<live; i++)
+            add_bit(&demod[i], afsk_demod_sample(&demod[i], 0));
+    stats.snr = afsk_dcd_snr();
     
-    /* 
-     * If there is a transition, adjust the phase of our sampler
-     * to stay in sync with the transmitter. 
-     */ 
-    if (TRANSITION_FOUND(afsk.sampled_bits)) {
-        if (afsk.curr_phase < PHASE_THRESHOLD) {
-            afsk.curr_phase += PHASE_INC;
-        } else {
-            afsk.curr_phase -= PHASE_INC;
-        }
+    /* Retry with the other pre-filters on the window */
+    for (i=live; i<AFSK_DEMODULATORS && !hdlc_isSuccess(); i++) {
+        int64_t t = esp_timer_get_time();
+        rxSampler_readLast();
+        doFrameParallel(i, i+1);
+        stats.usec += (uint32_t) (esp_timer_get_time() - t);
     }
+    if (hdlc_isSuccess())
+        stats.decoded++;
+}
+
 
-    afsk.curr_phase += PHASE_BITS;
-
-    /* Check if we have reached the end of
-     * our sampling window.
-     */ 
-    if (afsk.curr_phase >= PHASE_MAX) 
-    { 
-        afsk.curr_phase %= PHASE_MAX;
-
-        /* Shift left to make room for the next bit */
-        afsk.found_bits <<= 1;
-
-        /*
-         * Determine bit value by reading the last 3 sampled bits.
-         * If the number of ones is two or greater, the bit value is a 1,
-         * otherwise is a 0.
-         * This algorithm presumes that there are 8 samples per bit.
-         */
-        uint8_t bits = afsk.sampled_bits & 0x0f;
-        if ( bits == 0x07       // 0111, 3 bits set to 1
-                || bits == 0x0f // 1111 
-                || bits == 0x0b // 1011
-                || bits == 0x0d // 1101
-                || bits == 0x0e // 1110
-                || bits == 0x03
-           )
-           afsk.found_bits |= 1;
+
+static void doStream() {
+    int8_t* samples;
+    bool carrier = false, prev = false;
+    int live = 0, i, k;
     
-        
-        /* 
-         * Now we can pass the actual bit to the HDLC parser.
-         * We are using NRZI coding, so if 2 consecutive bits
-         * have the same value, we have a 1, otherwise a 0.
-         * We use the TRANSITION_FOUND function to determine this.
-         */
-        add_bit( !TRANSITION_FOUND(afsk.found_bits) );
+    instream = true;
+    while (streaming && afsk_rx_enabled() && (radio_getSquelch() || afsk_isSquelchOff())) {
+        int n = rxSampler_getFragment(&samples, &carrier);
+        if (n < 0) {
+            ESP_LOGD(TAG, "RESET SAMPLER");
+            rxSampler_reInit();
+            continue;
+        }
+        if (carrier) {
+            frag_time = esp_timer_get_time();
+            if (!prev) {
+                /* Start of frame(s) */
+                live = (parallel ? AFSK_DEMODULATORS : 1);
+                hdlc_next_frame();
+                rxSampler_nextFrame();
+                for (k=0; k<AFSK_DEMODULATORS; k++) {
+                    demod[k].filter = demod_filter[k];
+                    hdlc_rx_init(&demod[k].hdlc);
+                }
+                stats.frames++;
+            }
+            for (i=0; i<n; i++) {
+                rxSampler_push(samples[i]);
+                frag_left = n-1-i;
+                for (k=0; k<live; k++) {
+                    Demod* d = &demod[k];
+                    add_bit(d, afsk_demod_sample(d, fir_filter(samples[i], d->filter, &d->mem[MEM_PRE])));
+                }
+            }
+            stats.usec += (uint32_t) (esp_timer_get_time() - frag_time);
+        }
+        else if (prev)
+            endBurst(live);
+        prev = carrier;
     }
-} 
+    if (prev)
+        endBurst(live);
+    instream = false;
+}
 
 
-uint8_t octet = 0; 
-int bit_count = 0;
 
 /*********************************************************
- * Send a single bit to the HDLC decoder
+ * Send a single bit to the HDLC decoder. When decoding
+ * in parallel or streaming, bits go to the demodulator's 
+ * own HDLC receiver. Negative values mean no bit. 
  *********************************************************/
 
-static void add_bit(bool bit)
-{     
-    octet = (octet >> 1) | (bit ? 0x80 : 0x00);
-    bit_count++;
-
-    if (bit_count == 8) 
-    {      
-        fifo_put(&iq, octet);
-        bit_count = 0;
+static void add_bit(Demod* d, int8_t bit)
+{
+    if (bit < 0)
+        return;
+    if (parallel || instream) {
+        if (!hdlc_rx_bit(&d->hdlc, bit))
+            return;
+        rx_end = frag_time - SAMPLES2USEC(frag_left);
+        if (hdlc_rx_deliver(&d->hdlc)) {
+            /* Latency from closing flag to delivery */
+            uint32_t lat = (uint32_t) (esp_timer_get_time() - rx_end);
+            stats.demod[d - demod]++;
+            stats.lat_n++;
+            stats.lat_usec += lat;
+            if (lat > stats.lat_max)
+                stats.lat_max = lat;
+        }
+        return;
+    }
+    d->octet = (d->octet >> 1) | (bit ? 0x80 : 0x00);
+    d->bit_count++;
+
+    if (d->bit_count == 8)
+    {
+        /* One fifo_put_n (and wakeup of the HDLC decoder) per batch */
+        octets[noctets++] = d->octet;
+        if (noctets == AFSK_RX_QUEUE_SIZE) {
+            fifo_put_n(&iq, octets, noctets);
+            noctets = 0;
+        }
+        d->bit_count = 0;
     }
 }
 
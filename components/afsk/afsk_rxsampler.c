@@ -25,19 +25,25 @@
 #include "fifo.h"
 #include "radio.h"
 #include "system.h"
+#include "config.h"
 
 
 #define TAG "afsk-rx"
 
 /* 
- * 200 kilobytes can contain 20 seconds of transmission 
- * (when sampling rate is 9600 Hz)
+ * Size of sample buffer is given by the AFSK.BUF setting in 
+ * thousands of samples. 200 kilobytes can contain 20 seconds 
+ * of transmission (when sampling rate is 9600 Hz). In streaming
+ * mode it is only used as a window for retrying decoding, and 
+ * can be much smaller. 
  */ 
-#define RX_SAMPLE_BUF_SIZE 200000
+#define RX_SAMPLE_BUF_SIZE (get_byte_param("AFSK.BUF", DFL_AFSK_BUF) * 1000)
 #define ADC_FRAGMENT_SIZE 1024 /* 256 samples */
+#define ADC_FRAGMENT_SAMPLES (ADC_FRAGMENT_SIZE / ADC_RESULT_BYTES)
 
 
 static uint8_t *raw_sample_buf;
+static int8_t *frag_buf, *frag_tmp;   // Converted samples of a fragment and work area for DCD
 static int8_t* sample_buffer; 
 static int8_t* start;      // Start of frame
 static int8_t* wstart;     // Start of frame under writing
@@ -60,18 +66,25 @@ void rxSampler_init()
 {
     adcsampler_init( &adc, RADIO_INPUT);
     raw_sample_buf = malloc(ADC_FRAGMENT_SIZE);   
-    sample_buffer = malloc(RX_SAMPLE_BUF_SIZE);
+    frag_buf = malloc(ADC_FRAGMENT_SAMPLES);
+    frag_tmp = malloc(ADC_FRAGMENT_SAMPLES);
+    uint32_t size = RX_SAMPLE_BUF_SIZE;
+    sample_buffer = malloc(size);
     rxsampler_mutex = mutex_create();
-    if (raw_sample_buf == NULL || sample_buffer == NULL) {
+    if (raw_sample_buf == NULL || sample_buffer == NULL || frag_buf == NULL || frag_tmp == NULL) {
         ESP_LOGE(TAG, "Failed to allocate memory for RX sampler buffers");
-        if (raw_sample_buf) free(raw_sample_buf);
-        if (sample_buffer) free(sample_buffer);
+        free(raw_sample_buf);
+        free(sample_buffer);
+        free(frag_buf);
+        free(frag_tmp);
         raw_sample_buf = NULL;
         sample_buffer = NULL;
+        frag_buf = frag_tmp = NULL;
         return;
     }
+    afsk_dcd_reset();
     start = wstart = curr = end_frame = curr_put = sample_buffer;
-    buf_end = sample_buffer + RX_SAMPLE_BUF_SIZE-1;
+    buf_end = sample_buffer + size-1;
 }
 
 
@@ -90,40 +103,58 @@ void rxSampler_adjNull(int delta) {
 
 
 
+/* 
+ * Get the next fragment from ADC and convert it to samples. 
+ * Carrier detect is done on the fragment. Return the number 
+ * of samples, or -1 on error. 
+ */
+int rxSampler_getFragment(int8_t** samples, bool* carrier)
+{
+    int len = adcsampler_read(adc, raw_sample_buf, ADC_FRAGMENT_SIZE);   
+    if (len <= 0)
+        return len;
+    
+    int n = 0;
+    for (int i = 0; i < len && n < ADC_FRAGMENT_SAMPLES; i += ADC_RESULT_BYTES) {
+        adc_digi_output_data_t  *p = ADC_RESULT(raw_sample_buf,i);
+        if (ADC_DATA_VALID(p))  
+            frag_buf[n++] = convertSample(ADC_GET_DATA(p));
+    }
+    *carrier = afsk_dcd_block(frag_buf, frag_tmp, n);
+    *samples = frag_buf;
+    return n;
+}
+
+
+
 /* 
  * Get the next frame (or sequence of frames?) from ADC 
  */
 int rxSampler_getFrame()
 {
-    uint32_t total = 0;
     int nresults = 0;
+    int8_t *samples;
+    bool carrier;
     bool breakout = false; 
     rxSampler_nextFrame();
 
     /* Start sampling */   
     while (radio_getSquelch() || afsk_isSquelchOff()) {
-        /* Get raw fragment from ADC */
-        int len = adcsampler_read(adc, raw_sample_buf, ADC_FRAGMENT_SIZE);   
-        if (len == 0)
+        /* Get fragment from ADC */
+        int n = rxSampler_getFragment(&samples, &carrier);
+        if (n == 0)
             continue;
-        if (len == -1) 
+        if (n == -1) 
             return -1;
         
-        total += len;
-        
-        /* Convert its content and add it to frame */
-        for (int i = 0; i < len; i += ADC_RESULT_BYTES) {
-            adc_digi_output_data_t  *p = ADC_RESULT(raw_sample_buf,i);
-            if (ADC_DATA_VALID(p)) { 
-                int8_t sample = convertSample(ADC_GET_DATA(p));   
-                if (afsk_dcd(sample)) {
-                    if (rxSampler_put(sample))
-                        nresults++;
-                }
-                else if (nresults > 0)
-                    breakout = true;
-            }
-        }    
+        /* If carrier, add it to frame */
+        if (carrier) {
+            for (int i = 0; i < n; i++)
+                if (rxSampler_put(samples[i]))
+                    nresults++;
+        }
+        else if (nresults > 0)
+            breakout = true;
         
         /* APRS packets of less than 2700 samples are invalid */
         if (breakout && nresults < 2700) {
@@ -135,8 +166,6 @@ int rxSampler_getFrame()
         }
         else if (breakout) 
             break;
-   //     else if (total >= 300000)
-   //         return -1;
         
     }
     return nresults;
@@ -194,6 +223,25 @@ bool rxSampler_put(int8_t sample) {
 
 
 
+/* 
+ * Add a sample to the frame under writing. If the buffer is 
+ * full, the oldest sample of the frame is dropped, i.e. the 
+ * buffer is a sliding window over the last samples (streaming). 
+ */
+void rxSampler_push(int8_t sample) {
+    int8_t* next = (curr_put == buf_end-1) ? sample_buffer : curr_put+1;
+    if (next == wstart) {
+        if (wstart++ == buf_end-1)
+            wstart = sample_buffer;
+        wlength--;
+    }
+    *curr_put = sample;
+    curr_put = next;
+    wlength++;
+}
+
+
+
 /* Get next sample */
 int8_t rxSampler_get() {
     register int8_t x = *curr;
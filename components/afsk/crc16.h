@@ -4,6 +4,9 @@
  #define _UTIL_CRC16_H_
  
  #include <stdint.h>
+ #include <stddef.h>
+ 
+ struct _fb;
  
  static inline uint16_t _crc16_update(uint16_t crc, uint8_t data) __attribute__((always_inline, unused));
  static inline uint16_t _crc16_update(uint16_t crc, uint8_t data)
@@ -63,6 +66,12 @@
    return crc;
  }
  
+
+ /* Table driven CRC-CCITT, see crc16.c and crc16_fbuf.c. Same result as _crc_ccitt_update */
+ uint16_t crc_ccitt_byte(uint16_t crc, uint8_t data);
+ uint16_t crc_ccitt_block(uint16_t crc, const uint8_t* data, size_t len);
+ uint16_t crc_ccitt_fbuf(uint16_t crc, struct _fb* b, uint16_t pos, uint16_t len);
+ 
  #endif
  
  
\ No newline at end of file
@@ -0,0 +1,33 @@
+/*
+ * CRC-CCITT over FBUF chains. Kept apart from crc16.c so that 
+ * the table driven CRC can be built without the buffer layer 
+ * (host test program). 
+ * By LA7ECA, ohanssen@acm.org
+ */
+
+#include <stdint.h>
+#include "fbuf.h"
+#include "crc16.h"
+
+
+
+/**************************************************************
+ * Update a CRC with len bytes of a buffer chain, starting 
+ * at position pos. The read position is not changed. 
+ **************************************************************/
+
+uint16_t crc_ccitt_fbuf(uint16_t crc, FBUF* b, uint16_t pos, uint16_t len)
+{
+    fbseg_t seg[FBUF_MAXSEGS];
+    uint8_t i, n;
+    do {
+        n = fbuf_segments(b, pos, seg, FBUF_MAXSEGS);
+        for (i=0; i<n && len > 0; i++) {
+            uint8_t sz = (seg[i].length > len ? len : seg[i].length);
+            crc = crc_ccitt_block(crc, (const uint8_t*) seg[i].data, sz);
+            pos += sz;
+            len -= sz;
+        }
+    } while (n == FBUF_MAXSEGS && len > 0);
+    return crc;
+}
@@ -1,50 +1,120 @@
-
 #include "fifo.h"
 
 /* Blocking FIFO of bytes. Max length 64k
  * Classic ringbuffer impl. Limited to one producer and one consumer! 
+ * 
+ * The read and write positions are updated atomically and run from 
+ * 0 to 2*size-1, so that a full fifo can be distinguished from an empty 
+ * one without wasting a slot. No locks are needed. A task only blocks when the 
+ * fifo is empty (consumer) or full (producer). It then registers 
+ * itself as waiting and is woken up by a task notification from 
+ * the other side. 
  */
 
 
 void fifo_init(fifo_t* f, uint16_t size) {
     f->buffer = malloc(size); 
     f->size = size;
-    f->wpos = 0;
-    f->pos = 0;
-    f->capacity = sem_create(size);
-    f->elements = sem_create(0);
-    f->mutex = mutex_create();
+    atomic_init(&f->wpos, 0);
+    atomic_init(&f->pos, 0);
+    atomic_init(&f->wwait, NULL);
+    atomic_init(&f->rwait, NULL);
 }
 
 
 
-void fifo_put(fifo_t* f, uint8_t x) 
+#define USED(f, w, r)   (((w) + 2*(f)->size - (r)) % (2*(f)->size))
+#define NEXT(f, p)      (((p) + 1) % (2*(f)->size))
+#define INDEX(f, p)     ((p) % (f)->size)
+
+
+
+/*
+ * Block until the other side calls wakeup() or the condition
+ * (empty/full) is no longer true. The condition is checked again 
+ * after registering as waiting to not lose a wakeup. 
+ */
+static void wait(fifo_t* f, _Atomic(TaskHandle_t) *waiter, bool reader) 
 {
-    sem_down(f->capacity);
-    mutex_lock(f->mutex);
-    
-    f->buffer[f->wpos] = x;
-    f->wpos = (f->wpos + 1) % f->size;
-    
-    mutex_unlock(f->mutex);
-    sem_up(f->elements);
+    atomic_store(waiter, xTaskGetCurrentTaskHandle());
+    uint32_t used = USED(f, atomic_load(&f->wpos), atomic_load(&f->pos));
+    if (reader ? used == 0 : used >= f->size)
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    atomic_store(waiter, NULL);
 }
 
 
+static void wakeup(_Atomic(TaskHandle_t) *waiter) 
+{
+    TaskHandle_t t = atomic_exchange(waiter, NULL); 
+    if (t != NULL)
+        xTaskNotifyGive(t);
+}
+
+
+
+void fifo_put(fifo_t* f, uint8_t x) 
+{
+    fifo_put_n(f, &x, 1);
+}
+
 
 
 uint8_t fifo_get(fifo_t* f) 
 {
-    register uint8_t res;
-    sem_down(f->elements);
-    mutex_lock(f->mutex);
-     
-    res = f->buffer[f->pos];
-    f->pos = (f->pos + 1) % f->size;
-  
-    mutex_unlock(f->mutex);
-    sem_up(f->capacity);
+    uint8_t res;
+    fifo_get_n(f, &res, 1);
     return res;
 }
- 
+
+
+
+/*
+ * Put n bytes into the fifo. Block while the fifo is full.
+ */
+void fifo_put_n(fifo_t* f, const uint8_t* x, uint16_t n) 
+{
+    uint32_t wpos = atomic_load_explicit(&f->wpos, memory_order_relaxed);
+    while (n > 0) {
+        uint32_t pos = atomic_load_explicit(&f->pos, memory_order_acquire);
+        uint32_t room = f->size - USED(f, wpos, pos);
+        if (room == 0) {
+            wait(f, &f->wwait, false);
+            continue;
+        }
+        if (room > n) 
+            room = n;
+        for (uint32_t i=0; i<room; i++) {
+            f->buffer[INDEX(f, wpos)] = *(x++);
+            wpos = NEXT(f, wpos);
+        }
+        n -= room;
+        atomic_store(&f->wpos, wpos);
+        wakeup(&f->rwait);
+    }
+}
+
+
+
+/*
+ * Get up to n bytes from the fifo. Block while the fifo is empty. 
+ * Return the number of bytes read (at least 1). 
+ */
+uint16_t fifo_get_n(fifo_t* f, uint8_t* x, uint16_t n) 
+{
+    uint32_t pos = atomic_load_explicit(&f->pos, memory_order_relaxed);
+    uint32_t avail; 
+    while ((avail = USED(f, atomic_load_explicit(&f->wpos, memory_order_acquire), pos)) == 0)
+        wait(f, &f->rwait, true);
     
+    if (avail > n)
+        avail = n;
+    for (uint32_t i=0; i<avail; i++) {
+        x[i] = f->buffer[INDEX(f, pos)];
+        pos = NEXT(f, pos);
+    }
+    atomic_store(&f->pos, pos);
+    wakeup(&f->wwait);
+    return avail;
+}
+ 
@@ -2,19 +2,19 @@
 #define __FIFO_H__
 
 #include <stdint.h>
+#include <stdatomic.h>
 #include "system.h"
 
 /* FIFO of bytes. Max size: 64k. 
- * Classic ringbuffer impl. Not thread safe. 
+ * Lock-free ringbuffer impl. Limited to one producer and one consumer! 
  */
 
  
 typedef struct _fifo_t {
     uint16_t size; 
-    uint16_t wpos;
-    uint16_t pos;
-    semaphore_t capacity, elements;
-    mutex_t mutex;
+    _Atomic uint32_t wpos;    /* Write position, 0 .. 2*size-1 */
+    _Atomic uint32_t pos;     /* Read position, 0 .. 2*size-1 */
+    _Atomic(TaskHandle_t) wwait, rwait;  
     int8_t* buffer; 
 } fifo_t;
 
@@ -23,6 +23,8 @@ typedef struct _fifo_t {
 void fifo_init(fifo_t* f, uint16_t size);
 void fifo_put(fifo_t* f, uint8_t x);
 uint8_t fifo_get(fifo_t* f);
+void fifo_put_n(fifo_t* f, const uint8_t* x, uint16_t n);
+uint16_t fifo_get_n(fifo_t* f, uint8_t* x, uint16_t n);
 
 
 #endif
@@ -10,8 +10,7 @@
 #include "fifo.h"
 #include "freertos/ringbuf.h"
 
-#define HDLC_FLAG 0x7E
-#define MAX_HDLC_FRAME_SIZE 289 // including FCS field
+#include "hdlc_rx.h"
 
 bool hdlc_isSuccess(); 
 void hdlc_wait_idle(void);
@@ -21,8 +20,19 @@ void hdlc_test_off(void);
 FBQ* hdlc_init_encoder(QueueHandle_t oq);
 fbq_t* hdlc_get_encoder_queue(void);
 bool hdlc_enc_packets_waiting(void);
+
+/* Transmitter statistics */
+typedef struct {
+   uint32_t keyups;     /* Number of transmissions */
+   uint32_t frames;     /* Number of frames sent */
+   uint32_t deferred;   /* Times a waiting frame was left for the next transmission (TXBUDGET) */
+   uint32_t maxframe;   /* Times a waiting frame was left since MAXFRAME frames were sent */
+} hdlc_txstats_t;
+
+void hdlc_tx_getStats(hdlc_txstats_t* st);
 uint8_t rand_u8(void);
 
 void hdlc_init_decoder (fifo_t *s);
 void hdlc_next_frame(void);
+bool hdlc_rx_deliver(hdlc_rx_t* h);
 #endif
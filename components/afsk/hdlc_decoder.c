@@ -16,6 +16,8 @@
 #include "ui.h"
 #include "fifo.h"
 #include "aprs.h"
+#include "afsk.h"
+#include "latency.h"
 
 #define TAG "hdlc-dec"
 
@@ -44,8 +46,8 @@ bool hdlc_isSuccess() {return success;}
  * packets are put into the given buffer queue.
  ***********************************************************/
 
-uint8_t hdlc_subscribe_rx(fbq_t* q) {
-    return fbqsw_subscribe(psub, q);
+uint8_t hdlc_subscribe_rx(fbq_t* q, fbq_policy_t p, const char* name) {
+    return fbqsw_subscribe(psub, q, p, name);
 }
 
 void hdlc_unsubscribe_rx(uint8_t i) {
@@ -66,9 +68,15 @@ static uint8_t get_bit ()
    static uint16_t bits = 0xffff;
    static uint8_t bit_count = 0;
    static uint8_t byte; 
+   static uint8_t inbuf[AFSK_RX_QUEUE_SIZE];
+   static uint8_t inpos = 0, inlen = 0;
    
    if (bit_count < 8) {
-      byte = fifo_get(inq);
+      if (inpos == inlen) {
+         inlen = fifo_get_n(inq, inbuf, AFSK_RX_QUEUE_SIZE);
+         inpos = 0;
+      }
+      byte = inbuf[inpos++];
       bits |= ((uint16_t) byte << bit_count);
       bit_count += 8;
    }
@@ -167,6 +175,8 @@ static void hdlc_rxdecoder (void* arg)
        */
       fbuf_removeLast(&fbuf);
       fbuf_removeLast(&fbuf);
+      lat_start(&fbuf, afsk_rx_frameEnd());
+      lat_mark(&fbuf, LAT_DECODE);
       
       /* Distribute packet to subscribers */
       if (fbqsw_publish(psub, fbuf) == 0)
@@ -189,10 +199,7 @@ static void hdlc_rxdecoder (void* arg)
 bool crc_match(FBUF* b, uint16_t length, uint16_t *crc)
 {
    /* Calculate FCS from frame content */
-   *crc = 0xFFFF;
-   uint16_t i;
-   for (i=0; i<length-2; i++)
-       *crc = _crc_ccitt_update(*crc, fbuf_getChar(b)); 
+   *crc = crc_ccitt_fbuf(0xFFFF, b, 0, length-2);
        
    /* Get FCS from 2 last bytes of frame */
    uint16_t rcrc; 
@@ -205,6 +212,45 @@ bool crc_match(FBUF* b, uint16_t length, uint16_t *crc)
 
 
 
+/***********************************************************
+ * Deliver a frame received by hdlc_rx_bit to subscribers. 
+ * The same frame may be received by more than one 
+ * demodulator. Return false if it is a duplicate, i.e. 
+ * if a frame with the same CRC is delivered earlier in 
+ * the same sample frame. 
+ ***********************************************************/
+
+#define RX_RECENT 4
+static uint16_t recent_crc[RX_RECENT];
+static uint8_t  nrecent = 0, irecent = 0;
+
+bool hdlc_rx_deliver(hdlc_rx_t* h)
+{
+   if (tag_seq != prev_seq) 
+      nrecent = 0;
+   for (int i=0; i<nrecent; i++)
+      if (recent_crc[i] == h->crc)
+         return false;
+   recent_crc[irecent] = h->crc;
+   irecent = (irecent + 1) % RX_RECENT;
+   if (nrecent < RX_RECENT)
+      nrecent++;
+   prev_seq = tag_seq;
+   success = true;
+   
+   ESP_LOGI(TAG, "VALID frame received. length=%d", h->length);
+   FBUF f;
+   fbuf_new(&f, SRC_RX);
+   fbuf_write(&f, (char*) h->buf, h->length-2);
+   lat_start(&f, afsk_rx_frameEnd());
+   lat_mark(&f, LAT_DECODE);
+   if (fbqsw_publish(psub, f) == 0)
+      fbuf_release(&f);
+   return true;
+}
+
+
+
 /*********************************************************************
  * Increment sequence number and filter-tag for incoming frame. 
  * This is used to detect duplicates. This is a hack. It depends on 
@@ -228,7 +274,7 @@ void hdlc_init_decoder (fifo_t* s)
 {   
   inq = s;
  // mqueue[0] = mqueue[1] = mqueue[2] = NULL;
-  psub = fbqsw_create(10);
+  psub = fbqsw_create("rx", 10);
   fbuf_new(&fbuf, SRC_RX);  
   xTaskCreatePinnedToCore(&hdlc_rxdecoder, "HDLC RX decoder", 
         STACK_HDLC_RXDECODER, NULL, NORMALPRIO, NULL, CORE_HDLC_RXDECODER);
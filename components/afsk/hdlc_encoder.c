@@ -14,6 +14,8 @@
 #include "ax25.h"
 #include "ui.h"
 #include "pmu.h"
+#include "latency.h"
+#include "afsk.h"
 
 #define TAG "hdlc-enc"
 
@@ -33,6 +35,11 @@ static FBQSW_t *psubtx;
 
 static SemaphoreHandle_t enc_idle; 
 static bool hdlc_idle = true;
+static uint32_t txbits;
+static hdlc_txstats_t stats;
+
+/* Estimated number of bits for a frame of n bytes incl. FCS, stuffing and flag */
+#define FRAME_BITS(n) (((n)+2)*8 + ((n)+2)/4 + 8)
 static void hdlc_encode_frames(void);
 static void hdlc_encode_byte(uint8_t txbyte, bool flag);
 
@@ -43,6 +50,9 @@ fbq_t* hdlc_get_encoder_queue()
 bool hdlc_enc_packets_waiting()
    { return !fbq_eof(&encoder_queue) || !BUFFER_EMPTY; }
 
+void hdlc_tx_getStats(hdlc_txstats_t* st)
+   { *st = stats; }
+
 void hdlc_wait_idle()
    { while (!hdlc_idle) WAIT_IDLE; }
 
@@ -52,8 +62,8 @@ void hdlc_wait_idle()
  * packets are put into the given buffer queue.
  ***********************************************************/
 
-uint8_t hdlc_subscribe_txmon(fbq_t* q) {
-    return fbqsw_subscribe(psubtx, q);
+uint8_t hdlc_subscribe_txmon(fbq_t* q, fbq_policy_t p, const char* name) {
+    return fbqsw_subscribe(psubtx, q, p, name);
 }
 
 void hdlc_unsubscribe_txmon(uint8_t i) {
@@ -124,6 +134,7 @@ static void hdlc_txencoder (void* arg)
       * This is a blocking call.
       */  
      buffer = fbq_get(&encoder_queue); 
+     lat_mark(&buffer, LAT_ENC);
      ESP_LOGI(TAG, "Got frame..");
 
      /* Wait until channel is free 
@@ -139,6 +150,7 @@ static void hdlc_txencoder (void* arg)
         else 
            break;
       } 
+      lat_mark(&buffer, LAT_TX);
       tx_led_on();
 #if DEVICE == ARCTIC4
       pmu_disableShutdown(true);
@@ -166,7 +178,7 @@ FBQ* hdlc_init_encoder(QueueHandle_t oq)
   outqueue = oq;
   enc_idle = xSemaphoreCreateBinary();
   fbq_init(&encoder_queue, HDLC_ENCODER_QUEUE_SIZE);
-  psubtx = fbqsw_create(10);
+  psubtx = fbqsw_create("tx", 10);
   xTaskCreatePinnedToCore(&hdlc_txencoder, "HDLC TX Encoder", 
         STACK_HDLC_TXENCODER, NULL, NORMALPRIO, NULL, CORE_HDLC_TXENCODER);
   return &encoder_queue; 
@@ -178,33 +190,46 @@ FBQ* hdlc_init_encoder(QueueHandle_t oq)
 /*******************************************************************************
  * HDLC encode and transmit one or more frames (one single transmission)
  * It is responsible for computing checksum, bit stuffing and for adding 
- * flags at start and end of frames.
+ * flags at start and end of frames. Frames waiting in the queue are added 
+ * to the transmission as long as there are at most MAXFRAME frames and 
+ * the airtime is within TXBUDGET milliseconds (0 means no limit). 
  *******************************************************************************/
 
 static void hdlc_encode_frames()
 {
     uint16_t crc = 0xffff;
-    uint8_t txbyte, i; 
-    uint8_t txdelay = get_byte_param("TXDELAY", DFL_TXDELAY);
-    uint8_t txtail  = get_byte_param("TXTAIL", DFL_TXTAIL);
-    uint8_t maxfr   = get_byte_param("MAXFRAME", DFL_MAXFRAME);
+    uint16_t len; 
+    const char* seg;
+    uint8_t i, j, n; 
+    uint8_t txdelay = config_byte(CFG_TXDELAY);
+    uint8_t txtail  = config_byte(CFG_TXTAIL);
+    uint8_t maxfr   = config_byte(CFG_MAXFRAME);
+    uint32_t budget = (uint32_t) config_i32(CFG_TXBUDGET) * AFSK_BITRATE / 1000;
+    FBUF next;
 
     ESP_LOGI(TAG, "Encode frame(s)..");
    
+    txbits = 0;
+    
     /* Preamble of TXDELAY flags */
     for (i=0; i<txdelay; i++)
         hdlc_encode_byte(HDLC_FLAG, true);
 
     for (i=0;i<maxfr;i++) 
     { 
+        len = fbuf_length(&buffer);
+        
+        /* Compute FCS in one pass over the frame before bit stuffing */
+        crc = crc_ccitt_fbuf(0xffff, &buffer, 0, len);
+        
         fbuf_reset(&buffer);
-        crc = 0xffff;
-
-        while(!BUFFER_EMPTY)
+        while ((n = fbuf_getSeg(&buffer, &seg)) > 0 && len > 0)
         {
-            txbyte = fbuf_getChar(&buffer);
-            crc = _crc_ccitt_update (crc, txbyte);
-            hdlc_encode_byte(txbyte, false);
+            if (n > len)
+                n = len;
+            for (j=0; j<n; j++)
+                hdlc_encode_byte(seg[j], false);
+            len -= n;
         }
             
         if (fbqsw_publish(psubtx, buffer) == 0)
@@ -213,14 +238,25 @@ static void hdlc_encode_frames()
         hdlc_encode_byte(crc^0xFF, false);       // Send FCS, LSB first
         hdlc_encode_byte((crc>>8)^0xFF, false);  // MSB
     
-        if (!fbq_eof(&encoder_queue) && (i + 1) < maxfr) {
-            hdlc_encode_byte(HDLC_FLAG, true);
-            buffer = fbq_get(&encoder_queue); 
-            ESP_LOGI(TAG, "Add frame to transmission..");
+        /* Add next frame to the transmission if it fits */
+        if (!fbq_peek(&encoder_queue, &next))
+            break;
+        if ((i + 1) >= maxfr) {
+            stats.maxframe++;
+            break;
         }
-        else
+        if (budget > 0 && txbits + FRAME_BITS(fbuf_length(&next)) + txtail*8 > budget) {
+            stats.deferred++;
             break;
+        }
+        hdlc_encode_byte(HDLC_FLAG, true);
+        buffer = fbq_get(&encoder_queue); 
+        lat_mark(&buffer, LAT_ENC);
+        lat_mark(&buffer, LAT_TX);
+        ESP_LOGI(TAG, "Add frame to transmission..");
     }
+    stats.keyups++;
+    stats.frames += (maxfr > 0 ? i+1 : 0);
 
     /* Postamble of TXTAIL flags */  
     for (i=0; i<txtail; i++)
@@ -249,6 +285,7 @@ static void hdlc_encode_frames()
           txbyte >>= 1;  
        }
      
+       txbits++;
        if (++outbits == 8) {
           xQueueSend(outqueue, &outbyte, portMAX_DELAY);
           outbits = 0;
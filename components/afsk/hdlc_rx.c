@@ -0,0 +1,86 @@
+/*
+ * Bit level HDLC receiver. Bits are pushed into it and complete 
+ * frames with a valid FCS come out. It does not depend on FreeRTOS 
+ * or the buffer layer so it can be used by the host test program. 
+ * By LA7ECA, ohanssen@acm.org
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "hdlc_rx.h"
+#include "crc16.h"
+
+
+
+/***********************************************************
+ * Bit level HDLC receiver (used by parallel demodulators).
+ * Reset state. 
+ ***********************************************************/
+
+void hdlc_rx_init(hdlc_rx_t* h)
+{
+   h->sreg = 0;
+   h->octet = 0;
+   h->bit_count = 0;
+   h->inframe = false;
+   h->pos = 0;
+   h->length = 0;
+   h->errors = 0;
+}
+
+
+
+/***********************************************************
+ * Push a bit into the receiver. Return true if a complete 
+ * frame with a valid CRC is received. The frame (including
+ * the FCS) is then in h->buf and its length in h->length. 
+ * It is valid until the next octet is received.  
+ ***********************************************************/
+
+bool hdlc_rx_bit(hdlc_rx_t* h, bool bit)
+{
+   h->sreg = (h->sreg >> 1) | (bit ? 0x80 : 0x00);
+   
+   /* Flag: End of frame (if any) and start of next */
+   if (h->sreg == HDLC_FLAG) {
+      bool valid = false;
+      if (h->inframe && h->bit_count == 7 && h->pos >= HDLC_MIN_FRAME_SIZE) {
+         h->crc = crc_ccitt_block(0xFFFF, h->buf, h->pos-2);
+         uint16_t rcrc = (h->buf[h->pos-2] ^ 0xFF) 
+                       | (uint16_t) (h->buf[h->pos-1] ^ 0xFF) << 8;
+         valid = (h->crc == rcrc);
+         if (valid)
+            h->length = h->pos;
+         else
+            h->errors++;
+      }
+      h->inframe = true;
+      h->pos = 0;
+      h->bit_count = 0;
+      return valid;
+   }
+   
+   /* More than 6 consecutive one bits: Abort */
+   if ((h->sreg & 0xFE) == 0xFE) {
+      h->inframe = false;
+      return false;
+   }
+   
+   /* Bit stuffing - skip zero bit after five ones */
+   if ((h->sreg & 0xFC) == 0x7C)
+      return false;
+   
+   if (!h->inframe)
+      return false;
+   
+   h->octet = (h->octet >> 1) | (bit ? 0x80 : 0x00);
+   if (++h->bit_count == 8) {
+      if (h->pos >= MAX_HDLC_FRAME_SIZE) {
+         h->inframe = false;   // Lost termination flag or only noise
+         return false;
+      }
+      h->buf[h->pos++] = h->octet;
+      h->bit_count = 0;
+   }
+   return false;
+}
@@ -0,0 +1,37 @@
+/*
+ * Bit level HDLC receiver. 
+ * By LA7ECA, ohanssen@acm.org
+ */
+
+#if !defined __HDLC_RX_H__
+#define __HDLC_RX_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define HDLC_FLAG 0x7E
+#define MAX_HDLC_FRAME_SIZE 289 // including FCS field
+#define HDLC_MIN_FRAME_SIZE 19  // AX.25 header without digis + 1 + FCS
+
+
+/* 
+ * Bit level HDLC receiver. Bits are pushed into it. Used when 
+ * running more than one demodulator in parallel. One instance 
+ * for each demodulator.  
+ */
+typedef struct _hdlc_rx {
+    uint8_t  sreg;          // Last 8 bits received
+    uint8_t  octet;         // Octet under construction
+    uint8_t  bit_count;
+    bool     inframe;
+    uint16_t pos;           // Number of octets received
+    uint16_t length;        // Length of last complete frame 
+    uint16_t crc;
+    uint32_t errors;        // Frames with FCS error
+    uint8_t  buf[MAX_HDLC_FRAME_SIZE];
+} hdlc_rx_t;
+
+void hdlc_rx_init(hdlc_rx_t* h);
+bool hdlc_rx_bit(hdlc_rx_t* h, bool bit);
+
+#endif
@@ -1,169 +1,416 @@
+/*
+ * Offline test of the AFSK demodulators and HDLC receiver.
+ * Runs on a host computer (not part of the firmware build):
+ *
+ *   gcc -O2 -Wall -o afsk_test test.c afsk_demod.c hdlc_rx.c crc16.c
+ *   ./afsk_test [-v] file ...
+ *   ./afsk_test -b
+ *
+ * Input files are WAV (8 or 16 bit PCM, any sample rate, first
+ * channel is used) or raw signed 8 bit samples at 9600 Hz. Raw
+ * and CSV files (comma or whitespace separated samples, like the
+ * ones used by convert.sh) are recognised by their extension.
+ *
+ * Each file is decoded with every demodulator variant and with all
+ * of them in parallel (like the firmware does when AFSK.PAR is on).
+ * Reports carrier detect and SNR, frames decoded, FCS errors, 
+ * duplicates and speed.
+ * With -b, the FIR filters are benchmarked instead.
+ *
+ * By LA7ECA, ohanssen@acm.org
+ */
+
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include "afsk_demod.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CYCLES() __rdtsc()
+#endif
+
+
+#define NVARIANTS 3
+#define RECENT 8
+
+static const enum fir_filters variants[NVARIANTS] =
+    { FIR_NONE, FIR_PREEMP, FIR_DEEMP };
+static const char* variant_name[NVARIANTS] =
+    { "flat", "pre-emphasis", "de-emphasis" };
+
+static bool verbose = false;
 
 
 
+/*******************************************************
+ * Read little endian integers from a byte buffer
+ *******************************************************/
 
-/* 
- * 100 kilobytes can contain 10 seconds of transmission 
- * (when sampling rate is 9600 Hz)
- */ 
-#define RX_SAMPLE_BUF_SIZE 20
+static uint32_t get_u32(const uint8_t* p)
+  { return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24); }
 
-static uint8_t *raw_sample_buf;
-static int8_t* sample_buffer; 
-static int8_t* start;      // Start of frame
-static int8_t* wstart;     // Start of frame under writing
-static int8_t* curr;       // Current read position
-static int8_t* curr_put;   // Current write position
-static int8_t* end_frame;  // End of frame
-static int8_t* buf_end;    // End of buffer
-static uint16_t length = 0; 
-static uint16_t wlength = 0; 
+static uint16_t get_u16(const uint8_t* p)
+  { return p[0] | (p[1] << 8); }
 
-void rxSampler_init() 
+
+
+/*******************************************************
+ * Read a whole file into memory.
+ *******************************************************/
+
+static uint8_t* read_file(const char* fname, long* size)
 {
-    sample_buffer = malloc(RX_SAMPLE_BUF_SIZE);
-    start = wstart = curr = end_frame = curr_put = sample_buffer;
-    buf_end = sample_buffer + RX_SAMPLE_BUF_SIZE-1;
+    FILE* f = fopen(fname, "rb");
+    if (f == NULL) {
+        perror(fname);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t* buf = malloc(*size + 1);
+    if (buf == NULL || fread(buf, 1, *size, f) != (size_t) *size) {
+        fprintf(stderr, "%s: Cannot read file\n", fname);
+        free(buf);
+        fclose(f);
+        return NULL;
+    }
+    buf[*size] = 0;
+    fclose(f);
+    return buf;
 }
 
 
 
-void rxSampler_put(int8_t sample) {
-    if (curr_put != start-1 && 
-        (curr_put != buf_end+1 || wstart != sample_buffer))
-    {
-        *curr_put = sample;
-        wlength++;
-        if (curr_put++ == buf_end-1)
-            curr_put = sample_buffer;
-    } 
+/*******************************************************
+ * Convert WAV data to signed 8 bit samples at
+ * AFSK_SAMPLERATE. Downsampling is done by averaging
+ * the input samples within each output sample period,
+ * upsampling by repeating samples.
+ *******************************************************/
+
+static int8_t* wav_samples(const char* fname, uint8_t* buf, long size, long* nsamples)
+{
+    uint16_t format = 0, channels = 0, bits = 0;
+    uint32_t rate = 0;
+    uint8_t* data = NULL;
+    uint32_t dlen = 0;
+
+    if (size < 12 || memcmp(buf, "RIFF", 4) || memcmp(buf+8, "WAVE", 4)) {
+        fprintf(stderr, "%s: Not a WAV file\n", fname);
+        return NULL;
+    }
+
+    /* Find fmt and data chunks */
+    long pos = 12;
+    while (pos + 8 <= size) {
+        uint32_t clen = get_u32(buf+pos+4);
+        if (!memcmp(buf+pos, "fmt ", 4) && clen >= 16) {
+            format   = get_u16(buf+pos+8);
+            channels = get_u16(buf+pos+10);
+            rate     = get_u32(buf+pos+12);
+            bits     = get_u16(buf+pos+22);
+        }
+        else if (!memcmp(buf+pos, "data", 4)) {
+            data = buf+pos+8;
+            dlen = (clen > size-pos-8 ? size-pos-8 : clen);
+            break;
+        }
+        pos += 8 + clen + (clen & 1);
+    }
+    if (data == NULL || format != 1 || channels == 0 || rate == 0
+          || (bits != 8 && bits != 16)) {
+        fprintf(stderr, "%s: Unsupported WAV format (need 8 or 16 bit PCM)\n", fname);
+        return NULL;
+    }
+
+    uint16_t frame = channels * bits / 8;
+    long nin = dlen / frame;
+    long nout = (long) ((int64_t) nin * AFSK_SAMPLERATE / rate);
+    int8_t* out = malloc(nout + 1);
+    if (out == NULL)
+        return NULL;
+
+    long i = 0, j = 0;
+    int32_t acc = 0, n = 0;
+    for (i=0; i<nin && j<nout; i++) {
+        const uint8_t* p = data + i*frame;
+        acc += (bits == 16 ? (int16_t) get_u16(p) >> 8 : (int) p[0] - 128);
+        n++;
+        /* Emit output samples whose period ends within this input sample */
+        while (j < nout && (int64_t) (j+1) * rate <= (int64_t) (i+1) * AFSK_SAMPLERATE) {
+            out[j++] = (int8_t) (acc / n);
+            if (rate >= AFSK_SAMPLERATE)
+                acc = n = 0;
+        }
+        if (rate < AFSK_SAMPLERATE)
+            acc = n = 0;
+    }
+    *nsamples = j;
+    return out;
 }
 
 
 
-/* Get next sample */
-int8_t rxSampler_get() {
-    register int8_t x = *curr;
-    if (curr++ == buf_end-1)
-        curr = sample_buffer;
-    return x;
+/*******************************************************
+ * Parse CSV (or whitespace separated) sample values
+ *******************************************************/
+
+static int8_t* csv_samples(uint8_t* buf, long size, long* nsamples)
+{
+    int8_t* out = malloc(size/2 + 1);
+    char* p = (char*) buf;
+    char* end;
+    long n = 0;
+    if (out == NULL)
+        return NULL;
+    while (*p) {
+        long x = strtol(p, &end, 10);
+        if (end == p) {
+            p++;
+            continue;
+        }
+        out[n++] = (int8_t) (x < -128 ? -128 : (x > 127 ? 127 : x));
+        p = end;
+    }
+    *nsamples = n;
+    return out;
 }
 
 
-/* Return true if read has reached end of frame */
-bool rxSampler_eof() {
-    return (length == 0 || curr == curr_put || (curr != start && curr == wstart));        
+
+/*******************************************************
+ * Print the addresses of a frame (src>dest,digis)
+ *******************************************************/
+
+static void print_addr(const uint8_t* a)
+{
+    for (int i=0; i<6 && a[i] != 0x40; i++)
+        putchar(a[i] >> 1);
+    uint8_t ssid = (a[6] >> 1) & 0x0f;
+    if (ssid > 0)
+        printf("-%d", ssid);
 }
 
 
-/* Reset read position to start of frame */
-void rxSampler_reset() {
-    curr = start;
+static void print_frame(const char* name, long sample, hdlc_rx_t* h)
+{
+    printf("  %8ld %-13s ", sample, name);
+    print_addr(h->buf+7);
+    putchar('>');
+    print_addr(h->buf);
+    for (int i=14; i+7 <= h->length-2 && !(h->buf[i-1] & 0x01); i+=7) {
+        putchar(',');
+        print_addr(h->buf+i);
+    }
+    printf(" (%d bytes)\n", h->length);
 }
 
 
-/* Ready for next frame */
-void rxSampler_nextFrame() {
-    wstart = curr_put;
-    wlength = 0;
+
+/*******************************************************
+ * Recently decoded frames. Used to count the frames
+ * decoded by more than one demodulator only once.
+ *******************************************************/
+
+typedef struct {
+    uint16_t crc[RECENT];
+    long     pos[RECENT];
+    int      n, i;
+} recent_t;
+
+
+static bool is_duplicate(recent_t* r, uint16_t crc, long pos)
+{
+    /* A frame is at most about 2.5 seconds long */
+    for (int k=0; k<r->n; k++)
+        if (r->crc[k] == crc && pos - r->pos[k] < 3 * AFSK_SAMPLERATE)
+            return true;
+    r->crc[r->i] = crc;
+    r->pos[r->i] = pos;
+    r->i = (r->i + 1) % RECENT;
+    if (r->n < RECENT)
+        r->n++;
+    return false;
 }
 
 
-void rxSampler_readLast() {
-    curr = start = wstart;
-    length = wlength;
+
+/*******************************************************
+ * Run a set of demodulators over the samples.
+ * If ndemod > 1 they run in parallel, and frames
+ * decoded by more than one of them are counted as
+ * duplicates.
+ *******************************************************/
+
+static Demod demod[NVARIANTS];
+
+static void run(const char* name, const int8_t* samples, long n,
+                const int* vars, int ndemod)
+{
+    recent_t recent;
+    long frames = 0, dups = 0, errors = 0;
+    long i;
+    int k;
+
+    memset(&recent, 0, sizeof(recent));
+    for (k=0; k<ndemod; k++)
+        afsk_demod_init(&demod[k], variants[vars[k]]);
+
+    clock_t t = clock();
+    for (i=0; i<n + 16; i++) {
+        /* Add 0-samples after the end to flush filters */
+        int8_t s = (i < n ? samples[i] : 0);
+        for (k=0; k<ndemod; k++) {
+            Demod* d = &demod[k];
+            int8_t bit = afsk_demod_sample(d, fir_filter(s, d->filter, &d->mem[MEM_PRE]));
+            if (bit >= 0 && hdlc_rx_bit(&d->hdlc, bit)) {
+                if (is_duplicate(&recent, d->hdlc.crc, i))
+                    dups++;
+                else {
+                    frames++;
+                    if (verbose)
+                        print_frame(variant_name[vars[k]], i, &d->hdlc);
+                }
+            }
+        }
+    }
+    double secs = (double) (clock() - t) / CLOCKS_PER_SEC;
+    for (k=0; k<ndemod; k++)
+        errors += demod[k].hdlc.errors;
+
+    printf("%-14s frames=%-5ld fcs-errors=%-5ld dups=%-5ld %8.0f ksamples/s\n",
+           name, frames, errors, dups,
+           (secs > 0 ? (double) n / secs / 1000 : 0));
 }
 
 
-uint16_t rxSampler_length() {
-    return length;
+
+/*******************************************************
+ * Run carrier detect over the samples, in blocks like
+ * the ADC fragments. Report blocks with carrier and SNR.
+ *******************************************************/
+
+#define DCD_FRAGMENT 256
+#define DCD_THRESHOLD 110
+
+static void run_dcd(const int8_t* samples, long n)
+{
+    static dcd_t dcd;
+    static int8_t tmp[DCD_FRAGMENT];
+    uint32_t signal = 0, noise = 0;
+    long i, blocks = 0, carrier = 0;
+
+    dcd_init(&dcd);
+    for (i=0; i<n; i += DCD_FRAGMENT) {
+        uint16_t k = (n-i > DCD_FRAGMENT ? DCD_FRAGMENT : n-i);
+        blocks++;
+        if (dcd_block(&dcd, samples+i, tmp, k, DCD_THRESHOLD)) {
+            carrier++;
+            signal += dcd.signal;
+            noise += dcd.noise;
+        }
+    }
+    printf("dcd            carrier=%ld/%ld blocks, snr=%d dB\n",
+           carrier, blocks, dcd_snr(signal, noise));
 }
 
 
-void printFrame() {
-    printf("FRAME LENGTH: %d\n", rxSampler_length());
-    while (!rxSampler_eof())
-        printf("%d  ", rxSampler_get());
-    printf("\n\n");
+
+/*******************************************************
+ * Decode a file
+ *******************************************************/
+
+static void decode_file(const char* fname)
+{
+    long size = 0, n = 0;
+    int8_t* samples = NULL;
+    const char* ext = strrchr(fname, '.');
+
+    uint8_t* buf = read_file(fname, &size);
+    if (buf == NULL)
+        return;
+
+    if (ext != NULL && (!strcmp(ext, ".raw") || !strcmp(ext, ".s8"))) {
+        samples = malloc(size + 1);
+        if (samples != NULL)
+            memcpy(samples, buf, size);
+        n = size;
+    }
+    else if (ext != NULL && (!strcmp(ext, ".csv") || !strcmp(ext, ".txt")))
+        samples = csv_samples(buf, size, &n);
+    else
+        samples = wav_samples(fname, buf, size, &n);
+    free(buf);
+    if (samples == NULL)
+        return;
+
+    printf("%s: %ld samples (%.1f s)\n", fname, n, (double) n / AFSK_SAMPLERATE);
+    run_dcd(samples, n);
+    for (int k=0; k<NVARIANTS; k++)
+        run(variant_name[k], samples, n, &k, 1);
+
+    static const int all[NVARIANTS] = {0, 1, 2};
+    run("parallel", samples, n, all, NVARIANTS);
+    free(samples);
 }
 
 
 
+/*******************************************************
+ * Benchmark the FIR filters with the block API.
+ * Reports time (and cycles if available) per sample
+ *******************************************************/
 
-int main() {
-    rxSampler_init();
-    
-    rxSampler_put(1); 
-    rxSampler_put(2);
-    rxSampler_put(3);
-    rxSampler_put(4);
-
-    rxSampler_readLast(); 
-    printFrame(); 
-
-    
-    rxSampler_nextFrame();
-
-    rxSampler_put(5); 
-    rxSampler_put(6);
-    rxSampler_put(7);
-    rxSampler_put(8);
-    rxSampler_put(9); 
-    rxSampler_put(10);
-    rxSampler_put(11);
-    rxSampler_put(12);
-
-    printFrame(); 
-    
-    rxSampler_reset();
-    printFrame(); 
-
-    rxSampler_readLast(); 
-    printFrame(); 
-    
-    rxSampler_nextFrame();
-    rxSampler_put(13); 
-    rxSampler_put(14);
-    rxSampler_put(15);
-    rxSampler_put(16);
-    rxSampler_put(17); 
-    rxSampler_put(18);
-    rxSampler_put(19); 
-    rxSampler_put(20);
-    rxSampler_put(21);
-    rxSampler_put(22);
-    rxSampler_put(23); 
-    rxSampler_put(24);
-    
-    rxSampler_reset();
-    printFrame(); 
-    
-    rxSampler_readLast(); 
-    printFrame(); 
-    
-    
-    
-    rxSampler_nextFrame();
-    
-    rxSampler_put(25); 
-    rxSampler_put(26);
-    rxSampler_put(27);
-    rxSampler_put(28);
-    rxSampler_put(29); 
-    rxSampler_put(30);
-    rxSampler_put(31); 
-    rxSampler_put(32);
-    
-    rxSampler_reset();
-    printFrame(); 
-    
-    rxSampler_readLast(); 
-    printFrame(); 
+#define BENCH_SAMPLES 2000000
+#define BENCH_BLOCK 256
+
+static void fir_bench()
+{
+    static int8_t in[BENCH_BLOCK], out[BENCH_BLOCK];
+    static fir_mem_t mem;
+    long i;
+    for (i=0; i<BENCH_BLOCK; i++)
+        in[i] = (int8_t) (rand() & 0xff);
+
+    for (int f=0; f<FIR_FILTERS; f++) {
+        memset(&mem, 0, sizeof(mem));
+        clock_t t = clock();
+#if defined(CYCLES)
+        uint64_t c = CYCLES();
+#endif
+        for (i=0; i<BENCH_SAMPLES; i += BENCH_BLOCK)
+            fir_process_block(f, &mem, in, out, BENCH_BLOCK);
+        double ns = (double) (clock() - t) / CLOCKS_PER_SEC * 1e9 / BENCH_SAMPLES;
+        printf("filter %d: taps=%-3d %6.2f ns/sample", f, fir_taps(f), ns);
+#if defined(CYCLES)
+        printf(" %6.2f cycles/sample", (double) (CYCLES() - c) / BENCH_SAMPLES);
+#endif
+        printf("  (out[0]=%d)\n", out[0]);
+    }
 }
 
 
 
+int main(int argc, char** argv)
+{
+    int i = 1;
+    if (i < argc && !strcmp(argv[i], "-b")) {
+        fir_bench();
+        return 0;
+    }
+    if (i < argc && !strcmp(argv[i], "-v")) {
+        verbose = true;
+        i++;
+    }
+    if (i >= argc) {
+        fprintf(stderr, "Usage: %s [-v] file ... | -b\n", argv[0]);
+        return 1;
+    }
+    for (; i < argc; i++)
+        decode_file(argv[i]);
+    return 0;
+}
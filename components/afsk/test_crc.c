@@ -0,0 +1,202 @@
+/*
+ * Offline test of the table driven CRC-CCITT (crc16.c, crc16_fbuf.c).
+ * Runs on a host computer (not part of the firmware build):
+ *
+ *   gcc -O2 -Wall -I../aprs/hoststub -I../../main -o crc_test \
+ *       test_crc.c crc16.c crc16_fbuf.c ../../main/fbuf.c
+ *   ./crc_test
+ *
+ * crc_ccitt_byte(), crc_ccitt_block() (slice-by-4) and crc_ccitt_fbuf()
+ * are compared with a bitwise CRC (reflected, poly 0x8408) and with
+ * _crc_ccitt_update() from crc16.h, for random data, lengths, start
+ * values and alignments. Then the speed of the bitwise, the byte-wise
+ * and the slice-by-4 CRC is measured.
+ *
+ * By LA7ECA, ohanssen@acm.org
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include "crc16.h"
+#include "fbuf.h"
+
+
+#define RANDOM_TESTS 100000
+#define BENCH_BYTES  (64 * 1024 * 1024)
+#define MAXLEN 400
+
+static uint8_t data[MAXLEN + 8];
+
+
+
+/*******************************************************
+ * Reference: one bit at a time
+ *******************************************************/
+
+static uint16_t crc_bitwise(uint16_t crc, const uint8_t* p, size_t len)
+{
+    while (len-- > 0) {
+        crc ^= *(p++);
+        for (int i=0; i<8; i++)
+            crc = (crc & 1) ? (crc >> 1) ^ 0x8408 : crc >> 1;
+    }
+    return crc;
+}
+
+
+static uint16_t crc_update(uint16_t crc, const uint8_t* p, size_t len)
+{
+    while (len-- > 0)
+        crc = _crc_ccitt_update(crc, *(p++));
+    return crc;
+}
+
+
+static uint16_t crc_bytes(uint16_t crc, const uint8_t* p, size_t len)
+{
+    while (len-- > 0)
+        crc = crc_ccitt_byte(crc, *(p++));
+    return crc;
+}
+
+
+
+/*******************************************************
+ * The FCS of "123456789" (CRC-16/X-25) is 0x906E.
+ *******************************************************/
+
+static int check_value()
+{
+    const uint8_t* s = (const uint8_t*) "123456789";
+    uint16_t fcs = ~crc_ccitt_block(0xffff, s, 9);
+    if (fcs != 0x906E || (uint16_t) ~crc_bitwise(0xffff, s, 9) != 0x906E) {
+        printf("FAIL: check value %04X, expected 906E\n", fcs);
+        return 1;
+    }
+    return 0;
+}
+
+
+
+/*******************************************************
+ * Random data. The start offset varies, so that the
+ * 4 byte blocks are not always aligned.
+ *******************************************************/
+
+static int check_random()
+{
+    int fails = 0;
+    for (int i=0; i<RANDOM_TESTS; i++) {
+        size_t len = rand() % MAXLEN;
+        const uint8_t* p = data + rand() % 8;
+        uint16_t crc = (i % 3 == 0 ? 0xffff : rand());
+
+        if (i % 100 == 0)
+            for (int j=0; j<sizeof(data); j++)
+                data[j] = rand();
+
+        uint16_t ref = crc_bitwise(crc, p, len);
+        uint16_t upd = crc_update(crc, p, len);
+        uint16_t byte = crc_bytes(crc, p, len);
+        uint16_t blk = crc_ccitt_block(crc, p, len);
+        if (upd != ref || byte != ref || blk != ref) {
+            printf("FAIL: random test %d (length %zu): bitwise %04X, update %04X, "
+                "byte %04X, block %04X\n", i, len, ref, upd, byte, blk);
+            fails++;
+        }
+
+        /* A block in two parts */
+        size_t k = (len > 0 ? rand() % len : 0);
+        if (crc_ccitt_block(crc_ccitt_block(crc, p, k), p + k, len - k) != ref) {
+            printf("FAIL: random test %d, split at %zu of %zu\n", i, k, len);
+            fails++;
+        }
+    }
+    return fails;
+}
+
+
+
+/*******************************************************
+ * CRC over a buffer chain, from a random position
+ *******************************************************/
+
+static int check_fbuf()
+{
+    int fails = 0;
+    for (int i=0; i<RANDOM_TESTS / 10; i++) {
+        FBUF b;
+        size_t len = 1 + rand() % MAXLEN;
+        size_t pos = rand() % len;
+        size_t n = rand() % (len - pos + 1);
+
+        fbuf_new(&b, 0);
+        fbuf_write(&b, (const char*) data, len);
+        uint16_t ref = crc_bitwise(0xffff, data + pos, n);
+        uint16_t fb = crc_ccitt_fbuf(0xffff, &b, pos, n);
+        if (fb != ref) {
+            printf("FAIL: fbuf test %d (%zu bytes from %zu of %zu): %04X, expected %04X\n",
+                i, n, pos, len, fb, ref);
+            fails++;
+        }
+        fbuf_release(&b);
+    }
+    return fails;
+}
+
+
+
+/*******************************************************
+ * Speed
+ *******************************************************/
+
+static double elapsed(struct timespec* t0)
+{
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) * 1e-9;
+}
+
+
+static void bench()
+{
+    static const char* name[] = {"bitwise", "_crc_ccitt_update", "crc_ccitt_byte", "crc_ccitt_block"};
+    static uint16_t (*const f[])(uint16_t, const uint8_t*, size_t) =
+        { crc_bitwise, crc_update, crc_bytes, crc_ccitt_block };
+    const size_t len = 200;
+    struct timespec t0;
+    uint16_t crc = 0xffff;
+    double t_ref = 0;
+
+    printf("\n  %d byte frames\n", (int) len);
+    for (int k=0; k<4; k++) {
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (int r=0; r < BENCH_BYTES / len; r++)
+            crc = f[k](crc, data, len);
+        double t = elapsed(&t0);
+        if (k == 0)
+            t_ref = t;
+        printf("  %-18s %7.1f MB/s (%.1fx)\n", name[k], BENCH_BYTES / t / 1e6, t_ref / t);
+    }
+    if (crc == 0)
+        printf("(zero crc)\n");
+}
+
+
+
+int main(int argc, char** argv)
+{
+    fbuf_init();
+    int fails = check_value();
+    fails += check_random();
+    fails += check_fbuf();
+    printf("%d random tests, %d failures\n", RANDOM_TESTS + RANDOM_TESTS / 10, fails);
+    if (fails > 0)
+        return 1;
+    bench();
+    return 0;
+}
@@ -0,0 +1,481 @@
+/*
+ * Offline test of the lock-free byte fifo (fifo.c) used between the
+ * AFSK sampler and the HDLC encoder/decoder tasks.
+ * Runs on a host computer (not part of the firmware build):
+ *
+ *   gcc -O2 -Wall -I../aprs/hoststub -I../../main -o fifo_test \
+ *       test_fifo.c fifo.c -lpthread
+ *   ./fifo_test
+ *
+ * The read and write positions run from 0 to 2*size-1. First, one
+ * thread moves data through fifos of some odd and even sizes, with
+ * fifo_put_n/fifo_get_n pieces that cross the 2*size wraparound at
+ * every offset, and when the fifo is exactly full.
+ *
+ * Then a producer and a consumer thread (SPSC) move a long byte
+ * sequence through small fifos with random piece sizes, so that both
+ * sides block and wake each other up often. The task notifications
+ * are implemented here with pthreads. A wakeup that is lost shows up
+ * as a wait that times out.
+ *
+ * Last, the fifo is benchmarked against the old one (two counting
+ * semaphores and a mutex per byte, kept here as a baseline), the way
+ * the AFSK receiver uses it: Frames of FRAME_BYTES through a fifo of
+ * AFSK_RX_QUEUE_SIZE bytes. Reported are bytes per second, and per
+ * frame the RTOS calls, the blocking waits and the wakeups of the other
+ * task. A blocking wait is a context switch, and so is a wakeup when
+ * the other task runs on the same core. The new fifo is run with one
+ * fifo_put per byte and with fifo_put_n of AFSK_RX_QUEUE_SIZE bytes
+ * (like afsk_rx.c). The consumer uses fifo_get_n (like hdlc_decoder.c).
+ *
+ * By LA7ECA, ohanssen@acm.org
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "fifo.h"
+
+
+#define WAIT_TIMEOUT 5
+
+
+
+/*******************************************************
+ * Task notifications (counting), one per thread
+ *******************************************************/
+
+typedef struct {
+    pthread_mutex_t mx;
+    pthread_cond_t  cond;
+    uint32_t        count;
+} notify_t;
+
+static __thread notify_t self = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 };
+static _Atomic int lost_wakeups = 0;
+static _Atomic long n_waits = 0, n_gives = 0;
+
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+   { return &self; }
+
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks)
+{
+    struct timespec ts;
+    uint32_t cnt;
+    n_waits++;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += WAIT_TIMEOUT;
+
+    pthread_mutex_lock(&self.mx);
+    while (self.count == 0)
+        if (pthread_cond_timedwait(&self.cond, &self.mx, &ts) != 0) {
+            lost_wakeups++;
+            break;
+        }
+    cnt = self.count;
+    self.count = (clear || cnt == 0 ? 0 : cnt - 1);
+    pthread_mutex_unlock(&self.mx);
+    return cnt;
+}
+
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    notify_t* n = task;
+    n_gives++;
+    pthread_mutex_lock(&n->mx);
+    n->count++;
+    pthread_cond_signal(&n->cond);
+    pthread_mutex_unlock(&n->mx);
+    return pdTRUE;
+}
+
+
+
+/*******************************************************
+ * One thread. Before each round, the fifo is moved to
+ * a given offset from the wraparound. Then a piece of
+ * n bytes is put, and got back in two parts.
+ *******************************************************/
+
+static const uint16_t sizes[] = {1, 2, 7, 16, 100, 255};
+
+
+static int check_wrap()
+{
+    int fails = 0, rounds = 0;
+    uint8_t in[600], out[600];
+
+    for (int s=0; s < sizeof(sizes)/sizeof(sizes[0]); s++) {
+        uint16_t size = sizes[s];
+        fifo_t f;
+        fifo_init(&f, size);
+
+        for (int off=0; off < 2*size; off++) {
+            for (int n=1; n <= size; n++) {
+                /* Move to off bytes before the end of the 0 .. 2*size-1 range */
+                uint32_t p = atomic_load(&f.pos);
+                uint32_t target = (2*size - off) % (2*size);
+                while (p != target) {
+                    fifo_put(&f, 0);
+                    fifo_get(&f);
+                    p = atomic_load(&f.pos);
+                }
+
+                for (int i=0; i<n; i++)
+                    in[i] = rand();
+                fifo_put_n(&f, in, n);
+                if (atomic_load(&f.wpos) != (target + n) % (2*size)) {
+                    printf("FAIL: size %d, offset %d, %d bytes: wpos=%d\n",
+                        size, off, n, (int) atomic_load(&f.wpos));
+                    fails++;
+                }
+                int k = rand() % n;
+                int got = 0;
+                if (k > 0)
+                    got = fifo_get_n(&f, out, k);
+                while (got < n)
+                    got += fifo_get_n(&f, out + got, sizeof(out) - got);
+                if (got != n || memcmp(in, out, n) != 0) {
+                    printf("FAIL: size %d, offset %d, %d bytes: got %d, content %s\n",
+                        size, off, n, got, memcmp(in, out, n) ? "differs" : "ok");
+                    fails++;
+                }
+                if (atomic_load(&f.pos) != atomic_load(&f.wpos)) {
+                    printf("FAIL: size %d, offset %d, %d bytes: not empty\n", size, off, n);
+                    fails++;
+                }
+                rounds++;
+            }
+        }
+        free(f.buffer);
+    }
+    printf("%d wraparound rounds\n", rounds);
+    return fails;
+}
+
+
+
+/*******************************************************
+ * Producer and consumer threads
+ *******************************************************/
+
+typedef struct {
+    fifo_t f;
+    uint16_t maxpiece;
+    long total, errors, pos;
+} stream_t;
+
+
+static inline uint8_t seq_byte(long i)
+   { return (uint8_t) (i % 251); }
+
+
+static void* producer(void* arg)
+{
+    stream_t* s = arg;
+    uint8_t buf[1024];
+    unsigned int seed = 1;
+    for (long i=0; i < s->total; ) {
+        int n = 1 + rand_r(&seed) % s->maxpiece;
+        if (n > s->total - i)
+            n = s->total - i;
+        for (int j=0; j<n; j++)
+            buf[j] = seq_byte(i + j);
+        if (n == 1)
+            fifo_put(&s->f, buf[0]);
+        else
+            fifo_put_n(&s->f, buf, n);
+        i += n;
+    }
+    return NULL;
+}
+
+
+static void* consumer(void* arg)
+{
+    stream_t* s = arg;
+    uint8_t buf[1024];
+    unsigned int seed = 2;
+    while (s->pos < s->total) {
+        int n = 1 + rand_r(&seed) % s->maxpiece;
+        if (n > s->total - s->pos)
+            n = s->total - s->pos;
+        if (n == 1)
+            buf[0] = fifo_get(&s->f);
+        else
+            n = fifo_get_n(&s->f, buf, n);
+        for (int j=0; j<n; j++)
+            if (buf[j] != seq_byte(s->pos + j))
+                s->errors++;
+        s->pos += n;
+    }
+    return NULL;
+}
+
+
+static double elapsed(struct timespec* t0)
+{
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) * 1e-9;
+}
+
+
+static int check_threads()
+{
+    static const uint16_t tsizes[] = {7, 64, 1000};
+    static const uint16_t pieces[] = {1, 16, 600};
+    static const long total[] = {200000, 2000000, 20000000};
+    int fails = 0;
+
+    printf("\n  size  piece   MB/s\n");
+    for (int t=0; t < sizeof(tsizes)/sizeof(tsizes[0]); t++) {
+        stream_t s = { .maxpiece = pieces[t], .total = total[t], .errors = 0, .pos = 0 };
+        pthread_t prod, cons;
+        struct timespec t0;
+
+        fifo_init(&s.f, tsizes[t]);
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        pthread_create(&cons, NULL, consumer, &s);
+        pthread_create(&prod, NULL, producer, &s);
+        pthread_join(prod, NULL);
+        pthread_join(cons, NULL);
+        double sec = elapsed(&t0);
+
+        printf("  %4d  %5d  %6.1f\n", tsizes[t], pieces[t], s.total / sec / 1e6);
+        if (s.errors > 0 || s.pos != s.total) {
+            printf("FAIL: size %d: %ld of %ld bytes, %ld wrong\n",
+                tsizes[t], s.pos, s.total, s.errors);
+            fails++;
+        }
+        free(s.f.buffer);
+    }
+    if (lost_wakeups > 0) {
+        printf("FAIL: %d lost wakeups\n", lost_wakeups);
+        fails++;
+    }
+    return fails;
+}
+
+
+
+/*******************************************************
+ * The old fifo: Two counting semaphores and a mutex.
+ * Every call counts as an RTOS call. A semaphore that
+ * must wait counts as a blocking wait, and giving a
+ * semaphore that a task waits for counts as a wakeup.
+ *******************************************************/
+
+typedef struct {
+    pthread_mutex_t mx;
+    pthread_cond_t  cond;
+    int count, waiting;
+} ksem_t;
+
+typedef struct {
+    uint16_t size, wpos, pos;
+    ksem_t capacity, elements;
+    pthread_mutex_t mutex;
+    uint8_t* buffer;
+} old_fifo_t;
+
+static _Atomic long k_calls = 0, k_waits = 0, k_wakeups = 0;
+
+
+static void ksem_init(ksem_t* s, int count)
+{
+    pthread_mutex_init(&s->mx, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    s->count = count;
+    s->waiting = 0;
+}
+
+
+static void ksem_down(ksem_t* s)
+{
+    k_calls++;
+    pthread_mutex_lock(&s->mx);
+    if (s->count == 0) {
+        k_waits++;
+        s->waiting++;
+        while (s->count == 0)
+            pthread_cond_wait(&s->cond, &s->mx);
+    }
+    s->count--;
+    pthread_mutex_unlock(&s->mx);
+}
+
+
+static void ksem_up(ksem_t* s)
+{
+    k_calls++;
+    pthread_mutex_lock(&s->mx);
+    s->count++;
+    if (s->waiting > 0) {
+        /* The waiting task is unblocked (once) */
+        k_wakeups++;
+        s->waiting--;
+        pthread_cond_signal(&s->cond);
+    }
+    pthread_mutex_unlock(&s->mx);
+}
+
+
+static void old_fifo_init(old_fifo_t* f, uint16_t size)
+{
+    f->buffer = malloc(size);
+    f->size = size;
+    f->wpos = f->pos = 0;
+    ksem_init(&f->capacity, size);
+    ksem_init(&f->elements, 0);
+    pthread_mutex_init(&f->mutex, NULL);
+}
+
+
+static void old_fifo_put(old_fifo_t* f, uint8_t x)
+{
+    ksem_down(&f->capacity);
+    k_calls++;
+    pthread_mutex_lock(&f->mutex);
+    f->buffer[f->wpos] = x;
+    f->wpos = (f->wpos + 1) % f->size;
+    k_calls++;
+    pthread_mutex_unlock(&f->mutex);
+    ksem_up(&f->elements);
+}
+
+
+static uint8_t old_fifo_get(old_fifo_t* f)
+{
+    uint8_t res;
+    ksem_down(&f->elements);
+    k_calls++;
+    pthread_mutex_lock(&f->mutex);
+    res = f->buffer[f->pos];
+    f->pos = (f->pos + 1) % f->size;
+    k_calls++;
+    pthread_mutex_unlock(&f->mutex);
+    ksem_up(&f->capacity);
+    return res;
+}
+
+
+
+/*******************************************************
+ * Benchmark. The producer puts frames of FRAME_BYTES,
+ * the consumer gets them and checks the content.
+ *******************************************************/
+
+#define FRAME_BYTES  128
+#define BENCH_FRAMES 5000
+#define QUEUE_SIZE   8      /* AFSK_RX_QUEUE_SIZE */
+
+enum { OLD_FIFO, NEW_PUT, NEW_PUT_N };
+
+typedef struct {
+    int impl;
+    old_fifo_t of;
+    fifo_t f;
+    long errors;
+} bench_t;
+
+
+static void* bench_producer(void* arg)
+{
+    bench_t* b = arg;
+    uint8_t buf[QUEUE_SIZE];
+    int n = 0;
+    for (long i=0; i < (long) BENCH_FRAMES * FRAME_BYTES; i++) {
+        uint8_t x = seq_byte(i);
+        if (b->impl == OLD_FIFO)
+            old_fifo_put(&b->of, x);
+        else if (b->impl == NEW_PUT)
+            fifo_put(&b->f, x);
+        else {
+            buf[n++] = x;
+            if (n == QUEUE_SIZE || i % FRAME_BYTES == FRAME_BYTES-1) {
+                fifo_put_n(&b->f, buf, n);
+                n = 0;
+            }
+        }
+    }
+    return NULL;
+}
+
+
+static void* bench_consumer(void* arg)
+{
+    bench_t* b = arg;
+    uint8_t buf[QUEUE_SIZE];
+    for (long i=0; i < (long) BENCH_FRAMES * FRAME_BYTES; ) {
+        int n = 1;
+        if (b->impl == OLD_FIFO)
+            buf[0] = old_fifo_get(&b->of);
+        else
+            n = fifo_get_n(&b->f, buf, QUEUE_SIZE);
+        for (int j=0; j<n; j++, i++)
+            if (buf[j] != seq_byte(i))
+                b->errors++;
+    }
+    return NULL;
+}
+
+
+static int bench()
+{
+    static const char* name[] = {"old (semaphores)", "new, fifo_put", "new, fifo_put_n"};
+    int fails = 0;
+
+    printf("\n  %d byte frames, fifo of %d bytes\n", FRAME_BYTES, QUEUE_SIZE);
+    printf("  %-18s  %8s  %9s  %9s  %9s\n", "", "MB/s", "calls", "waits", "wakeups");
+    for (int impl=OLD_FIFO; impl<=NEW_PUT_N; impl++) {
+        bench_t b = { .impl = impl, .errors = 0 };
+        pthread_t prod, cons;
+        struct timespec t0;
+
+        old_fifo_init(&b.of, QUEUE_SIZE);
+        fifo_init(&b.f, QUEUE_SIZE);
+        k_calls = k_waits = k_wakeups = n_waits = n_gives = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        pthread_create(&cons, NULL, bench_consumer, &b);
+        pthread_create(&prod, NULL, bench_producer, &b);
+        pthread_join(prod, NULL);
+        pthread_join(cons, NULL);
+        double sec = elapsed(&t0);
+
+        /* New fifo: Only waiting and waking up are RTOS calls */
+        long calls = (impl == OLD_FIFO ? k_calls : n_waits + n_gives);
+        long waits = (impl == OLD_FIFO ? k_waits : n_waits);
+        long wakeups = (impl == OLD_FIFO ? k_wakeups : n_gives);
+        printf("  %-18s  %8.1f  %9.1f  %9.1f  %9.1f\n", name[impl],
+            (double) BENCH_FRAMES * FRAME_BYTES / sec / 1e6, (double) calls / BENCH_FRAMES,
+            (double) waits / BENCH_FRAMES, (double) wakeups / BENCH_FRAMES);
+        if (b.errors > 0) {
+            printf("FAIL: %s: %ld bytes wrong\n", name[impl], b.errors);
+            fails++;
+        }
+        free(b.of.buffer);
+        free(b.f.buffer);
+    }
+    return fails;
+}
+
+
+
+int main(int argc, char** argv)
+{
+    int fails = check_wrap();
+    fails += check_threads();
+    printf("%d failures\n", fails);
+    if (fails > 0)
+        return 1;
+    return (bench() > 0 ? 1 : 0);
+}
@@ -12,36 +12,51 @@ typedef struct lorameta {
     int32_t ferror;
 } lorameta_t;
 
-char* loraprs_last_packet();
+/* TX scheduler statistics. Times are in ms */
+typedef struct loraprs_txstats {
+    uint32_t sent; 
+    uint32_t expired;    /* Dropped after waiting more than LORA.TXAGE */
+    uint32_t overflow;   /* Dropped since too many frames were waiting */
+    uint32_t deferred;   /* Had to wait for the duty cycle budget */
+    uint32_t cad; 
+    uint32_t cad_busy;
+    uint32_t airtime;    /* Total */
+    uint32_t window;     /* Used in the last hour */
+    uint32_t budget;     /* Allowed per hour, 0 = no limit */
+    uint8_t  queued;
+} loraprs_txstats_t;
+
+char* loraprs_last_packet(char* buf, uint16_t size);
 char* loraprs_last_heard(char* buf);
 bool loraprs_last_digied();
 int8_t loraprs_last_rssi();
 int8_t loraprs_last_snr();
 time_t loraprs_last_time();
-uint8_t loraprs_subscribe_rx(fbq_t* q);
+uint8_t loraprs_subscribe_rx(fbq_t* q, fbq_policy_t p, const char* name);
 void loraprs_unsubscribe_rx(uint8_t i);
-uint8_t loraprs_subscribe_txmon(fbq_t* q);
+uint8_t loraprs_subscribe_txmon(fbq_t* q, fbq_policy_t p, const char* name);
 void loraprs_unsubscribe_txmon(uint8_t i);
 fbq_t* loraprs_get_encoder_queue();
 bool loraprs_tx_is_on(); 
+void loraprs_getTxStats(loraprs_txstats_t* st);
 
 
-#define APRS_SUBSCRIBE_RX(q) loraprs_subscribe_rx((q))
+#define APRS_SUBSCRIBE_RX(q, p, n) loraprs_subscribe_rx((q), (p), (n))
 #define APRS_UNSUBSCRIBE_RX(i) loraprs_unsubscribe_rx((i))
-#define APRS_SUBSCRIBE_TXMON(q) loraprs_subscribe_txmon((q))
+#define APRS_SUBSCRIBE_TXMON(q, p, n) loraprs_subscribe_txmon((q), (p), (n))
 #define APRS_UNSUBSCRIBE_TXMON(i) loraprs_unsubscribe_txmon((i))
 #define APRS_GET_ENCODER_QUEUE loraprs_get_encoder_queue
 
 #else
  
-uint8_t hdlc_subscribe_rx(fbq_t* q);
+uint8_t hdlc_subscribe_rx(fbq_t* q, fbq_policy_t p, const char* name);
 void hdlc_unsubscribe_rx(uint8_t i);
-uint8_t hdlc_subscribe_txmon(fbq_t* q);
+uint8_t hdlc_subscribe_txmon(fbq_t* q, fbq_policy_t p, const char* name);
 void hdlc_unsubscribe_txmon(uint8_t i);
 
-#define APRS_SUBSCRIBE_RX(q) hdlc_subscribe_rx((q))
+#define APRS_SUBSCRIBE_RX(q, p, n) hdlc_subscribe_rx((q), (p), (n))
 #define APRS_UNSUBSCRIBE_RX(i) hdlc_unsubscribe_rx((i))
-#define APRS_SUBSCRIBE_TXMON(q) hdlc_subscribe_txmon((q))
+#define APRS_SUBSCRIBE_TXMON(q, p, n) hdlc_subscribe_txmon((q), (p), (n))
 #define APRS_UNSUBSCRIBE_TXMON(i) hdlc_unsubscribe_txmon((i))
 #define APRS_GET_ENCODER_QUEUE hdlc_get_encoder_queue
 
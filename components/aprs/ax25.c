@@ -381,10 +381,16 @@ int ax25_frame2str(char *buf, size_t bufsize, FBUF* b) {
 
         buf[len++] = ':';
         int dlen = fbuf_length(b) - AX25_HDR_LEN(ndigis);
-        for (int j = 0; j < dlen; j++) {
-            char c = fbuf_getChar(b);
-            if ((size_t)(len + 1) >= bufsize) break;
-            buf[len++] = c;
+        const char* seg;
+        int n;
+        if (dlen > (int) bufsize - len - 1)
+            dlen = bufsize - len - 1;
+        while (dlen > 0 && (n = fbuf_getSeg(b, &seg)) > 0) {
+            if (n > dlen) 
+                n = dlen;
+            memcpy(buf + len, seg, n);
+            len += n;
+            dlen -= n;
         }
         buf[len] = '\0';
     }
@@ -402,6 +408,8 @@ void ax25_str2frame(FBUF* b, char* str, uint8_t len)
     int p1 = strcspn(str, ">");
     int p2 = strcspn(str, ",");
     int p3 = strcspn(str, ":");
+    if (p2 > p3)
+        p2 = p3;  /* No digipeater path, comma is in the info field */
     str[p1] = str[p2] = str[p3] = '\0';
     
     char* from = str;
@@ -416,3 +424,91 @@ void ax25_str2frame(FBUF* b, char* str, uint8_t len)
     fbuf_putstr(b, text);
 }
 
+
+
+/**************************************************************************
+ * Parse a TNC2 header (from>to,digi,...:) in a single pass over str 
+ * (len bytes, need not be null terminated). Addresses are decoded 
+ * directly into from, to and digis (at most 7, more are ignored). Return
+ * the number of characters read (including the ':') or -1 if the header 
+ * is malformed. 
+ **************************************************************************/
+
+int ax25_tnc2_header(const char* str, uint16_t len, addr_t* from, addr_t* to, 
+                     addr_t digis[], uint8_t* ndigis)
+{
+    enum {S_FROM, S_TO, S_VIA} state = S_FROM;
+    addr_t dummy;
+    addr_t* a = from;
+    uint8_t i = 0, ssid = 0;
+    bool inssid = false;
+    
+    if (len > TNC2_HDR_MAX)
+        len = TNC2_HDR_MAX;
+    *ndigis = 0;
+    memset(a, 0, sizeof(addr_t));
+    
+    for (int n=0; n<len; n++) {
+        char c = str[n];
+        if (c == '>' || c == ',' || c == ':') {
+            /* End of address field */
+            if (i == 0 || (c == '>') != (state == S_FROM))
+                return -1;
+            a->ssid = ssid & 0x0f;
+            if (c == ':')
+                return n+1;
+        
+            if (c == '>') { 
+                state = S_TO; 
+                a = to; 
+            }
+            else { 
+                state = S_VIA; 
+                a = (*ndigis < 7 ? &digis[(*ndigis)++] : &dummy);
+            }
+            memset(a, 0, sizeof(addr_t));
+            i = ssid = 0;
+            inssid = false;
+        }
+        else if (c == '*') {
+            if (state == S_VIA)
+                a->flags = FLAG_DIGI;
+        }
+        else if (c == '-') 
+            inssid = true;
+        else if (inssid) {
+            if (c >= '0' && c <= '9')
+                ssid = ssid * 10 + (c - '0');
+        }
+        else if ((uint8_t) c <= ' ')
+            return -1;
+        else if (i < 6)
+            a->callsign[i++] = (c >= 'a' && c <= 'z' ? c - ('a' - 'A') : c);
+    }
+    return -1;
+}
+
+
+
+/**************************************************************************
+ * Encode an AX.25 frame from TNC2 text (len bytes, need not be null 
+ * terminated). The header is parsed in a single pass and encoded into 
+ * b (a new buffer), and the information field is written after it. 
+ * Unlike ax25_str2frame, the text is not changed. Return false if the 
+ * header is malformed. 
+ **************************************************************************/
+
+bool ax25_tnc2frame(FBUF* b, const char* str, uint16_t len)
+{
+    addr_t from, to; 
+    addr_t digis[7];
+    uint8_t ndigis;
+    
+    int n = ax25_tnc2_header(str, len, &from, &to, digis, &ndigis);
+    if (n < 0)
+        return false;
+    ax25_encode_header(b, &from, &to, digis, ndigis, FTYPE_UI, PID_NO_L3); 
+    fbuf_write(b, str + n, len - n);
+    return true;
+}
+
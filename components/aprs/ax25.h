@@ -36,6 +36,7 @@
 
 #define AX25_HDR_LEN(ndigis) (14+2+(ndigis)*7)
 #define AX25_ADDR_LEN 9
+#define TNC2_HDR_MAX 128
 
 
 /* AX.25 Address Field type */
@@ -64,6 +65,8 @@ uint8_t ax25_decode_header(FBUF*, addr_t*, addr_t*, addr_t[],
 
 /* Encode frame from string */
 void ax25_str2frame(FBUF* b, char* str, uint8_t len); 
+int  ax25_tnc2_header(const char* str, uint16_t len, addr_t* from, addr_t* to, addr_t digis[], uint8_t* ndigis);
+bool ax25_tnc2frame(FBUF* b, const char* str, uint16_t len); 
 int ax25_frame2str(char *buf, size_t bufsize, FBUF* b);
 
 /* Display information about frame on standard output */
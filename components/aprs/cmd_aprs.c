@@ -50,6 +50,51 @@ static int do_teston(int argc, char** argv)
     radio_release();
     return 0;
 }
+
+
+/********************************************************************************
+ * AFSK decoder statistics
+ ********************************************************************************/
+
+static int do_afskstat(int argc, char** argv)
+{
+    afsk_stats_t st;
+    afsk_rx_getStats(&st);
+    printf("Frames captured:  %ld\n", st.frames);
+    printf("Frames decoded:   %ld", st.decoded);
+    if (st.frames > 0)
+        printf(" (%ld %%)", 100 * st.decoded / st.frames);
+    printf("\n");
+    if (st.frames > 0)
+        printf("CPU time/frame:   %ld us\n", st.usec / st.frames);
+    if (st.frames > 0)
+        printf("Last frame SNR:   %d dB\n", st.snr);
+    if (st.lat_n > 0)
+        printf("Delivery latency: %ld us avg, %ld us max\n", st.lat_usec / st.lat_n, st.lat_max);
+    for (int i=0; i<AFSK_DEMODULATORS; i++)
+        printf("Demodulator %d:    %ld\n", i+1, st.demod[i]);
+    
+    hdlc_txstats_t tx;
+    hdlc_tx_getStats(&tx);
+    printf("Frames sent:      %ld", tx.frames);
+    if (tx.keyups > 0)
+        printf(" (%.2f per key-up)", (double) tx.frames / tx.keyups);
+    printf("\n");
+    printf("Over TX budget:   %ld\n", tx.deferred);
+    printf("Over MAXFRAME:    %ld\n", tx.maxframe);
+    return 0;
+}
+
+
+
+static int do_afskfir(int argc, char** argv)
+{
+    uint32_t cycles[FIR_FILTERS];
+    afsk_fir_bench(cycles);
+    for (int i=0; i<FIR_FILTERS; i++)
+        printf("FIR filter %d: %2d taps, %4ld cycles/sample\n", i, fir_taps(i), cycles[i]);
+    return 0;
+}
 #else
 
 static int do_heard(int argc, char** argv)
@@ -164,6 +209,54 @@ static int do_trput(int argc, char* argv[])
 }
 
 
+
+/****************************************************************************
+ * Track log write statistics
+ ****************************************************************************/
+
+static int do_trstat(int argc, char* argv[])
+{
+    (void) argv;
+    (void) argc; 
+    ts_stats_t st;
+    trackstore_getStats(&st);
+    uint32_t fixes = (st.fixes > 0 ? st.fixes : 1);
+    
+    printf("Fixes stored:        %lu\n", st.fixes);
+    printf("Block writes:        %lu\n", st.commits);
+    printf("Metadata writes:     %lu\n", st.metawrites);
+    printf("Bytes written:       %lu (%lu per fix)\n", st.bytes, st.bytes / fixes);
+    printf("Flash written (est): %llu (%llu per fix)\n", st.flash, st.flash / fixes);
+    printf("Flash wear (est):    %.6f erase cycles\n", (double) st.flash / fatfs_size());
+    return 0;
+}
+
+
+
+/*****************************************************************
+ * Igate connection statistics
+ *****************************************************************/
+
+static int do_igstat(int argc, char* argv[])
+{
+    (void) argv;
+    (void) argc; 
+    char buf[72];
+    igate_stats_t st;
+    igate_getStats(&st);
+    
+    printf("Server:              %s\n", igate_server(st.server, buf));
+    printf("Standby server:      %s\n", igate_server(st.standby, buf));
+    printf("Connections:         %lu\n", st.connects);
+    printf("Failovers:           %lu\n", st.failovers);
+    printf("Outages:             %lu\n", st.outages);
+    printf("Reconnect time:      %lu ms (max %lu ms)\n", st.last_reconnect, st.max_reconnect);
+    printf("Frames gated:        %lu (own %lu)\n", igate_icount(), igate_tr_count());
+    printf("Frames lost:         %lu\n", st.lost);
+    return 0;
+}
+
+
   
 /*****************************************************************
  * Handlers for making actions after changing after some 
@@ -173,10 +266,61 @@ static int do_trput(int argc, char* argv[])
 #if defined(ARCTIC4_UHF)
 
 
+/*****************************************************************
+ * LoRa SPI bus statistics
+ *****************************************************************/
+
+static int do_spistat(int argc, char* argv[])
+{
+    (void) argv;
+    (void) argc; 
+    lora_spistats_t st;
+    lora_getSpiStats(&st);
+    uint32_t trans = (st.trans > 0 ? st.trans : 1);
+    
+    printf("Transactions:        %lu\n", st.trans);
+    printf("Bytes:               %lu (%lu per transaction)\n", st.bytes, st.bytes / trans);
+    printf("Bus time:            %lu us (%lu us per transaction)\n", st.usec, st.usec / trans);
+    printf("Wait for BUSY:       %lu us\n", st.busy_usec);
+    printf("Profile switches:    %lu (%lu us each), %lu skipped\n", st.switches, 
+            st.switch_usec / (st.switches > 0 ? st.switches : 1), st.switch_skip);
+    return 0;
+}
+
+
+
+/*****************************************************************
+ * LoRa TX scheduler statistics
+ *****************************************************************/
+
+static int do_txstat(int argc, char* argv[])
+{
+    (void) argv;
+    (void) argc; 
+    loraprs_txstats_t st;
+    loraprs_getTxStats(&st);
+    uint32_t cad = (st.cad > 0 ? st.cad : 1);
+    
+    printf("Frames sent:         %lu\n", st.sent);
+    printf("Frames waiting:      %u\n", st.queued);
+    printf("Dropped (too old):   %lu\n", st.expired);
+    printf("Dropped (queue):     %lu\n", st.overflow);
+    printf("Over duty cycle:     %lu\n", st.deferred);
+    printf("Airtime:             %lu ms total\n", st.airtime);
+    if (st.budget > 0)
+        printf("Airtime last hour:   %lu ms (%lu%% of budget)\n", st.window, st.window * 100 / st.budget);
+    else
+        printf("Airtime last hour:   %lu ms (no limit)\n", st.window);
+    printf("CAD busy:            %lu of %lu (%lu%%)\n", st.cad_busy, st.cad, st.cad_busy * 100 / cad);
+    return 0;
+}
+
+
+
 void hdl_lora_sfcr(uint8_t sfcr) {
     uint8_t cr = get_byte_param("LORA_CR", DFL_LORA_CR);
     uint8_t sf = get_byte_param("LORA_SF", DFL_LORA_SF);
-    lora_SetModulationParams(sf, SX126X_LORA_BW_125_0, cr-4, (sf>=11 ? 1:0)); 
+    lora_SetProfile(lora_profile(sf, cr)); 
 }
 
 
@@ -206,6 +350,14 @@ void hdl_softsq(int32_t sq) {
     afsk_setSoftSq((uint16_t) sq); 
 }
 
+void hdl_afskpar(bool on) {
+    afsk_setParallel(on);
+}
+
+void hdl_afskstream(bool on) {
+    afsk_setStreaming(on);
+}
+
 void hdl_miclevel(uint8_t ml) {
     radio_setMicLevel(ml); 
 }
@@ -259,6 +411,10 @@ void hdl_tracklog(bool on) {
         tracklog_off();
 }
 
+void hdl_trklogflush(uint8_t n) {
+    trackstore_setFlush(n);
+}
+
 void hdl_tracker(bool on) {
     if (on) 
         tracker_on();
@@ -316,9 +472,11 @@ CMD_STR_SETTING  (_param_comment,    "REP.COMMENT",  40, DFL_REP_COMMENT,  NULL)
 CMD_STR_SETTING  (_param_igate_host, "IGATE.HOST",   64, DFL_IGATE_HOST,   REGEX_HOSTNAME);
 CMD_STR_SETTING  (_param_igate_user, "IGATE.USER",   10, DFL_IGATE_USER,   REGEX_AXADDR);
 CMD_STR_SETTING  (_param_igate_filt, "IGATE.FILTER", 32, DFL_IGATE_FILTER, ".*");
+CMD_STR_SETTING  (_param_igate_alt,  "IGATE.ALT",    128, DFL_IGATE_ALT,   REGEX_HOSTLIST);
 
 CMD_BYTE_SETTING (_param_trklogint,  "TRKLOG.INT",   DFL_TRKLOG_INT,  0, 60,  NULL);
 CMD_BYTE_SETTING (_param_trklogttl,  "TRKLOG.TTL",   DFL_TRKLOG_TTL,  0, 250, NULL);
+CMD_BYTE_SETTING (_param_trklogflush,"TRKLOG.FLUSH", DFL_TRKLOG_FLUSH, 1, TS_STAGE_MAX, hdl_trklogflush);
 CMD_BYTE_SETTING (_param_maxframe,   "MAXFRAME",     DFL_MAXFRAME,    1, 7,   NULL);
 CMD_BYTE_SETTING (_param_maxpause,   "MAXPAUSE",     DFL_MAXPAUSE,    0, 250, NULL);
 CMD_BYTE_SETTING (_param_minpause,   "MINPAUSE",     DFL_MINPAUSE,    0, 250, NULL);
@@ -332,6 +490,7 @@ CMD_U16_SETTING  (_param_igate_pass, "IGATE.PASS",   0,               0, 65535);
 CMD_BOOL_SETTING (_param_crypto_on,  "CRYPTO.on",      DFL_CRYPTO_ON,      hdl_crypto);
 CMD_BOOL_SETTING (_param_tracklog_on,"TRKLOG.on",      DFL_TRKLOG_ON,      hdl_tracklog);
 CMD_BOOL_SETTING (_param_trkpost_on, "TRKLOG.POST.on", DFL_TRKLOG_POST_ON, hdl_trkpost);
+CMD_BOOL_SETTING (_param_trkbin_on,  "TRKLOG.BIN.on",  DFL_TRKLOG_BIN_ON,  NULL);
 CMD_BOOL_SETTING (_param_tracker_on, "TRACKER.on",     DFL_TRACKER_ON,     hdl_tracker);
 CMD_BOOL_SETTING (_param_timestamp,  "TIMESTAMP.on",   DFL_TIMESTAMP_ON,   NULL);
 CMD_BOOL_SETTING (_param_compress,   "COMPRESS.on",    DFL_COMPRESS_ON,    NULL);
@@ -344,6 +503,7 @@ CMD_BOOL_SETTING (_param_digi_sar,   "DIGI.SAR.on",    DFL_DIGI_SAR_ON,    NULL)
 CMD_BOOL_SETTING (_param_rbeep_on,   "REPORT.BEEP.on", DFL_REPORT_BEEP_ON, NULL);
 CMD_BOOL_SETTING (_param_xturn_on,   "EXTRATURN.on",   DFL_EXTRATURN_ON,   NULL);
 CMD_BOOL_SETTING (_param_igtrack_on, "IGATE.TRACK.on", DFL_IGATE_TRACK_ON, NULL);
+CMD_BOOL_SETTING (_param_igstandby_on, "IGATE.STANDBY.on", DFL_IGATE_STANDBY_ON, NULL);
 CMD_BOOL_SETTING (_param_txmon_on,   "TXMON.on",       DFL_TXMON_ON,       NULL);
 CMD_BOOL_SETTING (_param_radio_on,   "RADIO.on",       DFL_RADIO_ON,       hdl_radio);
 
@@ -357,6 +517,10 @@ CMD_BYTE_SETTING (_param_txpower,     "TXPOWER",        DFL_TXPOWER,        0, 6
 CMD_BYTE_SETTING (_param_lora_alt_sf, "LORA_ALT_SF",    DFL_LORA_ALT_SF,    5, 12,  NULL);
 CMD_BYTE_SETTING (_param_lora_alt_cr, "LORA_ALT_CR",    DFL_LORA_ALT_CR,    5, 8,   NULL);
 CMD_BOOL_SETTING (_param_lora_alt_on, "LORA_ALT.on",    DFL_LORA_ALT_ON,    NULL);
+CMD_BYTE_SETTING (_param_lora_spi,    "LORA.SPI",       DFL_LORA_SPI,       1, 16,  NULL);
+CMD_BOOL_SETTING (_param_lora_busyirq,"LORA.BUSYIRQ.on",DFL_LORA_BUSYIRQ_ON,NULL);
+CMD_BYTE_SETTING (_param_lora_duty,   "LORA.DUTY",      DFL_LORA_DUTY,      0, 100, NULL);
+CMD_I32_SETTING  (_param_lora_txage,  "LORA.TXAGE",     DFL_LORA_TXAGE,     0, 3600, NULL);
 CMD_BOOL_SETTING (_param_digi_meta,   "DIGI.META.on",   DFL_DIGI_META_ON,   NULL);
 #else
 
@@ -368,7 +532,11 @@ CMD_BYTE_SETTING (_param_miclevel,   "TRX_MICLEVEL", DFL_TRX_MICLEVEL,1, 8,   hd
 CMD_BYTE_SETTING (_param_volume,     "TRX_VOLUME",   DFL_TRX_VOLUME,  1, 8,   hdl_volume);
 CMD_BYTE_SETTING (_param_txdelay,    "TXDELAY",      DFL_TXDELAY,     0, 250, NULL);
 CMD_BYTE_SETTING (_param_txtail,     "TXTAIL",       DFL_TXTAIL,      0, 250, NULL);
+CMD_I32_SETTING  (_param_txbudget,   "TXBUDGET",     DFL_TXBUDGET,    0, 10000, NULL);
 CMD_BOOL_SETTING (_param_txlow_on,   "TXLOW.on",     DFL_TXLOW_ON,    hdl_txlow);
+CMD_BOOL_SETTING (_param_afskpar_on, "AFSK.PAR.on",  DFL_AFSK_PAR_ON, hdl_afskpar);
+CMD_BOOL_SETTING (_param_afskstream_on, "AFSK.STREAM.on", DFL_AFSK_STREAM_ON, hdl_afskstream);
+CMD_BYTE_SETTING (_param_afskbuf,    "AFSK.BUF",     DFL_AFSK_BUF,    8, 250, NULL);
 
 #endif
 
@@ -384,6 +552,8 @@ void register_aprs()
     ADD_CMD("listen",     &do_listen,          "Monitor radio channel", "");
     ADD_CMD("trklog-get", &do_trget,           "Get tracklog record", "");      
     ADD_CMD("trklog-put", &do_trput,           "Put tracklog record", "");  
+    ADD_CMD("trklog-stat",&do_trstat,          "Track log write statistics", "");
+    ADD_CMD("igate-stat", &do_igstat,          "Igate connection statistics", "");
     
     ADD_CMD("mycall",     &_param_mycall,      "My callsign", "[<callsign>]");
     ADD_CMD("digipath",   &_param_digipath,    "APRS Digipeater path", "[<addr>, ...]");
@@ -394,6 +564,7 @@ void register_aprs()
     ADD_CMD("repeat",     &_param_repeat,      "# Times to repeat posreports (0-3)", "[val]");           
     ADD_CMD("trklog-int", &_param_trklogint,   "Interval for track logging (seconds)", "[<val>]");
     ADD_CMD("trklog-ttl", &_param_trklogttl,   "Max time to keep tracklog entries (hours)", "[<val>]");
+    ADD_CMD("trklog-flush",&_param_trklogflush,"Number of tracklog entries to keep in RAM before writing", "[<val>]");
     ADD_CMD("trklog-key", &_param_serverkey,   "KEY for authenticating tracklog-messages to Polaric Server", "[<key>]");
     ADD_CMD("trklog-url", &_param_trklogurl,   "URL for posting tracklog updates to Polaric Server", "[<url>]");
     ADD_CMD("crypto",     &_param_crypto_on,   "Encrypt APRS reports", "[on|off]");
@@ -417,8 +588,11 @@ void register_aprs()
     ADD_CMD("igate-user", &_param_igate_user,  "Igate server user",  "[<callsign>]");
     ADD_CMD("igate-pass", &_param_igate_pass,  "Igate server passcode",  "[<code>]");
     ADD_CMD("igate-filter", &_param_igate_filt, "Igate server filter", "[<filter>]");
+    ADD_CMD("igate-alt",  &_param_igate_alt,   "Igate alternative servers", "[<host>[:<port>],...]");
+    ADD_CMD("igate-standby", &_param_igstandby_on, "Igate warm standby connection", "[on|off]");
     ADD_CMD("tracklog",   &_param_tracklog_on, "Track logging", "[on|off]"); 
     ADD_CMD("trklog-post",&_param_trkpost_on,  "Track log automatic post to server", "[on|off]");
+    ADD_CMD("trklog-bin", &_param_trkbin_on,   "Post track log in compact binary format", "[on|off]");
     ADD_CMD("radio",      &_param_radio_on,    "Radio module power", "[on|off]");
     ADD_CMD("tracker",    &_param_tracker_on,  "APRS tracker setting", "[on|off]");
     ADD_CMD("reportbeep", &_param_rbeep_on,    "Beep when report is sent", "[on|off]");
@@ -431,18 +605,30 @@ void register_aprs()
     ADD_CMD("teston",     &do_teston,          "HDLC encoder test", "<byte>");    
     ADD_CMD("txdelay",    &_param_txdelay,     "APRS TXDELAY setting", "[<val>]");
     ADD_CMD("txtail",     &_param_txtail,      "APRS TXTAIL setting", "[<val>]");
+    ADD_CMD("txbudget",   &_param_txbudget,    "Max airtime per transmission (ms, 0=no limit)", "[<val>]");
     ADD_CMD("squelch",    &_param_squelch,     "Squelch setting (1-8)",              "[<val>]");
     ADD_CMD("softsq",     &_param_softsq,      "Soft Squelch setting",               "[<val>]");
     ADD_CMD("volume",     &_param_volume,      "RX audio level setting (1-8)",       "[<val>]");
     ADD_CMD("txlow",      &_param_txlow_on,    "Tx power low", "[on|off]");
     ADD_CMD("txfreq",     &_param_txfreq,      "TX frequency (100 Hz units)",        "[<val>]");
     ADD_CMD("rxfreq",     &_param_rxfreq,      "RX frequency (100 Hz units)",        "[<val>]");
+    ADD_CMD("afsk-par",   &_param_afskpar_on,  "Run AFSK demodulators in parallel",  "[on|off]");
+    ADD_CMD("afsk-stream", &_param_afskstream_on, "Decode AFSK while receiving",     "[on|off]");
+    ADD_CMD("afsk-buf",   &_param_afskbuf,     "AFSK sample buffer (ksamples, restart)", "[<val>]");
+    ADD_CMD("afsk-stat",  &do_afskstat,        "AFSK decoder statistics",            "");
+    ADD_CMD("afsk-fir",   &do_afskfir,         "Benchmark AFSK FIR filters",         "");
 #else
     ADD_CMD("lora-sf",     &_param_lora_sf,     "LoRa spreading factor (5-12)",            "[<val>]");
     ADD_CMD("lora-cr",     &_param_lora_cr,     "LoRa coding rate (5-8)",                  "[<val>]");
     ADD_CMD("lora-alt-sf", &_param_lora_alt_sf, "LoRa alt. spreading factor (5-12)",       "[<val>]");
     ADD_CMD("lora-alt-cr", &_param_lora_alt_cr, "LoRa alt. coding rate (5-8)",             "[<val>]");
     ADD_CMD("lora-alt",    &_param_lora_alt_on, "Use alternative setting for digipeating", "[on|off]");
+    ADD_CMD("lora-spi",    &_param_lora_spi,    "LoRa SPI clock (MHz, restart)",           "[<val>]");
+    ADD_CMD("lora-busyirq",&_param_lora_busyirq,"LoRa wait for BUSY by interrupt (restart)", "[on|off]");
+    ADD_CMD("lora-spistat",&do_spistat,         "LoRa SPI bus statistics",                 "");
+    ADD_CMD("lora-duty",   &_param_lora_duty,   "LoRa max duty cycle (%, 0=no limit)",     "[<val>]");
+    ADD_CMD("lora-txage",  &_param_lora_txage,  "LoRa max time in TX queue (s, 0=no limit)", "[<val>]");
+    ADD_CMD("lora-txstat", &do_txstat,          "LoRa TX scheduler statistics",            "");
     ADD_CMD("txpower",     &_param_txpower,     "Tx power (1-6)",                          "[<val>]");
     ADD_CMD("freq",        &_param_freq,        "TX/RX frequency (Hz)",                    "[<val>]");
     ADD_CMD("freq-offset", &_param_foffset,     "Frequency offset (error correction)",     "[<val>]");
@@ -28,7 +28,6 @@
  * Macros for configuration (defined in defines.h)
  *    HDLC_DECODER_QUEUE_SIZE - size (in packets) of receiving queue. Normally 7.
  *    STACK_DIGIPEATER        - size of stack for digipeater task.
- *    STACK_HLIST             - size of stack for tick_thread (for heard list).
  *   
  */
 
@@ -43,7 +42,9 @@
 #include "aprs.h"
 #include "heardlist.h"
 #include "digipeater.h"
+#include "latency.h"
 #include <string.h>
+#include <stdatomic.h>
 #include "esp_log.h"
    
 static bool digi_on = false;
@@ -53,6 +54,10 @@ static TaskHandle_t digithr;
 static fbq_t* outframes; 
 static uint8_t subscription;
 
+/* MYCALL, parsed. Refreshed when setting is changed */
+static addr_t mycall;
+static atomic_bool mycall_stale = true;
+
 
 static void check_frame(FBUF *f);
 static void send_packet(FBUF *hdr);
@@ -83,7 +88,8 @@ static void digipeater(void* arg)
         }
     
         /* Do something about it */       
-        ESP_LOGI(TAG, "Got frame"); 
+        lat_mark(&frame, LAT_DIGI);
+        ESP_LOGI(TAG, "Got frame");  
         check_frame(&frame);
     
         /* And dispose it */
@@ -101,11 +107,20 @@ static void digipeater(void* arg)
  *  digipeater_init
  **********************/
 
+static void config_changed(cfg_key_t key)
+{
+    if (key == CFG_MYCALL)
+        atomic_store(&mycall_stale, true);
+}
+
+
+
 void digipeater_init(fbq_t* out)
 {
     fbq_init(&rxqueue, HDLC_DECODER_QUEUE_SIZE);
     outframes = out;
-    if (GET_BOOL_PARAM("DIGIPEATER.on", DFL_DIGIPEATER_ON))
+    config_subscribe(config_changed);
+    if (CONFIG_BOOL(CFG_DIGIPEATER_ON))
         digipeater_activate(true);
 }
 
@@ -127,11 +142,10 @@ void digipeater_activate(bool m)
         ESP_LOGI(TAG, "starting.."); 
         
         /* Subscribe to RX packets and start treads */
-        subscription = APRS_SUBSCRIBE_RX(mq);
+        subscription = APRS_SUBSCRIBE_RX(mq, FBQ_DROP_OLDEST, "digi");
         
         xTaskCreatePinnedToCore(&digipeater, "Digipeater", 
             STACK_DIGI, NULL, NORMALPRIO, &digithr, CORE_DIGI);
-        hlist_start();
       
         /* Turn on radio and enable RX */
 #if !defined(ARCTIC4_UHF)
@@ -165,7 +179,7 @@ static void check_frame(FBUF *f)
 {
    FBUF newHdr;
    char mycall_s[10];
-   addr_t mycall, from, to; 
+   addr_t from, to;  
    addr_t digis[7], digis2[7];
    bool widedigi = false;
    int8_t wide2_ssid = -1;   /* SSID of matched WIDE2-N alias, -1 if not found */
@@ -179,8 +193,10 @@ static void check_frame(FBUF *f)
        ESP_LOGI(TAG, "Frame is duplicate. Ignore."); 
        return;
    }
-   get_str_param("MYCALL", mycall_s, 10, DFL_MYCALL);
-   str2addr(&mycall, mycall_s, false);
+   if (atomic_exchange(&mycall_stale, false)) {
+       config_str(CFG_MYCALL, mycall_s, 10);
+       str2addr(&mycall, mycall_s, false);
+   }
 
    /* Copy items in digi-path that has digipeated flag turned on, 
     * i.e. the digis that the packet has been through already 
@@ -193,19 +209,19 @@ static void check_frame(FBUF *f)
        return;
 
    /* Check if the WIDE1-1 alias is next in the list */
-   if (GET_BOOL_PARAM("DIGI.WIDE1.on", DFL_DIGI_WIDE1_ON) 
+   if (CONFIG_BOOL(CFG_DIGI_WIDE1_ON) 
            && strncasecmp("WIDE1", digis[i].callsign, 5) == 0 && digis[i].ssid == 1)
        widedigi = true; 
 
    /* Check if a WIDE2-N alias (N >= 1) is next in the list */
-   if (GET_BOOL_PARAM("DIGI.WIDE2.on", DFL_DIGI_WIDE2_ON)
+   if (CONFIG_BOOL(CFG_DIGI_WIDE2_ON)
            && strncasecmp("WIDE2", digis[i].callsign, 5) == 0 && digis[i].ssid >= 1)
        wide2_ssid = digis[i].ssid;
   
    /* Look for SAR alias in the rest of the path 
     * NOTE: Don't use SAR-preemption if packet has been digipeated by others first 
     */    
-   if (GET_BOOL_PARAM("DIGI.SAR.on", DFL_DIGI_SAR_ON) && i<=0)
+   if (CONFIG_BOOL(CFG_DIGI_SAR_ON) && i<=0)
      for (j=i; j<ndigis; j++)
        if (strncasecmp("SAR", digis[j].callsign, 3) == 0) 
           { sar_pos = j; break; } 
@@ -249,6 +265,7 @@ static void check_frame(FBUF *f)
     
    /* Write a new header -> newHdr */
    fbuf_new(&newHdr, SRC_DIGIPEATER);
+   newHdr.trace = f->trace;
    ax25_encode_header(&newHdr, &from, &to, digis2, j, ctrl, pid);
 
    /* Replace header in original packet with new header. 
@@ -270,7 +287,7 @@ static void check_frame(FBUF *f)
 
 #if defined(ARCTIC4_UHF)    
 static void addMeta(FBUF *f) {
-    if (GET_BOOL_PARAM("DIGI.META.on", DFL_DIGI_META_ON)) {
+    if (CONFIG_BOOL(CFG_DIGI_META_ON)) {
         lorameta_t *meta = (lorameta_t*) f->meta;
         char buf[35];
         sprintf(buf, " [rssi=%d dBm, snr=%d dB]", meta->rssi, meta->snr);
@@ -286,10 +303,12 @@ static void addMeta(FBUF *f) {
 
 static void send_packet(FBUF *hdr) {
     ESP_LOGI(TAG, "Resend (digipeat) frame"); 
-    beeps(". ");
-    sleepMs(60);
+    lat_mark(hdr, LAT_TXQ);
     fbq_put(outframes, *hdr);  
-    sleepMs(200);
+    
+    /* Beep, unless more frames are waiting */
+    if (fbq_eof(&rxqueue))
+        beeps(". ");
 }
 
 
@@ -16,83 +16,114 @@
  */
 
 
-#include "crc16.h"
 #include "defines.h"
 #include <stdlib.h>
-#include "hdlc.h"
+#include <string.h>
 #include "system.h"
-#include "radio.h"
-#include "config.h"
 #include "ax25.h"
 #include "heardlist.h"
- 
+#include "esp_timer.h"
+ 
+ /*
+  * The heard list is a small open-addressing hash table keyed by a
+  * 64 bit hash of source, destination and message. A slot is free if
+  * it is unused or if its entry is older than HEARDLIST_MAX_AGE. 
+  * Expired entries are not removed by a timer, they are just reused 
+  * when inserting. A lookup probes at most HEARDLIST_PROBES slots, 
+  * so both lookup and insert are O(1). 
+  */
  typedef struct _hitem {
-      uint16_t val;
-      uint16_t ts; 
+      uint64_t val;
+      uint32_t ts; 
  } HItem; 
  
- static HItem hlist[HEARDLIST_SIZE];
- static uint8_t hlist_next = 0;
- static uint8_t hlist_length = 0;
+ static HItem hlist[HEARDLIST_SLOTS];
+ static mutex_t hlist_mutex = NULL;
  
- /* Time. Number of ticks since this module was started */
- static uint16_t _time = 0; 
- static bool _hlist_running = false;
+ static uint64_t checksum(addr_t* from, addr_t* to, FBUF* f, uint8_t ndigis);
  
- static void hlist_tick(void);
- static uint16_t checksum(addr_t* from, addr_t* to, FBUF* f, uint8_t ndigis);
  
+ #define FNV_OFFSET 0xcbf29ce484222325ULL
+ #define FNV_PRIME  0x00000100000001b3ULL
  
  
- /* FIXME: Consider using virtual timer */
- static void hlist_thread(void* arg)
+/***************************************************************** 
+ * Time in seconds. Entries older than HEARDLIST_MAX_AGE are 
+ * considered to be expired. 
+ *****************************************************************/ 
+
+ static inline uint32_t hlist_time()
  {
-   while (_hlist_running) {
-     sleepMs(5000);
-     hlist_tick();
-   }
+    return (uint32_t) (esp_timer_get_time() / 1000000);
  }
  
  
-/***************************************************************** 
- * Must be called periodically with a fixed and known interval
- * It goes through list and removes entries that are older than
- * HEARDLIST_MAX_AGE (in ticks)
- *****************************************************************/ 
-
- static void hlist_tick()
+ static inline bool expired(HItem* x, uint32_t now)
  {
-    _time++; 
-    int16_t i = hlist_next - hlist_length; 
-    if (i<0) 
-        i = HEARDLIST_SIZE+i; 
-    
-    while (i != hlist_next) {
-       if (hlist[i].ts < _time - HEARDLIST_MAX_AGE)
-          hlist_length--;
-       else
-          break;
-       i = (i+1) % HEARDLIST_SIZE;
-    }
+    return x->val == 0 || now - x->ts > HEARDLIST_MAX_AGE;
  }
  
  
+ 
  /**************************************************************
-  * return true if x exists in list
+  * Find slot with x. Return NULL if not found.
   **************************************************************/
  
- bool hlist_exists(uint16_t x)
+ static HItem* hlist_find(uint64_t x, uint32_t now)
  {
-   int16_t i = hlist_next - hlist_length; 
-   if (i<0) 
-     i = HEARDLIST_SIZE+i; 
-   
-   while (i != hlist_next) {
-     if (hlist[i].val == x)
-        return true; 
-     i = (i+1) % HEARDLIST_SIZE;
+   uint16_t i = x & (HEARDLIST_SLOTS-1);
+   for (uint8_t n=0; n<HEARDLIST_PROBES; n++) {
+     HItem* it = &hlist[i];
+     if (it->val == x)
+        return (expired(it, now) ? NULL : it);
+     i = (i+1) & (HEARDLIST_SLOTS-1);
    } 
-   return false; 
+   return NULL; 
+ }
+ 
+ 
+ 
+ /**************************************************************
+  * Insert x (or refresh it if it is already there). Use the
+  * first expired slot in the probe sequence. If there is none,
+  * evict the oldest entry. 
+  **************************************************************/
+ 
+ static void hlist_insert(uint64_t x, uint32_t now)
+ {
+   uint16_t i = x & (HEARDLIST_SLOTS-1);
+   HItem* free = NULL;
+   HItem* oldest = &hlist[i];
+   for (uint8_t n=0; n<HEARDLIST_PROBES; n++) {
+     HItem* it = &hlist[i];
+     if (it->val == x) {
+        it->ts = now; 
+        return;
+     }
+     if (free == NULL && expired(it, now))
+        free = it;
+     if (now - it->ts > now - oldest->ts)
+        oldest = it;
+     i = (i+1) & (HEARDLIST_SLOTS-1);
+   }
+   if (free == NULL)
+     free = oldest;
+   free->val = x;
+   free->ts = now;
+ }
+ 
+ 
+ 
+ /**************************************************************
+  * return true if x exists in list
+  **************************************************************/
+ 
+ bool hlist_exists(uint64_t x)
+ {
+   mutex_lock(hlist_mutex);
+   bool found = (hlist_find(x, hlist_time()) != NULL);
+   mutex_unlock(hlist_mutex);
+   return found; 
  }
  
  
@@ -101,13 +132,11 @@
   * Add an entry to the list
   *************************************************/
  
- void hlist_add(uint16_t x)
+ void hlist_add(uint64_t x)
  {
-   hlist[hlist_next].val = x; 
-   hlist[hlist_next].ts = _time;
-   hlist_next = (hlist_next + 1) % HEARDLIST_SIZE; 
-   if (hlist_length < HEARDLIST_SIZE)
-     hlist_length++;
+   mutex_lock(hlist_mutex);
+   hlist_insert(x, hlist_time());
+   mutex_unlock(hlist_mutex);
  }
 
  
@@ -118,7 +147,7 @@
  
  void hlist_addPacket(addr_t* from, addr_t* to, FBUF* f, uint8_t ndigis) 
  {
-   uint16_t cs = checksum(from, to, f, ndigis);
+   uint64_t cs = checksum(from, to, f, ndigis);
    hlist_add(cs);
  }
  
@@ -130,49 +159,68 @@
  
  bool hlist_duplicate(addr_t* from, addr_t* to, FBUF* f, uint8_t ndigis)
  { 
-   uint16_t cs = checksum(from, to, f, ndigis);
-   bool hrd = hlist_exists(cs);
-   hlist_add(cs); 
+   uint64_t cs = checksum(from, to, f, ndigis);
+   uint32_t now = hlist_time();
+   mutex_lock(hlist_mutex);
+   bool hrd = (hlist_find(cs, now) != NULL);
+   hlist_insert(cs, now); 
+   mutex_unlock(hlist_mutex);
    return hrd;
  }
  
  
  
  /*********************************************************************************
-  * Compute a checksum (hash) from source-callsign + destination-callsign 
-  * + message. This is used to check for duplicate packets. 
+  * Compute a 64 bit hash (FNV-1a) from source-callsign + destination-callsign 
+  * + message. This is used to check for duplicate packets. 0 is used to mark 
+  * unused slots so it is never returned. 
   *********************************************************************************/
  
- static uint16_t checksum(addr_t* from, addr_t* to, FBUF* f, uint8_t ndigis)
+ static inline uint64_t fnv_block(uint64_t h, const uint8_t* data, uint16_t len)
  {
-   uint16_t crc = 0xFFFF;
-   uint8_t i = 0;
-   while (from->callsign[i] != 0)
-     crc = _crc_ccitt_update(crc, from->callsign[i++]); 
-   crc = _crc_ccitt_update(crc, from->ssid);
-   i=0;
-   while (to->callsign[i] != 0)
-     crc = _crc_ccitt_update(crc, to->callsign[i++]);
-   crc = _crc_ccitt_update(crc, to->ssid);
+   while (len--) {
+     h ^= *data++;
+     h *= FNV_PRIME;
+   }
+   return h;
+ }
+ 
+ 
+ static uint64_t checksum(addr_t* from, addr_t* to, FBUF* f, uint8_t ndigis)
+ {
+   uint64_t h = FNV_OFFSET;
+   h = fnv_block(h, (uint8_t*) from->callsign, strlen(from->callsign)); 
+   h = fnv_block(h, &from->ssid, 1);
+   h = fnv_block(h, (uint8_t*) to->callsign, strlen(to->callsign));
+   h = fnv_block(h, &to->ssid, 1);
    
-   /* Skip digipeater-list */
-   fbuf_rseek(f, AX25_HDR_LEN(ndigis)); 
-   /* Rest of packet */
-   for (i=AX25_HDR_LEN(ndigis); i<fbuf_length(f); i++)
-     crc = _crc_ccitt_update(crc, fbuf_getChar(f)); 
-   return crc;
+   /* Skip digipeater-list. Rest of packet */
+   fbseg_t seg[FBUF_MAXSEGS];
+   uint16_t pos = AX25_HDR_LEN(ndigis);
+   uint8_t i, n; 
+   if (fbuf_length(f) > pos)
+     do {
+       n = fbuf_segments(f, pos, seg, FBUF_MAXSEGS);
+       for (i=0; i<n; i++) {
+         h = fnv_block(h, (const uint8_t*) seg[i].data, seg[i].length);
+         pos += seg[i].length;
+       }
+     } while (n == FBUF_MAXSEGS);
+   return (h == 0 ? 1 : h);
  }
  
 
  
  
-void hlist_start() 
+/*************************************************
+ * Called once at startup, before the igate and
+ * digipeater tasks are created.
+ *************************************************/
+ 
+void hlist_init() 
  {
-    if (_hlist_running) 
-       return; 
-    _hlist_running = true;    
-    xTaskCreatePinnedToCore(&hlist_thread, "Heardlist tick", 
-        STACK_HLIST, NULL, NORMALPRIO, NULL, CORE_HLIST);
+    memset(hlist, 0, sizeof(hlist));
+    hlist_mutex = mutex_create();
  }
  
  
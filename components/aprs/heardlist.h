@@ -1,13 +1,14 @@
  #if !defined __HEARDLIST_H__
  #define __HEARDLIST_H__
  
- #define HEARDLIST_SIZE 32
- #define HEARDLIST_MAX_AGE 6
+ #define HEARDLIST_SLOTS 128   /* Must be a power of two */
+ #define HEARDLIST_PROBES 16
+ #define HEARDLIST_MAX_AGE 30  /* Seconds */
  
- bool hlist_exists(uint16_t x);
- void hlist_add(uint16_t x);
+ bool hlist_exists(uint64_t x);
+ void hlist_add(uint64_t x);
  void hlist_addPacket(addr_t* from, addr_t* to, FBUF* f, uint8_t ndigis);
  bool hlist_duplicate(addr_t* from, addr_t* to, FBUF* f, uint8_t ndigis);
- void hlist_start(void); 
+ void hlist_init(void); 
  
  #endif /* __HEARDLIST_H__ */
\ No newline at end of file
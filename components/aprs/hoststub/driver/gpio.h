@@ -0,0 +1,20 @@
+/* Host stub, see freertos/FreeRTOS.h */
+#include "freertos/FreeRTOS.h"
+
+typedef int gpio_num_t;
+typedef void (*gpio_isr_t)(void*);
+
+#define GPIO_MODE_INPUT      1
+#define GPIO_MODE_OUTPUT     2
+#define GPIO_PULLDOWN_ONLY   1
+#define GPIO_INTR_POSEDGE    1
+#define GPIO_INTR_NEGEDGE    2
+
+esp_err_t gpio_reset_pin(gpio_num_t pin);
+esp_err_t gpio_set_direction(gpio_num_t pin, int mode);
+esp_err_t gpio_set_pull_mode(gpio_num_t pin, int pull);
+esp_err_t gpio_set_level(gpio_num_t pin, uint32_t level);
+int       gpio_get_level(gpio_num_t pin);
+esp_err_t gpio_set_intr_type(gpio_num_t pin, int type);
+esp_err_t gpio_isr_handler_add(gpio_num_t pin, gpio_isr_t handler, void* arg);
+esp_err_t gpio_intr_enable(gpio_num_t pin);
@@ -0,0 +1,2 @@
+/* Host stub, see freertos/FreeRTOS.h */
+#include "freertos/FreeRTOS.h"
@@ -0,0 +1,7 @@
+/* Host stub, see freertos/FreeRTOS.h */
+#include "freertos/FreeRTOS.h"
+
+#define MALLOC_CAP_DEFAULT  0x1000
+#define MALLOC_CAP_SPIRAM   0x0400
+
+#define heap_caps_malloc_prefer(size, num, ...) malloc(size)
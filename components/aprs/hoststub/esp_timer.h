@@ -0,0 +1,4 @@
+/* Host stub, see freertos/FreeRTOS.h */
+#include "freertos/FreeRTOS.h"
+
+int64_t esp_timer_get_time(void);
@@ -0,0 +1,43 @@
+/*
+ * Minimal stand-ins for the ESP-IDF/FreeRTOS declarations used by
+ * system.h, so that buffer and AX.25 code can be built on a host
+ * computer for testing. Only types are provided; the test programs
+ * must not call the RTOS functions, except the ones declared in
+ * freertos/task.h, freertos/semphr.h, driver/gpio.h and esp_timer.h,
+ * which a test program may implement.
+ */
+
+#if !defined __HOSTSTUB_H__
+#define __HOSTSTUB_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef int   esp_err_t;
+typedef long  BaseType_t;
+typedef void* SemaphoreHandle_t;
+typedef void* EventGroupHandle_t;
+typedef void* TaskHandle_t;
+typedef uint32_t TickType_t;
+typedef void* gptimer_handle_t;
+typedef bool (*gptimer_alarm_cb_t)(void*, const void*, void*);
+typedef int   uart_port_t;
+typedef int   esp_log_level_t;
+
+#define pdFALSE        0
+#define pdTRUE         1
+#define portMAX_DELAY  0xffffffff
+#define portTICK_PERIOD_MS  1
+#define pdMS_TO_TICKS(ms)   ((TickType_t) (ms))
+#define IRAM_ATTR
+
+void esp_rom_delay_us(uint32_t us);
+
+#define ESP_LOGE(tag, fmt, ...) fprintf(stderr, "E %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) fprintf(stderr, "W %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...)
+#define ESP_LOGD(tag, fmt, ...)
+
+#endif
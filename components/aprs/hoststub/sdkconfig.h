@@ -0,0 +1 @@
+/* Host stub: no menuconfig settings */
@@ -32,6 +32,14 @@
  *   IGATE_PORT
  *   IGATE_PASSCODE
  *   IGATE_FILTER 
+ *   IGATE_ALT        - alternative servers: host[:port],...
+ *   IGATE_STANDBY_ON - keep a warm standby connection 
+ * 
+ * Servers are tried in priority order (IGATE_HOST first). Connection
+ * attempts are started a little apart and raced in parallel, the first 
+ * to answer wins. Reconnect with exponential backoff and jitter. With 
+ * a standby connection (to another server), we can fail over to it 
+ * at once. 
  * 
  * Add to config (later?):
  *   IGATE_DIGIPATH
@@ -42,7 +50,11 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stdatomic.h>
+#include "esp_random.h"
+#include "esp_timer.h"
 #include "system.h"
 #include "defines.h"
 #include "config.h"
@@ -62,17 +74,35 @@
 #define INET_NAME_LENGTH 64
 #define CRED_LENGTH 32
 #define FRAME_LEN 256
+#define ALT_LENGTH 128
+
+#define IGATE_STAGGER       250     /* ms between parallel connection attempts */
+#define IGATE_CONN_TIMEOUT  10000   /* ms to wait for a connection */
+#define IGATE_BACKOFF_MIN   2000    /* ms */
+#define IGATE_BACKOFF_MAX   120000  /* ms */
+#define IGATE_POLL          2000    /* ms */
 
 static void rf2inet(FBUF *);
 static void inet2rf(char *);
 
 static bool _igate_on = false;
 static bool _igate_run = false; 
+
+/* MYCALL, parsed. Refreshed when setting is changed */
+static addr_t mycall;
+static atomic_bool mycall_stale = true;
 static uint32_t _icount = 0;
 static uint32_t _rcvd = 0;
 static uint32_t _tracker_icount = 0;
 static uint8_t  _subscription;
 
+static inet_server_t servers[INET_RACE_MAX]; 
+static int nservers = 0; 
+static int _sock = -1;        /* Active connection */
+static int _standby = -1;     /* Standby connection */
+static mutex_t sock_lock;     /* Protects _sock while writing or switching */ 
+static igate_stats_t stats;
+
 static FBQ rxqueue;           /* Frames from radio or tracker */
 extern fbq_t* outframes;      /* Frames to be transmitted on radio */
 
@@ -93,11 +123,30 @@ uint32_t igate_rxcount()
 uint32_t igate_tr_count()
   { return _tracker_icount; }
   
+void igate_getStats(igate_stats_t* st)
+  { *st = stats; }
+  
+  
+/* Name of server with the given index, as returned in stats */
+char* igate_server(int i, char* buf) {
+    if (i < 0 || i >= nservers)
+        strcpy(buf, "-");
+    else
+        sprintf(buf, "%s:%u", servers[i].host, servers[i].port);
+    return buf;
+}
+
+  
+static uint32_t now_ms() 
+  { return (uint32_t) (esp_timer_get_time() / 1000); }
+  
   
 /********************************************
  * Radio thread
  * Listen for incoming packets from radio 
- * (or outgoing packets from tracker)
+ * (or outgoing packets from tracker). 
+ * Runs as long as the igate is on, also when 
+ * disconnected, to count lost frames.
  ********************************************/
 
 static void igate_radio(void* arg)
@@ -116,83 +165,272 @@ static void igate_radio(void* arg)
 }
 
 
+
+/*******************************************
+ * Get the list of servers in priority order.
+ * IGATE.HOST:IGATE.PORT first, then the 
+ * alternatives in IGATE.ALT (host[:port],..)
+ *******************************************/
+
+static void get_servers() 
+{
+    char alt[ALT_LENGTH];
+    char *tok, *save;
+    uint16_t port = get_u16_param("IGATE.PORT", DFL_IGATE_PORT);
+    
+    get_str_param("IGATE.HOST", servers[0].host, INET_NAME_LENGTH, DFL_IGATE_HOST); 
+    servers[0].port = port;
+    nservers = 1; 
+    
+    get_str_param("IGATE.ALT", alt, ALT_LENGTH, DFL_IGATE_ALT);
+    for (tok = strtok_r(alt, ", ", &save); tok != NULL && nservers < INET_RACE_MAX; 
+            tok = strtok_r(NULL, ", ", &save)) 
+    {
+        inet_server_t *srv = &servers[nservers++];
+        char* p = strchr(tok, ':');
+        srv->port = port;
+        if (p != NULL) {
+            *p = '\0';
+            srv->port = atoi(p+1);
+        }
+        strncpy(srv->host, tok, INET_NAME_LENGTH-1);
+        srv->host[INET_NAME_LENGTH-1] = '\0';
+    }
+}
+
+
+
+/*******************************************
+ * Connect to one of the servers, excluding 
+ * the one with index 'except' (-1 for none), 
+ * and log in. Return socket or -1. 
+ * Server index is returned in idx.
+ *******************************************/
+
+static int connect_server(int except, bool filter, int* idx) 
+{
+    inet_server_t srv[INET_RACE_MAX];
+    int map[INET_RACE_MAX];
+    int i, n = 0;
+    char buf[FRAME_LEN];
+    
+    for (i=0; i<nservers; i++)
+        if (i != except) {
+            map[n] = i;
+            srv[n++] = servers[i];
+        }
+    if (n == 0)
+        return -1;
+    
+    int s = inet_race(srv, n, IGATE_STAGGER, IGATE_CONN_TIMEOUT, idx);
+    if (s < 0)
+        return -1;
+    *idx = map[*idx];
+    
+    /* Connected ok. Await welcome text and log in */
+    if (inet_sread(s, buf, FRAME_LEN) <= 0 || !igate_login(s, filter)) {
+        ESP_LOGW(TAG, "Login to %s failed", servers[*idx].host);
+        inet_sclose(s);
+        return -1;
+    }
+    return s;
+}
+
+
+
+/*******************************************
+ * Wait before trying to connect again. 
+ * Exponential backoff with jitter. Return 
+ * the next backoff time. 
+ *******************************************/
+
+static uint32_t backoff(uint32_t ms) 
+{
+    uint32_t t = ms/2 + esp_random() % (ms/2);
+    ESP_LOGI(TAG, "Reconnect in %lu ms", t);
+    for (uint32_t i=0; i<t && _igate_on; i+=500)
+        sleepMs(500);
+    return min(ms*2, IGATE_BACKOFF_MAX);
+}
+
+
+
+/*******************************************
+ * Switch the active connection.
+ *******************************************/
+
+static void set_active(int s, int idx) 
+{
+    mutex_lock(sock_lock);
+    inet_sclose(_sock);
+    _sock = s;
+    stats.server = (s < 0 ? -1 : idx);
+    mutex_unlock(sock_lock);
+}
+
+
+
+/*******************************************
+ * Promote the standby connection to active.
+ * The filter was not set on it at login, so 
+ * set it now. 
+ *******************************************/
+
+static bool promote() 
+{
+    char filter[CRED_LENGTH];
+    char buf[CRED_LENGTH+12];
+    if (_standby < 0)
+        return false;
+    
+    get_str_param("IGATE.FILTER", filter, CRED_LENGTH, DFL_IGATE_FILTER);
+    if (strlen(filter) > 1) {
+        int n = sprintf(buf, "#filter %s\r\n", filter);
+        if (!inet_swrite(_standby, buf, n)) {
+            inet_sclose(_standby);
+            _standby = -1; stats.standby = -1;
+            return false; 
+        }
+    }
+    ESP_LOGI(TAG, "Failover to standby server %s", servers[stats.standby].host);
+    set_active(_standby, stats.standby);
+    _standby = -1; stats.standby = -1;
+    stats.failovers++;
+    return true; 
+}
+
+
+
 /*******************************************
  * Igate main thread. 
- *  connect to aprs-is server
+ *  connect to aprs-is server(s)
  *  listen for incoming data from server.
  *******************************************/
 
 static void igate_main(void* arg)
 {
-    char host[INET_NAME_LENGTH]; 
-    uint16_t port;
     char frame[FRAME_LEN];
+    uint32_t wait = IGATE_BACKOFF_MIN, sbwait = IGATE_BACKOFF_MIN;
+    uint32_t lost_at = 0, sbretry = 0;
+    uint32_t heard[2];        /* Time of last data on active and standby connection */
+    bool outage = false;
+    int idx;
+    
     sleepMs(1000);
     ESP_LOGI(TAG, "Main thread started..");
+    wifi_enable(true);
+    
+    /* Start child thread to listen for frames from radio or tracker */
+    _igate_run = true;
+    xTaskCreatePinnedToCore(&igate_radio, "Igate Radio", 
+        STACK_IGATE_RADIO, NULL, NORMALPRIO, NULL, CORE_IGATE_RADIO);
+    _subscription = APRS_SUBSCRIBE_RX(&rxqueue, FBQ_DROP_OLDEST, "igate");
     
     while (_igate_on) {
         /* connect-to-aprs-is */ 
-        get_str_param("IGATE.HOST", host, INET_NAME_LENGTH, DFL_IGATE_HOST); 
-        port = get_u16_param("IGATE.PORT", DFL_IGATE_PORT);
-
-        int res = -1, tries = 0;
-        wifi_enable(true);
-        sleepMs(2000);
+        if (!promote()) {
+            if (!wifi_isConnected()) {
+                sleepMs(IGATE_POLL);
+                continue;
+            }
+            get_servers();
+            int s = connect_server(-1, true, &idx);
+            if (s < 0) {
+                wait = backoff(wait);
+                continue;
+            }
+            set_active(s, idx);
+        }
         
-        while (!wifi_isConnected() 
-                || ((res = inet_open(host, port)) != 0 && tries++ < 3))
-            sleepMs(10000);
-  
-        if (_igate_on && res == 0) {
-            /* Connected ok. Await welcome text */
-            inet_read(frame, FRAME_LEN);
-            ESP_LOGI(TAG, "Connected to %s:%d", host, port);
-            beeps("--.  "); blipUp();
-            _igate_run = true;
-    
-            // Login using username/passcode and (option) sende filter-string
-            char uname[CRED_LENGTH];
-            char filter[CRED_LENGTH];
-            uint16_t pass;
-            get_str_param("IGATE.USER", uname, CRED_LENGTH, DFL_IGATE_USER);
-            pass = get_u16_param("IGATE.PASS", 0);
-            get_str_param("IGATE.FILTER", filter, CRED_LENGTH, DFL_IGATE_FILTER);      
-            igate_login(uname, pass, filter);
-
-            /* Start child thread to listen for frames from radio or tracker */
-            xTaskCreatePinnedToCore(&igate_radio, "Igate Radio", 
-                STACK_IGATE_RADIO, NULL, NORMALPRIO, NULL, CORE_IGATE_RADIO);
-    
-            _subscription = APRS_SUBSCRIBE_RX(&rxqueue);
-           
-            /* Listen for data from APRS/IS server */
-            while (_igate_on) {
-                int len = inet_read(frame, FRAME_LEN); 
+        stats.connects++;
+        if (outage) {
+            stats.last_reconnect = now_ms() - lost_at;
+            stats.max_reconnect = max(stats.max_reconnect, stats.last_reconnect);
+            outage = false;
+        }
+        ESP_LOGI(TAG, "Connected to %s:%d", servers[stats.server].host, servers[stats.server].port);
+        beeps("--.  "); blipUp();
+        wait = IGATE_BACKOFF_MIN;
+        heard[0] = now_ms();
+        
+        /* Listen for data from APRS/IS server(s). Data on the 
+         * standby connection is just read and thrown away. APRS-IS 
+         * servers send a keepalive comment about every 20 seconds, 
+         * so a connection without data for INET_IDLE_TIMEOUT is dead. 
+         */
+        while (_igate_on) {
+            if (_standby < 0 && nservers > 1 && now_ms() >= sbretry 
+                    && GET_BOOL_PARAM("IGATE.STANDBY.on", DFL_IGATE_STANDBY_ON)) {
+                if ((_standby = connect_server(stats.server, false, &idx)) >= 0) {
+                    ESP_LOGI(TAG, "Standby connection to %s", servers[idx].host);
+                    stats.standby = idx;
+                    sbwait = IGATE_BACKOFF_MIN;
+                    heard[1] = now_ms();
+                }
+                else {
+                    sbretry = now_ms() + sbwait;
+                    sbwait = min(sbwait*2, IGATE_BACKOFF_MAX);
+                }
+            }
+            int socks[2] = {_sock, _standby};
+            int i = inet_wait(socks, 2, IGATE_POLL);
+            uint32_t t = now_ms();
+            if (_standby >= 0 && t - heard[1] > INET_IDLE_TIMEOUT*1000) {
+                ESP_LOGW(TAG, "No data on standby connection");
+                inet_sclose(_standby);
+                _standby = -1; stats.standby = -1;
+                sbretry = t + sbwait;
+                if (i == 1)
+                    continue;
+            }
+            if (t - heard[0] > INET_IDLE_TIMEOUT*1000) {
+                ESP_LOGW(TAG, "No data from server");
+                break;
+            }
+            if (i < 0) 
+                continue;
+            
+            int len = inet_sread(socks[i], frame, FRAME_LEN); 
+            if (len > 0)
+                heard[i] = t;
+            if (i == 1) {
                 if (len <= 0) {
-                    ESP_LOGD(TAG, "Empty line from server");
-                    break;
+                    ESP_LOGW(TAG, "Standby connection lost");
+                    inet_sclose(_standby);
+                    _standby = -1; stats.standby = -1;
+                    sbretry = now_ms() + sbwait;
                 }
-                if (frame[0] != '#')
-                    inet2rf(frame);
-                else
-                    ESP_LOGD(TAG, "%s", frame);
+                continue;
+            }
+            if (len <= 0) {
+                ESP_LOGD(TAG, "Empty line from server");
+                break;
             }
+            if (frame[0] != '#')
+                inet2rf(frame);
+            else
+                ESP_LOGD(TAG, "%s", frame);
+        }
+        set_active(-1, -1);
     
-            /* Unsubscribe and terminate child thread */
-            _igate_run = false; 
-            fbq_signal(&rxqueue, SRC_IGATE);
-            sleepMs(50);
-            APRS_UNSUBSCRIBE_RX(_subscription);
-            
-            /* Connection failure. Wait for 2 minutes */
-            if (_igate_on) {
-                ESP_LOGW(TAG, "Connection failed");
-                beeps(" --. ..-.");
-                for (int i=0; i<60 && _igate_on; i++)
-                    sleepMs(2000);
-            }  
+        /* Connection failure */
+        if (_igate_on) {
+            ESP_LOGW(TAG, "Connection failed");
+            beeps(" --. ..-.");
+            stats.outages++;
+            lost_at = now_ms();
+            outage = true;
         }
     }
+    
+    /* Unsubscribe and terminate child thread */
+    _igate_run = false; 
+    fbq_signal(&rxqueue, SRC_IGATE);
+    sleepMs(50);
+    APRS_UNSUBSCRIBE_RX(_subscription);
+    inet_sclose(_standby);
+    _standby = -1; stats.standby = -1; 
+    
     beeps("--.  "); blipDown();
     vTaskDelete(NULL);
 }
@@ -202,9 +440,19 @@ static void igate_main(void* arg)
  *  igate init
  ************************/
 
+static void config_changed(cfg_key_t key)
+{
+    if (key == CFG_MYCALL)
+        atomic_store(&mycall_stale, true);
+}
+
+
 void igate_init() {
     fbq_init(&rxqueue, HDLC_DECODER_QUEUE_SIZE);
-    if (GET_BOOL_PARAM("IGATE.on", DFL_IGATE_ON))
+    sock_lock = mutex_create();
+    stats.server = stats.standby = -1;
+    config_subscribe(config_changed);
+    if (CONFIG_BOOL(CFG_IGATE_ON))
         igate_activate(true);
 }
 
@@ -228,7 +476,6 @@ void igate_activate(bool m)
         tracker_setGate(mq);
         xTaskCreatePinnedToCore(&igate_main, "Igate Main", 
             STACK_IGATE, NULL, NORMALPRIO, NULL, CORE_IGATE);
-        hlist_start();
     
         /* Turn on radio and decoder */
 #if !defined(ARCTIC4_UHF)
@@ -242,11 +489,12 @@ void igate_activate(bool m)
         afsk_rx_disable();
         radio_release();
 #endif
-        /* Close internet connection */
-        inet_close(); 
+        /* Main thread closes internet connections */
         sleepMs(100);
         tracker_setGate(NULL);       
         _icount = _rcvd = _tracker_icount = 0;
+        memset(&stats, 0, sizeof(stats));
+        stats.server = stats.standby = -1;
     }
 }
 
@@ -262,11 +510,13 @@ static void rf2inet(FBUF *frame)
     FBUF newHdr;
     char buf[FRAME_LEN+2];
     char mycall_s[10];
-    addr_t from, to, mycall; 
+    addr_t from, to; 
     addr_t digis[7];
     uint8_t ctrl, pid;
-    get_str_param("MYCALL", mycall_s, 10, DFL_MYCALL);
-    str2addr(&mycall, mycall_s, false);
+    if (atomic_exchange(&mycall_stale, false)) {
+        config_str(CFG_MYCALL, mycall_s, 10);
+        str2addr(&mycall, mycall_s, false);
+    }
   
     fbuf_reset(frame);
     uint8_t ndigis =  ax25_decode_header(frame, &from, &to, digis, &ctrl, &pid);
@@ -276,6 +526,12 @@ static void rf2inet(FBUF *frame)
     /* Dont igate it if it is igated earlier */
     if (hlist_duplicate(&from, &to, frame, ndigis))
         return;
+    
+    /* Lost if we are not connected */
+    if (_sock < 0) {
+        stats.lost++;
+        return;
+    }
       
     /* Write header in plain text -> newHdr */
     fbuf_new(&newHdr, SRC_IGATE);
@@ -310,8 +566,15 @@ static void rf2inet(FBUF *frame)
     int len = fbuf_read(&newHdr, FRAME_LEN, buf); 
     buf[len] = '\r';
     buf[len+1] = '\n';
-    inet_write(buf, len+2);
+    mutex_lock(sock_lock);
+    bool sent = (_sock >= 0 && inet_swrite(_sock, buf, len+2));
+    mutex_unlock(sock_lock);
     buf[len] = '\0';
+    if (!sent) {
+        stats.lost++;
+        fbuf_release(&newHdr);
+        return;
+    }
     if (!own) beeps(". ");
     ESP_LOGI(TAG, "Frame gated to inet.."); 
     ESP_LOGD(TAG, "%s", buf);
@@ -336,24 +599,34 @@ static void inet2rf(char *frame) {
 
 
 /***********************************************
- * Log in to APRS/IS server. 
- * Assume that connection is established. 
+ * Log in to APRS/IS server using username/passcode 
+ * and (option) filter-string. Assume that connection 
+ * is established. Return false if it fails. 
  ***********************************************/
 
-void igate_login(char* user, uint16_t pass, char* filter) 
+bool igate_login(int s, bool usefilter) 
 {
     int n=0;
     char buf[128];
-    n = sprintf(buf, "user %s pass %d vers Arctic-Tracker %s", user, pass, VERSION_SSTRING);
+    char uname[CRED_LENGTH];
+    char filter[CRED_LENGTH];
+    uint16_t pass;
+    get_str_param("IGATE.USER", uname, CRED_LENGTH, DFL_IGATE_USER);
+    pass = get_u16_param("IGATE.PASS", 0);
+    get_str_param("IGATE.FILTER", filter, CRED_LENGTH, DFL_IGATE_FILTER);      
+    
+    n = sprintf(buf, "user %s pass %d vers Arctic-Tracker %s", uname, pass, VERSION_SSTRING);
     ESP_LOGD(TAG, "Login string: %s", buf);
-    inet_write(buf, n);
+    if (!inet_swrite(s, buf, n))
+        return false;
   
-    if (strlen(filter) > 1) 
+    if (usefilter && strlen(filter) > 1) 
         n = sprintf(buf, " filter %s\r\n", filter);
     else
         n = sprintf(buf, "\r\n");
-    inet_write(buf, n);
-    inet_read(buf, 128);
+    if (!inet_swrite(s, buf, n) || inet_sread(s, buf, 128) <= 0)
+        return false;
     ESP_LOGD(TAG, "%s", buf);
+    return true;
 }
 
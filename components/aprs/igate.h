@@ -1,9 +1,24 @@
 
 
+/* Connection statistics. Times are in ms */
+typedef struct _igstats {
+    uint32_t connects;        /* Connections (including failovers) */
+    uint32_t failovers;       /* Failovers to the standby connection */ 
+    uint32_t outages;         /* Connections lost */
+    uint32_t lost;            /* Frames not gated because we were not connected */
+    uint32_t last_reconnect;  /* Time to reconnect after last outage */
+    uint32_t max_reconnect;   /* Max time to reconnect */
+    int8_t   server;          /* Index of current server, -1 if not connected */
+    int8_t   standby;         /* Index of standby server, -1 if none */
+} igate_stats_t;
+
+
  uint32_t igate_icount(void);
  uint32_t igate_rxcount(void);
  uint32_t igate_tr_count(void);
  bool igate_is_on(void);
  void igate_activate(bool on);
  void igate_init(void);
- void igate_login(char* user, uint16_t pass, char* filter);
+ bool igate_login(int sock, bool usefilter);
+ void igate_getStats(igate_stats_t* st);
+ char* igate_server(int i, char* buf);
@@ -28,37 +28,65 @@
 #include "lora1268.h"
 #include "ui.h"
 #include "aprs.h"
+#include "latency.h"
+#include "esp_timer.h"
 
 #define TAG "lora-aprs"
 
-#define CAD_RETRIES  5
+#define TX_PENDING     LORA_ENCODER_QUEUE_SIZE
+#define CAD_MAX_EXP    4             /* Max backoff is 2^CAD_MAX_EXP slots */
+#define DUTY_BUCKETS   60            /* Duty cycle window: 60 one-minute buckets */
+#define DUTY_BUCKET_US (60*1000000LL)
 
-                         // SF    5     6     7     8     9    10     11     12
-                         //--------------------------------------------------------
-const uint16_t cad_min_delay[] = {4,    6,   10,   18,   33,   61,   111,   200 };
-const uint16_t cad_max_delay[] = {40,  60,  100,  180,  330,  610,  1110,  2000 };
+FBQ encoder_queue; 
 
-static uint8_t cur_sf = 12;
+/* 
+ * Frames taken from the encoder queue, waiting to be sent. 
+ * Only the TX encoder thread uses this. 
+ */
+typedef struct {
+    FBUF    frame;
+    int64_t time;      /* When it was taken from the queue (us) */
+    uint8_t prio;      /* 0 is highest */
+    uint8_t busy;      /* Number of times CAD found the channel busy */
+    bool    deferred;  /* Has waited for the duty cycle budget */
+} txentry_t;
 
-FBQ encoder_queue; 
+static txentry_t pending[TX_PENDING];
+static uint8_t npending = 0;
+
+/* Airtime (ms) per minute, for the last DUTY_BUCKETS minutes */
+static uint32_t duty_ms[DUTY_BUCKETS];
+static int32_t duty_min[DUTY_BUCKETS];
+
+static loraprs_txstats_t txstats;
 
-static FBUF frame; 
 static cond_t packet_rdy;
 static cond_t cad_done;
+static cond_t tx_done;
 static volatile bool cad_detected;
 static FBQSW_t *psub, *psubtx;
 
-char  last_packet[256]; 
-int8_t last_rssi;
-int8_t last_snr;
-int32_t last_ferror;
-time_t last_time; 
+/* 
+ * Packets as received (with the 3 byte prefix). The receiver reads into 
+ * the buffer that is not the last heard packet, and makes it the last 
+ * heard packet when it is decoded. The last heard packet and its metadata 
+ * are changed and read with last_lock held. 
+ */
+static char rxbuf[2][256];
+static uint8_t last = 0;
+static mutex_t last_lock;
+static int8_t last_rssi;
+static int8_t last_snr;
+static int32_t last_ferror;
+static time_t last_time; 
 
 bool txon = false; 
 
 
-static void alt_setting(bool on, FBUF *frame);
-static void cad_wait();
+static const lora_profile_t* rx_profile();
+static const lora_profile_t* tx_profile(FBUF *frame);
+static bool cad_free();
 
 lorameta_t *loraprs_meta(int8_t rssi, int8_t snr, int32_t ferr) {
     lorameta_t * x = malloc(sizeof(lorameta_t));
@@ -74,15 +102,24 @@ fbq_t* loraprs_get_encoder_queue()
    { return &encoder_queue; }
    
    
-/* Return last heard packet */
-char* loraprs_last_packet() {
-    return last_packet;
+/* Return last heard packet (copied to buf) */
+char* loraprs_last_packet(char* buf, uint16_t size) {
+    if (size == 0)
+        return buf;
+    mutex_lock(last_lock);
+    strncpy(buf, rxbuf[last]+3, size-1);
+    mutex_unlock(last_lock);
+    buf[size-1] = '\0';
+    return buf;
 }
 
+
 /* Return last heard callsign */
 char* loraprs_last_heard(char* buf) {
-    int pos =  strcspn(last_packet, ">");
-    strncpy(buf, last_packet, pos);
+    char pbuf[TNC2_HDR_MAX+1];
+    loraprs_last_packet(pbuf, sizeof(pbuf));
+    int pos =  strcspn(pbuf, ">");
+    strncpy(buf, pbuf, pos);
     buf[pos] = '\0';
     return buf;
 }
@@ -90,7 +127,9 @@ char* loraprs_last_heard(char* buf) {
 
 /* Return true if last heard packet was via digipeater. */
 bool loraprs_last_digied() {
-    const char* hstart = strchr(last_packet, '>');
+    char pbuf[TNC2_HDR_MAX+1];
+    loraprs_last_packet(pbuf, sizeof(pbuf));
+    const char* hstart = strchr(pbuf, '>');
     if (hstart == NULL)
         return false;
 
@@ -116,15 +155,24 @@ bool loraprs_last_digied() {
 
    
 int8_t loraprs_last_rssi() {
-    return last_rssi;
+    mutex_lock(last_lock);
+    int8_t x = last_rssi;
+    mutex_unlock(last_lock);
+    return x;
 }
 
 int8_t loraprs_last_snr() {
-    return last_snr;
+    mutex_lock(last_lock);
+    int8_t x = last_snr;
+    mutex_unlock(last_lock);
+    return x;
 }
 
 time_t loraprs_last_time() {
-    return last_time;
+    mutex_lock(last_lock);
+    time_t x = last_time;
+    mutex_unlock(last_lock);
+    return x;
 }
 
 bool loraprs_tx_is_on() {
@@ -138,16 +186,16 @@ bool loraprs_tx_is_on() {
  ***********************************************************/
 
 
-uint8_t loraprs_subscribe_rx(fbq_t* q) {
-    return fbqsw_subscribe(psub, q);
+uint8_t loraprs_subscribe_rx(fbq_t* q, fbq_policy_t p, const char* name) {
+    return fbqsw_subscribe(psub, q, p, name);
 }
 
 void loraprs_unsubscribe_rx(uint8_t i) {
     fbqsw_unsubscribe(psub, i);
 }
 
-uint8_t loraprs_subscribe_txmon(fbq_t* q) {
-    return fbqsw_subscribe(psubtx, q);
+uint8_t loraprs_subscribe_txmon(fbq_t* q, fbq_policy_t p, const char* name) {
+    return fbqsw_subscribe(psubtx, q, p, name);
 }
 
 void loraprs_unsubscribe_txmon(uint8_t i) {
@@ -172,7 +220,6 @@ static void IRAM_ATTR intrHandler(void* x) {
  ************************************************************/
 
 static void rxdecoder (void* arg) {
-    uint8_t buf[256];
     int16_t len = 0;
     int8_t rssi, sigrssi;
     int8_t snr;
@@ -191,7 +238,7 @@ static void rxdecoder (void* arg) {
             lora_TxOff();
             tx_led_off();
             txon = false; 
-            alt_setting(false, NULL); 
+            cond_set(tx_done);
             continue;
         }
         
@@ -203,8 +250,10 @@ static void rxdecoder (void* arg) {
             continue;
         }
         
-        len = lora_ReceivePacket(buf, 200);
-        buf[len] = '\0';
+        /* Read the packet into the buffer that is not the last heard */
+        uint8_t next = 1 - last;
+        char* buf = rxbuf[next];
+        len = lora_ReceivePacket((uint8_t*) buf, sizeof(rxbuf[0])-1);
         lora_GetPacketStatus(&rssi, &sigrssi, &snr);
         long ferror = lora_GetFreqError(125);
         lora_ClearIrqStatus(SX126X_IRQ_ALL);
@@ -217,6 +266,7 @@ static void rxdecoder (void* arg) {
             ESP_LOGI(TAG, "CRC error");
             continue;
         }
+        buf[len] = '\0';
         
         rssi = rssi-LORA_LNA_GAIN;
         
@@ -224,18 +274,30 @@ static void rxdecoder (void* arg) {
                  len, rssi, (snr<0 ? rssi+snr: rssi), snr, ferror);
         
         /* Is it APRS? */
-        if (len < 20 || buf[0]!= '<' || buf[1]!= 0xff || buf[2]!= 0x01) {
+        if (len < 20 || buf[0] != '<' || (uint8_t) buf[1] != 0xff || buf[2] != 0x01) {
             ESP_LOGW(TAG, "Packet is not LoRa APRS");
             continue;
         }
         
+        /* Parse the TNC2 header in place and encode the frame */
         fbuf_new(&frame, SRC_RX);
+        lat_start(&frame, esp_timer_get_time());
+        if (!ax25_tnc2frame(&frame, buf+3, len-3)) {
+            ESP_LOGW(TAG, "Couldn't parse TNC2 header");
+            fbuf_release(&frame);
+            continue;
+        }
         frame.meta = loraprs_meta(rssi, snr, ferror);
-        ax25_str2frame(&frame,  (char*) buf+3, len-3);
-        strcpy(last_packet, (char*) buf+3);
+        lat_mark(&frame, LAT_DECODE);
+        
+        /* The packet is now the last heard packet */
+        time_t now = getTime();
+        mutex_lock(last_lock);
+        last = next;
         last_rssi = rssi; last_snr = snr;
-        last_time = getTime();
+        last_time = now;
         last_ferror = ferror;
+        mutex_unlock(last_lock);
 
         /* Distribute packet to subscribers */
         if (fbqsw_publish(psub, frame) == 0)
@@ -245,96 +307,279 @@ static void rxdecoder (void* arg) {
 }
 
 
+/*******************************************************************************
+ * Priority of a frame to be sent, by its source. 0 is highest. Our own 
+ * position reports and messages go before other traffic, and frames to 
+ * be digipeated go last. 
+ *******************************************************************************/
+
+static uint8_t tx_prio(uint8_t tag) {
+    switch (tag) {
+        case SRC_TRACKER:
+        case SRC_USER:       return 0;
+        case SRC_DIGIPEATER: return 2;
+        default:             return 1;
+    }
+}
+
+
+
+/*******************************************************************************
+ * Add a frame to the pending frames. If full, the newest frame with the 
+ * lowest priority is dropped, unless the new frame has a lower priority. 
+ *******************************************************************************/
+
+static void tx_add(FBUF* frame) 
+{
+    uint8_t prio = tx_prio(frame->tag);
+    lat_mark(frame, LAT_ENC);
+    
+    if (npending == TX_PENDING) {
+        int worst = 0;
+        for (int i=1; i<npending; i++)
+            if (pending[i].prio > pending[worst].prio || (pending[i].prio == pending[worst].prio 
+                    && pending[i].time > pending[worst].time))
+                worst = i;
+        txstats.overflow++;
+        if (pending[worst].prio <= prio) {
+            fbuf_release(frame);
+            return;
+        }
+        fbuf_release(&pending[worst].frame);
+        pending[worst] = pending[--npending];
+    }
+    txentry_t* e = &pending[npending++];
+    e->frame = *frame;
+    e->time = esp_timer_get_time();
+    e->prio = prio;
+    e->busy = 0;
+    e->deferred = false;
+}
+
+
+
+/*******************************************************************************
+ * Drop frames that have waited more than LORA.TXAGE seconds (0 = no limit)
+ *******************************************************************************/
+
+static void tx_expire(int64_t now) 
+{
+    int64_t maxage = (int64_t) config_i32(CFG_LORA_TXAGE) * 1000000;
+    if (maxage <= 0)
+        return;
+    for (int i=0; i<npending; ) {
+        if (now - pending[i].time > maxage) {
+            ESP_LOGI(TAG, "TX: dropping frame after %lld s", (now - pending[i].time) / 1000000);
+            fbuf_release(&pending[i].frame);
+            pending[i] = pending[--npending];
+            txstats.expired++;
+        }
+        else
+            i++;
+    }
+}
+
+
+
+/*******************************************************************************
+ * Select the next frame to send: Highest priority, and oldest first. 
+ *******************************************************************************/
+
+static int tx_select() 
+{
+    int best = 0;
+    for (int i=1; i<npending; i++)
+        if (pending[i].prio < pending[best].prio || (pending[i].prio == pending[best].prio 
+                && pending[i].time < pending[best].time))
+            best = i;
+    return best;
+}
+
+
+
+/*******************************************************************************
+ * Airtime in the duty cycle window (the last hour). Each bucket is tagged 
+ * with its minute, so buckets that are too old are ignored. 
+ *******************************************************************************/
+
+static uint32_t duty_used(int64_t now) 
+{
+    int32_t min = now / DUTY_BUCKET_US;
+    uint32_t sum = 0;
+    for (int i=0; i<DUTY_BUCKETS; i++)
+        if (min - duty_min[i] < DUTY_BUCKETS)
+            sum += duty_ms[i];
+    return sum;
+}
+
+
+static void duty_add(int64_t now, uint32_t ms) 
+{
+    int32_t min = now / DUTY_BUCKET_US;
+    int i = min % DUTY_BUCKETS;
+    if (duty_min[i] != min) {
+        duty_min[i] = min;
+        duty_ms[i] = 0;
+    }
+    duty_ms[i] += ms;
+}
+
+
+/* Airtime allowed in the window (ms). 0 means no limit */
+static uint32_t duty_budget() {
+    return (uint32_t) config_byte(CFG_LORA_DUTY) * (DUTY_BUCKETS * 60 * 1000 / 100);
+}
+
+
+
+/*******************************************************************************
+ * Get TX statistics
+ *******************************************************************************/
+
+void loraprs_getTxStats(loraprs_txstats_t* st) 
+{
+    *st = txstats;
+    st->window = duty_used(esp_timer_get_time());
+    st->budget = duty_budget();
+    st->queued = npending + encoder_queue.cnt;
+}
+
+
+
 /*******************************************************************************
  * TX encoder thread
  *
- * This function gets a frame from frame-queue, and starts the transmitter
- * as soon as the channel is free.   
+ * Frames are taken from the frame-queue and kept in a small table of pending
+ * frames. The frame with the highest priority (oldest first) is sent if its 
+ * time on air fits in the duty cycle budget and CAD finds the channel free. 
+ * If the channel is busy, we back off a random number of CAD slots and 
+ * select again, so that a more important frame can go first. Frames that 
+ * wait too long are dropped.   
  *******************************************************************************/
 
 static void txencoder (void* arg)
 { 
   (void)arg;
   char txbuf[256];
+  FBUF frame;
   ESP_LOGI(TAG, "TX encoder thread");
+  
+  txbuf[0]='<'; 
+  txbuf[1]=0xFF;
+  txbuf[2]=0x01;
   while (true) {
-     /* Get frame from frame-queue when available. 
-      * This is a blocking call.
-      */  
-     frame = fbq_get(&encoder_queue); 
+     /* Wait for a frame if there are none pending. Then collect the rest. */
+     if (npending == 0) {
+        lora_SetProfile(rx_profile());
+        frame = fbq_get(&encoder_queue); 
+        tx_add(&frame);
+     }
+     while (fbq_tryGet(&encoder_queue, &frame))
+        tx_add(&frame);
      
-     /* Now send it */
-     txbuf[0]='<'; 
-     txbuf[1]=0xFF;
-     txbuf[2]=0x01;
-     int len = ax25_frame2str(txbuf+3, sizeof(txbuf)-3, &frame);
-     alt_setting(true, &frame); 
+     int64_t now = esp_timer_get_time();
+     tx_expire(now);
+     if (npending == 0)
+        continue;
+     
+     txentry_t* e = &pending[tx_select()];
+     int len = ax25_frame2str(txbuf+3, sizeof(txbuf)-3, &e->frame);
+     const lora_profile_t* prof = tx_profile(&e->frame);
+     uint32_t toa = lora_TimeOnAir(prof, len+3) / 1000;
+     
+     /* 
+      * Duty cycle: If the frame doesn't fit in the budget, wait for 
+      * the next bucket (or a new frame) and try again. 
+      */
+     uint32_t budget = duty_budget();
+     if (budget > 0 && duty_used(now) + toa > budget) {
+        if (!e->deferred) {
+            ESP_LOGI(TAG, "TX: duty cycle budget exceeded, waiting");
+            txstats.deferred++;
+            e->deferred = true;
+        }
+        lora_SetProfile(rx_profile());
+        uint32_t wait = (DUTY_BUCKET_US - now % DUTY_BUCKET_US) / 1000 + 1;
+        if (fbq_getTimeout(&encoder_queue, &frame, wait))
+            tx_add(&frame);
+        continue;
+     }
      
-      /* CAD: check the channel is free before transmitting */
-     cad_wait();
+     /* 
+      * CAD: check the channel is free before transmitting. The radio is 
+      * switched back to the normal setting only when we wait, so frames 
+      * sent in a row with the alternative setting need no switching. 
+      */
+     lora_SetProfile(prof);
+     if (!cad_free()) {
+        lora_SetProfile(rx_profile());
+        if (e->busy < CAD_MAX_EXP)
+            e->busy++;
+        uint32_t slots = 1 + rand() % (1 << e->busy);
+        ESP_LOGI(TAG, "CAD: channel busy, waiting %lu slots", slots);
+        sleepMs(slots * prof->cad_slot);
+        continue;
+     }
      
-     ESP_LOGI(TAG, "TX packet: %d bytes", len);
+     /* Now send it */
+     frame = e->frame;
+     *e = pending[--npending];
+     lat_mark(&frame, LAT_TX);
+     
+     ESP_LOGI(TAG, "TX packet: %d bytes, %lu ms", len, toa);
+     cond_clear(tx_done);
      tx_led_on();
      txon = true;
      lora_SendPacket((uint8_t*) txbuf, len+3);
+     duty_add(esp_timer_get_time(), toa);
+     txstats.sent++;
+     txstats.airtime += toa;
      
      /* Distribute packet to subscribers */
      if (fbqsw_publish(psubtx, frame) == 0)
         fbuf_release(&frame);
-
+     
+     /* Wait until it is sent before the next CAD */
+     if (!cond_waitTimeout(tx_done, toa + 1000))
+        ESP_LOGW(TAG, "TX: no TX done interrupt");
   }
 }
 
+
+
 /*******************************************************************************
- * CAD: check the channel is free before transmitting 
+ * CAD: check if the channel is free. Return false if busy.  
  *******************************************************************************/
 
-static void cad_wait() {
-    int cad_min = cad_min_delay[cur_sf - 5];
-    int cad_max = cad_max_delay[cur_sf - 5];
-    
-    bool channel_free = false;
-    for (int retry = 0; retry < CAD_RETRIES; retry++) {
-        cond_clear(cad_done);
-        lora_SetCad();
-        cond_wait(cad_done);
-        if (!cad_detected) {
-            channel_free = true;
-            break;
-        }
-        ESP_LOGI(TAG, "CAD: channel busy, retry %d/%d", retry+1, CAD_RETRIES);
+static bool cad_free() {
+    cond_clear(cad_done);
+    lora_SetCad();
+    cond_wait(cad_done);
+    txstats.cad++;
+    if (cad_detected) {
+        txstats.cad_busy++;
         lora_TxOff();   /* back to RX while waiting */
-        sleepMs(cad_min + (rand() % (cad_max - cad_min + 1)));
+        return false;
     }
-    if (!channel_free)
-        ESP_LOGW(TAG, "CAD: channel busy after %d retries, transmitting anyway", CAD_RETRIES);
-
+    return true;
 }
 
 
+
 /*******************************************************************************
- * Switch to/from alternative SF/CR setting
+ * Modem profile for receiving, and for sending a frame. Frames to be
+ * digipeated may use the alternative setting. 
  *******************************************************************************/
 
-static void alt_setting(bool on, FBUF *frame) {
-    if (!GET_BOOL_PARAM("LORA_ALT.on", DFL_LORA_ALT_ON) 
-        || (frame != NULL && frame->tag != SRC_DIGIPEATER))
-        return; 
-        
-    uint8_t cr, sf; 
-    if (on) {
-        sf = get_byte_param("LORA_ALT_SF", DFL_LORA_ALT_SF);
-        cr = get_byte_param("LORA_ALT_CR", DFL_LORA_ALT_CR);
-        ESP_LOGD(TAG, "Switching to alternative setting: sf=%d, cr=%d", sf, cr);
-        cur_sf = sf;
-    }
-    else {
-        sf = get_byte_param("LORA_SF", DFL_LORA_SF);
-        cr = get_byte_param("LORA_CR", DFL_LORA_CR);
-        ESP_LOGD(TAG, "Switching to normal setting: sf=%d, cr=%d", sf, cr);
-        cur_sf = sf;
-    }
-    lora_SetModulationParams(sf, SX126X_LORA_BW_125_0, cr-4, (sf>=11 ? 1:0)); 
+static const lora_profile_t* rx_profile() {
+    return lora_profile(config_byte(CFG_LORA_SF), config_byte(CFG_LORA_CR));
+}
+
+
+static const lora_profile_t* tx_profile(FBUF *frame) {
+    if (CONFIG_BOOL(CFG_LORA_ALT_ON) && frame->tag == SRC_DIGIPEATER)
+        return lora_profile(config_byte(CFG_LORA_ALT_SF), config_byte(CFG_LORA_ALT_CR));
+    return rx_profile();
 }
 
 
@@ -346,14 +591,16 @@ static void alt_setting(bool on, FBUF *frame) {
 
 void loraprs_init_decoder() 
 {
-    cur_sf = get_byte_param("LORA_SF", DFL_LORA_SF);
     radio_require();
     packet_rdy = cond_create();
     cond_clear(packet_rdy);
     cad_done = cond_create();
     cond_clear(cad_done);
+    tx_done = cond_create();
+    cond_clear(tx_done);
+    last_lock = mutex_create();
     
-    psub = fbqsw_create(10);
+    psub = fbqsw_create("rx", 10);
     lora_SetIrqHandler(intrHandler, SX126X_IRQ_RX_DONE | SX126X_IRQ_TX_DONE | 
                                     SX126X_IRQ_CAD_DONE);
     
@@ -370,7 +617,7 @@ void loraprs_init_decoder()
 
 FBQ* loraprs_init_encoder() 
 {
-  psubtx = fbqsw_create(10);
+  psubtx = fbqsw_create("tx", 10);
   fbq_init(&encoder_queue, LORA_ENCODER_QUEUE_SIZE);
   /* Start TX thread */
   xTaskCreatePinnedToCore(&txencoder, "LoRa APRS TX", 
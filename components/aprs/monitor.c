@@ -95,9 +95,9 @@ void mon_activate(bool m)
     if (tstart) {
         FBQ* mq = (mon_on? &mon : NULL);
         
-        subscription = APRS_SUBSCRIBE_RX(mq);
+        subscription = APRS_SUBSCRIBE_RX(mq, FBQ_DROP_NEWEST, "monitor");
         if (GET_BOOL_PARAM("TXMON.on", DFL_TXMON_ON))
-            txsubscr = APRS_SUBSCRIBE_TXMON(mq);
+            txsubscr = APRS_SUBSCRIBE_TXMON(mq, FBQ_DROP_NEWEST, "monitor");
 
         xTaskCreate(&monitor, "Packet monitor", 
             STACK_MONITOR, NULL, NORMALPRIO, NULL);
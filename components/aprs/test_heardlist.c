@@ -0,0 +1,282 @@
+/*
+ * Offline test of the heard list (heardlist.c) used by the igate and
+ * the digipeater to drop duplicate packets.
+ * Runs on a host computer (not part of the firmware build):
+ *
+ *   gcc -O2 -Wall -Ihoststub -I../../main -I../afsk -o heardlist_test \
+ *       test_heardlist.c heardlist.c ../../main/fbuf.c
+ *   ./heardlist_test
+ *
+ * Streams of 1k and 10k different packets are sent through
+ * hlist_duplicate(), at a rate where the table is full and entries
+ * must be evicted. No packet may be reported as a duplicate (a false
+ * drop). For comparison, the same streams are run through a model of
+ * the old heard list (16 bit CRC in a ring of 32 entries).
+ *
+ * Then each packet is heard again 1-20 seconds later (like when it is
+ * digipeated), and must be reported as a duplicate, unless the copy
+ * comes after HEARDLIST_MAX_AGE. Last, the time per lookup is
+ * measured for streams of 1k and 10k different packets, 10 per second.
+ *
+ * The clock (esp_timer_get_time) and the mutex are implemented here.
+ *
+ * By LA7ECA, ohanssen@acm.org
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include "ax25.h"
+#include "heardlist.h"
+#include "crc16.h"
+
+
+#define NCALLS 300
+#define PAYLOAD 40
+
+static int64_t now_us = 0;
+
+int64_t esp_timer_get_time(void)
+   { return now_us; }
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+   { return (SemaphoreHandle_t) 1; }
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+   { return pdTRUE; }
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+   { return pdTRUE; }
+
+
+
+/*******************************************************
+ * Packets. Source is one of NCALLS stations, the
+ * payload is like a position report with a sequence
+ * number and a comment.
+ *******************************************************/
+
+typedef struct {
+    addr_t from, to;
+    FBUF f;
+} packet_t;
+
+
+static void make_packet(packet_t* p, int seq)
+{
+    char buf[AX25_HDR_LEN(0) + PAYLOAD + 1];
+    int st = seq % NCALLS;
+
+    memset(&p->from, 0, sizeof(addr_t));
+    memset(&p->to, 0, sizeof(addr_t));
+    sprintf(p->from.callsign, "LA%dX%c", st % 10, 'A' + st / 10 % 26);
+    p->from.ssid = st % 16;
+    strcpy(p->to.callsign, "APAT51");
+
+    memset(buf, 0, AX25_HDR_LEN(0));
+    int n = sprintf(buf + AX25_HDR_LEN(0), "!6911.%02dN/01857.%02dE>%07d ",
+        seq / 100 % 100, seq % 100, seq);
+    /* Comment, depends only on seq */
+    uint32_t x = seq * 2654435761u;
+    for (int i = AX25_HDR_LEN(0) + n; i < AX25_HDR_LEN(0) + PAYLOAD; i++) {
+        x = x * 1103515245 + 12345;
+        buf[i] = 'A' + (x >> 16) % 26;
+    }
+    fbuf_new(&p->f, 0);
+    fbuf_write(&p->f, buf, AX25_HDR_LEN(0) + PAYLOAD);
+}
+
+
+
+/*******************************************************
+ * Model of the old heard list: 16 bit CRC, ring of 32
+ *******************************************************/
+
+#define OLD_SIZE 32
+static uint16_t old_ring[OLD_SIZE];
+static int old_next = 0, old_len = 0;
+
+static uint16_t old_checksum(packet_t* p)
+{
+    uint16_t crc = 0xFFFF;
+    for (int i=0; p->from.callsign[i] != 0; i++)
+        crc = _crc_ccitt_update(crc, p->from.callsign[i]);
+    crc = _crc_ccitt_update(crc, p->from.ssid);
+    for (int i=0; p->to.callsign[i] != 0; i++)
+        crc = _crc_ccitt_update(crc, p->to.callsign[i]);
+    crc = _crc_ccitt_update(crc, p->to.ssid);
+    fbuf_rseek(&p->f, AX25_HDR_LEN(0));
+    for (int i=AX25_HDR_LEN(0); i<fbuf_length(&p->f); i++)
+        crc = _crc_ccitt_update(crc, fbuf_getChar(&p->f));
+    return crc;
+}
+
+static bool old_duplicate(packet_t* p)
+{
+    uint16_t cs = old_checksum(p);
+    bool found = false;
+    for (int i=0; i<old_len; i++)
+        if (old_ring[i] == cs)
+            found = true;
+    old_ring[old_next] = cs;
+    old_next = (old_next + 1) % OLD_SIZE;
+    if (old_len < OLD_SIZE)
+        old_len++;
+    return found;
+}
+
+
+
+/*******************************************************
+ * False drops: n different packets, 10 per second, so
+ * that about 300 are younger than HEARDLIST_MAX_AGE.
+ *******************************************************/
+
+static int check_unique(int n, int seed)
+{
+    int fails = 0, old_fp = 0;
+    for (int i=0; i<n; i++) {
+        packet_t p;
+        make_packet(&p, seed + i);
+        now_us += 100000;
+        if (hlist_duplicate(&p.from, &p.to, &p.f, 0)) {
+            printf("FAIL: packet %d of %d reported as duplicate\n", i, n);
+            fails++;
+        }
+        if (old_duplicate(&p))
+            old_fp++;
+        fbuf_release(&p.f);
+    }
+    printf("  %5d packets: %d false drops (old heard list: %d)\n", n, fails, old_fp);
+    return fails;
+}
+
+
+
+/*******************************************************
+ * True duplicates. One new packet per second, and each
+ * packet is heard again after 1-20 seconds. Packets
+ * heard again more than HEARDLIST_MAX_AGE after they were
+ * last heard are not duplicates.
+ *******************************************************/
+
+#define DELAYS 64
+
+static int check_dupes(int n)
+{
+    int fails = 0, missed = 0, expired = 0;
+    int again[DELAYS];          /* Seq of packet to repeat, by second */
+
+    for (int i=0; i<DELAYS; i++)
+        again[i] = -1;
+    for (int t=0; t<n; t++) {
+        packet_t p;
+        now_us += 1000000;
+
+        make_packet(&p, 1000000 + t);
+        if (hlist_duplicate(&p.from, &p.to, &p.f, 0)) {
+            printf("FAIL: new packet %d reported as duplicate\n", t);
+            fails++;
+        }
+        fbuf_release(&p.f);
+        again[(t + 1 + rand() % 20) % DELAYS] = t;
+
+        int s = again[t % DELAYS];
+        if (s >= 0) {
+            make_packet(&p, 1000000 + s);
+            if (!hlist_duplicate(&p.from, &p.to, &p.f, 0))
+                missed++;
+            fbuf_release(&p.f);
+            again[t % DELAYS] = -1;
+        }
+
+        /* Heard again, too late to be a duplicate */
+        if (t > HEARDLIST_MAX_AGE + 25 && t % 10 == 0) {
+            make_packet(&p, 1000000 + t - HEARDLIST_MAX_AGE - 25);
+            if (hlist_duplicate(&p.from, &p.to, &p.f, 0))
+                expired++;
+            fbuf_release(&p.f);
+        }
+    }
+    printf("  %5d packets: %d duplicates missed, %d expired packets dropped\n",
+        n, missed, expired);
+    return fails + missed + expired;
+}
+
+
+
+/*******************************************************
+ * Time per hlist_duplicate()
+ *******************************************************/
+
+static double elapsed(struct timespec* t0)
+{
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) * 1e-9;
+}
+
+
+#define BENCH_PACKETS 1000000
+
+static void bench(int n)
+{
+    struct timespec t0;
+    int d = 0;
+
+    /* Making and releasing packets, subtracted below */
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i=0; i<BENCH_PACKETS; i++) {
+        packet_t p;
+        make_packet(&p, 2000000 + i % n);
+        fbuf_release(&p.f);
+    }
+    double t_make = elapsed(&t0);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i=0; i<BENCH_PACKETS; i++) {
+        packet_t p;
+        make_packet(&p, 2000000 + i % n);
+        now_us += 100000;
+        d += hlist_duplicate(&p.from, &p.to, &p.f, 0);
+        fbuf_release(&p.f);
+    }
+    double t_new = elapsed(&t0) - t_make;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i=0; i<BENCH_PACKETS; i++) {
+        packet_t p;
+        make_packet(&p, 2000000 + i % n);
+        d += old_duplicate(&p);
+        fbuf_release(&p.f);
+    }
+    double t_old = elapsed(&t0) - t_make;
+
+    printf("  %5d different packets: %6.1f ns/packet (old heard list: %6.1f ns)\n", n,
+        t_new * 1e9 / BENCH_PACKETS, t_old * 1e9 / BENCH_PACKETS);
+    if (d < 0)
+        printf("(impossible)\n");
+}
+
+
+
+int main(int argc, char** argv)
+{
+    fbuf_init();
+    hlist_init();
+    int fails = check_unique(1000, 0);
+    fails += check_unique(10000, 100000);
+    fails += check_dupes(1000);
+    fails += check_dupes(10000);
+    printf("%d failures\n", fails);
+    if (fails > 0)
+        return 1;
+
+    printf("\n");
+    bench(1000);
+    bench(10000);
+    return 0;
+}
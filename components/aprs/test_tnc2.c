@@ -0,0 +1,338 @@
+/*
+ * Offline test of the single pass TNC2 parser used by the LoRa receiver.
+ * Runs on a host computer (not part of the firmware build):
+ *
+ *   gcc -O2 -Wall -Ihoststub -I../../main -o tnc2_test \
+ *       test_tnc2.c ax25.c ../../main/fbuf.c
+ *   ./tnc2_test [-v] [file ...]
+ *
+ * Input files contain LoRa APRS payloads in TNC2 format, one per line
+ * (the 3 byte "<\xff\x01" prefix is optional). Without files, a set of
+ * built in payloads captured from LoRa APRS traffic is used.
+ *
+ * Each payload is converted to an AX.25 frame with ax25_tnc2frame() and
+ * with ax25_str2frame(). The two frames must be equal. This is also done
+ * for information fields of all lengths up to what a LoRa packet can
+ * hold. Then both are benchmarked: The conversion alone, and the whole
+ * receive path.
+ *
+ * By LA7ECA, ohanssen@acm.org
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include "ax25.h"
+
+
+#define MAXPKTS 1024
+#define PREFIX "<\xff\x01"
+#define BENCH_ROUNDS 20000
+
+static const char* builtin[] = {
+    "LA7ECA-7>APLRT1,WIDE1-1:!/5L!!<*e7>7P[Arctic Tracker",
+    "LA3T-12>APLRG1,LA7ECA-7*,WIDE2-1:=6911.23N/01857.12E&LoRa iGate",
+    "OE3XLR-11>APLRT1,WIDE1-1:!/6LY1N<IeW> QLoRa Tracker",
+    "DB0ABC-10>APLG01,TCPIP*,qAC,T2NUENGLD:!4852.28N/00956.37EL433.775MHz",
+    "LA1FTA>APZ019,LA7ECA-7*,LA3T-12*,WIDE2:>Test status",
+    "LA9XXX-9>APRS:`o]Tl Y>/>\"4V}=",
+    "N0CALL-15>APLT00,WIDE1-1,WIDE2-1:!4903.50N/07201.75W>088/036/A=001234",
+    "ab1cd-3>apdr16,wide1-1:=5947.11N/01043.64E$ lower case",
+    "LA7ECA-11>APLRT1:;LA7ECA-9 *111111z6911.00N/01857.00E-Object",
+    "LA7ECA-9>APLRT1:>Status, with a comma",
+    "SP5ABC-7>APLRT1,SP5XYZ-10*,WIDE1*,WIDE2-1:!5213.00N/02100.00E>speed 42",
+};
+
+static char* pkts[MAXPKTS];
+static int npkts = 0;
+static bool verbose = false;
+
+
+
+/*******************************************************
+ * Copy of tokenize() from system.c (which needs the
+ * RTOS), used by str2digis()
+ *******************************************************/
+
+uint8_t tokenize(char* buf, char* tokens[], uint8_t maxtokens, char *delim, bool merge)
+{ 
+     uint8_t ntokens = 0;
+     while (ntokens<maxtokens)
+     {    
+        tokens[ntokens] = strsep(&buf, delim);
+        if ( buf == NULL)
+            break;
+        if (!merge || *tokens[ntokens] != '\0') 
+            ntokens++;
+     }
+     return (merge && *tokens[ntokens] == '\0' ? ntokens : ntokens+1);
+}
+
+
+
+/*******************************************************
+ * Read payloads from a file, one per line
+ *******************************************************/
+
+static void read_file(const char* fname)
+{
+    char line[512];
+    FILE* f = fopen(fname, "r");
+    if (f == NULL) {
+        perror(fname);
+        return;
+    }
+    while (npkts < MAXPKTS && fgets(line, sizeof(line), f) != NULL) {
+        char* p = line;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (strncmp(p, PREFIX, 3) == 0)
+            p += 3;
+        if (strlen(p) < 10 || strlen(p) > 252)
+            continue;
+        pkts[npkts++] = strdup(p);
+    }
+    fclose(f);
+}
+
+
+
+/*******************************************************
+ * Compare two frames. Return true if they are equal.
+ *******************************************************/
+
+static bool frame_equal(FBUF* a, FBUF* b)
+{
+    char abuf[512], bbuf[512];
+    if (fbuf_length(a) != fbuf_length(b))
+        return false;
+    fbuf_reset(a); fbuf_reset(b);
+    uint16_t n = fbuf_read(a, sizeof(abuf), abuf);
+    fbuf_read(b, sizeof(bbuf), bbuf);
+    return memcmp(abuf, bbuf, n) == 0;
+}
+
+
+
+/*******************************************************
+ * Convert every payload with both methods and compare
+ *******************************************************/
+
+static int check()
+{
+    int fails = 0;
+    for (int i=0; i<npkts; i++) {
+        char str[256], out[512];
+        FBUF f1, f2;
+
+        fbuf_new(&f1, SRC_RX);
+        bool ok = ax25_tnc2frame(&f1, pkts[i], strlen(pkts[i]));
+
+        fbuf_new(&f2, SRC_RX);
+        strcpy(str, pkts[i]);
+        ax25_str2frame(&f2, str, strlen(str));
+
+        if (!ok || !frame_equal(&f1, &f2)) {
+            printf("FAIL: %s\n", pkts[i]);
+            fails++;
+        }
+        else if (verbose) {
+            ax25_frame2str(out, sizeof(out), &f1);
+            printf("OK:   %s\n", out);
+        }
+        fbuf_release(&f1);
+        fbuf_release(&f2);
+    }
+
+    /* Malformed headers must be rejected */
+    static const char* bad[] = {
+        "LA7ECA-7APLRT1:no separator", "LA7ECA-7>APLRT1,WIDE1-1 no colon",
+        ">APLRT1:no source", "LA7ECA-7>APLRT1,,WIDE1-1:empty digi",
+        "LA7ECA-7>APLRT1>X:two tos", "LA 7ECA>APLRT1:space"
+    };
+    for (int i=0; i < sizeof(bad)/sizeof(bad[0]); i++) {
+        FBUF f;
+        fbuf_new(&f, SRC_RX);
+        if (ax25_tnc2frame(&f, bad[i], strlen(bad[i]))) {
+            printf("FAIL (accepted): %s\n", bad[i]);
+            fails++;
+        }
+        fbuf_release(&f);
+    }
+
+    if (fbuf_usedSlots() != 0) {
+        printf("FAIL: %d buffer slots leaked\n", fbuf_usedSlots());
+        fails++;
+    }
+    printf("%d payloads, %d failures\n", npkts, fails);
+    return fails;
+}
+
+
+
+/*******************************************************
+ * Information fields of all lengths, after headers of
+ * different lengths. The text is not null terminated.
+ *******************************************************/
+
+static int check_lengths()
+{
+    int fails = 0;
+    for (int pad=0; pad < 16; pad++)
+        for (int len=0; len < 200; len++) {
+            char pkt[256], str[256];
+            FBUF f1, f2;
+
+            int n = sprintf(pkt, "LA7ECA-%d>APLRT1,WIDE1-1,%.*s:",
+                pad % 16, 1 + pad % 6, "ABCDEF");
+            for (int i=0; i<len; i++)
+                pkt[n+i] = 'a' + (pad + i) % 26;
+            pkt[n+len] = '#';
+            fbuf_new(&f1, SRC_RX);
+            bool ok = ax25_tnc2frame(&f1, pkt, n+len);
+            pkt[n+len] = '\0';
+
+            fbuf_new(&f2, SRC_RX);
+            strcpy(str, pkt);
+            ax25_str2frame(&f2, str, strlen(str));
+
+            if (!ok || !frame_equal(&f1, &f2)) {
+                printf("FAIL: %s\n", pkt);
+                fails++;
+            }
+            fbuf_release(&f1);
+            fbuf_release(&f2);
+        }
+    if (fbuf_usedSlots() != 0) {
+        printf("FAIL: %d buffer slots leaked\n", fbuf_usedSlots());
+        fails++;
+    }
+    return fails;
+}
+
+
+
+/*******************************************************
+ * Time both receive paths. First the conversion alone
+ * (the str2frame string must be copied since it is
+ * changed). Then the whole path, like rxdecoder() does
+ * it: The packet is copied out of the SPI buffer,
+ * converted, and kept as the last heard packet. The old
+ * receiver copied it to last_packet, the new one swaps
+ * between two receive buffers.
+ *******************************************************/
+
+static double elapsed(struct timespec* t0)
+{
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) * 1e-9;
+}
+
+
+static void bench()
+{
+    static char spi[MAXPKTS][256];
+    static uint8_t spilen[MAXPKTS];
+    static char last_packet[256];
+    static char rxbuf[2][256];
+    uint8_t last = 0;
+    struct timespec t0;
+    double t_str, t_tnc2;
+    long n = (long) BENCH_ROUNDS * npkts;
+
+    /* Conversion only */
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int r=0; r<BENCH_ROUNDS; r++)
+        for (int i=0; i<npkts; i++) {
+            char buf[256];
+            FBUF f;
+            size_t len = strlen(pkts[i]);
+            memcpy(buf, pkts[i], len+1);
+            fbuf_new(&f, SRC_RX);
+            ax25_str2frame(&f, buf, len);
+            fbuf_release(&f);
+        }
+    t_str = elapsed(&t0);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int r=0; r<BENCH_ROUNDS; r++)
+        for (int i=0; i<npkts; i++) {
+            FBUF f;
+            fbuf_new(&f, SRC_RX);
+            ax25_tnc2frame(&f, pkts[i], strlen(pkts[i]));
+            fbuf_release(&f);
+        }
+    t_tnc2 = elapsed(&t0);
+
+    printf("Conversion only:\n");
+    printf("  ax25_str2frame: %8.0f ns/packet\n", t_str * 1e9 / n);
+    printf("  ax25_tnc2frame: %8.0f ns/packet (%.2fx)\n", t_tnc2 * 1e9 / n, t_str / t_tnc2);
+
+    /* Packets as they are in the SPI buffer */
+    for (int i=0; i<npkts; i++) {
+        spilen[i] = 3 + strlen(pkts[i]);
+        memcpy(spi[i], PREFIX, 3);
+        memcpy(spi[i]+3, pkts[i], spilen[i]-3);
+    }
+
+    /* Old receiver: parsed with ax25_str2frame, copied to last_packet */
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int r=0; r<BENCH_ROUNDS; r++)
+        for (int i=0; i<npkts; i++) {
+            char buf[256];
+            FBUF f;
+            uint8_t len = spilen[i];
+            memcpy(buf, spi[i], len);
+            buf[len] = '\0';
+            fbuf_new(&f, SRC_RX);
+            ax25_str2frame(&f, buf+3, len-3);
+            strcpy(last_packet, buf+3);
+            fbuf_release(&f);
+        }
+    t_str = elapsed(&t0);
+
+    /* New receiver: parsed in place, the buffer is the last packet */
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int r=0; r<BENCH_ROUNDS; r++)
+        for (int i=0; i<npkts; i++) {
+            FBUF f;
+            uint8_t next = 1 - last;
+            char* buf = rxbuf[next];
+            uint8_t len = spilen[i];
+            memcpy(buf, spi[i], len);
+            buf[len] = '\0';
+            fbuf_new(&f, SRC_RX);
+            ax25_tnc2frame(&f, buf+3, len-3);
+            last = next;
+            fbuf_release(&f);
+        }
+    t_tnc2 = elapsed(&t0);
+
+    printf("Receive path:\n");
+    printf("  ax25_str2frame: %8.0f ns/packet\n", t_str * 1e9 / n);
+    printf("  ax25_tnc2frame: %8.0f ns/packet (%.2fx)\n", t_tnc2 * 1e9 / n, t_str / t_tnc2);
+}
+
+
+
+int main(int argc, char** argv)
+{
+    for (int i=1; i<argc; i++) {
+        if (strcmp(argv[i], "-v") == 0)
+            verbose = true;
+        else
+            read_file(argv[i]);
+    }
+    if (npkts == 0)
+        for (int i=0; i < sizeof(builtin)/sizeof(builtin[0]); i++)
+            pkts[npkts++] = (char*) builtin[i];
+
+    fbuf_init();
+    if (check() + check_lengths() > 0)
+        return 1;
+    bench();
+    return 0;
+}
@@ -0,0 +1,598 @@
+/*
+ * Offline test of the compressed track store (trackstore.c).
+ * Runs on a host computer (not part of the firmware build):
+ *
+ *   gcc -O2 -Wall -Ihoststub -I../../main -o trackstore_test \
+ *       test_trackstore.c -lm
+ *   ./trackstore_test
+ *
+ * trackstore.c is included here, so that the block codec (static
+ * functions) can be tested directly. Block files are put in TS_DIR
+ * below, and NVS parameters are kept in a table here.
+ *
+ * The codec: Smooth, noisy and worst case tracks are encoded and
+ * decoded. No entry may use more than TSC_MAXENC bytes, and the worst
+ * case must use exactly that. Decoding a block cut at any byte must
+ * give the complete entries before the cut. The decoder state after a
+ * block must let the encoder continue the block (like after a restart).
+ *
+ * The store: Entries are put across block boundaries, read back and
+ * removed, also after a restart with a torn last entry. A store of
+ * uncompressed blocks from an earlier version is read, its last block
+ * is converted, and new entries are added after it.
+ *
+ * Last, a full store of MAX_BLOCKS blocks is made, and the time for a
+ * cache miss (file read and decode, with the mutex held), a full scan,
+ * a one hour query with and without the time index, and a put to the
+ * full store is measured.
+ *
+ * By LA7ECA, ohanssen@acm.org
+ */
+
+#define TS_DIR "/tmp/trklog_test"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include "trackstore.c"
+
+
+#define NPARAMS 8
+#define MAXENTRIES (4 * BLOCK_SIZE)
+
+static posentry_t ent[MAXENTRIES], out[MAXENTRIES];
+static uint8_t buf[MAXENTRIES * TSC_MAXENC + 16];
+static int offs[MAXENTRIES + 1];
+
+
+
+/*******************************************************
+ * NVS parameters and mutex
+ *******************************************************/
+
+static struct {
+    char key[16];
+    uint8_t val[16];
+    size_t len;
+} params[NPARAMS];
+static int nparams = 0;
+
+
+static int find_param(const char* key, bool add)
+{
+    for (int i=0; i<nparams; i++)
+        if (strcmp(params[i].key, key) == 0)
+            return i;
+    if (!add || nparams >= NPARAMS)
+        return -1;
+    strcpy(params[nparams].key, key);
+    return nparams++;
+}
+
+
+void set_bin_param(const char* key, const void* val, size_t len)
+{
+    int i = find_param(key, true);
+    memcpy(params[i].val, val, len);
+    params[i].len = len;
+}
+
+
+int get_bin_param(const char* key, void* val, size_t size, const void* dfl)
+{
+    int i = find_param(key, false);
+    if (i < 0)
+        return 0;
+    memcpy(val, params[i].val, size);
+    return params[i].len;
+}
+
+
+void set_u16_param(const char* key, uint16_t val)
+   { set_bin_param(key, &val, sizeof(val)); }
+
+
+uint16_t get_u16_param(const char* key, const uint16_t dfl)
+{
+    uint16_t val = dfl;
+    get_bin_param(key, &val, sizeof(val), NULL);
+    return val;
+}
+
+
+uint8_t get_byte_param(const char* key, const uint8_t dfl)
+   { return dfl; }
+
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+   { return (SemaphoreHandle_t) 1; }
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+   { return pdTRUE; }
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+   { return pdTRUE; }
+
+
+
+/*******************************************************
+ * Tracks. Smooth: one fix per second along a straight
+ * line. Noisy: irregular intervals, GPS noise, turns.
+ * Worst case: random values in all fields.
+ *******************************************************/
+
+enum { SMOOTH, NOISY, WORST };
+static const char* kname[] = {"smooth", "noisy", "worst case"};
+
+
+static void make_track(posentry_t* e, int n, int kind, uint32_t t)
+{
+    uint32_t lat = 6965000, lng = 1895000;
+    int32_t vlat = 12, vlng = -7;
+    uint16_t alt = 100;
+
+    for (int i=0; i<n; i++) {
+        if (kind == SMOOTH) {
+            t += 1;
+            lat += vlat; lng += vlng;
+        }
+        else if (kind == NOISY) {
+            t += 1 + (rand() % 10 == 0 ? rand() % 600 : rand() % 3);
+            if (rand() % 50 == 0)
+                { vlat = rand() % 200 - 100; vlng = rand() % 200 - 100; }
+            lat += vlat + rand() % 7 - 3;
+            lng += vlng + rand() % 7 - 3;
+            alt += rand() % 5 - 2;
+        }
+        else {
+            t = (uint32_t) rand() << 16 ^ rand();
+            lat = (uint32_t) rand() << 16 ^ rand();
+            lng = (uint32_t) rand() << 16 ^ rand();
+            alt = (i % 2 ? 0 : 65535);
+        }
+        e[i].time = t;
+        e[i].lat = lat;
+        e[i].lng = lng;
+        e[i].altitude = alt;
+        e[i].reserved = 0;
+    }
+}
+
+
+static bool same(posentry_t* a, posentry_t* b, int n)
+   { return memcmp(a, b, n * sizeof(posentry_t)) == 0; }
+
+
+
+/*******************************************************
+ * Codec round trip, one block. offs[i] is the position
+ * of entry i in the encoded block.
+ *******************************************************/
+
+static int encode(ts_codec_t* c, posentry_t* e, int n, int* maxlen)
+{
+    int len = 0;
+    *maxlen = 0;
+    for (int i=0; i<n; i++) {
+        memset(buf + len, 0xAA, TSC_MAXENC + 1);
+        offs[i] = len;
+        int k = encode_entry(c, &e[i], buf + len);
+        if (i > 0 && k > *maxlen)
+            *maxlen = k;
+        if (buf[len + TSC_MAXENC] != 0xAA)
+            *maxlen = TSC_MAXENC + 1;
+        len += k;
+    }
+    offs[n] = len;
+    return len;
+}
+
+
+static int check_codec(int kind)
+{
+    int fails = 0, maxlen, used;
+    ts_codec_t enc1, dec;
+
+    memset(&enc1, 0, sizeof(enc1));
+    make_track(ent, BLOCK_SIZE, kind, 1700000000);
+    int len = encode(&enc1, ent, BLOCK_SIZE, &maxlen);
+    int n = decode_block(&dec, buf, len, out, BLOCK_SIZE, &used);
+    printf("  %-10s %5d bytes, %5.2f bytes/entry, max %2d\n",
+        kname[kind], len, (double) len / BLOCK_SIZE, maxlen);
+
+    if (n != BLOCK_SIZE || used != len || !same(ent, out, n)) {
+        printf("FAIL: %s: decoded %d of %d entries, %d of %d bytes\n",
+            kname[kind], n, BLOCK_SIZE, used, len);
+        fails++;
+    }
+    if (maxlen > TSC_MAXENC || (kind == WORST && maxlen != TSC_MAXENC)) {
+        printf("FAIL: %s: entry of %d bytes, TSC_MAXENC is %d\n", kname[kind], maxlen, TSC_MAXENC);
+        fails++;
+    }
+
+    /* Decoder state must be the encoder state (to continue a block) */
+    if (!same(&dec.prev, &enc1.prev, 1) || dec.n != enc1.n || dec.dtime != enc1.dtime
+          || dec.dlat != enc1.dlat || dec.dlng != enc1.dlng) {
+        printf("FAIL: %s: decoder state differs from encoder state\n", kname[kind]);
+        fails++;
+    }
+
+    /* Block boundary: stop after max entries */
+    for (int max = 1; max < BLOCK_SIZE; max += 97) {
+        n = decode_block(&dec, buf, len, out, max, &used);
+        if (n != max || used != offs[max] || !same(ent, out, n)) {
+            printf("FAIL: %s: max %d: decoded %d entries, %d bytes\n", kname[kind], max, n, used);
+            fails++;
+        }
+    }
+
+    /* Cut at every byte (power loss while writing) */
+    for (int cut = 0; cut < len; cut += (cut < 400 ? 1 : 1 + rand() % 50)) {
+        int k = 0;
+        while (offs[k+1] <= cut)
+            k++;
+        n = decode_block(&dec, buf, cut, out, BLOCK_SIZE, &used);
+        if (n != k || used != offs[k] || !same(ent, out, n)) {
+            printf("FAIL: %s: cut at %d: decoded %d entries, %d bytes, expected %d, %d\n",
+                kname[kind], cut, n, used, k, offs[k]);
+            fails++;
+            break;
+        }
+    }
+    return fails;
+}
+
+
+/* Continue a block with the decoded state, like recover_last() */
+static int check_continue()
+{
+    int fails = 0, maxlen, used;
+    ts_codec_t c;
+
+    memset(&c, 0, sizeof(c));
+    make_track(ent, BLOCK_SIZE, NOISY, 1700000000);
+    int len = encode(&c, ent, 300, &maxlen);
+    decode_block(&c, buf, len, out, BLOCK_SIZE, &used);
+    for (int i=300; i<BLOCK_SIZE; i++)
+        len += encode_entry(&c, &ent[i], buf + len);
+    int n = decode_block(&c, buf, len, out, BLOCK_SIZE, &used);
+    if (n != BLOCK_SIZE || used != len || !same(ent, out, n)) {
+        printf("FAIL: continued block: decoded %d of %d entries\n", n, BLOCK_SIZE);
+        fails++;
+    }
+    return fails;
+}
+
+
+
+/*******************************************************
+ * Store. Positions are converted like in trackstore_put
+ *******************************************************/
+
+static void clear_store()
+{
+    DIR* d = opendir(TS_DIR);
+    struct dirent* de;
+    char fname[300];
+    while (d != NULL && (de = readdir(d)) != NULL)
+        if (de->d_name[0] != '.') {
+            sprintf(fname, "%s/%s", TS_DIR, de->d_name);
+            unlink(fname);
+        }
+    if (d != NULL)
+        closedir(d);
+    nparams = 0;
+    for (int i=0; i<TS_CACHE_BLOCKS; i++)
+        cache[i].valid = false;
+}
+
+
+/* Restart: Files and NVS are kept, RAM is not */
+static void restart()
+{
+    trackstore_stop();
+    for (int i=0; i<TS_CACHE_BLOCKS; i++)
+        cache[i].valid = false;
+    memset(&meta, 0, sizeof(meta));
+    trackstore_start();
+}
+
+
+static void put(posentry_t* e, int n, int kind, uint32_t t)
+{
+    static float lat = 69.65, lng = 18.95;
+    for (int i=0; i<n; i++) {
+        posdata_t p;
+        if (kind == WORST)
+            { lat = (rand() % 9000) / 100.0; lng = (rand() % 18000) / 100.0; }
+        else
+            { lat += 0.0001 + (rand() % 5) * 0.00001; lng -= 0.00007; }
+        t += (kind == WORST ? rand() : 1 + rand() % 3);
+        p.timestamp = t;
+        p.latitude = lat;
+        p.longitude = lng;
+        p.altitude = (kind == WORST ? rand() % 65536 : 100 + rand() % 5);
+        trackstore_put(&p);
+
+        e[i].time = (uint32_t) p.timestamp;
+        e[i].lat = p.latitude * POS_RESOLUTION;
+        e[i].lng = p.longitude * POS_RESOLUTION;
+        e[i].altitude = p.altitude;
+        e[i].reserved = 0;
+    }
+}
+
+
+static int read_all(posentry_t* e, int max)
+{
+    ts_cursor_t c;
+    int n = 0, k;
+    trackstore_cursor(&c);
+    while ((k = trackstore_read(&c, e + n, (max - n < 100 ? max - n : 100))) > 0)
+        n += k;
+    return n;
+}
+
+
+static int check_read(const char* what, posentry_t* exp, int n)
+{
+    int k = read_all(out, MAXENTRIES);
+    if (k != n || !same(exp, out, n) || trackstore_nEntries() != n) {
+        int i = 0;
+        while (i < n && i < k && same(&exp[i], &out[i], 1))
+            i++;
+        printf("FAIL: %s: read %d of %d entries (%d counted), first difference at %d\n",
+            what, k, n, trackstore_nEntries(), i);
+        return 1;
+    }
+    return 0;
+}
+
+
+static int check_remove(const char* what, posentry_t* exp, int n)
+{
+    posentry_t e;
+    for (int i=0; i<n; i++)
+        if (trackstore_getEnt(&e) == NULL || !same(&e, &exp[i], 1)) {
+            printf("FAIL: %s: entry %d of %d removed wrong\n", what, i, n);
+            return 1;
+        }
+    return 0;
+}
+
+
+static int check_store()
+{
+    int fails = 0, n = 2 * BLOCK_SIZE + 300;
+
+    clear_store();
+    trackstore_start();
+    put(ent, n, NOISY, 1700000000);
+    fails += check_read("new store", ent, n);
+    restart();
+    fails += check_read("after restart", ent, n);
+
+    /* Worst case entries, a full staging buffer per write */
+    trackstore_setFlush(TS_STAGE_MAX);
+    put(ent + n, 500, WORST, 1700100000);
+    n += 500;
+    fails += check_read("worst case", ent, n);
+    restart();
+    fails += check_read("worst case, after restart", ent, n);
+
+    /* Power loss while writing: Cut the last entry */
+    trackstore_setFlush(1);
+    put(ent + n, 1, WORST, 1700200000);
+    trackstore_flush();
+    char fname[64];
+    struct stat st;
+    blk_fname(fname, meta.lastblk);
+    stat(fname, &st);
+    truncate(fname, st.st_size - 1);
+    restart();
+    fails += check_read("torn entry", ent, n);
+
+    /* Continue the block, remove across blocks */
+    put(ent + n, BLOCK_SIZE, NOISY, 1700300000);
+    n += BLOCK_SIZE;
+    fails += check_read("continued", ent, n);
+    int nblocks = meta.nblocks;
+    fails += check_remove("continued", ent, 1500);
+    restart();
+    fails += check_read("removed, after restart", ent + 1500, n - 1500);
+    fails += check_remove("rest", ent + 1500, n - 1500);
+    if (trackstore_getEnt(out) != NULL || trackstore_nEntries() != 0) {
+        printf("FAIL: store not empty\n");
+        fails++;
+    }
+    trackstore_stop();
+    printf("  store: %d entries in %d blocks\n", n, nblocks);
+    return fails;
+}
+
+
+
+/*******************************************************
+ * Store from an earlier version: 3 uncompressed blocks,
+ * the last one not full, 10 entries removed.
+ *******************************************************/
+
+static int check_old()
+{
+    int fails = 0, nlast = 100, first = 10;
+    int n = 2 * TS_OLD_BLOCK_SIZE + nlast;
+    ts_meta_t m = { .nblocks = 3, .first = first, .last = nlast, .lastblk = 2, .firstblk = 0 };
+    char fname[64];
+    struct stat st;
+
+    clear_store();
+    mkdir(TS_DIR, 0755);
+    make_track(ent, n, NOISY, 1600000000);
+    for (int b=0; b<3; b++) {
+        blk_fname(fname, b);
+        FILE* f = fopen(fname, "w");
+        fwrite(ent + b * TS_OLD_BLOCK_SIZE, sizeof(posentry_t), (b < 2 ? TS_OLD_BLOCK_SIZE : nlast), f);
+        fclose(f);
+    }
+    set_bin_param("tracks.META", &m, sizeof(m));
+
+    trackstore_start();
+    blk_fname(fname, 2);
+    stat(fname, &st);
+    if (nold != 2 || st.st_size >= nlast * sizeof(posentry_t)) {
+        printf("FAIL: old store: nold=%d, last block %d bytes\n", nold, (int) st.st_size);
+        fails++;
+    }
+    fails += check_read("old store", ent + first, n - first);
+
+    /* Fill the converted block and add one more */
+    put(ent + n, BLOCK_SIZE - nlast + 200, NOISY, 1700000000);
+    n += BLOCK_SIZE - nlast + 200;
+    fails += check_read("old store, added", ent + first, n - first);
+    restart();
+    fails += check_read("old store, after restart", ent + first, n - first);
+
+    /* Remove the old blocks */
+    fails += check_remove("old store", ent + first, 2 * TS_OLD_BLOCK_SIZE - first + 5);
+    first = 2 * TS_OLD_BLOCK_SIZE + 5;
+    if (nold != 0) {
+        printf("FAIL: old store: nold=%d after removing old blocks\n", nold);
+        fails++;
+    }
+    fails += check_read("old blocks removed", ent + first, n - first);
+    restart();
+    fails += check_read("old blocks removed, after restart", ent + first, n - first);
+    trackstore_stop();
+    return fails;
+}
+
+
+
+/*******************************************************
+ * Speed with a full store: MAX_BLOCKS blocks of a noisy
+ * track, written directly to the block files.
+ *******************************************************/
+
+static double elapsed(struct timespec* t0)
+{
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) * 1e-9;
+}
+
+
+#define BENCH_LOADS 2000
+#define BENCH_PUTS  (5 * MAXENTRIES)
+
+static void bench()
+{
+    ts_meta_t m = { .nblocks = MAX_BLOCKS, .first = 0, .last = BLOCK_SIZE - 24,
+                    .lastblk = MAX_BLOCKS - 1, .firstblk = 0 };
+    uint32_t t = 1600000000, tmid = 0;
+    long bytes = 0, nent = 0;
+    struct timespec t0;
+    char fname[64];
+    ts_codec_t c;
+    int maxlen, k, used;
+
+    clear_store();
+    mkdir(TS_DIR, 0755);
+    for (int b=0; b<MAX_BLOCKS; b++) {
+        int n = (b == MAX_BLOCKS - 1 ? m.last : BLOCK_SIZE);
+        make_track(ent, n, NOISY, t);
+        t = ent[n-1].time;
+        if (b == MAX_BLOCKS / 2)
+            tmid = t;
+        memset(&c, 0, sizeof(c));
+        int len = encode(&c, ent, n, &maxlen);
+        blk_fname(fname, b);
+        FILE* f = fopen(fname, "w");
+        fwrite(buf, 1, len, f);
+        fclose(f);
+        bytes += len;
+        nent += n;
+    }
+    set_bin_param("tracks.META", &m, sizeof(m));
+    set_u16_param("tracks.NOLD", 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    trackstore_start();
+    double t_start = elapsed(&t0);
+    printf("\n  Full store: %ld entries in %d blocks, %ld KB, %.2f bytes/entry\n",
+        nent, MAX_BLOCKS, bytes / 1024, (double) bytes / nent);
+    printf("  start (recover last block)   %8.2f ms\n", t_start * 1e3);
+
+    /* Decoding one block in RAM */
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i=0; i<BENCH_LOADS; i++)
+        k = decode_block(&c, buf, bytes / MAX_BLOCKS, out, BLOCK_SIZE, &used);
+    printf("  decode block in RAM          %8.2f us\n", elapsed(&t0) * 1e6 / BENCH_LOADS);
+
+    /* Cache miss: read and decode a block (the mutex is held) */
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i=0; i<BENCH_LOADS; i++) {
+        for (int j=0; j<TS_CACHE_BLOCKS; j++)
+            cache[j].valid = false;
+        get_block(rand() % MAX_BLOCKS, (uint16_t*) &k);
+    }
+    printf("  cache miss (file + decode)   %8.2f us\n", elapsed(&t0) * 1e6 / BENCH_LOADS);
+
+    /* Full scan with the cursor, cold */
+    tidx_clear();
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    ts_cursor_t cur;
+    int n = 0;
+    trackstore_cursor(&cur);
+    while ((k = trackstore_read(&cur, out, 1000)) > 0)
+        n += k;
+    printf("  full scan, %6d entries     %8.2f ms\n", n, elapsed(&t0) * 1e3);
+
+    /* One hour in the middle, cold (index unknown) and warm */
+    for (int warm=0; warm<2; warm++) {
+        ts_query_t q;
+        if (!warm)
+            tidx_clear();
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        trackstore_query(&q, tmid, tmid + 3600, 1);
+        n = 0;
+        while ((k = trackstore_range(&q, out, 1000)) > 0)
+            n += k;
+        printf("  1 hour query, %s, %4d ent %8.2f ms\n", (warm ? "warm" : "cold"), n,
+            elapsed(&t0) * 1e3);
+    }
+
+    /* Put to a full store, the oldest entry is removed (and logged) each time */
+    freopen("/dev/null", "w", stderr);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i=0; i<BENCH_PUTS; i += MAXENTRIES)
+        put(ent, MAXENTRIES, NOISY, t + i * 3);
+    printf("  put, store full              %8.2f us\n", elapsed(&t0) * 1e6 / BENCH_PUTS);
+    trackstore_stop();
+
+    printf("\n  RAM: cache %d KB, time index %d KB, staging %d KB\n",
+        (int) (TS_CACHE_BLOCKS * BLOCK_SIZE * sizeof(posentry_t) / 1024),
+        (int) (sizeof(tindex) / 1024), (int) ((sizeof(stage) + sizeof(encbuf)) / 1024));
+    clear_store();
+}
+
+
+
+int main(int argc, char** argv)
+{
+    int fails = 0;
+    printf("  1024 entry blocks:\n");
+    for (int k = SMOOTH; k <= WORST; k++)
+        fails += check_codec(k);
+    fails += check_continue();
+    fails += check_store();
+    fails += check_old();
+    printf("%d failures\n", fails);
+    if (fails > 0)
+        return 1;
+    bench();
+    return 0;
+}
@@ -578,7 +578,7 @@ static void send_header(FBUF* packet, bool no_tx)
     addr_t from, to; 
     char call[10];
     
-    get_str_param("MYCALL", call, 10, DFL_MYCALL); 
+    config_str(CFG_MYCALL, call, 10);
     str2addr(&from, call, false); 
     get_str_param("DEST", call, 10, DFL_DEST);
     str2addr(&to, call, false); 
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <string.h>
 #include "system.h"
 #include "config.h"
 #include "gps.h"
@@ -140,108 +141,187 @@ static void remove_old() {
 
 
 /********************************************************
- *  Send positions to server using a HTTP POST call
- *  and JSON.
+ *  Serialise track-log entries for upload. 
+ *
+ *  JSON format: 
+ *    {"call":<call>, "pos":[{"time":.., "lat":.., "lng":..}, ...]}
+ *
+ *  Binary format (if TRKLOG.BIN.on): 
+ *    "ATB1", call (null terminated), and for each entry: 
+ *    the difference from the previous entry (zero for the 
+ *    first) of time, lat, lng and altitude, each as a 
+ *    zigzag-encoded varint (LEB128). 
+ *
+ *  Entries are read directly from the track store, from 
+ *  the oldest and at most TRKLOG_BATCH of them. They are
+ *  not removed until the server has accepted the POST. 
  ********************************************************/
 
-int tracklog_post() {
-    char call[10];
-    const int bufsize = JS_CHUNK_SIZE * JS_RECORD_SIZE + JS_HEAD + 50;
-    char* buf = malloc(bufsize);
-    char url[64]; 
-    int len = 0, i=0;
-    posentry_t pd; 
+typedef struct {
+    char         call[10];
+    bool         bin; 
+    uint8_t      stage;        /* 0=head, 1=entries, 2=tail, 3=end */
+    ts_cursor_t  start, cur; 
+    posentry_t   ent[TRKLOG_READ_SIZE], prev;
+    int          nent, ient;   /* Entries in ent and next to use */
+    int          n;            /* Entries serialised */
+    int          max;
+} upload_t;
 
-    /* Check malloc result */
-    if (buf == NULL) {
-        ESP_LOGE(TAG, "Failed to allocate memory for tracklog buffer");
-        return 0;
+static upload_t upl; 
+
+
+
+static void upload_rewind(void* arg) {
+    upload_t* u = (upload_t*) arg;
+    u->cur = u->start;
+    u->stage = 0;
+    u->nent = u->ient = u->n = 0;
+    memset(&u->prev, 0, sizeof(posentry_t));
+}
+
+
+static int put_varint(char* buf, int32_t x) {
+    uint32_t z = ((uint32_t) x << 1) ^ (uint32_t) (x >> 31); 
+    int i = 0;
+    while (z >= 0x80) {
+        buf[i++] = (char) (z | 0x80);
+        z >>= 7;
     }
+    buf[i++] = (char) z;
+    return i;
+}
 
-    /* If empty, just return */
-    if (trackstore_getEnt(&pd) == NULL) {
-        free(buf);
-        return 0;
+
+/* Get the next entry. Return 0 if no more, -1 if error */
+static int next_entry(upload_t* u, posentry_t** e) {
+    if (u->ient >= u->nent) {
+        int k = u->max - u->n;
+        if (k <= 0)
+            return 0;
+        u->nent = trackstore_read(&u->cur, u->ent, (k < TRKLOG_READ_SIZE ? k : TRKLOG_READ_SIZE));
+        u->ient = 0;
+        if (u->nent <= 0)
+            return u->nent;
     }
-    
-    /* Get settings */
-    get_str_param("MYCALL", call, 10, DFL_MYCALL);
-    get_str_param("TRKLOG.URL", url, 64, DFL_TRKLOG_URL);
+    *e = &u->ent[u->ient++];
+    u->n++;
+    return 1;
+}
 
-    /* 
-     * Serialise as JSON: 
-     *   (call, list-of (call, time, lat, lng))
-     */
-    int n = snprintf(buf+len, bufsize-len, "{\"call\":\"%s\", \"pos\":[\n", call);
-    if (n < 0 || n >= bufsize-len) {
-        ESP_LOGE(TAG, "Buffer overflow in tracklog_post header");
-        free(buf);
-        return 0;
+
+static int upload_read(void* arg, char* buf, int size) {
+    upload_t* u = (upload_t*) arg;
+    posentry_t* e;
+    int len = 0, r;
+    
+    if (u->stage == 0) {
+        if (u->bin) 
+            len = sprintf(buf, "ATB1%s", u->call) + 1;
+        else
+            len = sprintf(buf, "{\"call\":\"%s\", \"pos\":[\n", u->call);
+        u->stage = 1;
     }
-    len += n;
-    for (;;) {
-        n = snprintf(buf+len, bufsize-len, "{\"time\":%lu, \"lat\":%lu, \"lng\":%lu}", pd.time, pd.lat, pd.lng);
-        if (n < 0 || n >= bufsize-len) {
-            ESP_LOGE(TAG, "Buffer overflow in tracklog_post record");
+    while (u->stage == 1 && size - len >= JS_RECORD_SIZE) {
+        if ((r = next_entry(u, &e)) < 0)
+            return -1; 
+        if (r == 0) {
+            u->stage = 2;
             break;
         }
-        len += n;
-        if (++i >= JS_CHUNK_SIZE)
-            break;
-        if (trackstore_getEnt(&pd) == NULL)
-            break;
-        n = snprintf(buf+len, bufsize-len, ",\n");
-        if (n < 0 || n >= bufsize-len) {
-            ESP_LOGE(TAG, "Buffer overflow in tracklog_post separator");
-            break;
+        if (u->bin) {
+            len += put_varint(buf+len, (int32_t) (e->time - u->prev.time));
+            len += put_varint(buf+len, (int32_t) (e->lat - u->prev.lat));
+            len += put_varint(buf+len, (int32_t) (e->lng - u->prev.lng));
+            len += put_varint(buf+len, (int32_t) e->altitude - (int32_t) u->prev.altitude);
+            u->prev = *e;
         }
-        len += n;
+        else 
+            len += sprintf(buf+len, "%s{\"time\":%lu, \"lat\":%lu, \"lng\":%lu}", 
+                 (u->n > 1 ? ",\n" : ""), e->time, e->lat, e->lng);
     }
-    n = snprintf(buf+len, bufsize-len, "]}");
-    if (n >= 0 && n < bufsize-len) {
-        len += n;
+    if (u->stage == 2 && size - len >= 2) {
+        if (!u->bin)
+            len += sprintf(buf+len, "]}");
+        u->stage = 3;
     }
+    return len;
+}
+
+
+
+/********************************************************
+ *  Send positions to server using a HTTP POST call. 
+ *  Content is serialised while sending. Entries are 
+ *  removed from the store only if the server returns 
+ *  200. Returns the number of entries posted or -1 if 
+ *  the post failed. 
+ ********************************************************/
+
+int tracklog_post() {
+    char url[64]; 
+    rest_body_t body = { upload_read, upload_rewind, &upl };
+
+    trackstore_cursor(&upl.start);
+    upl.max = trackstore_nEntries();
+    if (upl.max > TRKLOG_BATCH)
+        upl.max = TRKLOG_BATCH;
     
+    /* If empty, just return */
+    if (upl.max <= 0)
+        return 0;
     
+    /* Get settings */
+    get_str_param("MYCALL", upl.call, 10, DFL_MYCALL);
+    get_str_param("TRKLOG.URL", url, 64, DFL_TRKLOG_URL);
+    upl.bin = GET_BOOL_PARAM("TRKLOG.BIN.on", DFL_TRKLOG_BIN_ON);
+
+    int status = rest_post_stream(url, "arctic", 
+        (upl.bin ? "application/octet-stream" : "application/json"), &body, "TRKLOG.KEY");
     
-    /* Post it */
-    for (int j=0; j<3; j++) {
-        int status = rest_post(url, "arctic", buf, len, "TRKLOG.KEY");
-    
-        if (status == 200) {
-            ESP_LOGI(TAG, "Posted track-log (%d bytes/%d entries) to %s", len, i, url);
-            sprintf(statusmsg, "Posted %d reports OK", i);
-            posted += i;
-            break;
-        }
-        else {
-            ESP_LOGW(TAG, "Post of track-log failed. Status=%d", status);
-            sprintf(statusmsg, "Post failed. code=%d", status);
-            /* Wait one minute */
-            sleepMs(1000 * 60);
-        }
+    if (status == 200 && upl.stage == 3) {
+        /* Move the start of the store past the posted entries */
+        trackstore_removeUntil(&upl.cur);
+        ESP_LOGI(TAG, "Posted track-log (%d entries) to %s", upl.n, url);
+        sprintf(statusmsg, "Posted %d reports OK", upl.n);
+        posted += upl.n;
+        return upl.n;
     }
-    free(buf);
-    return i;
+    ESP_LOGW(TAG, "Post of track-log failed. Status=%d", status);
+    sprintf(statusmsg, "Post failed. code=%d", status);
+    return -1;
 }
 
 
 
 
+/********************************************************
+ *  Post entries while connected. If a full batch was 
+ *  posted, there may be more: post the next right away.
+ *  If post failed, retry with increasing delays. 
+ ********************************************************/
 
 static void post_loop() 
 {       
+    uint32_t backoff = TRKLOG_RETRY_MIN;
     sleepMs(5000);    
     ESP_LOGI(TAG, "Starting trklog POST task");
     sprintf(statusmsg, "POST task running");
     trackpost_running = true;
     while (wifi_isConnected() && GET_BOOL_PARAM("TRKLOG.POST.on", DFL_TRKLOG_POST_ON)) {
         int n = tracklog_post();
+        if (n < 0) {
+            sleepMs(backoff * 1000);
+            if (backoff < TRKLOG_RETRY_MAX)
+                backoff *= 2;
+            continue;
+        }
+        backoff = TRKLOG_RETRY_MIN;
         if (n == 0)
             sleepMs(1000 * 240);
         else if (n < 24) 
             sleepMs(1000 * 90);
-        else
+        else if (n < TRKLOG_BATCH)
             sleepMs(1000 * 20);
     }
     trackpost_running = false;
@@ -249,6 +329,3 @@ static void post_loop()
     sprintf(statusmsg, "POST task stopped");   
     vTaskDelete(NULL);
 }
-
-
-
@@ -1,9 +1,15 @@
 
 
-/* 796 byte buffer */
-#define JS_CHUNK_SIZE 128
-#define JS_RECORD_SIZE 64
-#define JS_HEAD 28
+/* Max entries in one POST, entries read from store at a time */
+#define TRKLOG_BATCH      1024
+#define TRKLOG_READ_SIZE  16
+
+/* Max size of a serialised entry */
+#define JS_RECORD_SIZE 72
+
+/* Retry delays (seconds) after failed POST */
+#define TRKLOG_RETRY_MIN  15
+#define TRKLOG_RETRY_MAX  600
 
 
  
@@ -1,25 +1,125 @@
 
 #include <unistd.h>
 #include <string.h>
+#include <stdlib.h>
+#include <math.h>
 #include <inttypes.h>
 #include "system.h"
 #include "gps.h"
 #include "config.h"
 #include "trackstore.h"
 #include "errno.h"
+#include "esp_heap_caps.h"
 #include <sys/stat.h>
+
+/* Directory of block files. Host tests may use another directory */
+#if !defined TS_DIR
+#define TS_DIR "/files/trklog"
+#endif
  
 static mutex_t mutex;
 static ts_meta_t meta;
 static posentry_t prev;
 static FILE *lastfile=NULL, *firstfile=NULL;
 
+
+/* 
+ * Read cache of whole blocks. The least recently used 
+ * block is replaced. 
+ */
+typedef struct _cblock {
+    blkno_t     blk;
+    uint16_t    n;       /* Number of entries in block */
+    bool        valid;
+    uint32_t    used; 
+    posentry_t *ent;
+} ts_cblock_t;
+
+static ts_cblock_t cache[TS_CACHE_BLOCKS];
+static uint32_t cache_clock = 0;
+
+
+/* 
+ * Time index. Min and max time of each block in the store. 
+ * It is a ring indexed by the distance from the first block. 
+ * Unknown if tmin and tmax are 0. It is filled in when 
+ * a block is loaded into the cache. 
+ */
+typedef struct _tindex {
+    uint32_t tmin, tmax;
+} ts_tindex_t;
+
+#define TINDEX_SIZE (MAX_BLOCKS+1)
+static ts_tindex_t tindex[TINDEX_SIZE];
+static uint16_t tindex_head = 0;
+
+#define TINDEX_UNKNOWN(x) ((x)->tmin == 0 && (x)->tmax == 0)
+
+
+/* 
+ * Staging buffer. New entries are kept in RAM and written to the 
+ * last block in one go: When there are 'flushlim' entries, when 
+ * the block is full or when the store is flushed. Metadata is 
+ * saved when blocks are added or removed, not for each write. 
+ * The number of entries in the last block is found from the 
+ * file size at startup. 
+ */
+static posentry_t stage[TS_STAGE_MAX];
+static uint16_t nstage = 0;
+static uint16_t flushlim = DFL_TRKLOG_FLUSH;
+static bool meta_dirty = false;
+static ts_stats_t stats;
+
+
+/* 
+ * Compressed blocks. The first entry of a block (keyframe) is 
+ * stored as is. Each of the following entries is stored as a flag 
+ * byte followed by zigzag varints for the fields that are not zero: 
+ * Time and position as the difference from the predicted value 
+ * (previous value plus previous change) and altitude as the 
+ * difference from the previous value. 
+ *
+ * The first 'nold' blocks of the store are uncompressed blocks 
+ * from earlier versions. 
+ */
+typedef struct _codec {
+    posentry_t prev;
+    uint32_t   dtime, dlat, dlng;
+    uint16_t   n;
+} ts_codec_t;
+
+#define TSC_TIME   0x01
+#define TSC_LAT    0x02
+#define TSC_LNG    0x04
+#define TSC_ALT    0x08
+#define TSC_MAXENC 19
+
+static ts_codec_t enc;
+static uint8_t encbuf[TS_STAGE_MAX * TSC_MAXENC];
+static uint16_t nold = 0;
+
+
 static bool check_rblock();
 static FILE* open_block(blkno_t blk, char* perm);
 static void delete_block(blkno_t blk);
-static void write_entry(posentry_t* entr, FILE* f);
-static bool read_entry(posentry_t* entr, FILE* f, uint16_t pos);
+static void blk_fname(char* fname, blkno_t blk);
+static void commit();
+static void save_meta();
+static void recover_last();
+static void convert_last();
+static int encode_entry(ts_codec_t* c, posentry_t* e, uint8_t* buf);
+static int decode_block(ts_codec_t* c, uint8_t* buf, int len, posentry_t* out, int max, int* used);
+static bool blk_old(blkno_t blk);
+static uint16_t blk_cap(blkno_t blk);
+static void set_nold(uint16_t n);
+static bool read_entry(posentry_t* entr, blkno_t blk, uint16_t pos);
+static posentry_t* get_block(blkno_t blk, uint16_t* n);
+static void cache_append(blkno_t blk, posentry_t* entr, uint16_t pos);
+static ts_tindex_t* tidx(blkno_t blk);
+static void tidx_update(ts_tindex_t* x, uint32_t t);
+static void tidx_clear();
 static void reset_empty();
+static void* ts_malloc(size_t size);
 
 #define TAG "trackstore"
 
@@ -37,6 +137,9 @@ void trackstore_start() {
     meta.lastblk = meta.firstblk = 0;
     meta.nblocks = 1;
     prev.time = prev.lat = prev.lng = prev.altitude = 0;
+    nstage = 0;
+    memset(&enc, 0, sizeof(enc));
+    tidx_clear();
     
     /* Get metadata from nvs */
     get_bin_param("tracks.META", &meta, sizeof(ts_meta_t), NULL);
@@ -44,9 +147,20 @@ void trackstore_start() {
              meta.first, meta.last, meta.firstblk, meta.lastblk, meta.nblocks);
     
     /* Create directory if necessary */
-    if (mkdir("/files/trklog", 0755))
+    if (mkdir(TS_DIR, 0755))
         ESP_LOGI(TAG, "Created trklog file directory");
     
+    flushlim = get_byte_param("TRKLOG.FLUSH", DFL_TRKLOG_FLUSH);
+    if (flushlim < 1 || flushlim > TS_STAGE_MAX)
+        flushlim = DFL_TRKLOG_FLUSH;
+    
+    /* First start with compression: Existing blocks are uncompressed */
+    nold = get_u16_param("tracks.NOLD", MAX_UINT16);
+    if (nold == MAX_UINT16) 
+        set_nold((meta.firstblk == meta.lastblk && meta.first == meta.last) ? 0 : meta.nblocks);
+    recover_last();
+    convert_last();
+    
     /* Open file(s) */
     firstfile = open_block(meta.firstblk, "a+");
     if (firstfile == NULL) {
@@ -89,11 +203,15 @@ void trackstore_reset() {
     meta.first = meta.last = 0; 
     meta.lastblk = meta.firstblk = 0;
     meta.nblocks = 1;
+    nstage = 0;
+    memset(&enc, 0, sizeof(enc));
+    set_nold(0);
+    tidx_clear();
     lastfile = firstfile = open_block(meta.lastblk, "a+");
     if (lastfile == NULL) {
         ESP_LOGE(TAG, "Failed to open block file after reset");
     }
-    set_bin_param("tracks.META", &meta, sizeof(ts_meta_t));
+    save_meta();
     mutex_unlock(mutex);
 }
 
@@ -104,7 +222,12 @@ void trackstore_reset() {
  ******************************************************/
 
 void trackstore_stop() {
+    if (mutex == NULL)
+        return;
     mutex_lock(mutex); 
+    commit();
+    if (meta_dirty)
+        save_meta();
     if (lastfile != NULL) {
         fclose(lastfile);
         lastfile = NULL;
@@ -118,12 +241,60 @@ void trackstore_stop() {
 
 
 
+/******************************************************
+ * Write staged entries and metadata now. Called from 
+ * systemShutdown() and systemRestart(), which may 
+ * happen before the store is started. 
+ ******************************************************/
+
+void trackstore_flush() {
+    if (mutex == NULL)
+        return;
+    mutex_lock(mutex);
+    commit();
+    if (meta_dirty)
+        save_meta();
+    mutex_unlock(mutex);
+}
+
+
+
+/******************************************************
+ * Set number of entries to stage before writing
+ ******************************************************/
+
+void trackstore_setFlush(uint8_t n) {
+    if (n < 1 || n > TS_STAGE_MAX || mutex == NULL)
+        return;
+    mutex_lock(mutex);
+    flushlim = n;
+    if (nstage >= flushlim)
+        commit();
+    mutex_unlock(mutex);
+}
+
+
+
+/******************************************************
+ * Write statistics
+ ******************************************************/
+
+void trackstore_getStats(ts_stats_t* st) {
+    mutex_lock(mutex);
+    *st = stats;
+    mutex_unlock(mutex);
+}
+
+
+
 /******************************************************
  * number of entries
  ******************************************************/
 
 int trackstore_nEntries() {
-    return (meta.nblocks-1) * BLOCK_SIZE + meta.last - meta.first;
+    int nfull = meta.nblocks - 1;
+    return nfull * BLOCK_SIZE + meta.last - meta.first
+        - (nold < nfull ? nold : nfull) * (BLOCK_SIZE - TS_OLD_BLOCK_SIZE);
 }
 
 
@@ -145,6 +316,7 @@ void trackstore_put(posdata_t *x) {
     entry.lat = x->latitude * POS_RESOLUTION;
     entry.lng = x->longitude * POS_RESOLUTION;
     entry.altitude = x->altitude;
+    entry.reserved = 0;
     
     /* Drop it if no change in position within the last 60 seconds */
     if (entry.lat == prev.lat && entry.lng == prev.lng && 
@@ -165,10 +337,13 @@ void trackstore_put(posdata_t *x) {
     /* if block is full, add a new one */
     if (meta.last >= BLOCK_SIZE) {
         ESP_LOGD(TAG, "put - switch block");
+        commit();
         if (meta.firstblk != meta.lastblk)
             fclose(lastfile);
         meta.lastblk = (meta.lastblk + 1) % MAX_UINT16;
         meta.nblocks++;
+        tidx(meta.lastblk)->tmin = UINT32_MAX;
+        tidx(meta.lastblk)->tmax = 0;
         lastfile = open_block(meta.lastblk, "a+");
         if (lastfile == NULL) {
             ESP_LOGE(TAG, "Failed to open new block file");
@@ -178,12 +353,18 @@ void trackstore_put(posdata_t *x) {
             return;
         }
         meta.last = 0;
+        memset(&enc, 0, sizeof(enc));
+        save_meta();
     } 
     
-    /* Append the entry to the file */
+    /* Add the entry to the staging buffer. Write if full */
     meta.last++;
-    write_entry(&entry, lastfile);
-    set_bin_param("tracks.META", &meta, sizeof(ts_meta_t));    
+    stage[nstage++] = entry;
+    stats.fixes++;
+    cache_append(meta.lastblk, &entry, meta.last-1);
+    tidx_update(tidx(meta.lastblk), entry.time);
+    if (nstage >= flushlim || meta.last >= BLOCK_SIZE)
+        commit();
     
     if (meta.nblocks >= MAX_BLOCKS && meta.last >= 1) {
         ESP_LOGW(TAG, "put - store is full, removing oldest");
@@ -214,17 +395,251 @@ posentry_t* trackstore_getEnt(posentry_t* pbuf) {
     if (!check_rblock()) 
         { mutex_unlock(mutex); return NULL; }
         
-    bool readok = read_entry(pbuf, firstfile, meta.first);
+    bool readok = read_entry(pbuf, meta.firstblk, meta.first);
     meta.first++;
-    set_bin_param("tracks.META", &meta, sizeof(ts_meta_t));
+    meta_dirty = true;
     mutex_unlock(mutex); 
     return (readok? pbuf : NULL);
 }
 
 
+/****************************************************** 
+ * Set a cursor to the oldest entry in the store
+ ******************************************************/
+
+void trackstore_cursor(ts_cursor_t* c) {
+    mutex_lock(mutex);
+    c->blk = meta.firstblk; 
+    c->pos = meta.first;
+    mutex_unlock(mutex);
+}
+
+
+
+/********************************************************** 
+ * Read up to max entries starting at the cursor, without 
+ * removing them, and advance the cursor. Entries are 
+ * copied from the block cache. Returns the number of 
+ * entries read (0 at the end of the store) or -1 on error. 
+ **********************************************************/
+
+int trackstore_read(ts_cursor_t* c, posentry_t* buf, int max) {
+    int n = 0;
+    uint16_t cnt;
+    mutex_lock(mutex);
+    while (n < max) {
+        if (c->blk == meta.lastblk && c->pos >= meta.last)
+            break;
+        if (c->pos >= BLOCK_SIZE) {
+            c->blk = (c->blk + 1) % MAX_UINT16;
+            c->pos = 0; 
+            continue;
+        }
+        uint16_t end = (c->blk == meta.lastblk ? meta.last : BLOCK_SIZE);
+        posentry_t* b = get_block(c->blk, &cnt);
+        if (b == NULL || cnt <= c->pos) {
+            ESP_LOGE(TAG, "read - error reading block %d", c->blk);
+            n = -1; break;
+        }
+        if (end > cnt)
+            end = cnt;
+        int k = (max-n < end - c->pos ? max-n : end - c->pos);
+        memcpy(buf+n, b + c->pos, k * sizeof(posentry_t));
+        n += k;
+        c->pos += k;
+        if (c->pos == cnt && cnt < BLOCK_SIZE && c->blk != meta.lastblk)
+            c->pos = BLOCK_SIZE;   /* Short block */
+    }
+    mutex_unlock(mutex);
+    return n;
+}
+
+
+
+/********************************************************** 
+ * Remove entries before the cursor. Entries that are 
+ * already removed (by TTL or when full) are ignored. 
+ **********************************************************/
+
+void trackstore_removeUntil(ts_cursor_t* c) {
+    mutex_lock(mutex);
+    while (!(meta.firstblk == meta.lastblk && meta.first == meta.last)) {
+        uint16_t d = (c->blk + MAX_UINT16 - meta.firstblk) % MAX_UINT16;
+        if (d > MAX_BLOCKS) 
+            break;  /* Cursor is before the oldest entry */
+        if (d == 0) {
+            uint16_t pos = (meta.firstblk == meta.lastblk && c->pos > meta.last ? meta.last : c->pos);
+            if (pos > meta.first)
+                meta.first = pos;
+            if (meta.firstblk == meta.lastblk || meta.first < blk_cap(meta.firstblk) || !check_rblock())
+                break;
+            continue;
+        }
+        /* Cursor is in a later block. Remove rest of this */
+        meta.first = BLOCK_SIZE;
+        if (!check_rblock())
+            break;
+    }
+    if (meta.firstblk == meta.lastblk && meta.first == meta.last)
+        reset_empty();
+    save_meta();
+    mutex_unlock(mutex);
+}
+
+
+
+/********************************************************** 
+ * Start a query for entries with time between from and 
+ * to (inclusive). Take every Nth matching entry. 
+ **********************************************************/
+
+void trackstore_query(ts_query_t* q, uint32_t from, uint32_t to, uint16_t every) {
+    q->from = from; 
+    q->to = to; 
+    q->every = (every < 1 ? 1 : every);
+    q->skip = 0;
+    trackstore_cursor(&q->c);
+}
+
+
+
+/********************************************************** 
+ * Get up to max entries matching the query, without 
+ * removing them from the store. Blocks outside the time 
+ * window are skipped using the time index. Can be called 
+ * repeatedly to get more entries. Returns the number of 
+ * entries found, 0 when there are no more. 
+ **********************************************************/
+
+int trackstore_range(ts_query_t* q, posentry_t* buf, int max) {
+    int n = 0;
+    uint16_t cnt;
+    ts_cursor_t* c = &q->c;
+    mutex_lock(mutex);
+    
+    /* Entries may have been removed since last call */
+    uint16_t d = (c->blk + MAX_UINT16 - meta.firstblk) % MAX_UINT16;
+    if (d > MAX_BLOCKS || (d == 0 && c->pos < meta.first)) {
+        c->blk = meta.firstblk;
+        c->pos = meta.first; 
+    }
+    
+    while (n < max) {
+        if (c->blk == meta.lastblk && c->pos >= meta.last)
+            break;
+        if (c->pos >= BLOCK_SIZE) {
+            c->blk = (c->blk + 1) % MAX_UINT16;
+            c->pos = 0; 
+            continue;
+        }
+        ts_tindex_t* x = tidx(c->blk);
+        if (!TINDEX_UNKNOWN(x) && (x->tmax < q->from || x->tmin > q->to)) {
+            c->pos = BLOCK_SIZE; 
+            continue;
+        }
+        posentry_t* b = get_block(c->blk, &cnt);
+        if (b == NULL) {
+            ESP_LOGW(TAG, "range - skipping unreadable block %d", c->blk);
+            c->pos = BLOCK_SIZE; 
+            continue;
+        }
+        uint16_t end = (c->blk == meta.lastblk ? meta.last : BLOCK_SIZE);
+        if (end > cnt)
+            end = cnt;
+        while (c->pos < end && n < max) {
+            posentry_t* e = &b[c->pos++];
+            if (e->time < q->from || e->time > q->to)
+                continue;
+            if (q->skip == 0)
+                buf[n++] = *e;
+            q->skip = (q->skip + 1) % q->every;
+        }
+        if (c->pos >= end && c->blk != meta.lastblk)
+            c->pos = BLOCK_SIZE;
+    }
+    mutex_unlock(mutex);
+    return n;
+}
+
+
+
+/********************************************************** 
+ * Simplify a track (in place) using the Douglas-Peucker 
+ * algorithm. Points closer than tol (in units of 
+ * 1/POS_RESOLUTION degree, about 1.1 m) to the line 
+ * between the kept neighbours are removed. Returns the 
+ * new number of entries. 
+ **********************************************************/
+
+#define COORD(x) ((float) (int32_t) (x))
+
+int trackstore_simplify(posentry_t* buf, int n, uint32_t tol) {
+    if (n < 3 || n > MAX_UINT16)
+        return n;
+    uint8_t* keep = calloc((n+7)/8, 1);
+    uint16_t* stack = malloc(n * 2 * sizeof(uint16_t));
+    if (keep == NULL || stack == NULL) {
+        ESP_LOGW(TAG, "simplify - cannot allocate memory");
+        free(keep); free(stack);
+        return n;
+    }
+    
+    /* Longitude is scaled to get about the same unit as latitude */
+    float kx = cosf(COORD(buf[0].lat) / POS_RESOLUTION * M_PI / 180);
+    float tol2 = (float) tol * tol;
+    int sp = 0;
+    stack[sp++] = 0; 
+    stack[sp++] = n-1;
+    keep[0] |= 1;
+    keep[(n-1)/8] |= 1 << ((n-1)%8);
+    
+    while (sp > 0) {
+        uint16_t last = stack[--sp];
+        uint16_t first = stack[--sp];
+        float ax = COORD(buf[first].lng) * kx, ay = COORD(buf[first].lat);
+        float dx = COORD(buf[last].lng) * kx - ax;
+        float dy = COORD(buf[last].lat) - ay;
+        float len2 = dx*dx + dy*dy;
+        float dmax = 0;
+        uint16_t imax = 0;
+        
+        /* Find point farthest from the line (first, last) */
+        for (uint16_t i = first+1; i < last; i++) {
+            float px = COORD(buf[i].lng) * kx - ax;
+            float py = COORD(buf[i].lat) - ay;
+            float d;
+            if (len2 == 0) 
+                d = px*px + py*py;
+            else {
+                float cr = dx*py - dy*px; 
+                d = cr*cr / len2;
+            }
+            if (d > dmax) 
+                { dmax = d; imax = i; }
+        }
+        if (dmax > tol2) {
+            keep[imax/8] |= 1 << (imax%8);
+            if (imax - first > 1)
+                { stack[sp++] = first; stack[sp++] = imax; }
+            if (last - imax > 1)
+                { stack[sp++] = imax; stack[sp++] = last; }
+        }
+    }
+    
+    int k = 0;
+    for (int i=0; i<n; i++)
+        if (keep[i/8] & (1 << (i%8)))
+            buf[k++] = buf[i];
+    free(keep); 
+    free(stack);
+    return k;
+}
+
+
+
 /****************************************************** 
  * Get and remove a record from the store. 
- * Convert it to a posdata_t datatype. 
+ * Convert it to a posdata_t datatype.    
  ******************************************************/
 
 posdata_t* trackstore_get(posdata_t* pbuf) {
@@ -258,7 +673,7 @@ posentry_t* trackstore_peek(posentry_t* pbuf) {
          meta.first == meta.last ) || (!check_rblock())) 
         { mutex_unlock(mutex); return NULL; }
 
-    if (!read_entry(pbuf, firstfile, meta.first))
+    if (!read_entry(pbuf, meta.firstblk, meta.first))
         { mutex_unlock(mutex); return NULL; }
     mutex_unlock(mutex);
     return pbuf;
@@ -272,7 +687,7 @@ posentry_t* trackstore_peek(posentry_t* pbuf) {
  ******************************************************/
 
 static bool check_rblock() { 
-    if (meta.first >= BLOCK_SIZE) {
+    if (meta.first >= blk_cap(meta.firstblk)) {
         if (meta.firstblk == meta.lastblk)
             { reset_empty(); return false; }
         
@@ -281,6 +696,10 @@ static bool check_rblock() {
         fclose(firstfile);
         delete_block(meta.firstblk);
         meta.nblocks--;
+        if (nold > 0)
+            set_nold(nold-1);
+        tidx(meta.firstblk)->tmin = tidx(meta.firstblk)->tmax = 0;
+        tindex_head = (tindex_head + 1) % TINDEX_SIZE;
         meta.firstblk = (meta.firstblk + 1) % MAX_UINT16;
         meta.first = 0;
         
@@ -294,7 +713,7 @@ static bool check_rblock() {
                 return false;
             }
         }
-        set_bin_param("tracks.META", &meta, sizeof(ts_meta_t));
+        save_meta();
     }
     return true; 
 }
@@ -313,12 +732,299 @@ static void reset_empty() {
         meta.first = meta.last = 0;
         meta.firstblk = meta.lastblk = 0;
         meta.nblocks = 1;
+        nstage = 0;
+        memset(&enc, 0, sizeof(enc));
+        set_nold(0);
+        tidx_clear();
         firstfile = lastfile = open_block(meta.firstblk, "a+");
         if (firstfile == NULL) {
             ESP_LOGE(TAG, "Failed to open block file in reset_empty");
         }
-        set_bin_param("tracks.META", &meta, sizeof(ts_meta_t));
+        save_meta();
+    }
+}
+
+
+
+/******************************************************
+ * Compress staged entries and write them to the end of 
+ * the last block. If metadata is changed by removals, 
+ * save it too. 
+ ******************************************************/
+
+static void commit() {
+    if (nstage == 0)
+        return;
+    if (lastfile == NULL) {
+        ESP_LOGW(TAG, "Cannot write entries to file");
+        return;
+    }
+    uint32_t bytes = 0;
+    for (int i=0; i<nstage; i++)
+        bytes += encode_entry(&enc, &stage[i], encbuf + bytes);
+    
+    /* The file may have been read since last write */
+    fseek(lastfile, 0, SEEK_END);
+    size_t k = fwrite(encbuf, 1, bytes, lastfile);
+    fflush(lastfile);
+    fsync(fileno(lastfile));
+    if (k < bytes)
+        ESP_LOGE(TAG, "commit - write error: %s", strerror(errno));
+    
+    /* Estimate flash writes: Data sectors, FAT and directory entry */
+    stats.commits++;
+    stats.bytes += bytes;
+    stats.flash += ((bytes + TS_SECTOR_SIZE - 1) / TS_SECTOR_SIZE + 2) * TS_SECTOR_SIZE;
+    nstage = 0;
+    if (meta_dirty)
+        save_meta();
+}
+
+
+
+/******************************************************
+ * Save metadata to NVS
+ ******************************************************/
+
+static void save_meta() {
+    set_bin_param("tracks.META", &meta, sizeof(ts_meta_t));
+    meta_dirty = false;
+    stats.metawrites++;
+    stats.flash += TS_NVS_WRITE;
+}
+
+
+
+/******************************************************
+ * Get number of entries in the last block from the 
+ * file. Entries may have been written after the 
+ * metadata was saved. A partly written entry (at power 
+ * loss) is removed. For a compressed block, this also 
+ * sets up the encoder to continue the block. 
+ ******************************************************/
+
+static void recover_last() {
+    char fname[64];
+    struct stat st;
+    int used, n;
+    blk_fname(fname, meta.lastblk);
+    if (stat(fname, &st) != 0)
+        return;
+    
+    if (blk_old(meta.lastblk)) {
+        n = (st.st_size / sizeof(posentry_t) > TS_OLD_BLOCK_SIZE ? 
+             TS_OLD_BLOCK_SIZE : st.st_size / sizeof(posentry_t));
+        used = n * sizeof(posentry_t);
+    }
+    else {
+        uint8_t* buf = ts_malloc(st.st_size);
+        FILE* f = fopen(fname, "r");
+        if (buf == NULL || f == NULL) {
+            ESP_LOGE(TAG, "recover_last - cannot read last block");
+            free(buf);
+            if (f != NULL) 
+                fclose(f);
+            return;
+        }
+        int len = fread(buf, 1, st.st_size, f);
+        fclose(f);
+        n = decode_block(&enc, buf, len, NULL, BLOCK_SIZE, &used);
+        free(buf);
+    }
+    if (st.st_size != used) {
+        ESP_LOGW(TAG, "Truncating last block to %d entries", n);
+        truncate(fname, used);
+    }
+    if (n != meta.last) {
+        ESP_LOGI(TAG, "Last block has %d entries, metadata says %d", n, meta.last);
+        meta.last = n;
+        if (meta.firstblk == meta.lastblk && meta.first > meta.last)
+            meta.first = meta.last;
+        save_meta();
+    }
+}
+
+
+
+/******************************************************
+ * If the last block is uncompressed (from an earlier 
+ * version), rewrite it compressed so that new entries 
+ * can be added to it. 
+ ******************************************************/
+
+static void convert_last() {
+    char fname[64], tmpname[64];
+    if (!blk_old(meta.lastblk))
+        return;
+    blk_fname(fname, meta.lastblk);
+    sprintf(tmpname, TS_DIR "/tracks_tmp.bin");
+    posentry_t* ent = ts_malloc(TS_OLD_BLOCK_SIZE * sizeof(posentry_t));
+    uint8_t* buf = ts_malloc(TS_OLD_BLOCK_SIZE * TSC_MAXENC);
+    FILE* f = fopen(fname, "r");
+    FILE* tf = fopen(tmpname, "w");
+    if (ent == NULL || buf == NULL || f == NULL || tf == NULL) {
+        ESP_LOGE(TAG, "convert_last - cannot convert last block");
+        goto done;
+    }
+    int n = fread(ent, sizeof(posentry_t), meta.last, f), len = 0;
+    memset(&enc, 0, sizeof(enc));
+    for (int i=0; i<n; i++)
+        len += encode_entry(&enc, &ent[i], buf + len);
+    fwrite(buf, 1, len, tf);
+    fflush(tf);
+    fsync(fileno(tf));
+    fclose(tf); tf = NULL;
+    fclose(f); f = NULL;
+    unlink(fname);
+    if (rename(tmpname, fname) != 0) 
+        ESP_LOGE(TAG, "convert_last - cannot rename file: %s", strerror(errno));
+    else {
+        ESP_LOGI(TAG, "Last block compressed: %d entries, %d bytes", n, len);
+        meta.last = n;
+        set_nold(nold-1);
+    }
+done:
+    if (f != NULL) 
+        fclose(f);
+    if (tf != NULL) 
+        fclose(tf);
+    free(ent); 
+    free(buf);
+}
+
+
+
+/******************************************************
+ * Compress an entry. Return the number of bytes.  
+ ******************************************************/
+
+static int put_uvarint(uint8_t* buf, uint32_t z) {
+    int i = 0;
+    while (z >= 0x80) {
+        buf[i++] = (uint8_t) (z | 0x80);
+        z >>= 7;
+    }
+    buf[i++] = (uint8_t) z;
+    return i;
+}
+
+
+static int encode_entry(ts_codec_t* c, posentry_t* e, uint8_t* buf) {
+    if (c->n++ == 0) {
+        /* Keyframe */
+        memcpy(buf, e, sizeof(posentry_t));
+        c->prev = *e;
+        c->dtime = c->dlat = c->dlng = 0;
+        return sizeof(posentry_t);
+    }
+    uint32_t dtime = e->time - c->prev.time;
+    uint32_t dlat = e->lat - c->prev.lat;
+    uint32_t dlng = e->lng - c->prev.lng;
+    int32_t v[4] = { 
+        (int32_t) (dtime - c->dtime), (int32_t) (dlat - c->dlat), 
+        (int32_t) (dlng - c->dlng), (int32_t) e->altitude - c->prev.altitude };
+    
+    int len = 1;
+    buf[0] = 0;
+    for (int i=0; i<4; i++)
+        if (v[i] != 0) {
+            buf[0] |= 1 << i;
+            len += put_uvarint(buf+len, ((uint32_t) v[i] << 1) ^ (uint32_t) (v[i] >> 31));
+        }
+    c->prev = *e;
+    c->dtime = dtime; 
+    c->dlat = dlat; 
+    c->dlng = dlng;
+    return len;
+}
+
+
+
+/******************************************************
+ * Decompress entries. Return the number of entries. 
+ * used is set to the number of bytes of complete 
+ * entries. If out is NULL, only the codec state and 
+ * the counts are found. 
+ ******************************************************/
+
+static int get_uvarint(uint8_t* buf, int len, uint32_t* z) {
+    *z = 0;
+    for (int i=0; i<len && i<5; i++) {
+        *z |= (uint32_t) (buf[i] & 0x7f) << (7*i);
+        if ((buf[i] & 0x80) == 0)
+            return i+1;
+    }
+    return 0;
+}
+
+
+static int decode_block(ts_codec_t* c, uint8_t* buf, int len, posentry_t* out, int max, int* used) {
+    int n = 0, i = 0;
+    posentry_t tmp;
+    memset(c, 0, sizeof(ts_codec_t));
+    while (n < max && i < len) {
+        posentry_t* e = (out == NULL ? &tmp : &out[n]);
+        if (c->n == 0) {
+            if (len - i < (int) sizeof(posentry_t))
+                break;
+            memcpy(e, buf+i, sizeof(posentry_t));
+            i += sizeof(posentry_t);
+        }
+        else {
+            uint8_t flags = buf[i];
+            int32_t v[4] = {0, 0, 0, 0};
+            int k = i+1, m = 1;
+            if (flags & 0xf0)
+                break; 
+            for (int j=0; j<4 && m > 0; j++)
+                if (flags & (1 << j)) {
+                    uint32_t z;
+                    m = get_uvarint(buf+k, len-k, &z);
+                    v[j] = (int32_t) (z >> 1) ^ -(int32_t) (z & 1);
+                    k += m;
+                }
+            if (m == 0)
+                break;
+            i = k;
+            c->dtime += v[0]; 
+            c->dlat += v[1]; 
+            c->dlng += v[2];
+            e->time = c->prev.time + c->dtime;
+            e->lat = c->prev.lat + c->dlat;
+            e->lng = c->prev.lng + c->dlng;
+            e->altitude = c->prev.altitude + v[3];
+            e->reserved = 0;
+        }
+        c->prev = *e;
+        c->n++;
+        n++;
     }
+    *used = i;
+    return n;
+}
+
+
+
+/******************************************************
+ * Uncompressed blocks from earlier versions 
+ ******************************************************/
+
+static bool blk_old(blkno_t blk) {
+    return (blk + MAX_UINT16 - meta.firstblk) % MAX_UINT16 < nold;
+}
+
+
+static void set_nold(uint16_t n) {
+    if (n == nold)
+        return;
+    nold = n;
+    set_u16_param("tracks.NOLD", n);
+}
+
+
+/* Max number of entries in a block */
+static uint16_t blk_cap(blkno_t blk) {
+    return (blk_old(blk) ? TS_OLD_BLOCK_SIZE : BLOCK_SIZE);
 }
 
 
@@ -327,9 +1033,14 @@ static void reset_empty() {
  * Open file
  ******************************************************/
 
+static void blk_fname(char* fname, blkno_t blk) {
+    sprintf(fname, TS_DIR "/tracks_blk%u.bin", blk);
+}
+
+
 static FILE* open_block(blkno_t blk, char* perm) {
     char fname[64];
-    sprintf(fname, "/files/trklog/tracks_blk%u.bin", blk);
+    blk_fname(fname, blk);
     FILE* f = fopen(fname, perm);
     if (f==NULL)
         ESP_LOGW(TAG, "Couldn't open file %s: %s", fname, strerror(errno));
@@ -344,41 +1055,155 @@ static FILE* open_block(blkno_t blk, char* perm) {
 
 static void delete_block(blkno_t blk) {
     char fname[64];
-    sprintf(fname, "/files/trklog/tracks_blk%u.bin", blk);
+    blk_fname(fname, blk);
     ESP_LOGI(TAG, "Deleting file: %s", fname);
     unlink(fname);
+    for (int i=0; i<TS_CACHE_BLOCKS; i++)
+        if (cache[i].valid && cache[i].blk == blk)
+            cache[i].valid = false;
 }
 
 
 
 /******************************************************
- * Write new entry to the end of a file
+ * Read entry from block at specified position
  ******************************************************/
 
-static void write_entry(posentry_t* entr, FILE* f) {
-    if (f==NULL || entr==NULL) {
-        ESP_LOGW(TAG, "Cannot write entry to file");
-        return;
+static bool read_entry(posentry_t* entr, blkno_t blk, uint16_t pos) {
+    uint16_t n;
+    memset(entr, 0, sizeof(posentry_t));
+    posentry_t* b = get_block(blk, &n);
+    if (b == NULL || pos >= n) {
+        ESP_LOGE(TAG, "read_entry - cannot read block %d, pos=%d", blk, pos);
+        return false;
     }
-    fwrite(entr, sizeof(posentry_t), 1, f);
+    *entr = b[pos];
+    return true;
 }
 
 
 
 /******************************************************
- * Read entry from file at specified position
+ * Get a block from the cache. Read it from file if 
+ * not there. n is set to the number of entries. 
+ * Must be called with the mutex locked. 
  ******************************************************/
 
-static bool read_entry(posentry_t* entr, FILE* f, uint16_t pos) {
-    memset(entr, 0, sizeof(posentry_t));
-    if ( fseek(f, pos*sizeof(posentry_t), SEEK_SET) == -1) {
-        ESP_LOGE(TAG, "read_entry - file seek error: pos=%d. %s", pos, strerror(errno));
-        return false;
+static posentry_t* get_block(blkno_t blk, uint16_t* n) {
+    ts_cblock_t* cb = &cache[0];
+    for (int i=0; i<TS_CACHE_BLOCKS; i++) {
+        if (cache[i].valid && cache[i].blk == blk) {
+            cache[i].used = ++cache_clock;
+            *n = cache[i].n;
+            return cache[i].ent;
+        }
+        if (cb->valid && (!cache[i].valid || cache[i].used < cb->used))
+            cb = &cache[i];
     }
-    fread(entr, sizeof(posentry_t), 1, f); 
-    return true;
+    
+    /* Not in cache. Replace least recently used block */
+    cb->valid = false;
+    if (cb->ent == NULL && (cb->ent = ts_malloc(BLOCK_SIZE * sizeof(posentry_t))) == NULL) {
+        ESP_LOGE(TAG, "get_block - cannot allocate memory");
+        return NULL;
+    }
+    
+    /* Use the open files for the first or last block */
+    FILE* f = (blk == meta.firstblk ? firstfile : 
+              (blk == meta.lastblk ? lastfile : NULL));
+    bool opened = (f == NULL); 
+    if (opened && (f = open_block(blk, "r")) == NULL) 
+        return NULL;
+    int k = 0;
+    if (blk_old(blk)) {
+        if (fseek(f, 0, SEEK_SET) == 0)
+            k = fread(cb->ent, sizeof(posentry_t), TS_OLD_BLOCK_SIZE, f);
+    }
+    else if (fseek(f, 0, SEEK_END) == 0) {
+        /* Read the whole file and decompress it */
+        ts_codec_t dec;
+        int used, size = ftell(f);
+        uint8_t* buf = (size > 0 ? ts_malloc(size) : NULL);
+        if (buf != NULL && fseek(f, 0, SEEK_SET) == 0)
+            k = decode_block(&dec, buf, fread(buf, 1, size, f), cb->ent, BLOCK_SIZE, &used);
+        free(buf);
+    }
+    if (opened)
+        fclose(f);
+    
+    /* Add staged entries to the last block */
+    if (blk == meta.lastblk) {
+        if (k > meta.last - nstage)
+            k = meta.last - nstage;
+        memcpy(cb->ent + k, stage, nstage * sizeof(posentry_t));
+        k += nstage;
+    }
+    
+    cb->blk = blk; 
+    cb->n = k;
+    cb->used = ++cache_clock;
+    cb->valid = true;
+    
+    /* Update the time index */
+    ts_tindex_t* x = tidx(blk);
+    x->tmin = UINT32_MAX; 
+    x->tmax = 0;
+    for (int i=0; i<k; i++)
+        tidx_update(x, cb->ent[i].time);
+    *n = k;
+    return cb->ent;
+}
+
+
+
+/******************************************************
+ * Block buffers are allocated in PSRAM if there is 
+ * any, to save internal RAM. 
+ ******************************************************/
+
+static void* ts_malloc(size_t size) {
+    return heap_caps_malloc_prefer(size, 2, MALLOC_CAP_SPIRAM, MALLOC_CAP_DEFAULT);
 }
 
 
 
+/******************************************************
+ * Add a new entry to a block in the cache 
+ ******************************************************/
 
+static void cache_append(blkno_t blk, posentry_t* entr, uint16_t pos) {
+    for (int i=0; i<TS_CACHE_BLOCKS; i++)
+        if (cache[i].valid && cache[i].blk == blk) {
+            if (cache[i].n == pos && pos < BLOCK_SIZE)
+                cache[i].ent[cache[i].n++] = *entr;
+            else
+                cache[i].valid = false;
+        }
+}
+
+
+
+/******************************************************
+ * Time index 
+ ******************************************************/
+
+static ts_tindex_t* tidx(blkno_t blk) {
+    uint16_t d = (blk + MAX_UINT16 - meta.firstblk) % MAX_UINT16;
+    return &tindex[(tindex_head + d) % TINDEX_SIZE];
+}
+
+
+static void tidx_update(ts_tindex_t* x, uint32_t t) {
+    if (TINDEX_UNKNOWN(x))
+        return;
+    if (t < x->tmin) 
+        x->tmin = t;
+    if (t > x->tmax) 
+        x->tmax = t;
+}
+
+
+static void tidx_clear() {
+    memset(tindex, 0, sizeof(tindex));
+    tindex_head = 0;
+}
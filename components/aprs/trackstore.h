@@ -4,13 +4,30 @@
 
 
 #define MAX_UINT16     65535
-#define BLOCK_SIZE     256
+#define BLOCK_SIZE     1024
+#define TS_OLD_BLOCK_SIZE 256
 #define MAX_BLOCKS     512
 #define POS_RESOLUTION 100000
+#define TS_CACHE_BLOCKS 2
+#define TS_STAGE_MAX    64
+#define TS_SECTOR_SIZE  4096
+#define TS_NVS_WRITE    96
 
 /* 
- * 512 * 512 = 262144 records = 4MB data 
- * that is enough for a position every second for 3 days
+ * 512 * 1024 = 524288 records. Blocks are compressed to about 
+ * 3-4 bytes per record, i.e. about 2MB data. That is enough for a
+ * position every second for 6 days. Blocks from earlier versions
+ * (TS_OLD_BLOCK_SIZE uncompressed records) can still be read. 
+ */
+
+/*
+ * RAM: The block cache is TS_CACHE_BLOCKS decoded blocks of 16 KB, 
+ * allocated in PSRAM at the first read. Two blocks let the uploader 
+ * (at the first block) and queries or new entries (at the last block) 
+ * keep their block in the cache. Reading a block file (about 4.5 KB, 
+ * at most 19 KB) uses a temporary buffer of the file size, also in 
+ * PSRAM. The time index (4 KB) and the staging buffers (2 KB) are in 
+ * internal RAM. 
  */
 
 /*
@@ -36,13 +53,47 @@ typedef struct _meta {
 } ts_meta_t;
 
 
+/* Position in the store, for reading without removing entries */
+typedef struct _cursor {
+    blkno_t  blk; 
+    uint16_t pos;
+} ts_cursor_t;
+
+
+/* Write statistics. Flash is estimated bytes written to flash */
+typedef struct _tsstats {
+    uint32_t fixes; 
+    uint32_t commits;
+    uint32_t metawrites;
+    uint32_t bytes;
+    uint64_t flash;
+} ts_stats_t;
+
+
+/* Query for entries within a time window, taking every Nth entry */
+typedef struct _query {
+    uint32_t    from, to;
+    uint16_t    every, skip;
+    ts_cursor_t c;
+} ts_query_t;
+
+
 void trackstore_start();
 void trackstore_stop();
+void trackstore_flush();
+void trackstore_setFlush(uint8_t n);
+void trackstore_getStats(ts_stats_t* st);
 void trackstore_put(posdata_t *x);
 posentry_t* trackstore_getEnt(posentry_t* pbuf);
 posdata_t* trackstore_get(posdata_t* pbuf);
 posentry_t* trackstore_peek(posentry_t* pbuf);
 void trackstore_reset();
 int trackstore_nEntries();
+void trackstore_cursor(ts_cursor_t* c);
+int trackstore_read(ts_cursor_t* c, posentry_t* buf, int max);
+void trackstore_removeUntil(ts_cursor_t* c);
+void trackstore_query(ts_query_t* q, uint32_t from, uint32_t to, uint16_t every);
+int trackstore_range(ts_query_t* q, posentry_t* buf, int max);
+int trackstore_simplify(posentry_t* buf, int n, uint32_t tol);
 
 #endif
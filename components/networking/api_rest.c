@@ -15,6 +15,10 @@
 #include "digipeater.h"
 #include "igate.h"
 #include "tracklogger.h"
+#include "gps.h"
+#include "trackstore.h"
+#include "fbuf.h"
+#include "latency.h"
 
 
 #define TAG "rest"
@@ -434,6 +438,176 @@ static esp_err_t trackers_handler(httpd_req_t *req) {
 
 
 
+/******************************************************************
+ *   GET handler for packet subscriber statistics
+ ******************************************************************/
+
+static void add_subscriber(const char* sw, const fbqsub_t* sub, void* arg) {
+    cJSON *obj = cJSON_CreateObject();
+    cJSON_AddStringToObject(obj, "service", sw);
+    cJSON_AddStringToObject(obj, "name", sub->name);
+    cJSON_AddStringToObject(obj, "policy", fbqsw_policyName(sub->policy));
+    cJSON_AddNumberToObject(obj, "delivered", sub->delivered);
+    cJSON_AddNumberToObject(obj, "dropped", sub->dropped);
+    cJSON_AddItemToArray((cJSON*) arg, obj);
+}
+
+
+static esp_err_t queues_handler(httpd_req_t *req) {
+    rest_cors_enable(req);
+    httpd_resp_set_type(req, "application/json");
+    CHECK_AUTH(req);
+    cJSON *root = cJSON_CreateArray();
+    fbqsw_foreach(add_subscriber, root);
+    return rest_JSON_send(req, root);
+}
+
+
+
+
+/******************************************************************
+ *   GET handler for igate connection statistics
+ ******************************************************************/
+
+static esp_err_t igate_handler(httpd_req_t *req) {
+    char buf[128];
+    igate_stats_t st;
+    rest_cors_enable(req);
+    httpd_resp_set_type(req, "application/json");
+    CHECK_AUTH(req);
+    igate_getStats(&st);
+    
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddBoolToObject(root, "on", igate_is_on());
+    cJSON_AddStringToObject(root, "server", igate_server(st.server, buf));
+    cJSON_AddStringToObject(root, "standby", igate_server(st.standby, buf));
+    get_str_param("IGATE.ALT", buf, 128, DFL_IGATE_ALT);
+    cJSON_AddStringToObject(root, "alt", buf);
+    cJSON_AddNumberToObject(root, "connects", st.connects);
+    cJSON_AddNumberToObject(root, "failovers", st.failovers);
+    cJSON_AddNumberToObject(root, "outages", st.outages);
+    cJSON_AddNumberToObject(root, "reconnect", st.last_reconnect);
+    cJSON_AddNumberToObject(root, "maxReconnect", st.max_reconnect);
+    cJSON_AddNumberToObject(root, "gated", igate_icount());
+    cJSON_AddNumberToObject(root, "lost", st.lost);
+    return rest_JSON_send(req, root);
+}
+
+
+
+
+/******************************************************************
+ *   GET handler for frame latency statistics (usec)
+ ******************************************************************/
+
+static esp_err_t latency_handler(httpd_req_t *req) {
+    lat_hist_t h;
+    rest_cors_enable(req);
+    httpd_resp_set_type(req, "application/json");
+    CHECK_AUTH(req);
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddBoolToObject(root, "on", lat_enabled());
+    cJSON *stages = cJSON_AddArrayToObject(root, "stages");
+    for (int i=0; i<LAT_STAGES; i++) {
+        if (i == LAT_RX)
+            continue;
+        lat_getHist(i, &h);
+        cJSON *obj = cJSON_CreateObject();
+        cJSON_AddStringToObject(obj, "stage", lat_stageName(i));
+        cJSON_AddNumberToObject(obj, "n", h.n);
+        cJSON_AddNumberToObject(obj, "avg", (h.n > 0 ? h.sum / h.n : 0));
+        cJSON_AddNumberToObject(obj, "p50", lat_percentile(&h, 50));
+        cJSON_AddNumberToObject(obj, "p90", lat_percentile(&h, 90));
+        cJSON_AddNumberToObject(obj, "p99", lat_percentile(&h, 99));
+        cJSON_AddNumberToObject(obj, "max", h.max);
+        cJSON *hist = cJSON_AddArrayToObject(obj, "hist");
+        for (int j=0; j<LAT_BUCKETS; j++)
+            cJSON_AddItemToArray(hist, cJSON_CreateNumber(h.bucket[j]));
+        cJSON_AddItemToArray(stages, obj);
+    }
+    return rest_JSON_send(req, root);
+}
+
+
+
+
+/******************************************************************
+ *   GET handler for positions in the track store. Query 
+ *   parameters: from, to (unix time), every (take every Nth 
+ *   position), tol (simplify with given tolerance, in 1/100000 
+ *   degree) and max (number of positions). Positions are not 
+ *   removed from the store. If there are more, 'next' is the 
+ *   time to continue from.
+ ******************************************************************/
+
+#define TRACK_MAX   1024
+#define TRACK_CHUNK 512
+
+static uint32_t query_u32(char* qs, char* key, uint32_t dfl) {
+    char val[16];
+    if (qs == NULL || httpd_query_key_value(qs, key, val, sizeof(val)) != ESP_OK)
+        return dfl;
+    return (uint32_t) strtoul(val, NULL, 10);
+}
+
+
+static esp_err_t track_handler(httpd_req_t *req) {
+    char qs[128];
+    rest_cors_enable(req);
+    httpd_resp_set_type(req, "application/json");
+    CHECK_AUTH(req);
+    
+    char* q = (httpd_req_get_url_query_str(req, qs, sizeof(qs)) == ESP_OK ? qs : NULL);
+    uint32_t max = query_u32(q, "max", 256);
+    if (max < 1 || max > TRACK_MAX)
+        max = TRACK_MAX;
+    posentry_t* buf = malloc(max * sizeof(posentry_t));
+    char* out = malloc(TRACK_CHUNK);
+    if (buf == NULL || out == NULL) {
+        free(buf); free(out);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+        return ESP_FAIL;
+    }
+    
+    ts_query_t tq, nq;
+    posentry_t next;
+    trackstore_query(&tq, query_u32(q, "from", 0), query_u32(q, "to", UINT32_MAX), 
+        (uint16_t) query_u32(q, "every", 1));
+    int n = trackstore_range(&tq, buf, max);
+    
+    /* Look for the next entry in the window */
+    nq = tq; 
+    nq.every = 1; 
+    nq.skip = 0;
+    bool more = (n == max && trackstore_range(&nq, &next, 1) > 0);
+    
+    uint32_t tol = query_u32(q, "tol", 0);
+    if (tol > 0)
+        n = trackstore_simplify(buf, n, tol);
+    
+    int len = sprintf(out, "{\"n\":%d, \"next\":%lu, \"points\":[", 
+        n, (more ? (unsigned long) next.time : 0));
+    for (int i=0; i<n; i++) {
+        if (len > TRACK_CHUNK - 64) {
+            httpd_resp_send_chunk(req, out, len);
+            len = 0;
+        }
+        len += sprintf(out+len, "%s[%lu,%.5f,%.5f,%u]", (i>0 ? "," : ""), 
+            (unsigned long) buf[i].time, 
+            (double) (int32_t) buf[i].lat / POS_RESOLUTION, 
+            (double) (int32_t) buf[i].lng / POS_RESOLUTION, buf[i].altitude);
+    }
+    len += sprintf(out+len, "]}");
+    httpd_resp_send_chunk(req, out, len);
+    esp_err_t err = httpd_resp_send_chunk(req, NULL, 0);
+    free(buf); 
+    free(out);
+    return err;
+}
+
+
+
+
 extern httpd_handle_t http_server;
 extern esp_err_t register_file_server(httpd_handle_t *server, const char *path);
 
@@ -450,6 +624,15 @@ void register_api_rest()
     REGISTER_GET("/api/trackers",     trackers_handler);
     REGISTER_OPTIONS("/api/trackers", rest_options_handler);
     
+    REGISTER_GET("/api/queues",     queues_handler);
+    REGISTER_OPTIONS("/api/queues", rest_options_handler);
+    
+    REGISTER_GET("/api/latency",     latency_handler);
+    REGISTER_OPTIONS("/api/latency", rest_options_handler);
+    
+    REGISTER_GET("/api/igate",     igate_handler);
+    REGISTER_OPTIONS("/api/igate", rest_options_handler);
+    
     REGISTER_GET("/api/digi",      digi_get_handler);
     REGISTER_PUT("/api/digi",      digi_put_handler);
     REGISTER_OPTIONS("/api/digi",  rest_options_handler);
@@ -466,6 +649,9 @@ void register_api_rest()
     REGISTER_PUT("/api/trklog",    trklog_put_handler);
     REGISTER_OPTIONS("/api/trklog",rest_options_handler);
     
+    REGISTER_GET("/api/track",     track_handler);
+    REGISTER_OPTIONS("/api/track", rest_options_handler);
+    
     /* Static file access */
     register_file_server(http_server, "/webapp");
 }
@@ -154,9 +154,9 @@ static char* getFromFrame(char* buf, char* frame) {
  *************************************************************/
 
 static uint8_t subscribe(FBQ* mq, uint8_t *txsubscr) {
-    uint8_t subscription = APRS_SUBSCRIBE_RX(mq);
+    uint8_t subscription = APRS_SUBSCRIBE_RX(mq, FBQ_DROP_NEWEST, "logmon");
     if (GET_BOOL_PARAM("TXMON.on", DFL_TXMON_ON))
-       *txsubscr = APRS_SUBSCRIBE_TXMON(mq);
+       *txsubscr = APRS_SUBSCRIBE_TXMON(mq, FBQ_DROP_NEWEST, "logmon");
     return subscription;
 }
 
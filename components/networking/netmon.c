@@ -136,9 +136,9 @@ static void netmon_worker(void *wParam)
  *************************************************************/
 
 static uint8_t subscribe(FBQ* mq, uint8_t *txsubscr) {
-    uint8_t subscription = APRS_SUBSCRIBE_RX(mq);
+    uint8_t subscription = APRS_SUBSCRIBE_RX(mq, FBQ_DROP_NEWEST, "netmon");
     if (GET_BOOL_PARAM("TXMON.on", DFL_TXMON_ON))
-    *txsubscr = APRS_SUBSCRIBE_TXMON(mq);
+    *txsubscr = APRS_SUBSCRIBE_TXMON(mq, FBQ_DROP_NEWEST, "netmon");
     return subscription;
 }
 
@@ -80,11 +80,24 @@ void logmon_init();
 
 
 /* TCP client */
+#define INET_RACE_MAX      4
+#define INET_IDLE_TIMEOUT  60   /* Seconds without data before a connection is dead */
+
+typedef struct _inet_server {
+    char     host[64];
+    uint16_t port;
+} inet_server_t;
+
 int  inet_open(char* host, int port);
 void inet_close(void);
 int  inet_read(char* buf, int size);
 void inet_write(char* data, int len);
 bool inet_isConnected(void);
+int  inet_race(inet_server_t* srv, int n, int stagger, int timeout, int* idx);
+int  inet_wait(int* socks, int n, int timeout);
+int  inet_sread(int s, char* buf, int size);
+bool inet_swrite(int s, char* data, int len);
+void inet_sclose(int s);
 int  http_post(char* uri, char* ctype, char* data, int dlen);
 
 /* mdns */
@@ -21,6 +21,7 @@
 #include "trex.h"
 #include "esp_crt_bundle.h"
 #include "cert.h"
+#include "encryption.h"
 
 
 #define SCRATCH_BUFSIZE (10240)
@@ -435,3 +436,82 @@ esp_err_t rest_post(char* uri, char* service, char* data, int dlen, char* key)
     return status;
 }
 
+
+
+/******************************************************************************
+ * POST request with content that is produced while sending. The content is
+ * read twice: once to compute its length and hash (for authentication), 
+ * and once while sending. The content must therefore be the same both 
+ * times. Returns the HTTP status code or -1 if the request failed. 
+ ******************************************************************************/
+
+#define STREAM_BUFSIZE 512
+
+int rest_post_stream(char* uri, char* service, const char* ctype, rest_body_t* body, char* key) 
+{
+    char buf[STREAM_BUFSIZE];
+    char chash[48];
+    sec_sha256_t ss;
+    int len = 0, n, status = -1;
+    
+    /* First pass: length and hash of content */
+    body->rewind(body->arg);
+    sec_sha256_begin(&ss);
+    while ((n = body->read(body->arg, buf, STREAM_BUFSIZE)) > 0) {
+        sec_sha256_update(&ss, (uint8_t*) buf, n);
+        len += n;
+    }
+    sec_sha256_b64end(&ss, chash);
+    if (n < 0)
+        return -1;
+    
+    esp_http_client_config_t config = {
+        .url = uri,
+        .method = HTTP_METHOD_POST, 
+        .user_agent = "ArcticTracker",
+        .cert_pem = NULL,
+        .crt_bundle_attach = esp_crt_bundle_attach
+    };
+    esp_http_client_handle_t client = esp_http_client_init(&config);
+    if (client == NULL) {
+        ESP_LOGE(TAG, "Failed to initialize HTTP client");
+        return -1;
+    }
+    esp_http_client_set_header(client, "Content-Type", ctype);
+    rest_setSecHdrsHash(client, service, (len > 0 ? chash : NULL), key);
+    
+    /* Second pass: send content */
+    if (esp_http_client_open(client, len) != ESP_OK) {
+        ESP_LOGW(TAG, "HTTP post failed. Couldn't connect to %s", uri);
+        esp_http_client_cleanup(client);
+        return -1;
+    }
+    body->rewind(body->arg);
+    int sent = 0;
+    while (sent < len && (n = body->read(body->arg, buf, STREAM_BUFSIZE)) > 0) {
+        if (sent + n > len)
+            break;
+        int w = 0;
+        while (w < n) {
+            int r = esp_http_client_write(client, buf+w, n-w);
+            if (r <= 0)
+                break;
+            w += r;
+        }
+        if (w < n) 
+            break;
+        sent += n;
+    }
+    
+    if (sent == len && esp_http_client_fetch_headers(client) >= 0) {
+        status = esp_http_client_get_status_code(client);
+        ESP_LOGI(TAG, "Status = %d, content_length = %d", status, len);
+    }
+    else
+        ESP_LOGW(TAG, "HTTP post failed. Sent %d of %d bytes", sent, len);
+    
+    esp_http_client_close(client);
+    esp_http_client_cleanup(client);
+    return status;
+}
+
@@ -45,7 +45,21 @@ char*     compute_sha256_b64(char* hash, uint8_t *data, int len);
 char*     compute_hmac(const char* keyid, char* res, int hlen, uint8_t* data1, int len1, uint8_t* data2, int len2);
 esp_err_t rest_isAuth(httpd_req_t *req, char* payload, int plsize);
 void      rest_setSecHdrs(esp_http_client_handle_t client, char* service, char* data, int dlen, char* key);
+void      rest_setSecHdrsHash(esp_http_client_handle_t client, char* service, char* chash, char* key);
 void      nonce_init();
 
 /* REST API client */
 esp_err_t rest_post(char* uri, char* service, char* data, int dlen, char* key);
+
+/* 
+ * Content of a streamed POST request. read() puts the next part of 
+ * the content in buf and returns its length, 0 at the end or -1 on
+ * error. rewind() restarts from the beginning. 
+ */
+typedef struct {
+    int  (*read)(void* arg, char* buf, int size);
+    void (*rewind)(void* arg);
+    void* arg;
+} rest_body_t;
+
+int rest_post_stream(char* uri, char* service, const char* ctype, rest_body_t* body, char* key);
@@ -76,28 +76,40 @@ static void nonce_add(char* n) {
  *******************************************************************************************/
 
 void rest_setSecHdrs(esp_http_client_handle_t client, char* service, char* data, int dlen, char* key)
+{
+    char chash[SHA256_B64_SIZE+1];
+    
+    /* Create a SHA256 hash of the content */
+    if (dlen > 0) {
+        sec_sha256_b64(chash, (uint8_t*) data, dlen ); 
+        ESP_LOGI(TAG, "CHASH: %s", chash);
+    }
+    rest_setSecHdrsHash(client, service, (dlen > 0 ? chash : NULL), key);
+}
+
+
+
+/*******************************************************************************************
+ * Add auth headers to client request, using a SHA256 hash (base64) of the content 
+ * computed by the caller. chash is NULL if there is no content. 
+ *******************************************************************************************/
+
+void rest_setSecHdrsHash(esp_http_client_handle_t client, char* service, char* chash, char* key)
 {
     char hmac[HMAC_B64_SIZE+1];
     uint8_t bnonce[NONCE_BIN_SIZE+1];
     char nonce[NONCE_SIZE+1];
     size_t olen;
     char httpauth[HTTPAUTH_SIZE+1];
-    char chash[SHA256_B64_SIZE+1];
     
     /* Create nonce */
     esp_fill_random(bnonce, NONCE_BIN_SIZE);
     mbedtls_base64_encode((unsigned char*) nonce, NONCE_SIZE+1, &olen, bnonce, NONCE_BIN_SIZE  );
     nonce[NONCE_SIZE] = 0;
-    
-    /* Create a SHA256 hash of the content */
-    if (dlen > 0) {
-        sec_sha256_b64(chash, (uint8_t*) data, dlen ); 
-        ESP_LOGI(TAG, "CHASH: %s", chash);
-    }
 
     /* Create hmac */
     sec_hmac_sapi(hmac, HMAC_B64_SIZE, 
-        (uint8_t*) nonce, NONCE_SIZE, (uint8_t*) chash , (dlen>0 ? SHA256_B64_SIZE : 0));
+        (uint8_t*) nonce, NONCE_SIZE, (uint8_t*) chash , (chash != NULL ? SHA256_B64_SIZE : 0));
 
     /* Set header */
     sprintf(httpauth, "Arctic-Hmac %s;%s;%s", service, nonce, hmac);
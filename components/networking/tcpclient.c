@@ -7,6 +7,7 @@
 #include "lwip/sockets.h"
 #include "lwip/sys.h"
 #include <lwip/netdb.h>
+#include "esp_timer.h"
 #include "networking.h"
 
 #include "esp_http_client.h"
@@ -87,33 +88,226 @@ bool inet_isConnected(void) {return false;}
 
 int inet_read(char* buf, int size) 
 {
-    int len = recv(sock, buf, size, 0);
+    return inet_sread(sock, buf, size);
+}
+
+
+
+
+/***************************************************************************
+ * Write data to connection 
+ ***************************************************************************/
+
+void inet_write(char* data, int len)
+{
+    inet_swrite(sock, data, len);
+}
+
+
+
+
+/***************************************************************************
+ *  Start a non-blocking connect to a server. Return the socket 
+ *  or -1 if it failed at once (DNS lookup, etc.)
+ ***************************************************************************/
+
+static int race_start(inet_server_t* srv) 
+{
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *res;
+    struct sockaddr_in addr;
+    
+    if (getaddrinfo(srv->host, NULL, &hints, &res) != 0 || res == NULL) {
+        ESP_LOGW(TAG, "Failed DNS lookup for: %s", srv->host); 
+        return -1;
+    }
+    memcpy(&addr, res->ai_addr, sizeof(addr));
+    freeaddrinfo(res);
+    addr.sin_port = htons(srv->port);
+    
+    int s = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+    if (s < 0) { 
+        ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
+        return -1;
+    }
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+    ESP_LOGI(TAG, "Inet socket connecting to %s:%d", inet_ntoa(addr.sin_addr), srv->port);
+    
+    if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) != 0 && errno != EINPROGRESS) {
+        ESP_LOGW(TAG, "Socket unable to connect: errno=%d", errno);
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+
+
+/***************************************************************************
+ *  Connect to the first of a list of servers that answers. Servers
+ *  are in priority order. Attempts are started 'stagger' ms apart 
+ *  (or at once if all earlier attempts have failed) and run in 
+ *  parallel. The first connection to succeed wins and the rest are 
+ *  closed. Give up after 'timeout' ms. 
+ * 
+ *  Return the socket (in blocking mode, with a receive timeout of
+ *  INET_IDLE_TIMEOUT) and the index of the server in idx, or -1 if 
+ *  no connection could be made. The receive timeout only applies to 
+ *  blocking reads. Callers that wait with inet_wait() must check 
+ *  for idle connections themselves. 
+ ***************************************************************************/
+
+int inet_race(inet_server_t* srv, int n, int stagger, int timeout, int* idx) 
+{
+    int socks[INET_RACE_MAX];
+    int i, started = 0, active = 0, winner = -1;
+    int64_t start = esp_timer_get_time() / 1000;
+    
+    if (n > INET_RACE_MAX)
+        n = INET_RACE_MAX;
+    for (i=0; i<n; i++)
+        socks[i] = -1;
+    
+    while (winner < 0) {
+        int elapsed = (int) (esp_timer_get_time() / 1000 - start);
+        if (elapsed >= timeout)
+            break;
+        
+        /* Start next attempt if it is due or if nothing else is going on */
+        if (started < n && (elapsed >= started * stagger || active == 0)) {
+            if ((socks[started] = race_start(&srv[started])) >= 0)
+                active++;
+            started++;
+            continue;
+        }
+        if (active == 0)
+            break;
+        
+        /* Wait for a connection attempt to complete, or until next is due */
+        int wait = (started < n ? started * stagger : timeout) - elapsed;
+        struct timeval tv = { .tv_sec = wait / 1000, .tv_usec = (wait % 1000) * 1000 };
+        fd_set wset; 
+        int maxfd = -1;
+        FD_ZERO(&wset);
+        for (i=0; i<started; i++)
+            if (socks[i] >= 0) {
+                FD_SET(socks[i], &wset);
+                maxfd = max(maxfd, socks[i]);
+            }
+        if (select(maxfd+1, NULL, &wset, NULL, &tv) <= 0)
+            continue;
+        
+        for (i=0; i<started && winner < 0; i++) 
+            if (socks[i] >= 0 && FD_ISSET(socks[i], &wset)) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(socks[i], SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err == 0) 
+                    winner = i;
+                else {
+                    ESP_LOGW(TAG, "Unable to connect to %s: errno=%d", srv[i].host, err);
+                    close(socks[i]);
+                    socks[i] = -1;
+                    active--;
+                }
+            }
+    }
+    
+    /* Close the losers */
+    for (i=0; i<started; i++)
+        if (i != winner && socks[i] >= 0)
+            close(socks[i]);
+    if (winner < 0)
+        return -1;
+    
+    int s = socks[winner];
+    struct timeval tv = { .tv_sec = INET_IDLE_TIMEOUT, .tv_usec = 0 };
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) & ~O_NONBLOCK);
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    ESP_LOGI(TAG, "Successfully connected to %s:%d", srv[winner].host, srv[winner].port);
+    *idx = winner;
+    return s;
+}
+
+
+
+/***************************************************************************
+ *  Wait until data is available on one of the sockets. 
+ *  Return its index, or -1 on timeout (ms). Negative sockets
+ *  are ignored. 
+ ***************************************************************************/
+
+int inet_wait(int* socks, int n, int timeout)
+{
+    struct timeval tv = { .tv_sec = timeout / 1000, .tv_usec = (timeout % 1000) * 1000 };
+    fd_set rset;
+    int i, maxfd = -1;
+    FD_ZERO(&rset);
+    for (i=0; i<n; i++)
+        if (socks[i] >= 0) {
+            FD_SET(socks[i], &rset);
+            maxfd = max(maxfd, socks[i]);
+        }
+    if (select(maxfd+1, &rset, NULL, NULL, &tv) <= 0)
+        return -1;
+    for (i=0; i<n; i++)
+        if (socks[i] >= 0 && FD_ISSET(socks[i], &rset))
+            return i;
+    return -1;
+}
+
+
+
+/***************************************************************************
+ *  Read data from a socket into buf as a string without CR/LF at 
+ *  the end. Return the number of bytes received, 0 or less if the 
+ *  connection is closed, has failed or timed out. 
+ ***************************************************************************/
+
+int inet_sread(int s, char* buf, int size) 
+{
+    int n = recv(s, buf, size-1, 0);
     // Error occurred during receiving
-    if (len < 0) 
+    if (n < 0) 
         ESP_LOGE(TAG, "recv failed: errno %d", errno);
-    else {
+    else if (n > 0) {
         // Data received - don't include cr/lf at the end
-        while (buf[len-1] == '\n' || buf[len-1] == '\r')
+        int len = n;
+        while (len > 0 && (buf[len-1] == '\n' || buf[len-1] == '\r'))
             len--;
         
         buf[len] = '\0'; // Null-terminate whatever we received and treat like a string
         ESP_LOGI(TAG, "Received %d bytes", len);
     }
-    return len;
+    return n;
 }
 
 
 
-
 /***************************************************************************
- * Write data to connection 
+ *  Write data to a socket. Return false if it failed 
  ***************************************************************************/
 
-void inet_write(char* data, int len)
+bool inet_swrite(int s, char* data, int len)
 {
-    int err = send(sock, data, len, 0);
+    int err = send(s, data, len, 0);
     if (err < 0) 
         ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
+    return (err >= 0);
+}
+
+
+
+/***************************************************************************
+ *  Close a socket
+ ***************************************************************************/
+
+void inet_sclose(int s)
+{
+    if (s >= 0) {
+        shutdown(s, 0);
+        close(s);
+    }
 }
 
 
@@ -6,11 +6,13 @@
 #include "esp_log.h"
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include <math.h>
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include <driver/gpio.h>
+#include "esp_timer.h"
 #include "system.h"
 #include "config.h"
 #include "radio.h"
@@ -66,13 +68,22 @@ static void    readRegister(uint16_t reg, uint8_t* data, uint8_t numBytes);
 static void    writeRegister(uint16_t reg, uint8_t* data, uint8_t numBytes);
 static void    writeBuffer(uint8_t *txData, int16_t txDataLen);
 static void    getRxBufferStatus(uint8_t *payloadLength, uint8_t *rxStartBufferPointer);
-static void    chipSelect(bool select);
+static void    transfer(uint8_t* tx, uint8_t* rx, int len);
+static uint8_t readFifo(int16_t rxDataLen);
 
-extern uint8_t spi_transfer(uint8_t address);
+extern void  spi_xfer(uint8_t* tx, uint8_t* rx, size_t len);
 extern void  spi_init();
 
 
 static mutex_t lora_mutex;
+static semaphore_t busy_sem;
+static bool busy_irq;
+static lora_spistats_t spistats;
+static const lora_profile_t* active_profile = NULL;
+
+/* Command buffers. Command bytes followed by data */
+static uint8_t txcmd[SPI_MAX_TRANS];
+static uint8_t rxcmd[SPI_MAX_TRANS];
 
 static bool txActive; 
 static uint8_t PacketParams[6];
@@ -97,6 +108,26 @@ static int power[7] = {-5,-2,1,4,7,10,13};
  */ 
 
 
+/****************************************************************************
+ *  BUSY goes low. Chip is ready for a new command
+ ****************************************************************************/
+
+static void IRAM_ATTR busy_handler(void* arg)
+{
+	sem_upI(busy_sem);
+}
+
+
+
+/****************************************************************************
+ *  SPI bus statistics
+ ****************************************************************************/
+
+void lora_getSpiStats(lora_spistats_t* st)
+	{ *st = spistats; }
+
+
+
 /****************************************************************************
  *  Init 
  ****************************************************************************/
@@ -104,18 +135,23 @@ static int power[7] = {-5,-2,1,4,7,10,13};
 void lora_init(void)
 {
 	lora_mutex = mutex_create();
+	busy_sem = sem_createBin();
 	
 	mutex_lock(lora_mutex);
 	txActive = false;
-	gpio_reset_pin(LORA_PIN_CS);
-	gpio_set_direction(LORA_PIN_CS, GPIO_MODE_OUTPUT);
-	gpio_set_level(LORA_PIN_CS, 1);
+	/* Chip select is handled by the SPI driver */
 
 	gpio_reset_pin(LORA_PIN_RST);
 	gpio_set_direction(LORA_PIN_RST, GPIO_MODE_OUTPUT);
 	
 	gpio_reset_pin(LORA_PIN_BUSY);
 	gpio_set_direction(LORA_PIN_BUSY, GPIO_MODE_INPUT);
+	busy_irq = GET_BOOL_PARAM("LORA.BUSYIRQ.on", DFL_LORA_BUSYIRQ_ON);
+	if (busy_irq) {
+		gpio_set_intr_type(LORA_PIN_BUSY, GPIO_INTR_NEGEDGE);
+		gpio_isr_handler_add(LORA_PIN_BUSY, busy_handler, NULL);
+		gpio_intr_enable(LORA_PIN_BUSY);
+	}
 	
 	gpio_reset_pin(RADIO_PIN_PWRON);
 	gpio_set_direction(RADIO_PIN_PWRON, GPIO_MODE_OUTPUT);
@@ -153,7 +189,7 @@ void lora_on(bool on)
 		ESP_LOGI(TAG, "Lora on: sf=%d, cr=%d", sf, cr);
 		loraBegin((uint32_t) freq+foffset, power[txpo], 0, USELDO );
 		mutex_unlock(lora_mutex);
-		lora_config(sf, SX126X_LORA_BW_125_0, cr-4, 10, 0, true, false, (sf>=11 ? 1:0)); 
+		lora_config(sf, SX126X_LORA_BW_125_0, cr-4, LORA_PREAMBLE_LEN, 0, true, false, (sf>=11 ? 1:0)); 
 	     	// SF, BW, CR, PAlength, PLlen, CRCon, invertIRQ, optimize
 	}
 	else
@@ -212,6 +248,7 @@ void lora_config(uint8_t spreadingFactor, uint8_t bandwidth, uint8_t codingRate,
 	setLoRaSymbNumTimeout(0); 
 	setPacketType(SX126X_PACKET_TYPE_LORA); // SX126x.ModulationParams.PacketType : MODEM_LORA
 	setModulationParams(spreadingFactor, bandwidth, codingRate, ldro);
+	active_profile = NULL;
 	
 	PacketParams[0] = (preambleLength >> 8) & 0xFF;
 	PacketParams[1] = preambleLength;
@@ -310,6 +347,103 @@ void setRfFrequency(uint32_t frequency)
 
 
 
+/****************************************************************************
+ *  Modem profiles for SF 5-12 and CR 4/5 - 4/8 at 125 kHz. 
+ *
+ *  Time on air, see SX1261/2 datasheet, section 6.1.4. Explicit header, 
+ *  CRC on and LORA_PREAMBLE_LEN preamble symbols. The preamble adds 4.25 
+ *  symbols (6.25 for SF 5 and 6) and there are 8 symbols before the 
+ *  payload groups. Low data rate optimisation is on for SF 11 and 12. 
+ *  CAD parameters are the same for all SFs (4 symbols, peak 0x18, min 
+ *  0x0A, timeout 0x3FFF). The CAD slot is used for backoff when the 
+ *  channel is busy. 
+ ****************************************************************************/
+
+#define LDRO(sf) ((sf) >= 11 ? 1 : 0)
+
+#define PROFILE(s, c, slot) { \
+	.sf = (s), .cr = (c), .ldro = LDRO(s), \
+	.tsym_us  = (1 << (s)) * 8, \
+	.cad_slot = (slot), \
+	.toa_k    = 16 - 4*(s) + ((s) >= 7 ? 8 : 0), \
+	.toa_div  = 4 * ((s) - 2*LDRO(s)), \
+	.toa_qpre = 4 * (LORA_PREAMBLE_LEN + 8) + ((s) < 7 ? 25 : 17), \
+	.cmd_mod  = { SX126X_CMD_SET_MODULATION_PARAMS, (s), SX126X_LORA_BW_125_0, (c), LDRO(s) }, \
+	.cmd_cad  = { SX126X_CMD_SET_CAD_PARAMS, SX126X_CAD_ON_4_SYMB, 0x18, 0x0A, \
+	              SX126X_CAD_GOTO_STDBY, 0x00, 0x3F, 0xFF } }
+
+#define PROFILES(s, slot) \
+	PROFILE(s, 1, slot), PROFILE(s, 2, slot), PROFILE(s, 3, slot), PROFILE(s, 4, slot)
+
+static const lora_profile_t profiles[] = {
+	//      SF  CAD slot (ms)
+	PROFILES( 5,   4),
+	PROFILES( 6,   6),
+	PROFILES( 7,  10),
+	PROFILES( 8,  18),
+	PROFILES( 9,  33),
+	PROFILES(10,  61),
+	PROFILES(11, 111),
+	PROFILES(12, 200)
+};
+
+
+
+/****************************************************************************
+ *  Get the profile for a SF (5-12) and CR (5-8, as in the settings)
+ ****************************************************************************/
+
+const lora_profile_t* lora_profile(uint8_t spreadingFactor, uint8_t codingRate)
+{
+	if (spreadingFactor < 5 || spreadingFactor > 12)
+		spreadingFactor = 12;
+	if (codingRate < 5 || codingRate > 8)
+		codingRate = 5;
+	return &profiles[(spreadingFactor - 5) * 4 + codingRate - 5];
+}
+
+
+
+/****************************************************************************
+ *  Switch to a modem profile. The commands are pre-encoded and sent 
+ *  back to back under one lock. Nothing is sent if the profile is 
+ *  active already. 
+ ****************************************************************************/
+
+void lora_SetProfile(const lora_profile_t* p)
+{
+	mutex_lock(lora_mutex);
+	if (p == active_profile) {
+		spistats.switch_skip++;
+		mutex_unlock(lora_mutex);
+		return;
+	}
+	int64_t t = esp_timer_get_time();
+	writeCommand(p->cmd_mod[0], (uint8_t*) p->cmd_mod+1, sizeof(p->cmd_mod)-1);
+	if (active_profile == NULL || memcmp(p->cmd_cad, active_profile->cmd_cad, sizeof(p->cmd_cad)) != 0)
+		writeCommand(p->cmd_cad[0], (uint8_t*) p->cmd_cad+1, sizeof(p->cmd_cad)-1);
+	active_profile = p;
+	spistats.switch_usec += (uint32_t) (esp_timer_get_time() - t);
+	spistats.switches++;
+	mutex_unlock(lora_mutex);
+}
+
+
+
+/****************************************************************************
+ *  Time on air of a packet in microseconds
+ ****************************************************************************/
+
+uint32_t lora_TimeOnAir(const lora_profile_t* p, uint8_t len)
+{
+	int32_t bits = 8*len + p->toa_k;
+	int32_t groups = (bits > 0 ? (bits + p->toa_div - 1) / p->toa_div : 0);
+	uint32_t qsym = p->toa_qpre + 4 * groups * (p->cr + 4);
+	return qsym * p->tsym_us / 4;
+}
+
+
+
 /****************************************************************************
  *  Set Modulation Parameters
  ****************************************************************************/
@@ -318,6 +452,7 @@ void lora_SetModulationParams(uint8_t spreadingFactor, uint8_t bandwidth, uint8_
 {
 	mutex_lock(lora_mutex);
 	setModulationParams(spreadingFactor, bandwidth, codingRate, ldro);
+	active_profile = NULL;
 	mutex_unlock(lora_mutex);
 }
 
@@ -363,6 +498,7 @@ void lora_SetCadParams(uint8_t cadSymbolNum, uint8_t cadDetPeak, uint8_t cadDetM
 	data[5] = (uint8_t)((cadTimeout >> 8) & 0xFF);
 	data[6] = (uint8_t)(cadTimeout & 0xFF);
 	writeCommand(SX126X_CMD_SET_CAD_PARAMS, data, 7); // 0x88
+	active_profile = NULL;
 	mutex_unlock(lora_mutex);
 }
 
@@ -601,33 +737,41 @@ void lora_SetBufferAddr(uint8_t txBaseAddress, uint8_t rxBaseAddress)
 uint8_t lora_ReadBuffer(uint8_t *rxData, int16_t rxDataLen)
 {
 	mutex_lock(lora_mutex);
+	uint8_t payloadLength = readFifo(rxDataLen);
+	memcpy(rxData, rxcmd+3, payloadLength);
+	mutex_unlock(lora_mutex);
+	return payloadLength;
+}
+
+
+
+/****************************************************************************
+ *  Read the received packet from the FIFO into rxcmd (from position 3). 
+ *  Return the length. Assume that mutex is held. 
+ ****************************************************************************/
+
+static uint8_t readFifo(int16_t rxDataLen) 
+{
 	uint8_t offset = 0;
 	uint8_t payloadLength = 0;
 	getRxBufferStatus(&payloadLength, &offset);
 	if( payloadLength > rxDataLen )
 	{
 		ESP_LOGW(TAG, "ReadBuffer rxDataLen too small. payloadLength=%d rxDataLen=%d", payloadLength, rxDataLen);
-		mutex_unlock(lora_mutex);
 		return 0;
 	}
 
 	// ensure BUSY is low (state meachine ready)
 	waitForIdle(BUSY_TIMEOUT, "start ReadBuffer", true);
 
-	// start transfer
-	chipSelect(true); 
-	spi_transfer(SX126X_CMD_READ_BUFFER); // 0x1E
-	spi_transfer(offset);
-	spi_transfer(SX126X_CMD_NOP);
-	for( int i = 0; i < payloadLength; i++ )
-		rxData[i] = spi_transfer(SX126X_CMD_NOP);  
-
-	// stop transfer
-	chipSelect(false);
+	// one transaction: command, offset, NOP then the data
+	memset(txcmd, SX126X_CMD_NOP, payloadLength+3);
+	txcmd[0] = SX126X_CMD_READ_BUFFER; // 0x1E
+	txcmd[1] = offset;
+	transfer(txcmd, rxcmd, payloadLength+3);
 
 	// wait for BUSY to go low
 	waitForIdle(BUSY_TIMEOUT, "end ReadBuffer", false);
-	mutex_unlock(lora_mutex);
 	return payloadLength;
 }
 
@@ -650,16 +794,13 @@ static void writeBuffer(uint8_t *txData, int16_t txDataLen)
 	// ensure BUSY is low (state meachine ready)
 	waitForIdle(BUSY_TIMEOUT, "start WriteBuffer", true);
 
-	// start transfer
-	chipSelect(true);
-
-	spi_transfer(SX126X_CMD_WRITE_BUFFER); // 0x0E
-	spi_transfer(0); //offset in tx fifo
-	for( int i = 0; i < txDataLen; i++ )
-		 spi_transfer( txData[i]);	
-	
-	// stop transfer
-	chipSelect(false);
+	// one transaction: command, offset in tx fifo, then the data
+	if (txDataLen > SPI_MAX_TRANS-2)
+		txDataLen = SPI_MAX_TRANS-2;
+	txcmd[0] = SX126X_CMD_WRITE_BUFFER; // 0x0E
+	txcmd[1] = 0; 
+	memcpy(txcmd+2, txData, txDataLen);
+	transfer(txcmd, NULL, txDataLen+2);
 
 	// wait for BUSY to go low
 	waitForIdle(BUSY_TIMEOUT, "end WriteBuffer", false);
@@ -1006,11 +1147,15 @@ static void setRegulatorMode(uint8_t mode)
 
 
 /****************************************************************************
- *  Select pin 
+ *  One SPI transaction (chip select is held for the whole command)
  ****************************************************************************/
 
-static void chipSelect(bool select) {
-	gpio_set_level(LORA_PIN_CS, (select? LOW : HIGH));
+static void transfer(uint8_t* tx, uint8_t* rx, int len) {
+	int64_t t = esp_timer_get_time();
+	spi_xfer(tx, rx, len);
+	spistats.usec += (uint32_t) (esp_timer_get_time() - t);
+	spistats.trans++;
+	spistats.bytes += len;
 }
 
 
@@ -1034,12 +1179,22 @@ static void waitForIdleBegin(unsigned long timeout, char *text) {
 static bool waitForIdle(unsigned long timeout, char *text, bool stop)
 {
 	bool ret = true;
+	int64_t t = esp_timer_get_time();
 	TickType_t start = xTaskGetTickCount();
 	sleepUs(1);
-	while(xTaskGetTickCount() - start < (timeout/portTICK_PERIOD_MS)) {
-		if (gpio_get_level(LORA_PIN_BUSY) == 0) break;
-		sleepUs(1);
+	if (busy_irq) {
+		/* Wait for the falling edge on BUSY. Take the semaphore 
+		 * first to clear edges we have seen before */
+		sem_downTimeout(busy_sem, 0);
+		if (gpio_get_level(LORA_PIN_BUSY))
+			sem_downTimeout(busy_sem, timeout);
 	}
+	else
+		while(xTaskGetTickCount() - start < (timeout/portTICK_PERIOD_MS)) {
+			if (gpio_get_level(LORA_PIN_BUSY) == 0) break;
+			sleepUs(1);
+		}
+	spistats.busy_usec += (uint32_t) (esp_timer_get_time() - t);
 	if (gpio_get_level(LORA_PIN_BUSY)) {
         ESP_LOGE(TAG, "WaitForIdle Timeout text=%s timeout=%lu start=%"PRIu32, text, timeout, start);
 		if (stop) 
@@ -1061,22 +1216,12 @@ static void writeRegister(uint16_t reg, uint8_t* data, uint8_t numBytes) {
 	// ensure BUSY is low (state meachine ready)
 	waitForIdle(BUSY_TIMEOUT, "start WriteRegister", true);
 
-    // start transfer
-	chipSelect(true);
-
-	// send command byte
-	spi_transfer(SX126X_CMD_WRITE_REGISTER); // 0x0D
-	spi_transfer((reg & 0xFF00) >> 8);
-	spi_transfer(reg & 0xff);
-	
-	for(uint8_t n = 0; n < numBytes; n++) {
-		uint8_t in = spi_transfer(data[n]);
-		(void)in;
-        ESP_LOGD(TAG, "%02x --> %02x", data[n], in);
-	}
-
-	// stop transfer
-	chipSelect(false);
+	// command byte, address and data in one transaction
+	txcmd[0] = SX126X_CMD_WRITE_REGISTER; // 0x0D
+	txcmd[1] = (reg & 0xFF00) >> 8;
+	txcmd[2] = reg & 0xff;
+	memcpy(txcmd+3, data, numBytes);
+	transfer(txcmd, NULL, numBytes+3);
 
 	// wait for BUSY to go low
 	waitForIdle(BUSY_TIMEOUT, "end WriteRegister", false);
@@ -1091,22 +1236,13 @@ static void readRegister(uint16_t reg, uint8_t* data, uint8_t numBytes) {
 	// ensure BUSY is low (state meachine ready)
 	waitForIdle(BUSY_TIMEOUT, "start ReadRegister", true);
 
-	// start transfer
-	chipSelect(true);
-
-	// send command byte
-	spi_transfer(SX126X_CMD_READ_REGISTER); // 0x1D
-	spi_transfer((reg & 0xFF00) >> 8);
-	spi_transfer(reg & 0xff);
-	spi_transfer(SX126X_CMD_NOP);
-
-	for(uint8_t n = 0; n < numBytes; n++) {
-		data[n] = spi_transfer(SX126X_CMD_NOP);
-        ESP_LOGD(TAG, "DataIn:%02x ", data[n]);
-	}
-
-	// stop transfer
-	chipSelect(false);
+	// command byte, address, NOP then the data in one transaction
+	memset(txcmd, SX126X_CMD_NOP, numBytes+4);
+	txcmd[0] = SX126X_CMD_READ_REGISTER; // 0x1D
+	txcmd[1] = (reg & 0xFF00) >> 8;
+	txcmd[2] = reg & 0xff;
+	transfer(txcmd, rxcmd, numBytes+4);
+	memcpy(data, rxcmd+4, numBytes);
 
 	// wait for BUSY to go low
 	waitForIdle(BUSY_TIMEOUT, "end ReadRegister", false);
@@ -1139,18 +1275,17 @@ static uint8_t writeCommand2(uint8_t cmd, uint8_t* data, uint8_t numBytes) {
 	// ensure BUSY is low (state meachine ready)
 	waitForIdle(BUSY_TIMEOUT, "start WriteCommand2", true);
 
-	// start transfer
-	chipSelect(true);
-
-	// send command byte
-	spi_transfer(cmd);
+	// send command byte and data in one transaction
+	txcmd[0] = cmd;
+	memcpy(txcmd+1, data, numBytes);
+	transfer(txcmd, rxcmd, numBytes+1);
 
 	// variable to save error during SPI transfer
 	uint8_t status = 0;
 
-	// send/receive all bytes
+	// check status bytes received with the data
 	for(uint8_t n = 0; n < numBytes; n++) {
-		uint8_t in = spi_transfer(data[n]);
+		uint8_t in = rxcmd[n+1];
         ESP_LOGD(TAG, "%02x --> %02x", data[n], in);
 
 		// check status
@@ -1164,10 +1299,7 @@ static uint8_t writeCommand2(uint8_t cmd, uint8_t* data, uint8_t numBytes) {
 			break;
 		}
 	} 
-
-	// stop transfer
-	chipSelect(false);
-	
+		
 	// wait for BUSY to go low
 	waitForIdle(BUSY_TIMEOUT, "end WriteCommand2", false);
 	return status;
@@ -1184,19 +1316,11 @@ static void readCommand(uint8_t cmd, uint8_t* data, uint8_t numBytes) {
 	//WaitForIdle(BUSY_WAIT, "start ReadCommand", true);
 	waitForIdleBegin(BUSY_TIMEOUT, "start ReadCommand");
 
-	// start transfer
-	chipSelect(true);
-
-	// send command byte
-	spi_transfer(cmd);
-
-	// send/receive all bytes
-	for(uint8_t n = 0; n < numBytes; n++) {
-		data[n] = spi_transfer(SX126X_CMD_NOP);
-	}
-
-	// stop transfer
-	chipSelect(false);
+	// send command byte and receive all bytes in one transaction
+	memset(txcmd, SX126X_CMD_NOP, numBytes+1);
+	txcmd[0] = cmd;
+	transfer(txcmd, rxcmd, numBytes+1);
+	memcpy(data, rxcmd+1, numBytes);
 
 	// wait for BUSY to go low
 	sleepMs(1);
@@ -32,6 +32,38 @@
 #if defined(ARCTIC4_UHF)
  
 #define LORA_LNA_GAIN 7
+
+/* Preamble length (symbols) */
+#define LORA_PREAMBLE_LEN 10
+
+/* Max length of a SPI transaction: Command, offset, NOP and 255 bytes payload */
+#define SPI_MAX_TRANS 260
+
+/* SPI bus statistics for the LoRa chip. Times are in usec */
+typedef struct _lora_spistats {
+    uint32_t trans; 
+    uint32_t bytes;
+    uint32_t usec;
+    uint32_t busy_usec;
+    uint32_t switches;      /* Modem profile switches */
+    uint32_t switch_usec;   /* Time spent on them */
+    uint32_t switch_skip;   /* Profile was active already */
+} lora_spistats_t;
+
+/* 
+ * Modem profile: A SF/CR combination (BW is 125 kHz) with its timing 
+ * and the SPI commands to select it, all computed at compile time. 
+ */
+typedef struct _lora_profile {
+    uint8_t  sf, cr, ldro;    /* cr is 1-4 (4/5 - 4/8) */
+    uint32_t tsym_us;         /* Symbol time */
+    uint16_t cad_slot;        /* CAD backoff slot (ms) */
+    int16_t  toa_k;           /* Time on air: payload bits are 8*len + toa_k */
+    uint8_t  toa_div;         /*   payload bits per group of (cr+4) symbols */
+    uint16_t toa_qpre;        /*   fixed part in quarter symbols */
+    uint8_t  cmd_mod[5];      /* SetModulationParams */
+    uint8_t  cmd_cad[8];      /* SetCadParams */
+} lora_profile_t;
  
 void lora_config(uint8_t spreadingFactor, uint8_t bandwidth, uint8_t codingRate, 
         uint16_t preambleLength, uint8_t payloadLen, bool crcOn, bool invertIrq, uint8_t ldro );
@@ -58,6 +90,10 @@ void lora_GetRxBufferStatus(uint8_t *payloadLength, uint8_t *rxStartBufferPointe
 void lora_SetBufferAddr(uint8_t txBaseAddress, uint8_t rxBaseAddress);
 uint8_t lora_ReadBuffer(uint8_t *rxData, int16_t rxDataLen);
 void lora_WriteBuffer(uint8_t *txData, int16_t txDataLen);
+void lora_getSpiStats(lora_spistats_t* st);
+const lora_profile_t* lora_profile(uint8_t spreadingFactor, uint8_t codingRate);
+void lora_SetProfile(const lora_profile_t* p);
+uint32_t lora_TimeOnAir(const lora_profile_t* p, uint8_t len);
 
 #else 
 
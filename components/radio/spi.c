@@ -4,17 +4,23 @@
 #include <driver/spi_master.h>
 #include <driver/gpio.h>
 #include "esp_log.h"
+#include "esp_heap_caps.h"
 #include <string.h>
 #include <stdlib.h>
+#include "config.h"
+#include "radio.h"
 
 
 #define TAG "spi"
 
+/* Shorter transactions are polled, longer ones use DMA and interrupt */
+#define SPI_POLL_MAX  32
 
-
-static const int SPI_Frequency = 2000000;
 static spi_device_handle_t spi_handle;
 
+/* DMA capable buffers. Callers' buffers may be in PSRAM */
+static uint8_t *txbuf, *rxbuf;
+
 
 
 void spi_init()
@@ -35,9 +41,9 @@ void spi_init()
 	spi_device_interface_config_t devcfg;
 	memset( &devcfg, 0, sizeof( spi_device_interface_config_t ) );
     
-	devcfg.clock_speed_hz = SPI_Frequency;
-	devcfg.spics_io_num = -1; // FIXME: Can we configure the CS pin here?
-	devcfg.queue_size = 7;
+	devcfg.clock_speed_hz = get_byte_param("LORA.SPI", DFL_LORA_SPI) * 1000000;
+	devcfg.spics_io_num = LORA_PIN_CS; 
+	devcfg.queue_size = 1;
 	devcfg.mode = 0;
 	devcfg.flags = SPI_DEVICE_NO_DUMMY;
 
@@ -45,53 +51,36 @@ void spi_init()
 	ret = spi_bus_add_device( SPI_HOST, &devcfg, &spi_handle);
 	ESP_LOGI(TAG, "spi_bus_add_device = %d",ret);
 	assert(ret==ESP_OK);
+	
+	txbuf = heap_caps_malloc(SPI_MAX_TRANS, MALLOC_CAP_DMA);
+	rxbuf = heap_caps_malloc(SPI_MAX_TRANS, MALLOC_CAP_DMA);
+	assert(txbuf != NULL && rxbuf != NULL);
 }
 
 
 
-
-bool spi_write_byte(uint8_t* dataout, size_t dataLength )
-{
-	spi_transaction_t SPITransaction;
-
-	if ( dataLength > 0 ) {
-		memset( &SPITransaction, 0, sizeof( spi_transaction_t ) );
-		SPITransaction.length = dataLength * 8;
-		SPITransaction.tx_buffer = dataout;
-		SPITransaction.rx_buffer = NULL;
-		spi_device_transmit( spi_handle, &SPITransaction );
-	}
-	return true;
-}
-
-
-
-
-bool spi_read_byte(uint8_t* datain, uint8_t* dataout, size_t dataLength )
-{
-	spi_transaction_t SPITransaction;
-
-	if ( dataLength > 0 ) {
-		memset( &SPITransaction, 0, sizeof( spi_transaction_t ) );
-		SPITransaction.length = dataLength * 8;
-		SPITransaction.tx_buffer = dataout;
-		SPITransaction.rx_buffer = datain;
-		spi_device_transmit( spi_handle, &SPITransaction );
-	}
-
-	return true;
-}
-
-
-
-uint8_t spi_transfer(uint8_t address)
+/*
+ * One SPI transaction, with chip select (by hardware) held for the 
+ * whole transaction. Send len bytes from tx and, if rx is not NULL, 
+ * put the bytes received in rx. 
+ */
+void spi_xfer(uint8_t* tx, uint8_t* rx, size_t len)
 {
-	uint8_t datain[1];
-	uint8_t dataout[1];
-	dataout[0] = address;
-	//spi_write_byte(dataout, 1 );
-	spi_read_byte(datain, dataout, 1 );
-	return datain[0];
+	spi_transaction_t trans;
+	if (len == 0 || len > SPI_MAX_TRANS)
+		return;
+	
+	memset(&trans, 0, sizeof(spi_transaction_t));
+	memcpy(txbuf, tx, len);
+	trans.length = len * 8;
+	trans.tx_buffer = txbuf;
+	trans.rx_buffer = (rx == NULL ? NULL : rxbuf);
+	if (len <= SPI_POLL_MAX)
+		spi_device_polling_transmit(spi_handle, &trans);
+	else
+		spi_device_transmit(spi_handle, &trans);
+	if (rx != NULL)
+		memcpy(rx, rxbuf, len);
 }
 
 #endif
@@ -0,0 +1,490 @@
+/*
+ * Offline test of the SX1268 LoRa driver (lora1268.c) against a mock
+ * SX126x chip on the SPI bus. Runs on a host computer (not part of the
+ * firmware build):
+ *
+ *   gcc -O2 -Wall -DCONFIG_ARCTIC4_UHF -I../aprs/hoststub -I../../main \
+ *       -o lora_test test_lora1268.c -lm
+ *   ./lora_test
+ *
+ * lora1268.c is included here, so that the register and command
+ * functions (static) can be called directly. spi_xfer() (spi.c on the
+ * ESP32) is replaced by the mock chip. It has the register space, the
+ * 256 byte data buffer, the chip mode, IRQ status and the BUSY pin,
+ * and answers commands like the SX126x does. Each SPI transaction
+ * (one chip select) is recorded. A transaction while BUSY is high is
+ * a protocol error.
+ *
+ * Checked: The start sequence (lora_on), register writes and reads,
+ * buffer writes and reads of all lengths (also when the received
+ * packet wraps around the end of the buffer), sending, retry of
+ * commands when the chip reports an error, and modem profile
+ * switching. BUSY is waited for by polling and by interrupt.
+ *
+ * By LA7ECA, ohanssen@acm.org
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include "lora1268.c"
+
+
+#define LOG_SIZE   1024
+#define LOG_BYTES  8
+#define BUSY_POLLS 3
+
+#define MODE_STDBY_RC   2
+#define MODE_STDBY_XOSC 3
+#define MODE_RX         5
+#define MODE_TX         6
+
+
+
+/*******************************************************
+ * Mock SX126x chip
+ *******************************************************/
+
+typedef struct {
+    uint8_t  opcode;
+    uint16_t len;
+    uint8_t  tx[LOG_BYTES];
+} sxlog_t;
+
+static struct {
+    uint8_t  regs[0x1000];
+    uint8_t  buffer[256];
+    uint8_t  mode;
+    uint16_t irq;
+    uint8_t  rxlen, rxstart;
+    int      busy;            /* Polls of BUSY until it goes low */
+    int      fail;            /* Number of commands to fail */
+    int      violations;      /* Transactions while busy */
+    int      nlog;
+    sxlog_t  log[LOG_SIZE];
+} sx;
+
+static int dio3 = 0;
+
+
+static void sx_reset()
+{
+    memset(sx.regs, 0, sizeof(sx.regs));
+    sx.regs[SX126X_REG_LORA_SYNC_WORD_MSB] = SX126X_SYNC_WORD_PRIVATE >> 8;
+    sx.regs[SX126X_REG_LORA_SYNC_WORD_LSB] = SX126X_SYNC_WORD_PRIVATE & 0xff;
+    sx.mode = MODE_STDBY_RC;
+    sx.irq = 0;
+    sx.busy = 10 * BUSY_POLLS;
+}
+
+
+static uint8_t sx_status(uint8_t cmdstatus)
+   { return (sx.mode << 4) | cmdstatus; }
+
+
+void spi_init()
+   { }
+
+
+void spi_xfer(uint8_t* tx, uint8_t* rx, size_t len)
+{
+    uint8_t out[SPI_MAX_TRANS];
+    uint16_t addr = (tx[1] << 8) | tx[2];
+    int i;
+
+    if (sx.busy > 0)
+        sx.violations++;
+    if (sx.nlog < LOG_SIZE) {
+        sxlog_t* l = &sx.log[sx.nlog++];
+        l->opcode = tx[0];
+        l->len = len;
+        memcpy(l->tx, tx, (len < LOG_BYTES ? len : LOG_BYTES));
+    }
+
+    memset(out, sx_status(sx.fail > 0 ? SX126X_STATUS_CMD_FAILED : 0), len);
+    if (sx.fail > 0)
+        sx.fail--;
+    else switch (tx[0]) {
+        case SX126X_CMD_WRITE_REGISTER:
+            for (i=3; i<len; i++)
+                sx.regs[(addr + i - 3) & 0xfff] = tx[i];
+            break;
+        case SX126X_CMD_READ_REGISTER:
+            for (i=4; i<len; i++)
+                out[i] = sx.regs[(addr + i - 4) & 0xfff];
+            break;
+        case SX126X_CMD_WRITE_BUFFER:
+            for (i=2; i<len; i++)
+                sx.buffer[(tx[1] + i - 2) & 0xff] = tx[i];
+            break;
+        case SX126X_CMD_READ_BUFFER:
+            for (i=3; i<len; i++)
+                out[i] = sx.buffer[(tx[1] + i - 3) & 0xff];
+            break;
+        case SX126X_CMD_GET_IRQ_STATUS:
+            out[2] = sx.irq >> 8;
+            out[3] = sx.irq & 0xff;
+            break;
+        case SX126X_CMD_CLEAR_IRQ_STATUS:
+            sx.irq &= ~((tx[1] << 8) | tx[2]);
+            break;
+        case SX126X_CMD_GET_RX_BUFFER_STATUS:
+            out[2] = sx.rxlen;
+            out[3] = sx.rxstart;
+            break;
+        case SX126X_CMD_SET_STANDBY:
+            sx.mode = (tx[1] == SX126X_STANDBY_XOSC ? MODE_STDBY_XOSC : MODE_STDBY_RC);
+            break;
+        case SX126X_CMD_SET_RX:
+            sx.mode = MODE_RX;
+            break;
+        case SX126X_CMD_SET_TX:
+            sx.mode = MODE_TX;
+            break;
+    }
+    if (rx != NULL)
+        memcpy(rx, out, len);
+    sx.busy = BUSY_POLLS;
+}
+
+
+/* Find the n'th last transaction with the opcode, or NULL */
+static sxlog_t* sx_find(uint8_t opcode, int from)
+{
+    for (int i = sx.nlog - 1; i >= from; i--)
+        if (sx.log[i].opcode == opcode)
+            return &sx.log[i];
+    return NULL;
+}
+
+
+static int sx_count(uint8_t opcode, int from)
+{
+    int n = 0;
+    for (int i=from; i < sx.nlog; i++)
+        if (sx.log[i].opcode == opcode)
+            n++;
+    return n;
+}
+
+
+
+/*******************************************************
+ * GPIO, clock, semaphores and parameters. The mutex
+ * is handle 1, the BUSY semaphore is handle 2.
+ *******************************************************/
+
+static TickType_t ticks = 0;
+
+esp_err_t gpio_reset_pin(gpio_num_t pin)                            { return 0; }
+esp_err_t gpio_set_direction(gpio_num_t pin, int mode)              { return 0; }
+esp_err_t gpio_set_pull_mode(gpio_num_t pin, int pull)              { return 0; }
+esp_err_t gpio_set_intr_type(gpio_num_t pin, int type)              { return 0; }
+esp_err_t gpio_isr_handler_add(gpio_num_t pin, gpio_isr_t h, void* arg) { return 0; }
+esp_err_t gpio_intr_enable(gpio_num_t pin)                          { return 0; }
+
+
+esp_err_t gpio_set_level(gpio_num_t pin, uint32_t level)
+{
+    if (pin == LORA_PIN_RST && level == 1)
+        sx_reset();
+    if (pin == LORA_PIN_DIO3)
+        dio3 = level;
+    return 0;
+}
+
+
+int gpio_get_level(gpio_num_t pin)
+{
+    if (pin != LORA_PIN_BUSY || sx.busy == 0)
+        return 0;
+    sx.busy--;
+    return 1;
+}
+
+
+TickType_t xTaskGetTickCount(void)
+   { return ticks++; }
+
+void vTaskDelay(TickType_t t)
+   { ticks += t; }
+
+void esp_rom_delay_us(uint32_t us)
+   { }
+
+int64_t esp_timer_get_time(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000LL + t.tv_nsec / 1000;
+}
+
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+   { return (SemaphoreHandle_t) 1; }
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+   { return (SemaphoreHandle_t) 2; }
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+   { return pdTRUE; }
+
+BaseType_t xSemaphoreGiveFromISR(SemaphoreHandle_t sem, BaseType_t* woken)
+   { return pdTRUE; }
+
+
+/* Waiting on the BUSY semaphore: BUSY goes low (falling edge) */
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t t)
+{
+    if (sem != (SemaphoreHandle_t) 2)
+        return pdTRUE;
+    if (t == 0 || sx.busy == 0)
+        return pdFALSE;
+    sx.busy = 0;
+    return pdTRUE;
+}
+
+
+uint8_t get_byte_param(const char* key, const uint8_t dfl)
+   { return dfl; }
+
+int32_t get_i32_param(const char* key, const int32_t dfl)
+   { return dfl; }
+
+
+
+/*******************************************************
+ * Start: Reset, check sync word, calibrate, set
+ * frequency, modem parameters and RX mode.
+ *******************************************************/
+
+static int check_start()
+{
+    int fails = 0;
+    uint32_t freq = (uint32_t) ((double) DFL_FREQ / FREQ_STEP);
+
+    sx.nlog = 0;
+    lora_on(true);
+    sxlog_t* l = sx_find(SX126X_CMD_SET_RF_FREQUENCY, 0);
+    printf("  lora_on: %d transactions, BUSY by %s\n", sx.nlog, (busy_irq ? "interrupt" : "polling"));
+
+    if (sx_find(SX126X_CMD_READ_REGISTER, 0) == NULL || l == NULL) {
+        printf("FAIL: start: sync word not read or frequency not set\n");
+        return 1;
+    }
+    if (l->len != 5 || l->tx[1] != freq >> 24 || l->tx[2] != ((freq >> 16) & 0xff)
+          || l->tx[3] != ((freq >> 8) & 0xff) || l->tx[4] != (freq & 0xff)) {
+        printf("FAIL: start: frequency %02x%02x%02x%02x, expected %08x\n",
+            l->tx[1], l->tx[2], l->tx[3], l->tx[4], freq);
+        fails++;
+    }
+    if (sx.mode != MODE_RX) {
+        printf("FAIL: start: chip mode is %d, expected RX\n", sx.mode);
+        fails++;
+    }
+    return fails;
+}
+
+
+
+/*******************************************************
+ * Registers: Random addresses and lengths. One
+ * transaction each.
+ *******************************************************/
+
+static int check_registers()
+{
+    int fails = 0;
+    uint8_t in[16], out[16];
+
+    for (int i=0; i<2000; i++) {
+        uint16_t reg = 0x0600 + rand() % 0x400;
+        int n = 1 + rand() % 16;
+        for (int j=0; j<n; j++)
+            in[j] = rand();
+
+        sx.nlog = 0;
+        writeRegister(reg, in, n);
+        readRegister(reg, out, n);
+        if (sx.nlog != 2 || sx.log[0].len != n+3 || sx.log[1].len != n+4
+              || sx.log[0].tx[1] != reg >> 8 || sx.log[0].tx[2] != (reg & 0xff)) {
+            printf("FAIL: register 0x%04x, %d bytes: %d transactions\n", reg, n, sx.nlog);
+            fails++;
+        }
+        if (memcmp(in, out, n) != 0 || memcmp(in, sx.regs + reg, n) != 0) {
+            printf("FAIL: register 0x%04x, %d bytes: read back wrong\n", reg, n);
+            fails++;
+        }
+    }
+    return fails;
+}
+
+
+
+/*******************************************************
+ * Data buffer. Write packets of all lengths. Receive
+ * packets of all lengths from random positions in the
+ * buffer.
+ *******************************************************/
+
+static int check_buffer()
+{
+    int fails = 0;
+    uint8_t in[256], out[256];
+
+    for (int len=1; len<=255; len++) {
+        for (int j=0; j<len; j++)
+            in[j] = rand();
+
+        /* Write */
+        sx.nlog = 0;
+        lora_WriteBuffer(in, len);
+        if (sx.nlog != 1 || sx.log[0].len != len+2 || memcmp(sx.buffer, in, len) != 0) {
+            printf("FAIL: write buffer, %d bytes: %d transactions\n", len, sx.nlog);
+            fails++;
+        }
+
+        /* Receive */
+        sx.rxlen = len;
+        sx.rxstart = rand();
+        for (int j=0; j<len; j++)
+            sx.buffer[(sx.rxstart + j) & 0xff] = in[j];
+        sx.irq = SX126X_IRQ_RX_DONE | (len % 7 == 0 ? SX126X_IRQ_CRC_ERR : 0);
+        int n = lora_ReceivePacket(out, 255);
+        if (n != (len % 7 == 0 ? -len : len) || memcmp(in, out, len) != 0) {
+            printf("FAIL: receive %d bytes from %d: got %d\n", len, sx.rxstart, n);
+            fails++;
+        }
+
+        /* Too long for the caller's buffer: Not read */
+        sx.nlog = 0;
+        if (lora_ReceivePacket(out, len-1) != 0 || sx_count(SX126X_CMD_READ_BUFFER, 0) != 0) {
+            printf("FAIL: receive %d bytes into %d byte buffer\n", len, len-1);
+            fails++;
+        }
+    }
+    return fails;
+}
+
+
+
+/*******************************************************
+ * Send a packet and go back to RX
+ *******************************************************/
+
+static int check_send()
+{
+    static const uint8_t seq[] = { SX126X_CMD_SET_PACKET_PARAMS, SX126X_CMD_CLEAR_IRQ_STATUS,
+        SX126X_CMD_WRITE_BUFFER, SX126X_CMD_SET_STANDBY, SX126X_CMD_SET_TX, SX126X_CMD_GET_STATUS };
+    int fails = 0;
+    uint8_t pkt[100];
+
+    for (int j=0; j<sizeof(pkt); j++)
+        pkt[j] = rand();
+    sx.nlog = 0;
+    sx.irq = SX126X_IRQ_ALL;
+    lora_SendPacket(pkt, sizeof(pkt));
+    for (int i=0; i<sizeof(seq); i++)
+        if (i >= sx.nlog || sx.log[i].opcode != seq[i]) {
+            printf("FAIL: send: transaction %d is %02x, expected %02x\n", i, sx.log[i].opcode, seq[i]);
+            fails++;
+            break;
+        }
+    if (sx.log[0].tx[4] != sizeof(pkt) || memcmp(sx.buffer, pkt, sizeof(pkt)) != 0
+          || sx.irq != 0 || sx.mode != MODE_TX || dio3 != 1) {
+        printf("FAIL: send: length %d, mode %d, irq %04x, DIO3 %d\n",
+            sx.log[0].tx[4], sx.mode, sx.irq, dio3);
+        fails++;
+    }
+    lora_TxOff();
+    if (sx.mode != MODE_RX || dio3 != 0) {
+        printf("FAIL: tx off: mode %d, DIO3 %d\n", sx.mode, dio3);
+        fails++;
+    }
+    return fails;
+}
+
+
+
+/*******************************************************
+ * The chip reports an error: The command is sent
+ * again, up to 9 times.
+ *******************************************************/
+
+static int check_retry()
+{
+    int fails = 0;
+    for (int f=0; f<=10; f += 2) {
+        sx.nlog = 0;
+        sx.fail = f;
+        lora_SetBufferAddr(0, 0);
+        int n = sx_count(SX126X_CMD_SET_BUFFER_BASE_ADDRESS, 0);
+        if (n != (f < 9 ? f+1 : 9)) {
+            printf("FAIL: %d errors: command sent %d times\n", f, n);
+            fails++;
+        }
+        sx.fail = 0;
+    }
+    return fails;
+}
+
+
+
+/*******************************************************
+ * Modem profiles: Same command as SetModulationParams,
+ * nothing sent if the profile is active already.
+ *******************************************************/
+
+static int check_profile()
+{
+    int fails = 0;
+    for (uint8_t sf=5; sf<=12; sf++)
+        for (uint8_t cr=5; cr<=8; cr++) {
+            const lora_profile_t* p = lora_profile(sf, cr);
+            sx.nlog = 0;
+            lora_SetModulationParams(sf, SX126X_LORA_BW_125_0, cr-4, p->ldro);
+            sxlog_t ref = sx.log[0];
+
+            sx.nlog = 0;
+            lora_SetProfile(p);
+            sxlog_t* l = sx_find(SX126X_CMD_SET_MODULATION_PARAMS, 0);
+            if (l == NULL || l->len != ref.len || memcmp(l->tx, ref.tx, ref.len) != 0) {
+                printf("FAIL: profile SF%d CR4/%d: not like SetModulationParams\n", sf, cr);
+                fails++;
+            }
+            sx.nlog = 0;
+            lora_SetProfile(p);
+            if (sx.nlog != 0) {
+                printf("FAIL: profile SF%d CR4/%d: %d transactions when active\n", sf, cr, sx.nlog);
+                fails++;
+            }
+        }
+    return fails;
+}
+
+
+
+int main(int argc, char** argv)
+{
+    int fails = 0;
+    lora_init();
+    for (int irq=0; irq<2; irq++) {
+        busy_irq = irq;
+        fails += check_start();
+        fails += check_registers();
+        fails += check_buffer();
+        fails += check_send();
+        fails += check_retry();
+        fails += check_profile();
+        lora_on(false);
+    }
+    if (sx.violations > 0) {
+        printf("FAIL: %d transactions while BUSY was high\n", sx.violations);
+        fails++;
+    }
+    printf("%d failures\n", fails);
+    return (fails > 0 ? 1 : 0);
+}
@@ -5,10 +5,11 @@
 #include <string.h>
 #include "encryption.h"
 #include "esp_log.h"
-#include "micro_aes.h"
+#include "gcmsiv.h"
 #include "mbedtls/base64.h"
 #include "base91.h"
 #include "config.h"
+#include "system.h"
 #include "esp_random.h"
 #include "mbedtls/pkcs5.h"
 #include "mbedtls/sha256.h"
@@ -19,9 +20,6 @@
 
 #define SHA256_SIZE 32
 #define SHA256_B64_SIZE 44
-#define HMAC_SHA256_SIZE 32
-#define HMAC_KEY_SIZE 64
-#define HMAC_B64_SIZE 45
 
 #define DERIVED_KEY_LENGTH 32
 #define PBKDF2_ITERATIONS 16384
@@ -29,12 +27,24 @@
 #define SALT_SAPIKEY "*E^o2Zse@!_rQp:kL%{4qL.~!v[n&HS)"
 #define SALT_APIKEY  "Qcb_N56Z9e@A1.8),&#++ekwR]?xc<y_"
 
+/* Max size of text to be encrypted (longer text is truncated) */
+#define SEC_MAX_TEXT 260
+
 
 
 static uint8_t _cryptkey[DERIVED_KEY_LENGTH]; 
 static uint8_t _apikey[DERIVED_KEY_LENGTH]; 
 static uint8_t _sapikey[DERIVED_KEY_LENGTH]; 
 
+/* Expanded encryption key and state derived from it. Protected by crypt_lock */
+static gcmsiv_t _crypt;
+static bool _crypt_ready = false;
+static mutex_t crypt_lock = NULL;
+
+/* HMAC keys with precomputed hash states */
+static sec_hmac_key_t _apihk, _sapihk;
+static bool _apihk_ready = false, _sapihk_ready = false;
+
 #define TAG "secutils"
 
 
@@ -72,38 +82,52 @@ uint8_t * sec_derive_key(uint8_t* buf, const char* passwd, const char* salt)
 
 
 /**
- * Encrypt a text using a key, and a nonce. 
+ * Encrypt a text using the key set by sec_set_cryptkey(), and a nonce. 
+ * buf must have room for size + 16 bytes. 
  */
-static uint8_t * gcm_siv_encrypt(uint8_t *buf, uint8_t* key, char* cleartext, size_t size, char* nonce) 
+static uint8_t * gcm_siv_encrypt(uint8_t *buf, char* cleartext, size_t size, char* nonce) 
 {
-    uint8_t ivect[12], aad[1]; 
-    memset(ivect, 0, 12);
-    strncpy((char*) ivect, nonce, strlen(nonce));
+    uint8_t ivect[GCMSIV_NONCE_LEN]; 
+    memset(ivect, 0, GCMSIV_NONCE_LEN);
+    strncpy((char*) ivect, nonce, GCMSIV_NONCE_LEN);
     
-    GCM_SIV_encrypt ( 
-            key, ivect,
-            (void*) aad, 0,                 
-            (void*) cleartext, size,  
-            buf );    
+    mutex_lock(crypt_lock);
+    gcmsiv_encrypt(&_crypt, ivect, NULL, 0, cleartext, size, buf);
+    mutex_unlock(crypt_lock);
     return buf;
 }
 
 
 /**
  * Set a key to be used for encryption. 
- * The key is derived from a passphrase using PBKDF2. 
+ * The key is derived from a passphrase using PBKDF2. The AES key schedule
+ * is set up here, once, and not for every packet. 
  */ 
 void sec_set_cryptkey(char* keyphrase) {
+    if (crypt_lock == NULL)
+        crypt_lock = mutex_create();
     sec_derive_key(_cryptkey, keyphrase, SALT_APRSPOS);
+    
+    mutex_lock(crypt_lock);
+    if (_crypt_ready)
+        gcmsiv_free(&_crypt);
+    gcmsiv_init(&_crypt, _cryptkey);
+    _crypt_ready = true;
+    mutex_unlock(crypt_lock);
 }
 
 
 /**
  * Set a key to be used for API authentication. 
- * The key is derived from a passphrase using PBKDF2. 
+ * The key is derived from a passphrase using PBKDF2. The HMAC key pads are 
+ * hashed here, once, and not for every request. 
  */ 
 void sec_set_apikey(char* keyphrase) {
     sec_derive_key(_apikey, keyphrase, SALT_APIKEY);
+    if (_apihk_ready)
+        sec_hmac_freekey(&_apihk);
+    sec_hmac_setkey(&_apihk, _apikey, DERIVED_KEY_LENGTH);
+    _apihk_ready = true;
 }
 
 
@@ -113,6 +137,10 @@ void sec_set_apikey(char* keyphrase) {
  */ 
 void sec_set_sapikey(char* keyphrase) {
     sec_derive_key(_sapikey, keyphrase, SALT_SAPIKEY);
+    if (_sapihk_ready)
+        sec_hmac_freekey(&_sapihk);
+    sec_hmac_setkey(&_sapihk, _sapikey, DERIVED_KEY_LENGTH);
+    _sapihk_ready = true;
 }
 
 
@@ -121,7 +149,7 @@ void sec_set_sapikey(char* keyphrase) {
  *  Encrypt a string using AES-GCM-SIV.
  */
 uint8_t * sec_encrypt(uint8_t *buf, char* cleartext, size_t size, char* nonce) {
-    return gcm_siv_encrypt(buf, _cryptkey, cleartext, size, nonce);
+    return gcm_siv_encrypt(buf, cleartext, size, nonce);
 }
 
 
@@ -129,13 +157,13 @@ uint8_t * sec_encrypt(uint8_t *buf, char* cleartext, size_t size, char* nonce) {
  *  Encrypt a string using AES-GCM-SIV. Encode with Base64.
  */
 size_t sec_encryptB64(char *res, size_t dsize, char* cleartext, size_t size, char* nonce) {
-    size_t csize = size + 16;
+    uint8_t buf[SEC_MAX_TEXT + GCMSIV_TAG_LEN];
     size_t olen;
-    uint8_t *buf = (uint8_t*) malloc(csize);
-    gcm_siv_encrypt(buf, _cryptkey, cleartext, size, nonce);
+    if (size > SEC_MAX_TEXT)
+        size = SEC_MAX_TEXT;
+    gcm_siv_encrypt(buf, cleartext, size, nonce);
     
-    mbedtls_base64_encode((unsigned char*) res, dsize, &olen, buf, csize);
-    free(buf);
+    mbedtls_base64_encode((unsigned char*) res, dsize, &olen, buf, size + GCMSIV_TAG_LEN);
     return olen;
 }
 
@@ -145,13 +173,12 @@ size_t sec_encryptB64(char *res, size_t dsize, char* cleartext, size_t size, cha
  *  Encrypt a string using AES-GCM-SIV. Encode with Base91
  */
 size_t sec_encryptB91(char *res, size_t dsize, char* cleartext, size_t size, char* nonce) {
-    size_t csize = size + 16;
-    uint8_t *buf = (uint8_t*) malloc(csize);
-    gcm_siv_encrypt(buf, _cryptkey, cleartext, size, nonce);
+    uint8_t buf[SEC_MAX_TEXT + GCMSIV_TAG_LEN];
+    if (size > SEC_MAX_TEXT)
+        size = SEC_MAX_TEXT;
+    gcm_siv_encrypt(buf, cleartext, size, nonce);
     
-    size_t len = encodeBase91(buf, res, csize);
-    free(buf);
-    return len;
+    return encodeBase91(buf, res, size + GCMSIV_TAG_LEN);
 }
 
 
@@ -161,14 +188,38 @@ size_t sec_encryptB91(char *res, size_t dsize, char* cleartext, size_t size, cha
 
 char* sec_sha256_b64(char* res, uint8_t *data, int len) 
 {
-    uint8_t hash[SHA256_SIZE];
-    
-    mbedtls_sha256_context ss;
-    mbedtls_sha256_init (&ss);
-    mbedtls_sha256_starts (&ss, 0);
+    sec_sha256_t ss;
+    sec_sha256_begin(&ss);
+    sec_sha256_update(&ss, data, len);
+    return sec_sha256_b64end(&ss, res);
+}
+
+
+
+/********************************************************************************************
+ * SHA256 hash computed incrementally, for content that is not in one buffer. 
+ * Result is converted to base64 like above. 
+ ********************************************************************************************/
+
+void sec_sha256_begin(sec_sha256_t* ss) 
+{
+    mbedtls_sha256_init (ss);
+    mbedtls_sha256_starts (ss, 0);
+}
+
+
+void sec_sha256_update(sec_sha256_t* ss, const uint8_t *data, int len) 
+{
     if (len > 0)
-        mbedtls_sha256_update (&ss, (uint8_t*) data, len);
-    mbedtls_sha256_finish (&ss, hash);
+        mbedtls_sha256_update (ss, data, len);
+}
+
+
+char* sec_sha256_b64end(sec_sha256_t* ss, char* res) 
+{
+    uint8_t hash[SHA256_SIZE];
+    mbedtls_sha256_finish (ss, hash);
+    mbedtls_sha256_free (ss);
     
     size_t olen;
     mbedtls_base64_encode((unsigned char*) res, SHA256_B64_SIZE+1, &olen, hash, SHA256_SIZE);
@@ -179,100 +230,31 @@ char* sec_sha256_b64(char* res, uint8_t *data, int len)
 
 
 /********************************************************************************************
- * HMAC based on SHA256 
- * data contains (some representation of) the content. It should not be repeated in a 
- * predictable way. It may be a good idea to include a nonce or timestamp.
- * The hash is converted to a base64 format and returned in the res buffer.
- * 
- * HMAC(H, K) == H(K ^ opad, H(K ^ ipad, text))
- * Implementation adapted from Adrian Perez
- * https://github.com/aperezdc/hmac-sha256/blob/master/hmac-sha256.c
+ * HMAC based on SHA256, with the keys derived from the passphrases. See hmac.c. 
+ * The inner and outer hash states of the keys are computed when the keys are set. 
  ********************************************************************************************/
 
-
-#define I_PAD 0x36
-#define O_PAD 0x5C
-
-
 /* Use a key derived from the API.KEY passphrase */
 char* sec_hmac_api(char* res, int hlen, uint8_t* data1, int len1, uint8_t* data2, int len2) 
 {
-    return sec_hmac(_apikey, DERIVED_KEY_LENGTH, res, hlen, data1, len1, data2, len2);
+    return sec_hmac_k(&_apihk, res, hlen, data1, len1, data2, len2);
 }
 
 
-/* Use a key derived from the API.KEY passphrase */
+/* Use a key derived from the TRKLOG.KEY passphrase */
 char* sec_hmac_sapi(char* res, int hlen, uint8_t* data1, int len1, uint8_t* data2, int len2) 
 {
-    return sec_hmac(_sapikey, DERIVED_KEY_LENGTH, res, hlen, data1, len1, data2, len2);
+    return sec_hmac_k(&_sapihk, res, hlen, data1, len1, data2, len2);
 }
 
 
-/* Use any key that is provided */
-char* sec_hmac(const uint8_t* key, int keylen, char* res, int hlen, uint8_t* data1, int len1, uint8_t* data2, int len2)
-{      
-    char b64hash[HMAC_B64_SIZE+1];
-    uint8_t hash[HMAC_SHA256_SIZE];
-    
-    /* IF key length is more than HMAC_KEY_SIZE, use a hash of it instead */
-    if (keylen > HMAC_KEY_SIZE) {
-        mbedtls_sha256((unsigned char*) key, keylen, hash, 0);
-        memcpy(key, hash, HMAC_SHA256_SIZE);
-        keylen = HMAC_SHA256_SIZE;
-    }
-    /* Consider if this and the padding can be done once and stored. */
-    
-   /*
-     * (1) append zeros to the end of K to create a HMAC_KEY_SIZE byte string
-     * (2) XOR (bitwise exclusive-OR) the string computed in step
-     *     (1) with ipad
-     */
-    uint8_t kx[HMAC_KEY_SIZE];
-    for (size_t i = 0; i < keylen; i++) kx[i] = I_PAD ^ key[i];
-    for (size_t i = keylen; i < HMAC_KEY_SIZE; i++) kx[i] = I_PAD ^ 0;
-
-
-    /*
-     * (3) append the stream of data 'text' to the string resulting
-     *     from step (2)
-     * (4) apply H to the stream generated in step (3)
-     */  
-    mbedtls_sha256_context ss;
-    mbedtls_sha256_init (&ss);
-    mbedtls_sha256_starts (&ss, 0);
-    mbedtls_sha256_update (&ss, kx, HMAC_KEY_SIZE);
-    if (len1 > 0)
-        mbedtls_sha256_update (&ss, (uint8_t*) data1, len1);
-    if (len2 > 0)
-        mbedtls_sha256_update (&ss, (uint8_t*) data2, len2);
-    
-    mbedtls_sha256_finish (&ss, hash);
-    
-    /*
-     * (5) XOR (bitwise exclusive-OR) the 64 byte string computed in
-     *     step (1) with opad
-     */
-    for (size_t i = 0; i < keylen; i++) kx[i] = O_PAD ^ key[i];
-    for (size_t i = keylen; i < HMAC_KEY_SIZE; i++) kx[i] = O_PAD ^ 0;
-    
-    /*
-     * (6) append the H result from step (4) to the 64 byte string
-     *     resulting from step (5)
-     * (7) apply H to the stream generated in step (6)
-     */
-    mbedtls_sha256_init (&ss);
-    mbedtls_sha256_starts (&ss, 0);
-    mbedtls_sha256_update (&ss, kx, HMAC_KEY_SIZE);
-    mbedtls_sha256_update (&ss, hash, HMAC_SHA256_SIZE);
-    mbedtls_sha256_finish (&ss, hash);
+/* Incremental versions of the above. Use sec_hmac_update and sec_hmac_b64end */
+void sec_hmac_api_begin(sec_hmac_t* hm) 
+    { sec_hmac_begin(hm, &_apihk); }
+
+void sec_hmac_sapi_begin(sec_hmac_t* hm) 
+    { sec_hmac_begin(hm, &_sapihk); }
 
-    size_t olen;
-    mbedtls_base64_encode((unsigned char*) b64hash, HMAC_B64_SIZE, &olen, hash, HMAC_SHA256_SIZE  );
-    if (hlen >= 0) 
-        b64hash[hlen] = 0;
-    strcpy(res, b64hash);
-    return res;
-}
 
 
 bool sec_isEncrypted() {
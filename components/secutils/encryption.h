@@ -7,6 +7,23 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include "mbedtls/sha256.h"
+
+/* Incremental SHA256 hash */
+typedef mbedtls_sha256_context sec_sha256_t;
+
+/* HMAC-SHA256 key: hash states after the inner and outer key pads */
+typedef struct {
+    mbedtls_sha256_context inner, outer;
+} sec_hmac_key_t;
+
+/* Incremental HMAC-SHA256 */
+typedef struct {
+    mbedtls_sha256_context ctx;
+    const sec_hmac_key_t* key;
+} sec_hmac_t;
+
+#define SEC_HMAC_SIZE 32
 
 
 void sec_init(void);
@@ -17,9 +34,22 @@ size_t sec_encryptB64(char *res, size_t dsize, char* cleartext, size_t size, cha
 size_t sec_encryptB91(char *res, size_t dsize, char* cleartext, size_t size, char* nonce);
 
 char* sec_sha256_b64(char* res, uint8_t *data, int len);
+void  sec_sha256_begin(sec_sha256_t* ss);
+void  sec_sha256_update(sec_sha256_t* ss, const uint8_t *data, int len);
+char* sec_sha256_b64end(sec_sha256_t* ss, char* res);
 char* sec_hmac_api(char* res, int hlen, uint8_t* data1, int len1, uint8_t* data2, int len2); 
 char* sec_hmac_sapi(char* res, int hlen, uint8_t* data1, int len1, uint8_t* data2, int len2); 
 char* sec_hmac(const uint8_t* key, int keylen, char* res, int hlen, uint8_t* data1, int len1, uint8_t* data2, int len2);
+char* sec_hmac_k(const sec_hmac_key_t* hk, char* res, int hlen, uint8_t* data1, int len1, uint8_t* data2, int len2);
+
+void  sec_hmac_setkey(sec_hmac_key_t* hk, const uint8_t* key, int keylen);
+void  sec_hmac_freekey(sec_hmac_key_t* hk);
+void  sec_hmac_begin(sec_hmac_t* hm, const sec_hmac_key_t* hk);
+void  sec_hmac_update(sec_hmac_t* hm, const uint8_t* data, int len);
+void  sec_hmac_end(sec_hmac_t* hm, uint8_t* hash);
+char* sec_hmac_b64end(sec_hmac_t* hm, char* res, int hlen);
+void  sec_hmac_api_begin(sec_hmac_t* hm);
+void  sec_hmac_sapi_begin(sec_hmac_t* hm);
 
 bool sec_isEncrypted(void);
 
@@ -0,0 +1,314 @@
+/*
+ * AES-256-GCM-SIV (RFC 8452) encryption with cached key state.
+ * See gcmsiv.h. micro_aes.c has the reference implementation,
+ * test_gcmsiv.c compares the two.
+ *
+ * POLYVAL is computed with the GHASH 4-bit table method, using
+ * POLYVAL(H, X) = ByteReverse(GHASH(mulX_GHASH(ByteReverse(H)), ByteReverse(X)))
+ * from RFC 8452 appendix A.
+ */
+
+#include <string.h>
+#include "gcmsiv.h"
+
+
+
+/*******************************************************
+ * AES block encryption
+ *******************************************************/
+
+#if defined(GCMSIV_MBEDTLS)
+
+static void aes_init(gcmsiv_aes_t* a)
+    { mbedtls_aes_init(a); }
+
+static void aes_setkey(gcmsiv_aes_t* a, const uint8_t* key)
+    { mbedtls_aes_setkey_enc(a, key, 256); }
+
+static void aes_free(gcmsiv_aes_t* a)
+    { mbedtls_aes_free(a); }
+
+static inline void aes_encrypt(const gcmsiv_aes_t* a, const uint8_t* in, uint8_t* out)
+    { mbedtls_aes_crypt_ecb((gcmsiv_aes_t*) a, MBEDTLS_AES_ENCRYPT, in, out); }
+
+#else
+
+static const uint8_t sbox[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16
+};
+
+#define xtime(x) ((uint8_t) (((x) << 1) ^ (((x) & 0x80) ? 0x1b : 0)))
+
+
+static void aes_init(gcmsiv_aes_t* a)
+    { memset(a, 0, sizeof(gcmsiv_aes_t)); }
+
+static void aes_free(gcmsiv_aes_t* a)
+    { memset(a, 0, sizeof(gcmsiv_aes_t)); }
+
+
+static void aes_setkey(gcmsiv_aes_t* a, const uint8_t* key)
+{
+    uint8_t* w = a->rk;
+    uint8_t rcon = 1;
+    memcpy(w, key, 32);
+    for (int i = 32; i < 240; i += 4) {
+        uint8_t t0 = w[i-4], t1 = w[i-3], t2 = w[i-2], t3 = w[i-1];
+        if (i % 32 == 0) {
+            uint8_t x = t0;
+            t0 = sbox[t1] ^ rcon; t1 = sbox[t2]; t2 = sbox[t3]; t3 = sbox[x];
+            rcon = xtime(rcon);
+        }
+        else if (i % 32 == 16) {
+            t0 = sbox[t0]; t1 = sbox[t1]; t2 = sbox[t2]; t3 = sbox[t3];
+        }
+        w[i]   = w[i-32] ^ t0;
+        w[i+1] = w[i-31] ^ t1;
+        w[i+2] = w[i-30] ^ t2;
+        w[i+3] = w[i-29] ^ t3;
+    }
+}
+
+
+static void aes_encrypt(const gcmsiv_aes_t* a, const uint8_t* in, uint8_t* out)
+{
+    const uint8_t* rk = a->rk;
+    uint8_t s[16], t[16];
+    for (int i=0; i<16; i++)
+        s[i] = in[i] ^ rk[i];
+
+    for (int r=1; r<=14; r++) {
+        /* SubBytes and ShiftRows. State is column major: s[4*col + row] */
+        for (int c=0; c<4; c++)
+            for (int j=0; j<4; j++)
+                t[4*c + j] = sbox[s[4*((c+j) & 3) + j]];
+
+        rk += 16;
+        if (r == 14) {
+            for (int i=0; i<16; i++)
+                out[i] = t[i] ^ rk[i];
+            return;
+        }
+        /* MixColumns and AddRoundKey */
+        for (int c=0; c<16; c+=4) {
+            uint8_t a0 = t[c], a1 = t[c+1], a2 = t[c+2], a3 = t[c+3];
+            uint8_t x = a0 ^ a1 ^ a2 ^ a3;
+            s[c]   = a0 ^ x ^ xtime(a0 ^ a1) ^ rk[c];
+            s[c+1] = a1 ^ x ^ xtime(a1 ^ a2) ^ rk[c+1];
+            s[c+2] = a2 ^ x ^ xtime(a2 ^ a3) ^ rk[c+2];
+            s[c+3] = a3 ^ x ^ xtime(a3 ^ a0) ^ rk[c+3];
+        }
+    }
+}
+
+#endif
+
+
+
+/*******************************************************
+ * POLYVAL. The state is kept as a 128 bit big endian
+ * GHASH field element in two 64 bit words.
+ *******************************************************/
+
+static inline uint64_t get_le64(const uint8_t* p)
+{
+    uint64_t x = 0;
+    for (int i=7; i>=0; i--)
+        x = (x << 8) | p[i];
+    return x;
+}
+
+
+static inline void put_le64(uint8_t* p, uint64_t x)
+{
+    for (int i=0; i<8; i++, x >>= 8)
+        p[i] = (uint8_t) x;
+}
+
+
+static const uint64_t last4[16] = {
+    0x0000, 0x1c20, 0x3840, 0x2460, 0x7080, 0x6ca0, 0x48c0, 0x54e0,
+    0xe100, 0xfd20, 0xd940, 0xc560, 0x9180, 0x8da0, 0xa9c0, 0xb5e0
+};
+
+
+/*
+ * Precompute multiples of the authentication key H.
+ * ByteReverse(H) read big endian is H read little endian.
+ */
+static void polyval_table(gcmsiv_t* ctx, const uint8_t* H)
+{
+    uint64_t vh = get_le64(H+8), vl = get_le64(H);
+
+    /* mulX_GHASH */
+    uint64_t lsb = vl & 1;
+    vl = (vl >> 1) | (vh << 63);
+    vh = (vh >> 1) ^ (lsb ? 0xe100000000000000ULL : 0);
+
+    ctx->hh[0] = ctx->hl[0] = 0;
+    ctx->hh[8] = vh; ctx->hl[8] = vl;
+    for (int i=4; i>0; i >>= 1) {
+        uint64_t t = (vl & 1) ? 0xe100000000000000ULL : 0;
+        vl = (vh << 63) | (vl >> 1);
+        vh = (vh >> 1) ^ t;
+        ctx->hh[i] = vh; ctx->hl[i] = vl;
+    }
+    for (int i=2; i<=8; i *= 2)
+        for (int j=1; j<i; j++) {
+            ctx->hh[i+j] = ctx->hh[i] ^ ctx->hh[j];
+            ctx->hl[i+j] = ctx->hl[i] ^ ctx->hl[j];
+        }
+}
+
+
+/* y = y * H */
+static void polyval_mult(const gcmsiv_t* ctx, uint64_t* yh, uint64_t* yl)
+{
+    uint64_t zh = 0, zl = 0;
+    for (int i=15; i>=0; i--) {
+        uint8_t x = (uint8_t) (i < 8 ? *yh >> (56 - 8*i) : *yl >> (120 - 8*i));
+        for (int k=0; k<2; k++, x >>= 4) {
+            if (i < 15 || k > 0) {
+                uint8_t rem = zl & 0x0f;
+                zl = (zh << 60) | (zl >> 4);
+                zh = (zh >> 4) ^ (last4[rem] << 48);
+            }
+            zh ^= ctx->hh[x & 0x0f];
+            zl ^= ctx->hl[x & 0x0f];
+        }
+    }
+    *yh = zh; *yl = zl;
+}
+
+
+static void polyval_update(const gcmsiv_t* ctx, uint64_t* yh, uint64_t* yl, const uint8_t* data, size_t len)
+{
+    for (; len >= 16; data += 16, len -= 16) {
+        *yh ^= get_le64(data+8);
+        *yl ^= get_le64(data);
+        polyval_mult(ctx, yh, yl);
+    }
+    if (len > 0) {
+        uint8_t blk[16] = {0};
+        memcpy(blk, data, len);
+        *yh ^= get_le64(blk+8);
+        *yl ^= get_le64(blk);
+        polyval_mult(ctx, yh, yl);
+    }
+}
+
+
+
+/*******************************************************
+ * Derive the message keys for a nonce (RFC 8452 sec 4)
+ *******************************************************/
+
+static void derive_keys(gcmsiv_t* ctx, const uint8_t* nonce)
+{
+    uint8_t blk[16], enc[16], keys[48];
+
+    memset(blk, 0, 4);
+    memcpy(blk+4, nonce, GCMSIV_NONCE_LEN);
+    for (int i=0; i<6; i++) {
+        blk[0] = i;
+        aes_encrypt(&ctx->mkey, blk, enc);
+        memcpy(keys + 8*i, enc, 8);
+    }
+    polyval_table(ctx, keys);
+    aes_setkey(&ctx->ekey, keys+16);
+    memcpy(ctx->nonce, nonce, GCMSIV_NONCE_LEN);
+    ctx->ready = true;
+    memset(keys, 0, sizeof(keys));
+    memset(enc, 0, sizeof(enc));
+}
+
+
+
+/*******************************************************
+ * Set up a context with a 256 bit key
+ *******************************************************/
+
+void gcmsiv_init(gcmsiv_t* ctx, const uint8_t* key)
+{
+    aes_init(&ctx->mkey);
+    aes_init(&ctx->ekey);
+    aes_setkey(&ctx->mkey, key);
+    ctx->ready = false;
+}
+
+
+void gcmsiv_free(gcmsiv_t* ctx)
+{
+    aes_free(&ctx->mkey);
+    aes_free(&ctx->ekey);
+    memset(ctx->hh, 0, sizeof(ctx->hh));
+    memset(ctx->hl, 0, sizeof(ctx->hl));
+    ctx->ready = false;
+}
+
+
+
+/*******************************************************
+ * Encrypt len bytes of text. out must have room for
+ * len + GCMSIV_TAG_LEN bytes. The tag is put after the
+ * ciphertext, like GCM_SIV_encrypt() in micro_aes does.
+ * out may be the same buffer as text.
+ *******************************************************/
+
+void gcmsiv_encrypt(gcmsiv_t* ctx, const uint8_t* nonce,
+                    const void* aad, size_t alen, const void* text, size_t len, uint8_t* out)
+{
+    const uint8_t* in = text;
+    uint8_t* tag = out + len;
+    uint8_t blk[16], ks[16];
+    uint64_t yh = 0, yl = 0;
+
+    if (!ctx->ready || memcmp(ctx->nonce, nonce, GCMSIV_NONCE_LEN) != 0)
+        derive_keys(ctx, nonce);
+
+    /* POLYVAL over AAD, text and the bit lengths */
+    polyval_update(ctx, &yh, &yl, aad, alen);
+    polyval_update(ctx, &yh, &yl, in, len);
+    put_le64(blk, (uint64_t) alen * 8);
+    put_le64(blk+8, (uint64_t) len * 8);
+    polyval_update(ctx, &yh, &yl, blk, 16);
+
+    /* Tag */
+    put_le64(blk, yl);
+    put_le64(blk+8, yh);
+    for (int i=0; i<GCMSIV_NONCE_LEN; i++)
+        blk[i] ^= nonce[i];
+    blk[15] &= 0x7f;
+    aes_encrypt(&ctx->ekey, blk, ks);
+
+    /* Counter mode with the tag as initial counter.
+     * The counter is the first 32 bits, little endian. */
+    memcpy(blk, ks, 16);
+    blk[15] |= 0x80;
+    uint32_t ctr = blk[0] | blk[1] << 8 | blk[2] << 16 | (uint32_t) blk[3] << 24;
+    for (size_t i=0; i<len; i += 16) {
+        uint8_t ek[16];
+        aes_encrypt(&ctx->ekey, blk, ek);
+        size_t n = (len - i < 16 ? len - i : 16);
+        for (size_t j=0; j<n; j++)
+            out[i+j] = in[i+j] ^ ek[j];
+        ctr++;
+        blk[0] = ctr; blk[1] = ctr >> 8; blk[2] = ctr >> 16; blk[3] = ctr >> 24;
+    }
+    memcpy(tag, ks, GCMSIV_TAG_LEN);
+}
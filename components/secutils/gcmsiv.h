@@ -0,0 +1,51 @@
+/*
+ * AES-256-GCM-SIV (RFC 8452) encryption with cached key state.
+ *
+ * The expanded master key is kept in the context. The keys derived
+ * from the nonce (the message encryption key and the POLYVAL table
+ * for the authentication key) are kept for the last nonce used, so
+ * encrypting more packets with the same nonce does not repeat the
+ * key setup. No heap is used.
+ *
+ * On ESP32 the AES block function of mbedtls is used, which runs on
+ * the hardware accelerator when CONFIG_MBEDTLS_HARDWARE_AES is set.
+ * Elsewhere (host tests) a small software AES is used.
+ */
+
+#ifndef _GCMSIV_H
+#define _GCMSIV_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#if defined(ESP_PLATFORM) && !defined(GCMSIV_SOFT_AES)
+#define GCMSIV_MBEDTLS
+#include "mbedtls/aes.h"
+typedef mbedtls_aes_context gcmsiv_aes_t;
+#else
+typedef struct {
+    uint8_t rk[240];          /* AES-256 round keys */
+} gcmsiv_aes_t;
+#endif
+
+#define GCMSIV_KEY_LEN   32
+#define GCMSIV_NONCE_LEN 12
+#define GCMSIV_TAG_LEN   16
+
+
+typedef struct {
+    gcmsiv_aes_t mkey;                  /* Master key */
+    gcmsiv_aes_t ekey;                  /* Message encryption key for nonce */
+    uint64_t hh[16], hl[16];            /* POLYVAL table for nonce */
+    uint8_t nonce[GCMSIV_NONCE_LEN];    /* Nonce the above were derived from */
+    bool ready;
+} gcmsiv_t;
+
+
+void gcmsiv_init(gcmsiv_t* ctx, const uint8_t* key);
+void gcmsiv_free(gcmsiv_t* ctx);
+void gcmsiv_encrypt(gcmsiv_t* ctx, const uint8_t* nonce,
+                    const void* aad, size_t alen, const void* text, size_t len, uint8_t* out);
+
+#endif /* _GCMSIV_H */
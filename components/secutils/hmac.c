@@ -0,0 +1,179 @@
+/*
+ * HMAC based on SHA256
+ * data contains (some representation of) the content. It should not be repeated in a
+ * predictable way. It may be a good idea to include a nonce or timestamp.
+ *
+ * HMAC(H, K) == H(K ^ opad, H(K ^ ipad, text))
+ * Implementation adapted from Adrian Perez
+ * https://github.com/aperezdc/hmac-sha256/blob/master/hmac-sha256.c
+ *
+ * The key pads fill exactly one SHA256 block. The hash states after that block
+ * (the midstates) are computed once per key by sec_hmac_setkey() and copied for
+ * each HMAC, so an HMAC costs only the hashing of the message and of the inner
+ * hash.
+ */
+
+#include <string.h>
+#include "encryption.h"
+#include "mbedtls/sha256.h"
+#include "mbedtls/base64.h"
+
+
+#define HMAC_KEY_SIZE 64
+#define HMAC_B64_SIZE 45
+
+#define I_PAD 0x36
+#define O_PAD 0x5C
+
+
+
+/********************************************************************************************
+ * Precompute the inner and outer hash states for a key.
+ ********************************************************************************************/
+
+/*
+ * Hash one pad block into st. It is done in a temporary context and cloned, so
+ * that st does not hold on to the SHA hardware (ESP32) when the temporary is freed.
+ */
+static void pad_state(mbedtls_sha256_context* st, const uint8_t* kx)
+{
+    mbedtls_sha256_context tmp;
+    mbedtls_sha256_init (&tmp);
+    mbedtls_sha256_starts (&tmp, 0);
+    mbedtls_sha256_update (&tmp, kx, HMAC_KEY_SIZE);
+    mbedtls_sha256_init (st);
+    mbedtls_sha256_clone (st, &tmp);
+    mbedtls_sha256_free (&tmp);
+}
+
+
+void sec_hmac_setkey(sec_hmac_key_t* hk, const uint8_t* key, int keylen)
+{
+    uint8_t khash[SEC_HMAC_SIZE];
+    uint8_t kx[HMAC_KEY_SIZE];
+
+    /* IF key length is more than HMAC_KEY_SIZE, use a hash of it instead */
+    if (keylen > HMAC_KEY_SIZE) {
+        mbedtls_sha256(key, keylen, khash, 0);
+        key = khash;
+        keylen = SEC_HMAC_SIZE;
+    }
+
+    /*
+     * (1) append zeros to the end of K to create a HMAC_KEY_SIZE byte string
+     * (2) XOR (bitwise exclusive-OR) the string computed in step
+     *     (1) with ipad, and start the inner hash with it
+     */
+    for (int i = 0; i < keylen; i++) kx[i] = I_PAD ^ key[i];
+    for (int i = keylen; i < HMAC_KEY_SIZE; i++) kx[i] = I_PAD ^ 0;
+    pad_state(&hk->inner, kx);
+
+    /*
+     * (5) XOR (bitwise exclusive-OR) the 64 byte string computed in
+     *     step (1) with opad, and start the outer hash with it
+     */
+    for (int i = 0; i < keylen; i++) kx[i] = O_PAD ^ key[i];
+    for (int i = keylen; i < HMAC_KEY_SIZE; i++) kx[i] = O_PAD ^ 0;
+    pad_state(&hk->outer, kx);
+
+    memset(kx, 0, HMAC_KEY_SIZE);
+    memset(khash, 0, SEC_HMAC_SIZE);
+}
+
+
+void sec_hmac_freekey(sec_hmac_key_t* hk)
+{
+    mbedtls_sha256_free (&hk->inner);
+    mbedtls_sha256_free (&hk->outer);
+}
+
+
+
+/********************************************************************************************
+ * HMAC computed incrementally, for content that is not in one buffer or that is
+ * produced while sending.
+ ********************************************************************************************/
+
+void sec_hmac_begin(sec_hmac_t* hm, const sec_hmac_key_t* hk)
+{
+    mbedtls_sha256_init (&hm->ctx);
+    mbedtls_sha256_clone (&hm->ctx, &hk->inner);
+    hm->key = hk;
+}
+
+
+/*
+ * (3) append the stream of data 'text' to the string resulting
+ *     from step (2)
+ */
+void sec_hmac_update(sec_hmac_t* hm, const uint8_t* data, int len)
+{
+    if (len > 0)
+        mbedtls_sha256_update (&hm->ctx, data, len);
+}
+
+
+/*
+ * (4) apply H to the stream generated in step (3)
+ * (6) append the H result from step (4) to the 64 byte string
+ *     resulting from step (5)
+ * (7) apply H to the stream generated in step (6)
+ */
+void sec_hmac_end(sec_hmac_t* hm, uint8_t* hash)
+{
+    mbedtls_sha256_finish (&hm->ctx, hash);
+    mbedtls_sha256_free (&hm->ctx);
+
+    mbedtls_sha256_init (&hm->ctx);
+    mbedtls_sha256_clone (&hm->ctx, &hm->key->outer);
+    mbedtls_sha256_update (&hm->ctx, hash, SEC_HMAC_SIZE);
+    mbedtls_sha256_finish (&hm->ctx, hash);
+    mbedtls_sha256_free (&hm->ctx);
+}
+
+
+/*
+ * Like sec_hmac_end, but the result is converted to base64 and truncated to hlen
+ * characters (if hlen >= 0).
+ */
+char* sec_hmac_b64end(sec_hmac_t* hm, char* res, int hlen)
+{
+    char b64hash[HMAC_B64_SIZE+1];
+    uint8_t hash[SEC_HMAC_SIZE];
+    size_t olen;
+
+    sec_hmac_end(hm, hash);
+    mbedtls_base64_encode((unsigned char*) b64hash, HMAC_B64_SIZE, &olen, hash, SEC_HMAC_SIZE);
+    if (hlen >= 0)
+        b64hash[hlen] = 0;
+    strcpy(res, b64hash);
+    return res;
+}
+
+
+
+/********************************************************************************************
+ * HMAC of data1 + data2. The hash is converted to a base64 format and returned in the
+ * res buffer.
+ ********************************************************************************************/
+
+/* Use a precomputed key */
+char* sec_hmac_k(const sec_hmac_key_t* hk, char* res, int hlen, uint8_t* data1, int len1, uint8_t* data2, int len2)
+{
+    sec_hmac_t hm;
+    sec_hmac_begin(&hm, hk);
+    sec_hmac_update(&hm, data1, len1);
+    sec_hmac_update(&hm, data2, len2);
+    return sec_hmac_b64end(&hm, res, hlen);
+}
+
+
+/* Use any key that is provided */
+char* sec_hmac(const uint8_t* key, int keylen, char* res, int hlen, uint8_t* data1, int len1, uint8_t* data2, int len2)
+{
+    sec_hmac_key_t hk;
+    sec_hmac_setkey(&hk, key, keylen);
+    sec_hmac_k(&hk, res, hlen, data1, len1, data2, len2);
+    sec_hmac_freekey(&hk);
+    return res;
+}
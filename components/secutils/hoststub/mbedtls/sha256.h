@@ -0,0 +1,36 @@
+/*
+ * Host stand-in for mbedtls/sha256.h, on top of OpenSSL (link with -lcrypto).
+ * Only for the host tests, not used in the firmware.
+ */
+
+#ifndef _HOSTSTUB_SHA256_H
+#define _HOSTSTUB_SHA256_H
+
+#define OPENSSL_SUPPRESS_DEPRECATED
+#include <string.h>
+#include <openssl/sha.h>
+
+typedef SHA256_CTX mbedtls_sha256_context;
+
+static inline void mbedtls_sha256_init(mbedtls_sha256_context* ctx)
+    { memset(ctx, 0, sizeof(*ctx)); }
+
+static inline void mbedtls_sha256_free(mbedtls_sha256_context* ctx)
+    { memset(ctx, 0, sizeof(*ctx)); }
+
+static inline void mbedtls_sha256_clone(mbedtls_sha256_context* dst, const mbedtls_sha256_context* src)
+    { *dst = *src; }
+
+static inline int mbedtls_sha256_starts(mbedtls_sha256_context* ctx, int is224)
+    { return SHA256_Init(ctx) == 1 ? 0 : -1; }
+
+static inline int mbedtls_sha256_update(mbedtls_sha256_context* ctx, const unsigned char* input, size_t ilen)
+    { return SHA256_Update(ctx, input, ilen) == 1 ? 0 : -1; }
+
+static inline int mbedtls_sha256_finish(mbedtls_sha256_context* ctx, unsigned char* output)
+    { return SHA256_Final(output, ctx) == 1 ? 0 : -1; }
+
+static inline int mbedtls_sha256(const unsigned char* input, size_t ilen, unsigned char* output, int is224)
+    { SHA256(input, ilen, output); return 0; }
+
+#endif
@@ -0,0 +1,234 @@
+/*
+ * Offline test of the GCM-SIV encryption engine (gcmsiv.c) used for
+ * encrypted position reports. Runs on a host computer (not part of the
+ * firmware build):
+ *
+ *   gcc -O2 -Wall -o gcmsiv_test test_gcmsiv.c gcmsiv.c micro_aes.c base91.c
+ *   ./gcmsiv_test
+ *
+ * The engine is checked against test vectors from RFC 8452 and against
+ * GCM_SIV_encrypt() from micro_aes for random keys, nonces and lengths.
+ * Then the encrypt + Base91 path of sec_encryptB91() is benchmarked,
+ * with micro_aes and a heap buffer (like before) and with the engine.
+ *
+ * On the host, the engine uses its software AES. On the ESP32 it uses
+ * the mbedtls AES (hardware accelerated).
+ *
+ * By LA7ECA, ohanssen@acm.org
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include "gcmsiv.h"
+#include "micro_aes.h"
+#include "base91.h"
+
+
+#define RANDOM_TESTS 20000
+#define BENCH_ROUNDS 20000
+
+
+
+/*******************************************************
+ * Test vectors from RFC 8452, appendix C.2
+ *******************************************************/
+
+typedef struct {
+    const char *key, *nonce, *aad, *text, *result;
+} vector_t;
+
+static const vector_t vectors[] = {
+    { "0100000000000000000000000000000000000000000000000000000000000000",
+      "030000000000000000000000", "", "",
+      "07f5f4169bbf55a8400cd47ea6fd400f" },
+    { "0100000000000000000000000000000000000000000000000000000000000000",
+      "030000000000000000000000", "", "0100000000000000",
+      "c2ef328e5c71c83b843122130f7364b761e0b97427e3df28" },
+    { "0100000000000000000000000000000000000000000000000000000000000000",
+      "030000000000000000000000", "01", "0200000000000000",
+      "1de22967237a813291213f267e3b452f02d01ae33e4ec854" },
+};
+
+
+static size_t unhex(uint8_t* buf, const char* hex)
+{
+    size_t n = 0;
+    for (; hex[0] && hex[1]; hex += 2) {
+        unsigned x;
+        sscanf(hex, "%2x", &x);
+        buf[n++] = x;
+    }
+    return n;
+}
+
+
+static int check_vectors()
+{
+    int fails = 0;
+    for (int i=0; i < sizeof(vectors)/sizeof(vectors[0]); i++) {
+        uint8_t key[32], nonce[12], aad[64], text[64], result[80], out[80];
+        gcmsiv_t ctx;
+
+        unhex(key, vectors[i].key);
+        unhex(nonce, vectors[i].nonce);
+        size_t alen = unhex(aad, vectors[i].aad);
+        size_t len = unhex(text, vectors[i].text);
+        size_t rlen = unhex(result, vectors[i].result);
+
+        gcmsiv_init(&ctx, key);
+        gcmsiv_encrypt(&ctx, nonce, aad, alen, text, len, out);
+        gcmsiv_free(&ctx);
+        if (rlen != len + GCMSIV_TAG_LEN || memcmp(out, result, rlen) != 0) {
+            printf("FAIL: RFC 8452 vector %d\n", i);
+            fails++;
+        }
+    }
+    return fails;
+}
+
+
+
+/*******************************************************
+ * Compare with micro_aes for random input. The same
+ * context is used for many packets, and the nonce is
+ * changed now and then, like when the callsign changes.
+ *******************************************************/
+
+static void randomize(uint8_t* buf, size_t len)
+{
+    for (size_t i=0; i<len; i++)
+        buf[i] = rand();
+}
+
+
+static int check_random()
+{
+    int fails = 0;
+    uint8_t key[32], nonce[12];
+    gcmsiv_t ctx;
+
+    for (int i=0; i<RANDOM_TESTS; i++) {
+        uint8_t aad[48], text[300 + GCMSIV_TAG_LEN], out1[320], out2[320];
+
+        if (i % 500 == 0) {
+            if (i > 0)
+                gcmsiv_free(&ctx);
+            randomize(key, sizeof(key));
+            gcmsiv_init(&ctx, key);
+        }
+        if (i % 20 == 0)
+            randomize(nonce, sizeof(nonce));
+
+        size_t alen = (i % 7 == 0 ? rand() % sizeof(aad) : 0);
+        size_t len = rand() % 300;
+        randomize(aad, alen);
+        randomize(text, len);
+
+        GCM_SIV_encrypt(key, nonce, aad, alen, text, len, out1);
+        gcmsiv_encrypt(&ctx, nonce, aad, alen, text, len, out2);
+        if (memcmp(out1, out2, len + GCMSIV_TAG_LEN) != 0) {
+            printf("FAIL: random test %d (aad=%zu, text=%zu)\n", i, alen, len);
+            fails++;
+        }
+
+        /* In place */
+        gcmsiv_encrypt(&ctx, nonce, aad, alen, text, len, text);
+        if (memcmp(out1, text, len + GCMSIV_TAG_LEN) != 0) {
+            printf("FAIL: random test %d in place\n", i);
+            fails++;
+        }
+    }
+    gcmsiv_free(&ctx);
+    return fails;
+}
+
+
+
+/*******************************************************
+ * Time the encrypt + Base91 path for some typical
+ * payload sizes.
+ *******************************************************/
+
+static double elapsed(struct timespec* t0)
+{
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) * 1e-9;
+}
+
+
+static void bench()
+{
+    static const size_t sizes[] = {20, 40, 80, 160, 256};
+    uint8_t key[32], nonce[12] = "LA7ECA-7";
+    char text[256], res[400];
+    struct timespec t0;
+    gcmsiv_t ctx;
+    size_t total = 0;
+
+    randomize(key, sizeof(key));
+    randomize((uint8_t*) text, sizeof(text));
+    gcmsiv_init(&ctx, key);
+
+    printf("\n  size   micro_aes+malloc   engine         engine, new nonce\n");
+    for (int s=0; s < sizeof(sizes)/sizeof(sizes[0]); s++) {
+        size_t len = sizes[s];
+        double t_ref, t_eng, t_cold;
+
+        /* Old sec_encryptB91() */
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (int r=0; r<BENCH_ROUNDS; r++) {
+            uint8_t *buf = malloc(len + 16);
+            GCM_SIV_encrypt(key, nonce, NULL, 0, text, len, buf);
+            total += encodeBase91(buf, res, len + 16);
+            free(buf);
+        }
+        t_ref = elapsed(&t0);
+
+        /* New sec_encryptB91(), same nonce every time */
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (int r=0; r<BENCH_ROUNDS; r++) {
+            uint8_t buf[256 + GCMSIV_TAG_LEN];
+            gcmsiv_encrypt(&ctx, nonce, NULL, 0, text, len, buf);
+            total += encodeBase91(buf, res, len + GCMSIV_TAG_LEN);
+        }
+        t_eng = elapsed(&t0);
+
+        /* Worst case: the nonce changes for every packet */
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (int r=0; r<BENCH_ROUNDS; r++) {
+            uint8_t buf[256 + GCMSIV_TAG_LEN];
+            nonce[11] = r;
+            gcmsiv_encrypt(&ctx, nonce, NULL, 0, text, len, buf);
+            total += encodeBase91(buf, res, len + GCMSIV_TAG_LEN);
+        }
+        nonce[11] = 0;
+        t_cold = elapsed(&t0);
+
+        printf("  %4zu  %7.0f ns %5.1f MB/s  %7.0f ns (%.1fx)  %7.0f ns (%.1fx)\n", len,
+            t_ref * 1e9 / BENCH_ROUNDS, len * BENCH_ROUNDS / t_ref / 1e6,
+            t_eng * 1e9 / BENCH_ROUNDS, t_ref / t_eng,
+            t_cold * 1e9 / BENCH_ROUNDS, t_ref / t_cold);
+    }
+    gcmsiv_free(&ctx);
+    if (total == 0)
+        printf("(nothing encoded)\n");
+}
+
+
+
+int main(int argc, char** argv)
+{
+    int fails = check_vectors();
+    fails += check_random();
+    printf("%d vectors, %d random tests, %d failures\n",
+        (int) (sizeof(vectors)/sizeof(vectors[0])), RANDOM_TESTS, fails);
+    if (fails > 0)
+        return 1;
+    bench();
+    return 0;
+}
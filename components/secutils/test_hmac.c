@@ -0,0 +1,287 @@
+/*
+ * Offline test of the HMAC-SHA256 functions in hmac.c, used to authenticate
+ * REST API requests. Runs on a host computer (not part of the firmware build).
+ * The mbedtls SHA256 and base64 functions are replaced by OpenSSL (hoststub):
+ *
+ *   gcc -O2 -Wall -Ihoststub -o hmac_test test_hmac.c hmac.c -lcrypto
+ *   ./hmac_test
+ *
+ * Checks the test vectors from RFC 4231, incremental HMAC with the message
+ * split at every position, and that the results are the same as with the
+ * previous sec_hmac() for random keys and data. Then the HMAC of a typical request (nonce + content
+ * hash) is benchmarked with the previous sec_hmac() and with precomputed
+ * key states.
+ *
+ * By LA7ECA, ohanssen@acm.org
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include "encryption.h"
+#include "mbedtls/sha256.h"
+#include "mbedtls/base64.h"
+
+
+#define RANDOM_TESTS 5000
+#define BENCH_ROUNDS 200000
+
+
+
+/*******************************************************
+ * Test vectors from RFC 4231, section 4
+ *******************************************************/
+
+typedef struct {
+    const char *key, *data, *result;
+} vector_t;
+
+static const vector_t vectors[] = {
+    { "0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b",
+      "4869205468657265",
+      "b0344c61d8db38535ca8afceaf0bf12b881dc200c9833da726e9376c2e32cff7" },
+    { "4a656665",
+      "7768617420646f2079612077616e7420666f72206e6f7468696e673f",
+      "5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843" },
+    { "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa",
+      "dddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddd",
+      "773ea91e36800e46854db8ebd09181a72959098b3ef8c122d9635514ced565fe" },
+    { "0102030405060708090a0b0c0d0e0f10111213141516171819",
+      "cdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcd",
+      "82558a389a443c0ea4cc819899f2083a85f0faa3e578f8077a2e3ff46729665b" },
+    { "0c0c0c0c0c0c0c0c0c0c0c0c0c0c0c0c0c0c0c0c",
+      "546573742057697468205472756e636174696f6e",
+      "a3b6167473100ee06e0c796c2955552b" },      /* Truncated to 128 bits */
+    { "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa",
+      "54657374205573696e67204c6172676572205468616e20426c6f636b2d53697a65204b6579202d2048617368204b6579204669727374",
+      "60e431591ee0b67f0d8a26aacbf5b77f8e0bc6213728c5140546040f0ee37f54" },
+    { "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa",
+      "5468697320697320612074657374207573696e672061206c6172676572207468616e20626c6f636b2d73697a65206b657920616e642061206c6172676572207468616e20626c6f636b2d73697a6520646174612e20546865206b6579206e6565647320746f20626520686173686564206265666f7265206265696e6720757365642062792074686520484d414320616c676f726974686d2e",
+      "9b09ffa71b942fcb27635fbcd5b0e944bfdc63644f0713938a7f51535c3a35e2" },
+};
+
+
+static size_t unhex(uint8_t* buf, const char* hex)
+{
+    size_t n = 0;
+    for (; hex[0] && hex[1]; hex += 2) {
+        unsigned x;
+        sscanf(hex, "%2x", &x);
+        buf[n++] = x;
+    }
+    return n;
+}
+
+
+static int check_vectors()
+{
+    int fails = 0;
+    for (int i=0; i < sizeof(vectors)/sizeof(vectors[0]); i++) {
+        uint8_t key[160], data[200], result[SEC_HMAC_SIZE], hash[SEC_HMAC_SIZE];
+        sec_hmac_key_t hk;
+        sec_hmac_t hm;
+
+        int klen = unhex(key, vectors[i].key);
+        int dlen = unhex(data, vectors[i].data);
+        size_t rlen = unhex(result, vectors[i].result);
+
+        sec_hmac_setkey(&hk, key, klen);
+        sec_hmac_begin(&hm, &hk);
+        sec_hmac_update(&hm, data, dlen);
+        sec_hmac_end(&hm, hash);
+        if (memcmp(hash, result, rlen) != 0) {
+            printf("FAIL: RFC 4231 test case %d\n", i+1);
+            fails++;
+        }
+
+        /* Same key again, with the data split at every position */
+        for (int s=0; s<=dlen; s++) {
+            sec_hmac_begin(&hm, &hk);
+            sec_hmac_update(&hm, data, s);
+            sec_hmac_update(&hm, data+s, dlen-s);
+            sec_hmac_end(&hm, hash);
+            if (memcmp(hash, result, rlen) != 0) {
+                printf("FAIL: RFC 4231 test case %d, split at %d\n", i+1, s);
+                fails++;
+                break;
+            }
+        }
+        sec_hmac_freekey(&hk);
+    }
+    return fails;
+}
+
+
+
+/*******************************************************
+ * Copy of the previous sec_hmac(), which hashed the key
+ * pads on every call. Used as reference.
+ *******************************************************/
+
+#define HMAC_KEY_SIZE 64
+#define HMAC_B64_SIZE 45
+
+static char* old_hmac(const uint8_t* key, int keylen, char* res, int hlen, uint8_t* data1, int len1, uint8_t* data2, int len2)
+{
+    char b64hash[HMAC_B64_SIZE+1];
+    uint8_t hash[SEC_HMAC_SIZE], khash[SEC_HMAC_SIZE];
+
+    if (keylen > HMAC_KEY_SIZE) {
+        mbedtls_sha256((unsigned char*) key, keylen, khash, 0);
+        key = khash;
+        keylen = SEC_HMAC_SIZE;
+    }
+    uint8_t kx[HMAC_KEY_SIZE];
+    for (size_t i = 0; i < keylen; i++) kx[i] = 0x36 ^ key[i];
+    for (size_t i = keylen; i < HMAC_KEY_SIZE; i++) kx[i] = 0x36 ^ 0;
+
+    mbedtls_sha256_context ss;
+    mbedtls_sha256_init (&ss);
+    mbedtls_sha256_starts (&ss, 0);
+    mbedtls_sha256_update (&ss, kx, HMAC_KEY_SIZE);
+    if (len1 > 0)
+        mbedtls_sha256_update (&ss, (uint8_t*) data1, len1);
+    if (len2 > 0)
+        mbedtls_sha256_update (&ss, (uint8_t*) data2, len2);
+    mbedtls_sha256_finish (&ss, hash);
+
+    for (size_t i = 0; i < keylen; i++) kx[i] = 0x5C ^ key[i];
+    for (size_t i = keylen; i < HMAC_KEY_SIZE; i++) kx[i] = 0x5C ^ 0;
+
+    mbedtls_sha256_init (&ss);
+    mbedtls_sha256_starts (&ss, 0);
+    mbedtls_sha256_update (&ss, kx, HMAC_KEY_SIZE);
+    mbedtls_sha256_update (&ss, hash, SEC_HMAC_SIZE);
+    mbedtls_sha256_finish (&ss, hash);
+
+    size_t olen;
+    mbedtls_base64_encode((unsigned char*) b64hash, HMAC_B64_SIZE, &olen, hash, SEC_HMAC_SIZE  );
+    if (hlen >= 0)
+        b64hash[hlen] = 0;
+    strcpy(res, b64hash);
+    return res;
+}
+
+
+
+/*******************************************************
+ * Compare with the previous sec_hmac() for random keys
+ * and data
+ *******************************************************/
+
+static void randomize(uint8_t* buf, size_t len)
+{
+    for (size_t i=0; i<len; i++)
+        buf[i] = rand();
+}
+
+
+static int check_random()
+{
+    int fails = 0;
+    for (int i=0; i<RANDOM_TESTS; i++) {
+        uint8_t key[150], d1[100], d2[300];
+        char h1[HMAC_B64_SIZE+1], h2[HMAC_B64_SIZE+1], h3[HMAC_B64_SIZE+1];
+        sec_hmac_key_t hk;
+        sec_hmac_t hm;
+
+        int klen = 1 + rand() % sizeof(key);
+        int len1 = rand() % sizeof(d1);
+        int len2 = (i % 3 == 0 ? 0 : rand() % sizeof(d2));
+        int hlen = (i % 2 == 0 ? 24 : HMAC_B64_SIZE);
+        randomize(key, klen);
+        randomize(d1, len1);
+        randomize(d2, len2);
+
+        old_hmac(key, klen, h1, hlen, d1, len1, d2, len2);
+        sec_hmac(key, klen, h2, hlen, d1, len1, d2, len2);
+
+        sec_hmac_setkey(&hk, key, klen);
+        sec_hmac_begin(&hm, &hk);
+        for (int j=0; j<len1; j++)
+            sec_hmac_update(&hm, d1+j, 1);
+        sec_hmac_update(&hm, d2, len2);
+        sec_hmac_b64end(&hm, h3, hlen);
+        sec_hmac_freekey(&hk);
+
+        if (strcmp(h1, h2) != 0 || strcmp(h1, h3) != 0) {
+            printf("FAIL: random test %d (key=%d, data=%d+%d)\n", i, klen, len1, len2);
+            fails++;
+        }
+    }
+    return fails;
+}
+
+
+
+/*******************************************************
+ * Time the HMAC of a request like rest_isAuth() does:
+ * a 12 byte nonce and a 44 byte base64 content hash.
+ * And a 1 KB message.
+ *******************************************************/
+
+static double elapsed(struct timespec* t0)
+{
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) * 1e-9;
+}
+
+
+static void bench()
+{
+    static const int sizes[] = {44, 1024};
+    uint8_t key[32], nonce[12], data[1024];
+    char res[HMAC_B64_SIZE+1];
+    struct timespec t0;
+    sec_hmac_key_t hk;
+    long total = 0;
+
+    randomize(key, sizeof(key));
+    randomize(nonce, sizeof(nonce));
+    randomize(data, sizeof(data));
+    sec_hmac_setkey(&hk, key, sizeof(key));
+
+    printf("\n  message   old sec_hmac   precomputed key\n");
+    for (int s=0; s < sizeof(sizes)/sizeof(sizes[0]); s++) {
+        int len = sizes[s];
+        double t_old, t_new;
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (int r=0; r<BENCH_ROUNDS; r++) {
+            nonce[0] = r;
+            total += old_hmac(key, sizeof(key), res, HMAC_B64_SIZE, nonce, sizeof(nonce), data, len)[0];
+        }
+        t_old = elapsed(&t0);
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (int r=0; r<BENCH_ROUNDS; r++) {
+            nonce[0] = r;
+            total += sec_hmac_k(&hk, res, HMAC_B64_SIZE, nonce, sizeof(nonce), data, len)[0];
+        }
+        t_new = elapsed(&t0);
+
+        printf("  %4d B   %8.0f ns    %8.0f ns (%.2fx)\n", 12 + len,
+            t_old * 1e9 / BENCH_ROUNDS, t_new * 1e9 / BENCH_ROUNDS, t_old / t_new);
+    }
+    sec_hmac_freekey(&hk);
+    if (total == 0)
+        printf("(no result)\n");
+}
+
+
+
+int main(int argc, char** argv)
+{
+    int fails = check_vectors();
+    fails += check_random();
+    printf("%d RFC 4231 test cases, %d random tests, %d failures\n",
+        (int) (sizeof(vectors)/sizeof(vectors[0])), RANDOM_TESTS, fails);
+    if (fails > 0)
+        return 1;
+    bench();
+    return 0;
+}
@@ -358,7 +358,7 @@ static void mhandle_fwupgrade(void* x) {
 }
 
 static void mhandle_restart(void* x) {
-    esp_restart();
+    systemRestart();
 }
     
 static void mhandle_shutdown(void* x) {
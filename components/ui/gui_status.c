@@ -148,8 +148,8 @@ static void status_heading(char* label) {
 #if DISPLAY_HEIGHT >= 64
     disp_label(0,0, label);
     disp_flag(32,0, "i", wifi_isConnected() );
-    disp_flag(44,0, "g", wifi_isConnected() && GET_BOOL_PARAM("IGATE.on", DFL_IGATE_ON)); 
-    disp_flag(56,0, "d", GET_BOOL_PARAM("DIGIPEATER.on", DFL_DIGIPEATER_ON));
+    disp_flag(44,0, "g", wifi_isConnected() && CONFIG_BOOL(CFG_IGATE_ON)); 
+    disp_flag(56,0, "d", CONFIG_BOOL(CFG_DIGIPEATER_ON));
     disp_flag(68,0, "p", pmu_isVbusIn() );
     disp_flag(80,0, "F", gps_is_fixed());
     disp_flag(92,0, "c", sec_isEncrypted());
@@ -181,7 +181,7 @@ static void status_screen1() {
     disp_clear();
     status_heading("APRS");
 
-    get_str_param("MYCALL", call, 10, DFL_MYCALL);
+    config_str(CFG_MYCALL, call, 10);
     disp_setBoldFont(true);
     disp_setHighFont(true, false);
     disp_writeText(0, LINE1, call);
@@ -241,8 +241,8 @@ static void status_screen2() {
         gui_setPause(500); 
         
         int rssi=radio_getRssi();
-        uint8_t sf = get_byte_param("LORA_SF", DFL_LORA_SF);
-        uint8_t cr = get_byte_param("LORA_CR", DFL_LORA_CR);
+        uint8_t sf = config_byte(CFG_LORA_SF);
+        uint8_t cr = config_byte(CFG_LORA_CR);
         uint32_t f = get_i32_param("FREQ", DFL_FREQ);
         
         disp_setBoldFont(true);
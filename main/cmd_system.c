@@ -25,6 +25,7 @@
 #include "afsk.h"
 #include "radio.h"
 #include "fbuf.h"
+#include "latency.h"
 #include "gps.h"
 #include "gui.h"
 #include "linenoise/linenoise.h"
@@ -40,6 +41,8 @@ static int do_sysinfo(int argc, char** argv);
 static int do_restart(int argc, char** argv);
 static int do_free(int argc, char** argv);
 static int do_tasks(int argc, char** argv);
+static int do_queues(int argc, char** argv);
+static int do_latency(int argc, char** argv);
 
 #define TAG "shell"
 
@@ -234,7 +237,7 @@ static int do_format(int argc, char** argv) {
 static int do_restart(int argc, char** argv)
 {
     ESP_LOGI(TAG, "Restarting system..");
-    esp_restart();
+    systemRestart();
     return 0;
 }
 
@@ -359,6 +362,69 @@ static int do_tasks(int argc, char** argv)
 
 
 
+/********************************************************************************
+ * 'queues' command prints subscribers of packet streams (rx, tx), their
+ * overflow policy and number of frames delivered and dropped. 
+ ********************************************************************************/
+
+static void print_subscriber(const char* sw, const fbqsub_t* sub, void* arg)
+{
+    printf("%-4s %-10s %-12s %10lu %10lu\n", sw, sub->name, 
+        fbqsw_policyName(sub->policy), sub->delivered, sub->dropped);
+}
+
+
+static int do_queues(int argc, char** argv)
+{
+    printf("Strm Subscriber Policy        Delivered    Dropped\n");
+    fbqsw_foreach(print_subscriber, NULL);
+    return 0;
+}
+
+
+
+/********************************************************************************
+ * 'latency' command. Turn frame latency tracing on or off, reset or show 
+ * statistics. Times are in milliseconds. Each stage is the time since 
+ * the previous stage, total is from end of frame received to start of TX. 
+ ********************************************************************************/
+
+static int do_latency(int argc, char** argv)
+{
+    lat_hist_t h;
+    if (argc > 1) {
+        if (strcmp(argv[1], "on") == 0 || strcmp(argv[1], "off") == 0) {
+            bool on = (strcmp(argv[1], "on") == 0);
+            set_byte_param("LATENCY.on", on ? 1 : 0);
+            lat_enable(on);
+        }
+        else if (strcmp(argv[1], "reset") == 0)
+            lat_reset();
+        else {
+            printf("Unknown argument: %s\n", argv[1]);
+            return 1;
+        }
+        return 0;
+    }
+    printf("Latency tracing is %s\n", (lat_enabled() ? "on" : "off"));
+    printf("Stage       N      Avg      P50      P90      P99      Max\n");
+    for (int i=LAT_DECODE; i<=LAT_STAGES; i++) {
+        lat_stage_t s = (i == LAT_STAGES ? LAT_TOTAL : i);
+        lat_getHist(s, &h);
+        if (h.n == 0)
+            continue;
+        printf("%-6s %6lu %8.2f %8.2f %8.2f %8.2f %8.2f\n", lat_stageName(s), h.n,
+            (double) h.sum / h.n / 1000, 
+            (double) lat_percentile(&h, 50) / 1000,
+            (double) lat_percentile(&h, 90) / 1000, 
+            (double) lat_percentile(&h, 99) / 1000, 
+            (double) h.max / 1000);
+    }
+    return 0;
+}
+
+
+
 /*********************************************************************************
  * Set/get loglevel
  *********************************************************************************/
@@ -658,6 +724,8 @@ void register_system()
     ADD_CMD("sysinfo",   &do_sysinfo,      "System info", NULL);    
     ADD_CMD("restart",   &do_restart,      "Restart the system", NULL);
     ADD_CMD("tasks",     &do_tasks,        "Get information about running tasks", NULL);
+    ADD_CMD("queues",    &do_queues,       "Packet subscribers and their statistics", NULL);
+    ADD_CMD("latency",   &do_latency,      "Frame latency tracing (RX to TX)", "[on|off|reset]");
     ADD_CMD("log",       &do_log,          "Set loglevel (for debugging/testing)", "<tag> | * [<level>|delete]") ;
     ADD_CMD("time",      &do_time,         "Get date and time", NULL);
     ADD_CMD("timezone",  &_param_timezone, "Set timezone", "<tz-string>");
@@ -7,7 +7,9 @@
 #include "nvs_flash.h"
 #include "esp_log.h"
 #include <string.h>
+#include <stdatomic.h>
 #include "config.h"
+#include "system.h"
 #include "esp_system.h"
 #include "trex.h"
 #include "esp_mac.h"
@@ -18,6 +20,10 @@ static uint8_t _nvs_init = 0;
 
 #define TAG "config"
 
+static void cache_load(void);
+static int  cache_find(const char* key);
+static void cache_update(int i, bool present, int32_t val, const char* sval);
+
 
 uint32_t chipId() {
     uint8_t chipid[6];
@@ -65,6 +71,7 @@ int config_open() {
             ESP_LOGE(TAG, "Cannot open NVS");
             return 1;
         }    
+    cache_load();
     return 0;
 }
 
@@ -83,10 +90,12 @@ void delete_param(const char* key) {
         ESP_LOGI(TAG, "Key not found");
     else
         ESP_ERROR_CHECK(err);
+    cache_update(cache_find(key), false, 0, NULL);
 }
 
 void delete_all_param() {
     ESP_ERROR_CHECK(nvs_erase_all(nvs));
+    cache_load();
 }
 
 
@@ -401,14 +410,17 @@ char* param_parseBool(const char* key, char* val, char* buf)
 
 void set_byte_param(const char* key, uint8_t val) {
     ESP_ERROR_CHECK(nvs_set_u8(nvs, key, val));
+    cache_update(cache_find(key), true, val, NULL);
 }
 
+/* No cached settings are of type u16 or u32 */
 void set_u16_param(const char* key, uint16_t val) {
     ESP_ERROR_CHECK(nvs_set_u16(nvs, key, val));
 }
 
 void set_i32_param(const char* key, int32_t val) {
     ESP_ERROR_CHECK(nvs_set_i32(nvs, key, val));
+    cache_update(cache_find(key), true, val, NULL);
 }
 
 void set_u32_param(const char* key, uint32_t val) {
@@ -417,6 +429,7 @@ void set_u32_param(const char* key, uint32_t val) {
 
 void set_str_param(const char* key, char* val) {
     ESP_ERROR_CHECK(nvs_set_str(nvs, key, val));
+    cache_update(cache_find(key), true, 0, val);
 }
 
 void set_bin_param(const char* key, const void* val, size_t len) {
@@ -426,6 +439,220 @@ void set_bin_param(const char* key, const void* val, size_t len) {
 
 
 
+/********************************************************************************
+ * Cache of frequently used settings. 
+ ******************************************************************************** 
+ * The key table maps each cached key to a slot with its type and default value. 
+ * A small hash table maps key names to slots, so that looking up a key that is 
+ * not cached costs a hash of the name and usually no strcmp. 
+ * Values are loaded from NVS by config_open(). Setters write through to NVS and 
+ * update the slot, bump the version number and notify subscribers. 
+ * 
+ * Readers don't lock. Numeric values are atomic. Strings are double buffered: 
+ * the writer fills the inactive buffer, switches buffer and increments a 
+ * sequence number. A reader retries if the sequence number changed during 
+ * the copy. Writers are serialised by a mutex.  
+ ********************************************************************************/
+
+typedef enum { CFG_T_BYTE, CFG_T_I32, CFG_T_STR } cfg_type_t;
+
+typedef struct {
+    const char* key; 
+    cfg_type_t  type; 
+    int32_t     dfl; 
+    const char* sdfl; 
+} cfg_entry_t;
+
+static const cfg_entry_t cfg_table[CFG_NKEYS] = {
+    [CFG_MYCALL]        = { "MYCALL",        CFG_T_STR,  0,                 DFL_MYCALL },
+    [CFG_DIGIPEATER_ON] = { "DIGIPEATER.on", CFG_T_BYTE, DFL_DIGIPEATER_ON, NULL }, 
+    [CFG_DIGI_WIDE1_ON] = { "DIGI.WIDE1.on", CFG_T_BYTE, DFL_DIGI_WIDE1_ON, NULL }, 
+    [CFG_DIGI_WIDE2_ON] = { "DIGI.WIDE2.on", CFG_T_BYTE, DFL_DIGI_WIDE2_ON, NULL },
+    [CFG_DIGI_SAR_ON]   = { "DIGI.SAR.on",   CFG_T_BYTE, DFL_DIGI_SAR_ON,   NULL }, 
+    [CFG_DIGI_META_ON]  = { "DIGI.META.on",  CFG_T_BYTE, DFL_DIGI_META_ON,  NULL }, 
+    [CFG_IGATE_ON]      = { "IGATE.on",      CFG_T_BYTE, DFL_IGATE_ON,      NULL }, 
+    [CFG_TXDELAY]       = { "TXDELAY",       CFG_T_BYTE, DFL_TXDELAY,       NULL }, 
+    [CFG_TXTAIL]        = { "TXTAIL",        CFG_T_BYTE, DFL_TXTAIL,        NULL },
+    [CFG_MAXFRAME]      = { "MAXFRAME",      CFG_T_BYTE, DFL_MAXFRAME,      NULL },
+    [CFG_TXBUDGET]      = { "TXBUDGET",      CFG_T_I32,  DFL_TXBUDGET,      NULL },
+    [CFG_LORA_DUTY]     = { "LORA.DUTY",     CFG_T_BYTE, DFL_LORA_DUTY,     NULL },
+    [CFG_LORA_TXAGE]    = { "LORA.TXAGE",    CFG_T_I32,  DFL_LORA_TXAGE,    NULL },
+    [CFG_LORA_SF]       = { "LORA_SF",       CFG_T_BYTE, DFL_LORA_SF,       NULL },
+    [CFG_LORA_CR]       = { "LORA_CR",       CFG_T_BYTE, DFL_LORA_CR,       NULL },
+    [CFG_LORA_ALT_SF]   = { "LORA_ALT_SF",   CFG_T_BYTE, DFL_LORA_ALT_SF,   NULL },
+    [CFG_LORA_ALT_CR]   = { "LORA_ALT_CR",   CFG_T_BYTE, DFL_LORA_ALT_CR,   NULL },
+    [CFG_LORA_ALT_ON]   = { "LORA_ALT.on",   CFG_T_BYTE, DFL_LORA_ALT_ON,   NULL }
+};
+
+typedef struct {
+    _Atomic int32_t  num; 
+    _Atomic uint32_t seq; 
+    _Atomic bool     present;  // False if not in NVS (default is used)
+    _Atomic uint8_t  idx;      // Active string buffer
+    char str[2][CFG_STR_SIZE];
+} cfg_slot_t;
+
+static cfg_slot_t cfg_slot[CFG_NKEYS];
+
+#define CFG_HASH_SIZE 64    /* Power of 2, well above CFG_NKEYS */
+static int8_t cfg_hash[CFG_HASH_SIZE];
+static _Atomic uint32_t cfg_version = 0;
+static bool cfg_loaded = false; 
+static mutex_t cfg_mutex = NULL; 
+static cfg_handler_t cfg_subscr[CFG_MAX_SUBSCRIBERS];
+static _Atomic uint8_t cfg_nsubscr = 0;
+
+
+
+/* FNV-1a hash of key name */
+static uint32_t key_hash(const char* key) {
+    uint32_t h = 2166136261u;
+    while (*key != '\0')
+        h = (h ^ (uint8_t) *(key++)) * 16777619u;
+    return h;
+}
+
+
+/* Build the hash table (linear probing) */
+static void cache_index() {
+    memset(cfg_hash, -1, sizeof(cfg_hash));
+    for (int i=0; i<CFG_NKEYS; i++) {
+        uint32_t j = key_hash(cfg_table[i].key) & (CFG_HASH_SIZE-1);
+        while (cfg_hash[j] >= 0)
+            j = (j+1) & (CFG_HASH_SIZE-1);
+        cfg_hash[j] = i;
+    }
+}
+
+
+/* Find slot index of key. -1 if not cached */
+static int cache_find(const char* key) {
+    if (!cfg_loaded)
+        return -1;
+    for (uint32_t j = key_hash(key) & (CFG_HASH_SIZE-1); cfg_hash[j] >= 0; j = (j+1) & (CFG_HASH_SIZE-1))
+        if (strcmp(key, cfg_table[cfg_hash[j]].key) == 0)
+            return cfg_hash[j];
+    return -1;
+}
+
+
+static bool cache_present(int i) {
+    return atomic_load(&cfg_slot[i].present);
+}
+
+
+static int32_t cached_num(int i, int32_t dfl) {
+    return (atomic_load(&cfg_slot[i].present) ? atomic_load(&cfg_slot[i].num) : dfl);
+}
+
+
+
+/* Update slot i. present=false means that the default value is used */
+static void cache_update(int i, bool present, int32_t val, const char* sval) 
+{
+    if (i < 0)
+        return;
+    const cfg_entry_t* e = &cfg_table[i];
+    cfg_slot_t* s = &cfg_slot[i];
+    
+    mutex_lock(cfg_mutex);
+    if (e->type == CFG_T_STR) {
+        if (!present)
+            sval = e->sdfl;
+        uint8_t n = 1 - atomic_load(&s->idx);
+        strncpy(s->str[n], (sval==NULL ? "" : sval), CFG_STR_SIZE-1);
+        s->str[n][CFG_STR_SIZE-1] = '\0';
+        atomic_store(&s->idx, n);
+        atomic_fetch_add(&s->seq, 1);
+    }
+    else
+        atomic_store(&s->num, (present ? val : e->dfl));
+    atomic_store(&s->present, present);
+    atomic_fetch_add(&cfg_version, 1);
+    mutex_unlock(cfg_mutex);
+    
+    for (int j=0; j<atomic_load(&cfg_nsubscr); j++)
+        (*cfg_subscr[j])((cfg_key_t) i);
+}
+
+
+
+/* Load all cached settings from NVS */
+static void cache_load() 
+{
+    char buf[CFG_STR_SIZE];
+    esp_err_t err;
+    if (cfg_mutex == NULL) {
+        cfg_mutex = mutex_create();
+        cache_index();
+    }
+    cfg_loaded = true;
+    
+    for (int i=0; i<CFG_NKEYS; i++) {
+        const cfg_entry_t* e = &cfg_table[i];
+        if (e->type == CFG_T_STR) {
+            size_t len = CFG_STR_SIZE;
+            err = nvs_get_str(nvs, e->key, buf, &len);
+            cache_update(i, err==ESP_OK, 0, buf);
+        }
+        else if (e->type == CFG_T_BYTE) {
+            uint8_t val;
+            err = nvs_get_u8(nvs, e->key, &val);
+            cache_update(i, err==ESP_OK, val, NULL);
+        }
+        else {
+            int32_t val;
+            err = nvs_get_i32(nvs, e->key, &val);
+            cache_update(i, err==ESP_OK, val, NULL);
+        }
+    }
+}
+
+
+
+/* Version number. Incremented on every change of a cached setting */
+uint32_t config_version() {
+    return atomic_load(&cfg_version);
+}
+
+
+uint8_t config_byte(cfg_key_t key) {
+    return (uint8_t) atomic_load(&cfg_slot[key].num);
+}
+
+
+int32_t config_i32(cfg_key_t key) {
+    return atomic_load(&cfg_slot[key].num);
+}
+
+
+/* Copy cached string setting to buf. Return length including null-char */
+int config_str(cfg_key_t key, char* buf, size_t size) {
+    cfg_slot_t* s = &cfg_slot[key];
+    uint32_t seq;
+    if (size == 0)
+        return 0;
+    do {
+        seq = atomic_load(&s->seq);
+        strncpy(buf, s->str[atomic_load(&s->idx)], size);
+        buf[size-1] = '\0';
+    } while (atomic_load(&s->seq) != seq);
+    return strlen(buf) + 1;
+}
+
+
+/* Subscribe to changes of cached settings */
+bool config_subscribe(cfg_handler_t h) {
+    uint8_t n = atomic_load(&cfg_nsubscr);
+    if (n >= CFG_MAX_SUBSCRIBERS)
+        return false;
+    cfg_subscr[n] = h;
+    atomic_store(&cfg_nsubscr, n+1);
+    return true;
+}
+
+
+
 /********************************************************************************
  * get entry of numeric types
  ********************************************************************************/
@@ -438,6 +665,9 @@ void set_bin_param(const char* key, const void* val, size_t len) {
     
     
 uint8_t get_byte_param(const char* key, const uint8_t dfl) {
+    int i = cache_find(key);
+    if (i >= 0)
+        return (uint8_t) cached_num(i, dfl);
     uint8_t val = dfl;
     esp_err_t err = nvs_get_u8(nvs, key, &val); 
     _CHECK(err, key);
@@ -452,6 +682,9 @@ uint16_t get_u16_param(const char* key, const uint16_t dfl) {
 }
 
 int32_t get_i32_param(const char* key, const int32_t dfl) {
+    int i = cache_find(key);
+    if (i >= 0)
+        return cached_num(i, dfl);
     int32_t val = dfl;
     esp_err_t err = nvs_get_i32(nvs, key, &val); 
     _CHECK(err, key);
@@ -472,6 +705,18 @@ uint32_t get_u32_param(const char* key, const uint32_t dfl) {
  ********************************************************************************/
 
 int get_str_param(const char* key, char* buf, size_t size, const char* dfl) {
+    int i = cache_find(key);
+    if (i >= 0 && cache_present(i))
+        return config_str(i, buf, size);
+    else if (i >= 0 && dfl != NULL) {
+        strncpy(buf, dfl, size);
+        buf[size-1] = '\0';
+        return strlen(buf) + 1;
+    }
+    else if (i >= 0) {
+        buf[0] = '\0';
+        return 0;
+    }
     size_t len = size;
     esp_err_t err = nvs_get_str(nvs, key, buf, &len);
     if (err == ESP_ERR_NVS_NOT_FOUND) {
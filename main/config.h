@@ -8,6 +8,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include "default_param.h"
 
 uint32_t chipId(); 
@@ -56,6 +57,50 @@ int      get_bin_param(const char* key, void* buf, size_t size, const void* dfl)
 bool regexMatch(char* str, const char* pattern);
 
 
+/* 
+ * Settings that are cached in RAM. They are loaded from NVS at
+ * boot and updated by the setters. Use config_byte(), config_i32() 
+ * and config_str() for fast lookups in frequently called code. 
+ * get_byte_param, get_i32_param and get_str_param also use the cache 
+ * for these keys, but they must look up the key name first. 
+ */
+typedef enum {
+    CFG_MYCALL, 
+    CFG_DIGIPEATER_ON, 
+    CFG_DIGI_WIDE1_ON, 
+    CFG_DIGI_WIDE2_ON, 
+    CFG_DIGI_SAR_ON, 
+    CFG_DIGI_META_ON,
+    CFG_IGATE_ON, 
+    CFG_TXDELAY, 
+    CFG_TXTAIL, 
+    CFG_MAXFRAME, 
+    CFG_TXBUDGET,
+    CFG_LORA_DUTY,
+    CFG_LORA_TXAGE,
+    CFG_LORA_SF,
+    CFG_LORA_CR,
+    CFG_LORA_ALT_SF,
+    CFG_LORA_ALT_CR,
+    CFG_LORA_ALT_ON,
+    CFG_NKEYS
+} cfg_key_t;
+
+#define CFG_STR_SIZE 16
+#define CFG_MAX_SUBSCRIBERS 8
+
+/* Called when a cached setting is changed */
+typedef void (*cfg_handler_t)(cfg_key_t key);
+
+uint32_t config_version();
+uint8_t  config_byte(cfg_key_t key);
+int32_t  config_i32(cfg_key_t key);
+int      config_str(cfg_key_t key, char* buf, size_t size);
+bool     config_subscribe(cfg_handler_t h);
+
+#define CONFIG_BOOL(key) (config_byte(key) != 0)
+
+
 typedef void (*BoolHandler)(bool val);
 typedef void (*ByteHandler)(uint8_t val);
 typedef void (*I32Handler)(int32_t val);
@@ -11,6 +11,7 @@
 #define DFL_IGATE_HOST    "aprs.no"
 #define DFL_IGATE_USER    "NOCALL"
 #define DFL_IGATE_FILTER  "m/10"
+#define DFL_IGATE_ALT     ""
 #define DFL_TIMEZONE      ""
 #define DFL_FW_URL        ""
 #define DFL_FW_WEBAPP_URL ""
@@ -30,13 +31,18 @@
 #define DFL_LORA_CR          5
 #define DFL_LORA_ALT_SF      5
 #define DFL_LORA_ALT_CR      6
+#define DFL_LORA_SPI         8
+#define DFL_LORA_DUTY       10
+#define DFL_LORA_TXAGE      60
 #define DFL_REPEAT           0
 #define DFL_TRKLOG_INT       5
 #define DFL_TRKLOG_TTL      24
+#define DFL_TRKLOG_FLUSH    16
 #define DFL_ADC_REF       1100
 #define DFL_TXDELAY         10
 #define DFL_TXTAIL          10
 #define DFL_MAXFRAME         2
+#define DFL_TXBUDGET      2000
 #define DFL_MAXPAUSE       120
 #define DFL_MINPAUSE        20
 #define DFL_MINDIST        100
@@ -63,6 +69,7 @@
 #define DFL_CRYPTO_ON      false
 #define DFL_TRKLOG_ON      false
 #define DFL_TRKLOG_POST_ON false
+#define DFL_TRKLOG_BIN_ON  false
 #define DFL_TRACKER_ON     true
 #define DFL_TIMESTAMP_ON   true
 #define DFL_COMPRESS_ON    true
@@ -74,13 +81,19 @@
 #define DFL_DIGI_META_ON   false
 #define DFL_IGATE_ON       false
 #define DFL_IGATE_TRACK_ON true
+#define DFL_IGATE_STANDBY_ON false
 #define DFL_REPORT_BEEP_ON false
 #define DFL_EXTRATURN_ON   false
 #define DFL_TXMON_ON       true
+#define DFL_LATENCY_ON     false
 #define DFL_RADIO_ON       true
 #define DFL_TXLOW_ON       false
+#define DFL_AFSK_PAR_ON    true
+#define DFL_AFSK_STREAM_ON false
+#define DFL_AFSK_BUF        200
 
 #define DFL_WIFI_ON        false
 #define DFL_SOFTAP_ON      false
 
 #define DFL_LORA_ALT_ON    false
+#define DFL_LORA_BUSYIRQ_ON true
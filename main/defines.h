@@ -376,7 +376,6 @@
 #define STACK_TRACKER        4000
 #define STACK_MONITOR        3200
 #define STACK_GUI            4100
-#define STACK_HLIST          1500
 #define STACK_DIGI           3200
 #define STACK_TCP_REC        3000
 #define STACK_IGATE          4000
@@ -398,7 +397,6 @@
 #define CORE_HDLC_RXDECODER 1
 #define CORE_HDLC_TXENCODER 1
 #define CORE_HDLC_TEST      1
-#define CORE_HLIST          0
 #define CORE_DIGI           0
 #define CORE_TCP_REC        1
 #define CORE_IGATE          1
@@ -429,6 +427,7 @@
 #define REGEX_IPADDR   "(\\d{1,3}\\.){3}\\d{1,3}"
 #define REGEX_APRSSYM  "[0-9A-Z\\/\\\\&]."
 #define REGEX_HOSTNAME "[0-9a-zA-Z\\-\\_\\.]+"
+#define REGEX_HOSTLIST "[0-9a-zA-Z\\-\\_\\.\\:\\,]*"
 #define REGEX_URL      "http(s?):\\/\\/[0-9a-zA-Z\\-\\_\\.\\/]+"
 #define REGEX_FPATH    "[0-9a-zA-Z\\-\\_\\.\\/]+"
 #define REGEX_TIMEZONE ".*"
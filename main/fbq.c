@@ -11,11 +11,15 @@
 
 
 struct fbqsw {
+    const char* name;
+    struct fbqsw *next;
     int size;
     int last;
-    FBQ *mq[1];
+    fbqsub_t sub[1];
 }; 
 
+/* All pub-sub services, for statistics */
+static struct fbqsw *sw_list = NULL;
 
 
 
@@ -23,6 +27,9 @@ struct fbqsw {
 /* 
  *  Distribution of packets through a publish and subscribe service. 
  *  Multiple receivers may subscribe and packets will be copied to each of them.
+ *  Publishing does not block (for long) on a full subscriber queue. Each 
+ *  subscription has a policy for what to do when its queue is full, and 
+ *  counts frames delivered and dropped. 
  */   
 
 
@@ -30,11 +37,14 @@ struct fbqsw {
  * Create a pub-sub service
  ****************************************************************************/
 
-FBQSW_t* fbqsw_create(int capacity) {
+FBQSW_t* fbqsw_create(const char* name, int capacity) {
     
-    FBQSW_t* sw = malloc(sizeof(struct fbqsw) + sizeof(FBQ*) * (capacity-1));
+    FBQSW_t* sw = malloc(sizeof(struct fbqsw) + sizeof(fbqsub_t) * (capacity-1));
+    sw->name = name;
     sw->size = capacity;
     sw->last = -1;
+    sw->next = sw_list;
+    sw_list = sw;
     return sw;
 }
 
@@ -43,11 +53,15 @@ FBQSW_t* fbqsw_create(int capacity) {
  * Subscribe a FBQ
  ****************************************************************************/
 
-int fbqsw_subscribe(FBQSW_t* sw, FBQ * mq) {
+int fbqsw_subscribe(FBQSW_t* sw, FBQ * mq, fbq_policy_t policy, const char* name) {
     if (sw->last+1 >= sw->size)
         return -1;
+    fbqsub_t* s = &sw->sub[sw->last+1];
+    s->policy = policy;
+    s->name = name;
+    s->delivered = s->dropped = 0;
+    s->mq = mq;
     sw->last++;
-    sw->mq[sw->last] = mq;
     
     return sw->last;
 }
@@ -59,29 +73,94 @@ int fbqsw_subscribe(FBQSW_t* sw, FBQ * mq) {
 void fbqsw_unsubscribe(FBQSW_t* sw, int index) {
     if (index < 0 || index >= sw->size)
         return;
-    sw->mq[index] = NULL;
-    while (sw->last >= 0 && sw->mq[sw->last] == NULL)
+    sw->sub[index].mq = NULL;
+    while (sw->last >= 0 && sw->sub[sw->last].mq == NULL)
         sw->last--;
 }
 
 
+
+/****************************************************************************
+ * Put a frame on a subscriber's queue according to its policy. 
+ * Return false if it was dropped. 
+ ****************************************************************************/
+
+static bool sub_put(fbqsub_t* s, FBUF b) {
+    FBUF x;
+    switch (s->policy) {
+        case FBQ_DROP_NEWEST: 
+            return fbq_tryPut(s->mq, b, 0);
+            
+        case FBQ_DROP_OLDEST: 
+            if (fbq_tryPut(s->mq, b, 0))
+                return true;
+            if (fbq_tryGet(s->mq, &x)) {
+                fbuf_release(&x);
+                s->dropped++;
+            }
+            return fbq_tryPut(s->mq, b, 0);
+            
+        case FBQ_COALESCE: 
+            while (fbq_tryGet(s->mq, &x)) {
+                fbuf_release(&x);
+                s->dropped++;
+            }
+            return fbq_tryPut(s->mq, b, 0);
+    }
+    return false;
+}
+
+
+
 /****************************************************************************
- * Distribute (publish) a packet to subscribers
+ * Distribute (publish) a packet to subscribers. Each subscriber gets its 
+ * own reference. Return the number of subscribers that got it. If zero, 
+ * the caller still owns buf, otherwise it is released here. 
  ****************************************************************************/
 
 uint8_t fbqsw_publish(FBQSW_t* sw, FBUF buf) {
     uint8_t n = 0;
     if (sw->last < 0)
         return 0;
-    for (int i=0; i<=sw->last; i++)
-        if (sw->mq[i] != NULL) {
-            fbq_put(sw->mq[i], (n==0 ? buf : fbuf_newRef(&buf, SRC_DUPLICATE)));
+    for (int i=0; i<=sw->last; i++) {
+        fbqsub_t* s = &sw->sub[i];
+        if (s->mq == NULL)
+            continue;
+        FBUF x = fbuf_newRef(&buf, SRC_DUPLICATE);
+        if (sub_put(s, x)) {
+            s->delivered++;
             n++;
         }
+        else {
+            fbuf_release(&x);
+            s->dropped++;
+        }
+    }
+    if (n > 0)
+        fbuf_release(&buf);
     return n;
 }
 
 
+
+/****************************************************************************
+ * Visit all active subscriptions (for statistics)
+ ****************************************************************************/
+
+void fbqsw_foreach(fbqsw_visitor_t f, void* arg) {
+    for (struct fbqsw *sw = sw_list; sw != NULL; sw = sw->next)
+        for (int i=0; i<=sw->last; i++)
+            if (sw->sub[i].mq != NULL)
+                f(sw->name, &sw->sub[i], arg);
+}
+
+
+const char* fbqsw_policyName(fbq_policy_t p) {
+    static const char* names[] = {"drop-newest", "drop-oldest", "coalesce"};
+    return (p <= FBQ_COALESCE ? names[p] : "?");
+}
+
+
 /* 
  *  FBQ: QUEUE OF BUFFER-CHAINS
  */   
@@ -102,6 +181,7 @@ void fbq_init(FBQ* q, const uint16_t sz)
         q->length = NULL;
         q->capacity = NULL;
         q->lock = NULL;
+        q->mx = NULL;
         return;
     }
     q->size = sz;
@@ -111,6 +191,7 @@ void fbq_init(FBQ* q, const uint16_t sz)
     q->length = sem_create(0); 
     q->capacity = sem_create(sz);
     q->lock = cond_create();
+    q->mx = mutex_create();
 }
 
 
@@ -149,9 +230,11 @@ void fbq_put(FBQ* q, FBUF b)
         return;
     cond_clear(q->lock);
     if (sem_down(q->capacity) == pdTRUE) {
+        mutex_lock(q->mx);
         q->cnt++;
         uint8_t i = (q->index + q->cnt) % q->size; 
         q->buf[i] = b; 
+        mutex_unlock(q->mx);
         sem_up(q->length);
     }
     cond_set(q->lock);
@@ -159,6 +242,32 @@ void fbq_put(FBQ* q, FBUF b)
 
 
 
+/********************************************************
+ *   put a buffer chain into the queue. Wait at most 
+ *   ms milliseconds if full. Return false if not put. 
+ ********************************************************/
+
+bool fbq_tryPut(FBQ* q, FBUF b, uint32_t ms)
+{
+    if (clr)
+        return false;
+    bool res = false;
+    cond_clear(q->lock);
+    if (sem_downTimeout(q->capacity, ms) == pdTRUE) {
+        mutex_lock(q->mx);
+        q->cnt++;
+        uint8_t i = (q->index + q->cnt) % q->size; 
+        q->buf[i] = b; 
+        mutex_unlock(q->mx);
+        sem_up(q->length);
+        res = true;
+    }
+    cond_set(q->lock);
+    return res;
+}
+
+
+
 /*********************************************************
  *   get a buffer chain from the queue (block if empty)
  *********************************************************/
@@ -172,9 +281,11 @@ FBUF fbq_get(FBQ* q)
     }
     cond_clear(q->lock);
     if (sem_down(q->length) == pdTRUE) {  
+        mutex_lock(q->mx);
         q->index = (q->index + 1) % q->size;
         x = q->buf[q->index];
         q->cnt--;
+        mutex_unlock(q->mx);
         sem_up(q->capacity);
     }
     cond_set(q->lock);
@@ -183,9 +294,66 @@ FBUF fbq_get(FBQ* q)
 
 
 
+/*********************************************************
+ *   get a buffer chain from the queue if not empty. 
+ *   Return false if empty. 
+ *********************************************************/
+
+bool fbq_tryGet(FBQ* q, FBUF* x)
+{
+    return fbq_getTimeout(q, x, 0);
+}
+
+
+
+/*********************************************************
+ *   get a buffer chain from the queue. Wait at most ms 
+ *   milliseconds if empty. Return false on timeout. 
+ *********************************************************/
+
+bool fbq_getTimeout(FBQ* q, FBUF* x, uint32_t ms)
+{
+    if (clr)
+        return false;
+    bool res = false;
+    cond_clear(q->lock);
+    if (sem_downTimeout(q->length, ms) == pdTRUE) {  
+        mutex_lock(q->mx);
+        q->index = (q->index + 1) % q->size;
+        *x = q->buf[q->index];
+        q->cnt--;
+        mutex_unlock(q->mx);
+        sem_up(q->capacity);
+        res = true;
+    }
+    cond_set(q->lock);
+    return res;
+}
+
+
+
+
+/*********************************************************
+ *   look at the first buffer chain in the queue without 
+ *   removing it. Return false if empty. 
+ *********************************************************/
+
+bool fbq_peek(FBQ* q, FBUF* x)
+{
+    bool res = false;
+    mutex_lock(q->mx);
+    if (q->cnt > 0) {
+        *x = q->buf[(q->index + 1) % q->size];
+        res = true;
+    }
+    mutex_unlock(q->mx);
+    return res;
+}
+
+
 
 /**********************************************************
- * put an empty buffer onto the queue. 
+ * put an empty buffer onto the queue.  
  **********************************************************/
  
 void fbq_signal(FBQ* q, uint8_t tag)
@@ -7,6 +7,7 @@
 #include "defines.h"
 #include "fbuf.h"
 #include <string.h>
+#include <stdatomic.h>
 #include "esp_log.h"
 
 
@@ -19,12 +20,17 @@
  *    - Index of next buffer in chain (NILPTR if this is the last)
  *    - Storage for actual content
  *
+ * Free slots are kept in a list threaded through the 'next' field 
+ * (refcnt == 0) so that allocation and release are constant time. 
+ * The head of the free list is a 32 bit word: The slot index in the 
+ * low 16 bits and a counter in the high 16 bits which is incremented 
+ * on every update to avoid the ABA problem when doing compare-and-swap.
  *********************************************************************/
 
 
 
 typedef struct _slot {
-   uint8_t   refcnt; 
+   _Atomic uint8_t refcnt; 
    uint8_t   length; 
    fbindex_t next; 
    char      buf[FBUF_SLOTSIZE]; 
@@ -40,7 +46,11 @@ fbslot_t *_pool;
 
 
 
-static fbindex_t _free_slots = FBUF_SLOTS; 
+static _Atomic fbindex_t _free_slots = FBUF_SLOTS; 
+static _Atomic uint32_t _free_head = NILPTR;
+
+#define FREE_INDEX(h)    ((fbindex_t) ((h) & 0xFFFF))
+#define FREE_HEAD(h, i)  ((((h) + 0x10000) & 0xFFFF0000) | (i))
 
 static void(*memFullError)(void) = NULL;
 
@@ -76,15 +86,13 @@ uint32_t fbuf_freeMem()
    
    
 /*
- * Note: We assume that FBUF objects are not shared between 
- * ISRs/threads. 
- * 
- * We also assume that FBUF objects are not accessed from interrupt handlers. 
- * That may change later. In that case, check if we need to protect parts of 
- * code by using locks/disabling interrupts. slots may be shared between
- * FBUF objects but it is complicated and this should be tested and 
- * analysed more. We should disallow writing to a FBUF that contains
- * shared slots.
+ * Note: We assume that a FBUF object (the header) is not shared between 
+ * ISRs/threads. Slots may be shared between FBUF objects (see fbuf_newRef) 
+ * and such FBUFs are typically handed to tasks running on both cores. 
+ * Reference counts and the free list are therefore updated atomically 
+ * (without locks) so that allocating and releasing slots are safe from 
+ * any task or ISR. Writing to a FBUF that contains shared slots is not 
+ * safe and should be disallowed.
  */
 
 
@@ -100,30 +108,42 @@ void fbuf_errorHandler( void(*f)(void) )
  
 static fbindex_t _fbuf_newslot ()
 {
-    fbindex_t i; 
-    for (i=0; i<FBUF_SLOTS; i++)
-       if (_pool[i].refcnt == 0) 
-       {
-           _pool[i].refcnt = 1;
-           _pool[i].length = 0;
-           _pool[i].next = NILPTR; 
-           _free_slots--;
-           return i; 
-       }
-    return NILPTR; 
+    uint32_t head = atomic_load(&_free_head); 
+    fbindex_t i;
+    do {
+        i = FREE_INDEX(head);
+        if (i == NILPTR)
+            return NILPTR;
+    } while (!atomic_compare_exchange_weak(&_free_head, &head, FREE_HEAD(head, _pool[i].next)));
+    
+    _pool[i].length = 0;
+    _pool[i].next = NILPTR; 
+    atomic_store(&_pool[i].refcnt, 1);
+    atomic_fetch_sub(&_free_slots, 1);
+    return i; 
 }
 
 
 
 /******************************************************
-    Internal: Release a buffer slot 
+    Internal: Release a buffer slot. 
+    Note that this overwrites the next field when the 
+    slot becomes free. 
  ******************************************************/
 
 static void _fbuf_releaseslot(fbindex_t i) {
-    if (_pool[i].refcnt > 0) {
-        _pool[i].refcnt--;
-        if (_pool[i].refcnt == 0)
-            _free_slots++;
+    uint8_t cnt = atomic_load(&_pool[i].refcnt); 
+    do {
+        if (cnt == 0) 
+            return;     /* Already free */
+    } while (!atomic_compare_exchange_weak(&_pool[i].refcnt, &cnt, cnt-1));
+    
+    if (cnt == 1) {
+        uint32_t head = atomic_load(&_free_head); 
+        do {
+            _pool[i].next = FREE_INDEX(head);
+        } while (!atomic_compare_exchange_weak(&_free_head, &head, FREE_HEAD(head, i)));
+        atomic_fetch_add(&_free_slots, 1);
     }
 }
 
@@ -138,10 +158,12 @@ void fbuf_init() {
 #endif
     for (int i=0; i<FBUF_SLOTS; i++)
     {
-        _pool[i].refcnt = 0;
+        atomic_init(&_pool[i].refcnt, 0);
         _pool[i].length = 0;
-        _pool[i].next = NILPTR;
+        _pool[i].next = (i < FBUF_SLOTS-1 ? i+1 : NILPTR);
     }
+    atomic_store(&_free_head, 0);
+    atomic_store(&_free_slots, FBUF_SLOTS);
 }
 
 
@@ -176,6 +198,7 @@ void fbuf_new (FBUF* bb, uint8_t tag)
     bb->rpos = 0;
     bb->length = 0;
     bb->tag = tag;
+    bb->trace = 0xFF;
     bb->meta = NULL;
 }
 
@@ -189,8 +212,9 @@ void fbuf_release(FBUF* bb)
 {
     fbindex_t b = bb->head;
     while (b != NILPTR) {
+       fbindex_t next = _pool[b].next; 
        _fbuf_releaseslot(b);
-       b = _pool[b].next; 
+       b = next; 
     } 
     bb->head = bb->wslot = bb->rslot = NILPTR;
     bb->rpos = bb->length = 0;
@@ -208,7 +232,7 @@ FBUF fbuf_newRef(FBUF* bb, uint8_t tag)
     fbindex_t b = bb->head;
     while (b != NILPTR) 
     {
-        _pool[b].refcnt++; 
+        atomic_fetch_add(&_pool[b].refcnt, 1); 
         b = _pool[b].next; 
     } 
     newb.head = bb->head; 
@@ -216,6 +240,7 @@ FBUF fbuf_newRef(FBUF* bb, uint8_t tag)
     fbuf_reset(&newb);
     newb.wslot = bb->wslot;
     newb.tag = (tag==SRC_DUPLICATE ? bb->tag : tag);
+    newb.trace = bb->trace;
     newb.meta = bb->meta;
     return newb;
 }
@@ -237,7 +262,7 @@ void fbuf_rseek(FBUF* b, const uint16_t pos)
    if (pos > b->length)
        return;
    fbuf_reset(b);
-   while (i > _pool[b->rslot].length) {
+   while (b->rslot != NILPTR && i >= _pool[b->rslot].length) {
         i -= _pool[b->rslot].length;
         b->rslot = _pool[b->rslot].next;
    }
@@ -306,10 +331,10 @@ void fbuf_insert(FBUF* b, FBUF* x, uint16_t pos)
 
     /* Find last slot in x chain and increment reference count*/
     fbindex_t xlast = x->head;
-    _pool[xlast].refcnt++;
+    atomic_fetch_add(&_pool[xlast].refcnt, 1);
     while (_pool[xlast].next != NILPTR) {
         xlast = _pool[xlast].next;
-        _pool[xlast].refcnt++;
+        atomic_fetch_add(&_pool[xlast].refcnt, 1);
     }
 
     /* Insert x chain after islot */  
@@ -356,7 +381,7 @@ void fbuf_connect(FBUF* b, FBUF* x, uint16_t pos)
     /* Increment reference count of rest of x */
     while (_pool[xlast].next != NILPTR) {
         xlast = _pool[xlast].next;
-        _pool[xlast].refcnt++;
+        atomic_fetch_add(&_pool[xlast].refcnt, 1);
     }
 
     b->wslot = x->wslot = NILPTR; // Disallow writing
@@ -377,11 +402,10 @@ static fbindex_t _split(fbindex_t islot, uint16_t pos)
       }
       _pool[newslot].next = _pool[islot].next;
       _pool[islot].next = newslot;
-      _pool[newslot].refcnt = _pool[islot].refcnt; 
+      atomic_store(&_pool[newslot].refcnt, atomic_load(&_pool[islot].refcnt)); 
       
       /* Copy last part of slot to newslot */
-      for (uint8_t i = 0; i<_pool[islot].length - pos; i++)
-          _pool[newslot].buf[i] = _pool[islot].buf[pos+i];   
+      memcpy(_pool[newslot].buf, _pool[islot].buf + pos, _pool[islot].length - pos);
 
       _pool[newslot].length = _pool[islot].length - pos;
       _pool[islot].length = pos; 
@@ -392,14 +416,27 @@ static fbindex_t _split(fbindex_t islot, uint16_t pos)
 
 
 /*******************************************************
-    Write a string to a buffer chain
+    Write a string to a buffer chain. Fill the current
+    slot with memcpy, let fbuf_putChar add new slots. 
  *******************************************************/
  
 void fbuf_write (FBUF* b, const char* data, const uint16_t size)
 {
-    uint16_t i; 
-    for (i=0; i<size; i++)
-        fbuf_putChar(b, data[i]);
+    uint16_t i = 0; 
+    while (i < size) {
+        if (b->wslot == NILPTR || b->head == NILPTR || _pool[b->wslot].length == FBUF_SLOTSIZE) {
+            fbuf_putChar(b, data[i++]);
+            continue;
+        }
+        uint8_t pos = _pool[b->wslot].length;
+        uint16_t n = FBUF_SLOTSIZE - pos;
+        if (n > size - i)
+            n = size - i;
+        memcpy(_pool[b->wslot].buf + pos, data + i, n);
+        _pool[b->wslot].length += n;
+        b->length += n;
+        i += n;
+    }
 }
 
 
@@ -486,7 +523,7 @@ uint16_t fbuf_read (FBUF* b, uint16_t size, char *buf)
        if (n > _pool[bb].length) 
            n = _pool[bb].length;
             
-       strncpy(buf+r, _pool[bb].buf, n);
+       memcpy(buf+r, _pool[bb].buf, n);
        r += n; 
        bb = _pool[bb].next;
        if (r >= size ) 
@@ -499,6 +536,89 @@ uint16_t fbuf_read (FBUF* b, uint16_t size, char *buf)
 }
 
 
+/**************************************************************
+  Get the next contiguous segment of a buffer chain, starting 
+  at the read position. A pointer to the data is returned 
+  in 'data' and the read position is moved to the start of 
+  the next slot. Return the length of the segment, 0 if at 
+  end of chain. Note that the caller is responsible for not 
+  reading beyond fbuf_length. 
+ **************************************************************/
+
+uint8_t fbuf_getSeg(FBUF* b, const char** data)
+{
+    while (b->rslot != NILPTR && b->rpos >= _pool[b->rslot].length) {
+        b->rslot = _pool[b->rslot].next;
+        b->rpos = 0;
+    }
+    if (b->rslot == NILPTR)
+        return 0;
+    
+    uint8_t n = _pool[b->rslot].length - b->rpos;
+    *data = _pool[b->rslot].buf + b->rpos;
+    b->rslot = _pool[b->rslot].next;
+    b->rpos = 0;
+    return n;
+}
+
+
+
+/**************************************************************
+  Get a list of (up to max) contiguous segments of a buffer 
+  chain, starting at position pos and limited by the length 
+  of the chain. The read position is not changed. Return the 
+  number of segments.  
+ **************************************************************/
+
+uint8_t fbuf_segments(FBUF* b, uint16_t pos, fbseg_t seg[], uint8_t max)
+{
+    fbindex_t bb = b->head;
+    uint16_t left; 
+    uint8_t n = 0;
+    
+    if (pos >= b->length)
+        return 0;
+    left = b->length - pos;
+    
+    while (bb != NILPTR && pos >= _pool[bb].length) {
+        pos -= _pool[bb].length;
+        bb = _pool[bb].next;
+    }
+    while (bb != NILPTR && left > 0 && n < max) {
+        uint8_t len = _pool[bb].length - pos;
+        if (len > left)
+            len = left;
+        if (len > 0) {
+            seg[n].data = _pool[bb].buf + pos;
+            seg[n].length = len;
+            left -= len;
+            n++;
+        }
+        pos = 0;
+        bb = _pool[bb].next;
+    }
+    return n;
+}
+
+
+
+/**************************************************************
+  Get the content of a buffer chain as a contiguous array. 
+  If the content fits in the first slot, a pointer to the slot 
+  is returned (no copying). If not, up to size bytes are copied 
+  to buf and buf is returned. 
+ **************************************************************/
+
+const char* fbuf_linearize(FBUF* b, char* buf, uint16_t size)
+{
+    if (b->head != NILPTR && b->length <= _pool[b->head].length)
+        return _pool[b->head].buf;
+    fbuf_read(b, size, buf);
+    return buf;
+}
+
+
+
 /*******************************************************
   Remove the last byte of a buffer chain.
  *******************************************************/
@@ -516,10 +636,8 @@ void fbuf_removeLast(FBUF* x)
   
   _pool[xlast].length--;
   if (_pool[xlast].length == 0 && prev != xlast) {
-    _pool[xlast].refcnt--;
-    if (_pool[xlast].refcnt == 0)
-      _free_slots++;
     _pool[prev].next = NILPTR;
+    _fbuf_releaseslot(xlast);
   }
   x->length--;
 }
@@ -11,6 +11,7 @@
 #include "system.h"
 
 #define NILPTR 0xFFFF
+#define FBUF_MAXSEGS 12
 
 #define SRC_UNKNOWN      0x00
 #define SRC_RX           0x01
@@ -42,11 +43,23 @@ typedef struct _fb
    uint16_t  rpos; 
    uint16_t  length;
    uint8_t   tag;
+   uint8_t   trace;     /* Latency trace id, see latency.h */
    void*     meta;
 }
 FBUF; 
 
 
+/*********************************
+   Contiguous segment of a chain
+ *********************************/
+typedef struct _fbseg
+{
+   const char* data;
+   uint8_t     length;
+}
+fbseg_t;
+
+
 /****************************************
    Operations for packet buffer chain
  ****************************************/
@@ -69,6 +82,9 @@ void     fbuf_print     (FILE* f, FBUF* b);
 void     fbuf_insert    (FBUF* b, FBUF* x, uint16_t pos);
 void     fbuf_connect   (FBUF* b, FBUF* x, uint16_t pos);
 void     fbuf_removeLast(FBUF* b);
+uint8_t  fbuf_getSeg    (FBUF* b, const char** data);
+uint8_t  fbuf_segments  (FBUF* b, uint16_t pos, fbseg_t seg[], uint8_t max);
+const char* fbuf_linearize(FBUF* b, char* buf, uint16_t size);
 
 fbindex_t fbuf_usedSlots(void);
 fbindex_t fbuf_freeSlots(void);
@@ -89,11 +105,40 @@ typedef struct _fbq
   uint8_t size, index, cnt; 
   semaphore_t length, capacity; 
   cond_t lock;
+  mutex_t mx;
   FBUF *buf; 
 } FBQ;
 
 
 
+/*********************************************
+ * What to do when a subscriber's queue is full.
+ * The publisher (the RX decoder) never waits.
+ *********************************************/
+
+typedef enum {
+  FBQ_DROP_NEWEST,   /* Drop the frame being published */
+  FBQ_DROP_OLDEST,   /* Drop the oldest frame in the queue */
+  FBQ_COALESCE       /* Keep only the newest frame */
+} fbq_policy_t;
+
+
+/*********************************
+ *   A subscription 
+ *********************************/
+
+typedef struct _fbqsub
+{
+  FBQ* mq;
+  const char* name;
+  fbq_policy_t policy;
+  uint32_t delivered, dropped; 
+} fbqsub_t;
+
+typedef void (*fbqsw_visitor_t)(const char* sw, const fbqsub_t* sub, void* arg);
+
+
+
 /************************************************
    Operations for queue of packet buffer chains
  ************************************************/
@@ -101,7 +146,11 @@ typedef struct _fbq
 void  fbq_init  (FBQ* q, const uint16_t size); 
 void  fbq_clear (FBQ* q);
 void  fbq_put   (FBQ* q, FBUF b); 
+bool  fbq_tryPut(FBQ* q, FBUF b, uint32_t ms);
 FBUF  fbq_get   (FBQ* q);
+bool  fbq_tryGet(FBQ* q, FBUF* b);
+bool  fbq_getTimeout(FBQ* q, FBUF* b, uint32_t ms);
+bool  fbq_peek  (FBQ* q, FBUF* b);
 void  fbq_signal(FBQ* q, uint8_t tag);
 
 
@@ -109,10 +158,12 @@ void  fbq_signal(FBQ* q, uint8_t tag);
  * Operations for publish/subscribe functions
  ************************************************/
 
-FBQSW_t* fbqsw_create(int capacity);
-int      fbqsw_subscribe(FBQSW_t* sw, FBQ * mq);
+FBQSW_t* fbqsw_create(const char* name, int capacity);
+int      fbqsw_subscribe(FBQSW_t* sw, FBQ * mq, fbq_policy_t policy, const char* name);
 void     fbqsw_unsubscribe(FBQSW_t* sw, int index);
 uint8_t  fbqsw_publish(FBQSW_t* sw, FBUF buf);
+void     fbqsw_foreach(fbqsw_visitor_t f, void* arg);
+const char* fbqsw_policyName(fbq_policy_t p);
 
 
 
@@ -0,0 +1,167 @@
+/*
+ * Latency tracing of frames through the RX -> digipeater -> TX pipeline.
+ * By LA7ECA, ohanssen@acm.org
+ */
+
+#include "defines.h"
+#include <string.h>
+#include <stdatomic.h>
+#include "esp_timer.h"
+#include "system.h"
+#include "config.h"
+#include "latency.h"
+
+
+/* 
+ * A traced frame carries a trace id in its FBUF header. It refers to a 
+ * trail, which is a timestamp (usec) per stage. Trails are reused in a 
+ * round-robin fashion. The id includes a sequence number so that marks 
+ * on a frame whose trail has been reused are ignored. When a stage is 
+ * marked, the time since the previous marked stage is added to the 
+ * stage's histogram. When tracing is off, frames are not given a trace id 
+ * and lat_mark is just a comparison. 
+ */
+
+typedef struct _lat_trail {
+   uint8_t  id; 
+   uint8_t  last;
+   uint32_t t[LAT_STAGES];
+} lat_trail_t;
+
+static lat_trail_t trail[LAT_TRAILS];
+static lat_hist_t hist[LAT_STAGES];
+static atomic_uint lat_seq = 0;
+static atomic_bool lat_on = false;
+static mutex_t lat_mutex;
+
+static const char* stage_names[LAT_STAGES] = 
+   { "total", "rx", "decode", "digi", "txq", "enc", "tx" };
+   
+
+
+/********************************************************************************
+ * Initialize. Tracing is turned on if the LATENCY.on setting is true.
+ ********************************************************************************/
+
+void lat_init() 
+{
+   lat_mutex = mutex_create();
+   lat_reset();
+   lat_enable(GET_BOOL_PARAM("LATENCY.on", DFL_LATENCY_ON));
+}
+
+
+void lat_enable(bool on)
+   { atomic_store(&lat_on, on); }
+   
+   
+bool lat_enabled()
+   { return atomic_load(&lat_on); }
+   
+
+void lat_reset() 
+{
+   mutex_lock(lat_mutex);
+   memset(hist, 0, sizeof(hist));
+   memset(trail, LAT_NONE, sizeof(trail));
+   mutex_unlock(lat_mutex);
+}
+
+
+
+/********************************************************************************
+ * Start tracing a frame. t is the time of the last sample of the frame
+ ********************************************************************************/
+
+void lat_start(FBUF* f, int64_t t) 
+{
+   if (!atomic_load(&lat_on)) {
+      f->trace = LAT_NONE;
+      return;
+   }
+   uint8_t id = atomic_fetch_add(&lat_seq, 1) & 0x7F;
+   lat_trail_t* tr = &trail[id % LAT_TRAILS];
+   mutex_lock(lat_mutex);
+   tr->id = id;
+   tr->last = LAT_RX;
+   tr->t[LAT_RX] = (uint32_t) t;
+   mutex_unlock(lat_mutex);
+   f->trace = id;
+}
+
+
+
+static void hist_add(lat_hist_t* h, uint32_t usec) 
+{
+   uint8_t i = 0; 
+   while (i < LAT_BUCKETS-1 && (usec >> (i+1)) > 0)
+      i++;
+   h->bucket[i]++;
+   h->n++;
+   h->sum += usec;
+   if (usec > h->max)
+      h->max = usec;
+}
+
+
+
+/********************************************************************************
+ * Mark that a traced frame has reached stage s. Stages are expected to be 
+ * reached in order. Repeated or out-of-order marks are ignored. 
+ ********************************************************************************/
+
+void _lat_mark(FBUF* f, lat_stage_t s) 
+{
+   uint32_t now = (uint32_t) esp_timer_get_time();
+   lat_trail_t* tr = &trail[f->trace % LAT_TRAILS];
+   mutex_lock(lat_mutex);
+   if (tr->id == f->trace && s > tr->last) {
+      hist_add(&hist[s], now - tr->t[tr->last]);
+      tr->t[s] = now;
+      tr->last = s;
+      if (s == LAT_TX)
+         hist_add(&hist[LAT_TOTAL], now - tr->t[LAT_RX]);
+   }
+   mutex_unlock(lat_mutex);
+}
+
+
+
+/********************************************************************************
+ * Get a copy of the histogram for a stage
+ ********************************************************************************/
+
+void lat_getHist(lat_stage_t s, lat_hist_t* h) 
+{
+   mutex_lock(lat_mutex);
+   *h = hist[s];
+   mutex_unlock(lat_mutex);
+}
+
+
+
+/********************************************************************************
+ * Estimate a percentile (0-100) from a histogram. Returns the upper bound 
+ * of the bucket (in usec), but not more than the max value seen. 
+ ********************************************************************************/
+
+uint32_t lat_percentile(lat_hist_t* h, uint8_t p) 
+{
+   if (h->n == 0)
+      return 0;
+   uint32_t lim = (uint32_t) (((uint64_t) h->n * p + 99) / 100);
+   uint32_t cnt = 0;
+   for (int i=0; i<LAT_BUCKETS; i++) {
+      cnt += h->bucket[i];
+      if (cnt >= lim) {
+         uint32_t ub = (i < 31 ? (2u << i) - 1 : UINT32_MAX);
+         return (ub < h->max ? ub : h->max);
+      }
+   }
+   return h->max;
+}
+
+
+const char* lat_stageName(lat_stage_t s)
+   { return (s < LAT_STAGES ? stage_names[s] : "?"); }
+
@@ -0,0 +1,53 @@
+/*
+ * Latency tracing of frames through the RX -> digipeater -> TX pipeline.
+ * By LA7ECA, ohanssen@acm.org
+ */
+
+#if !defined __LATENCY_H__
+#define __LATENCY_H__
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include "fbuf.h"
+
+/* Stages of a frame's trip. LAT_TOTAL is from LAT_RX to LAT_TX */
+typedef enum {
+   LAT_TOTAL=0, 
+   LAT_RX,        /* Last sample of frame received */
+   LAT_DECODE,    /* Frame decoded, before publishing to subscribers */
+   LAT_DIGI,      /* Frame taken from the digipeater's queue */
+   LAT_TXQ,       /* Frame put on the encoder queue */
+   LAT_ENC,       /* Frame taken from the encoder queue */
+   LAT_TX,        /* Channel is free, start transmitting */
+   LAT_STAGES
+} lat_stage_t;
+
+#define LAT_NONE    0xFF
+#define LAT_TRAILS  16     /* Number of frames traced at the same time */
+#define LAT_BUCKETS 24     /* Bucket i counts latencies < 2^(i+1) usec */
+
+typedef struct _lat_hist {
+   uint32_t n, max; 
+   uint64_t sum;
+   uint32_t bucket[LAT_BUCKETS];
+} lat_hist_t;
+
+
+void        lat_init(void);
+void        lat_enable(bool on);
+bool        lat_enabled(void);
+void        lat_reset(void);
+void        lat_start(FBUF* f, int64_t t);
+void        _lat_mark(FBUF* f, lat_stage_t s);
+void        lat_getHist(lat_stage_t s, lat_hist_t* h);
+uint32_t    lat_percentile(lat_hist_t* h, uint8_t p);
+const char* lat_stageName(lat_stage_t s);
+
+
+/* Record the time of stage s. Does nothing if frame is not traced */
+static inline void lat_mark(FBUF* f, lat_stage_t s) {
+   if (f->trace != LAT_NONE) 
+      _lat_mark(f, s);
+}
+
+#endif /* __LATENCY_H__ */
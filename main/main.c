@@ -18,6 +18,7 @@
 #include "config.h"
 #include "networking.h"
 #include "fbuf.h"
+#include "latency.h"
 #include "gps.h"
 #include "ui.h"
 #include "afsk.h"
@@ -25,6 +26,7 @@
 #include "tracker.h"
 #include "radio.h"
 #include "ax25.h"
+#include "heardlist.h"
 #include "digipeater.h"
 #include "igate.h"
 #include "trackstore.h"
@@ -197,6 +199,7 @@ static void startup(void* arg)
     gps_init(GPS_UART);
     tracker_init(oq);
     tracklog_init();
+    hlist_init();
     digipeater_init(oq);
     igate_init(); 
     mon_init();
@@ -253,6 +256,7 @@ void app_main()
     gpio_install_isr_service(ESP_INTR_FLAG_DEFAULT);
     config_open();
     logLevel_init();
+    lat_init();
     initialize_console();
     
     /* Register commands */
@@ -25,6 +25,7 @@
 #include "gps.h"
 #include "esp_crt_bundle.h"
 #include "tracker.h"
+#include "trackstore.h"
 #if defined USE_PMU
 #include "pmu.h"
 #endif
@@ -275,7 +276,7 @@ esp_err_t firmware_upgrade()
         gui_fwsuccess();
         sleepMs(500);
         beeps("--- -.-");
-        esp_restart();
+        systemRestart();
     } else {
         ESP_LOGE(TAG, "Fw upgrade failed!");
         return ESP_FAIL;
@@ -441,6 +442,7 @@ static void batt_monitor(void* arg)  {
 
 void systemShutdown(void)
 {   
+    trackstore_flush();
     sleepMs(500);
     disp_sleepmode(true);
     sleepMs(1000);
@@ -456,6 +458,19 @@ void systemShutdown(void)
 
 
 
+/******************************************************************************
+ * Restart. Like in systemShutdown(), track log entries that are staged 
+ * in RAM are written first.
+ ******************************************************************************/
+
+void systemRestart(void)
+{
+    trackstore_flush();
+    esp_restart();
+}
+
+
+
 /*******************************************************************************
  * TIME MANAGEMENT
  *******************************************************************************/
@@ -29,6 +29,7 @@
 esp_err_t firmware_upgrade();
 esp_err_t webapp_upgrade();
 void systemShutdown(void);
+void systemRestart(void);
 
 /* Time */
 typedef struct tm tm_t; 
@@ -119,6 +120,7 @@ typedef SemaphoreHandle_t semaphore_t;
 #define sem_up(x)        xSemaphoreGive(x)
 #define sem_upI(x)       xSemaphoreGiveFromISR(x, pdFALSE)
 #define sem_down(x)      xSemaphoreTake(x, portMAX_DELAY)
+#define sem_downTimeout(x, ms) xSemaphoreTake(x, pdMS_TO_TICKS(ms))
 #define sem_getCount(x)  uxSemaphoreGetCount(x)
 
 typedef SemaphoreHandle_t mutex_t; 
@@ -131,6 +133,7 @@ typedef SemaphoreHandle_t mutex_t;
 typedef EventGroupHandle_t cond_t;
 #define cond_create          xEventGroupCreate
 #define cond_wait(cond)      xEventGroupWaitBits(cond, BIT_0, pdFALSE, pdFALSE,  portMAX_DELAY)
+#define cond_waitTimeout(cond, ms) (xEventGroupWaitBits(cond, BIT_0, pdFALSE, pdFALSE, pdMS_TO_TICKS(ms)) & BIT_0)
 #define cond_set(cond)       xEventGroupSetBits(cond, BIT_0)
 #define cond_setI(cond)      _cond_setBitsI(cond, BIT_0)
 #define cond_clear(cond)     xEventGroupClearBits(cond, BIT_0)
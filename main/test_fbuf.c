@@ -0,0 +1,654 @@
+/*
+ * Offline test of the packet buffer chains (fbuf.c).
+ * Runs on a host computer (not part of the firmware build):
+ *
+ *   gcc -O2 -Wall -I../components/aprs/hoststub -o fbuf_test test_fbuf.c fbuf.c -lpthread
+ *   ./fbuf_test
+ *
+ * The slot pool is checked: All slots can be allocated, the free/used
+ * counts are exact after random allocation and release, and chains
+ * written with fbuf_write() are equal to chains written byte by byte
+ * with fbuf_putChar(). The segment views (fbuf_segments, fbuf_getSeg
+ * and fbuf_linearize) are compared with reading byte by byte with
+ * fbuf_getChar(), also for chains that share slots or have slots that
+ * are not full (made with fbuf_connect).
+ *
+ * The lock-free pool is stress tested with threads: Producers publish
+ * packets to several subscriber queues like fbqsw_publish() does, and
+ * consumers check the content before they release it. A slot that is
+ * freed twice or too early shows up as a corrupt packet, or as a
+ * duplicate in the free list when the whole pool is allocated at the
+ * end. A lost slot shows up as fbuf_usedSlots() > 0.
+ * Built with -fsanitize=thread, the only reports are the read of 'next'
+ * in _fbuf_newslot() racing with a write to a slot that another thread
+ * has just taken. That value is thrown away, since the counter in the
+ * free list head makes the compare-and-swap fail.
+ *
+ * Then the cost of allocating, writing and releasing a packet is
+ * measured as the pool occupancy rises. With the free list it should
+ * not depend on how many slots are in use. Last, a checksum over a
+ * packet is computed with fbuf_getChar() and with fbuf_segments(),
+ * to compare bytes/second.
+ *
+ * By LA7ECA, ohanssen@acm.org
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "fbuf.h"
+
+
+#define RANDOM_TESTS 20000
+#define BENCH_ROUNDS 200000
+#define MAXPKT 256
+
+static char text[MAXPKT];
+
+
+
+/*******************************************************
+ * Allocate every slot in the pool, one chain each.
+ * The next allocation must fail.
+ *******************************************************/
+
+static FBUF all[FBUF_SLOTS];
+
+static int check_exhaust()
+{
+    int fails = 0;
+    for (int i=0; i<FBUF_SLOTS; i++) {
+        fbuf_new(&all[i], 0);
+        if (all[i].head == NILPTR) {
+            printf("FAIL: slot %d of %d not allocated\n", i, FBUF_SLOTS);
+            return fails + 1;
+        }
+    }
+    if (fbuf_freeSlots() != 0 || fbuf_usedSlots() != FBUF_SLOTS) {
+        printf("FAIL: pool full, but free=%d used=%d\n", fbuf_freeSlots(), fbuf_usedSlots());
+        fails++;
+    }
+    FBUF x;
+    fbuf_new(&x, 0);
+    if (x.head != NILPTR) {
+        printf("FAIL: allocation from a full pool\n");
+        fails++;
+    }
+    for (int i=0; i<FBUF_SLOTS; i++)
+        fbuf_release(&all[i]);
+    if (fbuf_freeSlots() != FBUF_SLOTS || fbuf_usedSlots() != 0) {
+        printf("FAIL: pool empty, but free=%d used=%d\n", fbuf_freeSlots(), fbuf_usedSlots());
+        fails++;
+    }
+    return fails;
+}
+
+
+
+/*******************************************************
+ * Allocate and release chains in random order and
+ * compare the used count with the number of slots we
+ * know we hold. A chain of n bytes uses n/SLOTSIZE
+ * slots rounded up (and at least one).
+ *******************************************************/
+
+#define NCHAINS 64
+
+static int slots(int len)
+   { return len == 0 ? 1 : (len + FBUF_SLOTSIZE - 1) / FBUF_SLOTSIZE; }
+
+
+static int check_counts()
+{
+    int fails = 0, held = 0;
+    FBUF ch[NCHAINS];
+    bool used[NCHAINS] = {false};
+
+    for (int i=0; i<RANDOM_TESTS; i++) {
+        int k = rand() % NCHAINS;
+        if (used[k]) {
+            held -= slots(fbuf_length(&ch[k]));
+            fbuf_release(&ch[k]);
+            used[k] = false;
+        }
+        else {
+            fbuf_new(&ch[k], 0);
+            fbuf_write(&ch[k], text, rand() % MAXPKT);
+            held += slots(fbuf_length(&ch[k]));
+            used[k] = true;
+        }
+        if (fbuf_usedSlots() != held || fbuf_freeSlots() != FBUF_SLOTS - held) {
+            printf("FAIL: count test %d: used=%d free=%d, expected used=%d\n",
+                i, fbuf_usedSlots(), fbuf_freeSlots(), held);
+            return fails + 1;
+        }
+    }
+    for (int k=0; k<NCHAINS; k++)
+        if (used[k])
+            fbuf_release(&ch[k]);
+    if (fbuf_usedSlots() != 0) {
+        printf("FAIL: %d slots not released\n", fbuf_usedSlots());
+        fails++;
+    }
+    return fails;
+}
+
+
+
+/*******************************************************
+ * fbuf_write() fills the current slot with memcpy.
+ * Compare with writing the same bytes with putChar,
+ * in random pieces, so that pieces start and end at
+ * any position in a slot.
+ *******************************************************/
+
+static int check_write()
+{
+    int fails = 0;
+    char out1[MAXPKT], out2[MAXPKT];
+
+    for (int i=0; i<RANDOM_TESTS; i++) {
+        FBUF b1, b2;
+        int len = rand() % MAXPKT;
+
+        fbuf_new(&b1, 0);
+        fbuf_new(&b2, 0);
+        for (int pos = 0; pos < len; ) {
+            int n = rand() % (2 * FBUF_SLOTSIZE + 1);
+            if (n > len - pos)
+                n = len - pos;
+            fbuf_write(&b1, text + pos, n);
+            pos += n;
+        }
+        for (int j=0; j<len; j++)
+            fbuf_putChar(&b2, text[j]);
+
+        if (fbuf_length(&b1) != len || fbuf_length(&b2) != len
+              || fbuf_read(&b1, 0, out1) != len || fbuf_read(&b2, 0, out2) != len
+              || memcmp(out1, out2, len) != 0 || memcmp(out1, text, len) != 0) {
+            printf("FAIL: write test %d (length %d)\n", i, len);
+            fails++;
+        }
+        if (fbuf_usedSlots() != 2 * slots(len)) {
+            printf("FAIL: write test %d uses %d slots, expected %d\n",
+                i, fbuf_usedSlots(), 2 * slots(len));
+            fails++;
+        }
+        fbuf_release(&b1);
+        fbuf_release(&b2);
+    }
+    return fails;
+}
+
+
+
+/*******************************************************
+ * Segment views. Make a chain, sometimes with a header
+ * connected to the tail of another chain, and read it
+ * in every way from a random position.
+ *******************************************************/
+
+#define MAXCHAIN (MAXPKT + 2 * FBUF_SLOTSIZE)
+
+static int make_chain(FBUF* b, char* exp)
+{
+    int len = 1 + rand() % (MAXPKT - 1);
+    if (rand() % 2 == 0 || len < 2) {
+        fbuf_new(b, 0);
+        fbuf_write(b, text, len);
+        memcpy(exp, text, len);
+        return len;
+    }
+    FBUF a;
+    int hlen = 1 + rand() % (2 * FBUF_SLOTSIZE);
+    int pos = 1 + rand() % (len - 1);
+    fbuf_new(&a, 0);
+    fbuf_write(&a, text, len);
+    fbuf_new(b, 0);
+    fbuf_write(b, text + 100, hlen);
+    fbuf_connect(b, &a, pos);
+    fbuf_release(&a);
+    memcpy(exp, text + 100, hlen);
+    memcpy(exp + hlen, text + pos, len - pos);
+    return hlen + len - pos;
+}
+
+
+static int check_segments()
+{
+    int fails = 0;
+    for (int i=0; i<RANDOM_TESTS; i++) {
+        char exp[MAXCHAIN], out[MAXCHAIN], lin[MAXCHAIN];
+        fbseg_t seg[FBUF_MAXSEGS];
+        const char* data;
+        FBUF b;
+        int len = make_chain(&b, exp);
+        int pos = rand() % (len + 1);
+        int n = 0;
+
+        /* Reference: byte by byte */
+        fbuf_rseek(&b, pos);
+        for (int j=pos; j<len; j++)
+            out[j-pos] = fbuf_getChar(&b);
+        if (fbuf_length(&b) != len || memcmp(out, exp + pos, len - pos) != 0) {
+            printf("FAIL: segment test %d: getChar from %d (length %d)\n", i, pos, len);
+            fails++;
+        }
+
+        /* All segments from pos */
+        uint8_t nseg = fbuf_segments(&b, pos, seg, FBUF_MAXSEGS);
+        for (int k=0; k<nseg; k++) {
+            memcpy(out + n, seg[k].data, seg[k].length);
+            n += seg[k].length;
+        }
+        if (n != len - pos || memcmp(out, exp + pos, n) != 0) {
+            printf("FAIL: segment test %d: fbuf_segments from %d (length %d, got %d)\n",
+                i, pos, len, n);
+            fails++;
+        }
+
+        /* getSeg after reading pos bytes with getChar */
+        fbuf_reset(&b);
+        for (int j=0; j<pos; j++)
+            fbuf_getChar(&b);
+        n = 0;
+        for (uint8_t k; n < len - pos && (k = fbuf_getSeg(&b, &data)) > 0; n += k)
+            memcpy(out + n, data, k);
+        if (n < len - pos || memcmp(out, exp + pos, len - pos) != 0) {
+            printf("FAIL: segment test %d: fbuf_getSeg from %d (length %d, got %d)\n",
+                i, pos, len, n);
+            fails++;
+        }
+
+        /* Whole chain */
+        data = fbuf_linearize(&b, lin, sizeof(lin));
+        if (memcmp(data, exp, len) != 0) {
+            printf("FAIL: segment test %d: fbuf_linearize (length %d)\n", i, len);
+            fails++;
+        }
+        fbuf_release(&b);
+    }
+    if (fbuf_usedSlots() != 0) {
+        printf("FAIL: %d slots not released after segment test\n", fbuf_usedSlots());
+        fails++;
+    }
+    return fails;
+}
+
+
+
+/*******************************************************
+ * Multi-threaded stress test.
+ *
+ * Subscriber queues are protected by a pthread mutex,
+ * like FBQ is by a FreeRTOS mutex. Two subscribers
+ * make the producer wait when the queue is full, so
+ * that all frames arrive in order. fbqsw_publish()
+ * never waits, but these keep the pool busy. One
+ * subscriber drops the newest and one drops the oldest
+ * frame, so that frames are also released by the
+ * producers.
+ *******************************************************/
+
+#define NPROD     3
+#define NSUB      4
+#define QSIZE     16
+#define STRESS_PKTS 50000
+#define HDRLEN    8
+
+typedef enum { SQ_WAIT, SQ_DROP_NEWEST, SQ_DROP_OLDEST } sq_policy_t;
+
+typedef struct {
+    pthread_mutex_t mx;
+    pthread_cond_t  cond;
+    FBUF buf[QSIZE];
+    int  index, cnt;
+    sq_policy_t policy;
+    int  received, dropped, corrupt;
+    int  lastseq[NPROD];
+} squeue_t;
+
+static squeue_t sq[NSUB];
+static _Atomic int producers_left;
+
+
+static inline char pkt_byte(int id, int seq, int j)
+   { return (char) (id * 31 + seq * 7 + j * 13); }
+
+static int pkt_len(int seq)
+   { return HDRLEN + (seq * 37) % 200; }
+
+
+static void sq_put(squeue_t* q, FBUF b)
+{
+    pthread_mutex_lock(&q->mx);
+    if (q->cnt == QSIZE) {
+        if (q->policy == SQ_WAIT) {
+            while (q->cnt == QSIZE)
+                pthread_cond_wait(&q->cond, &q->mx);
+        }
+        else if (q->policy == SQ_DROP_NEWEST) {
+            q->dropped++;
+            pthread_mutex_unlock(&q->mx);
+            fbuf_release(&b);
+            return;
+        }
+        else {
+            fbuf_release(&q->buf[q->index]);
+            q->index = (q->index + 1) % QSIZE;
+            q->cnt--;
+            q->dropped++;
+        }
+    }
+    q->buf[(q->index + q->cnt) % QSIZE] = b;
+    q->cnt++;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->mx);
+}
+
+
+static bool sq_get(squeue_t* q, FBUF* b)
+{
+    pthread_mutex_lock(&q->mx);
+    while (q->cnt == 0 && producers_left > 0)
+        pthread_cond_wait(&q->cond, &q->mx);
+    if (q->cnt == 0) {
+        pthread_mutex_unlock(&q->mx);
+        return false;
+    }
+    *b = q->buf[q->index];
+    q->index = (q->index + 1) % QSIZE;
+    q->cnt--;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->mx);
+    return true;
+}
+
+
+static void* producer(void* arg)
+{
+    int id = (int) (intptr_t) arg;
+    char buf[MAXPKT];
+
+    for (int seq=0; seq<STRESS_PKTS; seq++) {
+        int len = pkt_len(seq);
+        memcpy(buf, &id, 4);
+        memcpy(buf+4, &seq, 4);
+        for (int j=HDRLEN; j<len; j++)
+            buf[j] = pkt_byte(id, seq, j);
+
+        FBUF b;
+        fbuf_new(&b, SRC_RX);
+        fbuf_write(&b, buf, len);
+
+        /* Like fbqsw_publish */
+        for (int i=0; i<NSUB; i++)
+            sq_put(&sq[i], fbuf_newRef(&b, SRC_DUPLICATE));
+        fbuf_release(&b);
+    }
+    if (atomic_fetch_sub(&producers_left, 1) == 1)
+        for (int i=0; i<NSUB; i++) {
+            pthread_mutex_lock(&sq[i].mx);
+            pthread_cond_broadcast(&sq[i].cond);
+            pthread_mutex_unlock(&sq[i].mx);
+        }
+    return NULL;
+}
+
+
+static bool pkt_ok(FBUF* b, int* id, int* seq)
+{
+    char buf[MAXPKT];
+    int len = fbuf_read(b, 0, buf);
+    if (len < HDRLEN)
+        return false;
+    memcpy(id, buf, 4);
+    memcpy(seq, buf+4, 4);
+    if (*id < 0 || *id >= NPROD || *seq < 0 || *seq >= STRESS_PKTS || len != pkt_len(*seq))
+        return false;
+    for (int j=HDRLEN; j<len; j++)
+        if (buf[j] != pkt_byte(*id, *seq, j))
+            return false;
+    return true;
+}
+
+
+static void* consumer(void* arg)
+{
+    squeue_t* q = arg;
+    FBUF b;
+    int id, seq;
+
+    while (sq_get(q, &b)) {
+        if (!pkt_ok(&b, &id, &seq)) {
+            q->corrupt++;
+            fbuf_release(&b);
+            continue;
+        }
+        if (q->policy == SQ_WAIT && seq != q->lastseq[id] + 1)
+            q->corrupt++;
+        q->lastseq[id] = seq;
+        q->received++;
+
+        /*
+         * Share the tail of the frame with a new header, like the
+         * digipeater does. The connection is at a slot boundary,
+         * so no shared slot is modified.
+         */
+        if (q == &sq[0] && fbuf_length(&b) > FBUF_SLOTSIZE) {
+            char hdr[HDRLEN], buf[MAXPKT];
+            FBUF h;
+            memcpy(hdr, &id, 4);
+            memcpy(hdr+4, &seq, 4);
+            fbuf_new(&h, SRC_DIGIPEATER);
+            fbuf_write(&h, hdr, HDRLEN);
+            fbuf_connect(&h, &b, FBUF_SLOTSIZE);
+            int len = fbuf_read(&h, 0, buf);
+            if (len != pkt_len(seq) - FBUF_SLOTSIZE + HDRLEN
+                  || buf[HDRLEN] != pkt_byte(id, seq, FBUF_SLOTSIZE))
+                q->corrupt++;
+            fbuf_release(&h);
+        }
+        /* Extra references, like the monitor */
+        else if (q == &sq[1]) {
+            FBUF x = fbuf_newRef(&b, SRC_DUPLICATE);
+            fbuf_release(&b);
+            b = x;
+        }
+        fbuf_release(&b);
+    }
+    return NULL;
+}
+
+
+static int check_threads()
+{
+    static const sq_policy_t policy[NSUB] =
+        { SQ_WAIT, SQ_WAIT, SQ_DROP_NEWEST, SQ_DROP_OLDEST };
+    static const char* pname[] = {"wait", "drop-newest", "drop-oldest"};
+    pthread_t prod[NPROD], cons[NSUB];
+    int fails = 0;
+
+    producers_left = NPROD;
+    for (int i=0; i<NSUB; i++) {
+        memset(&sq[i], 0, sizeof(squeue_t));
+        pthread_mutex_init(&sq[i].mx, NULL);
+        pthread_cond_init(&sq[i].cond, NULL);
+        sq[i].policy = policy[i];
+        for (int p=0; p<NPROD; p++)
+            sq[i].lastseq[p] = -1;
+        pthread_create(&cons[i], NULL, consumer, &sq[i]);
+    }
+    for (int p=0; p<NPROD; p++)
+        pthread_create(&prod[p], NULL, producer, (void*) (intptr_t) p);
+    for (int p=0; p<NPROD; p++)
+        pthread_join(prod[p], NULL);
+    for (int i=0; i<NSUB; i++)
+        pthread_join(cons[i], NULL);
+
+    for (int i=0; i<NSUB; i++) {
+        printf("  subscriber %d (%s): %d received, %d dropped, %d corrupt\n", i,
+            pname[sq[i].policy], sq[i].received, sq[i].dropped, sq[i].corrupt);
+        if (sq[i].corrupt > 0 || sq[i].received + sq[i].dropped != NPROD * STRESS_PKTS)
+            fails++;
+    }
+    if (fbuf_usedSlots() != 0) {
+        printf("FAIL: %d slots lost after stress test\n", fbuf_usedSlots());
+        fails++;
+    }
+
+    /*
+     * A slot that was pushed twice on the free list would be
+     * allocated twice here.
+     */
+    static bool seen[FBUF_SLOTS];
+    memset(seen, 0, sizeof(seen));
+    for (int i=0; i<FBUF_SLOTS; i++) {
+        fbuf_new(&all[i], 0);
+        if (all[i].head == NILPTR || seen[all[i].head]) {
+            printf("FAIL: free list corrupt after stress test (slot %d)\n", i);
+            fails++;
+            break;
+        }
+        seen[all[i].head] = true;
+    }
+    FBUF x;
+    fbuf_new(&x, 0);
+    if (x.head != NILPTR) {
+        printf("FAIL: more than %d slots in free list\n", FBUF_SLOTS);
+        fails++;
+    }
+    for (int i=0; i<FBUF_SLOTS; i++)
+        fbuf_release(&all[i]);
+    return fails;
+}
+
+
+
+/*******************************************************
+ * Time fbuf_new + fbuf_write + fbuf_release of a
+ * typical packet for increasing pool occupancy. The
+ * slots in use are scattered over the pool, like after
+ * the system has run for a while.
+ *******************************************************/
+
+static double elapsed(struct timespec* t0)
+{
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) * 1e-9;
+}
+
+
+static void bench()
+{
+    static const int percent[] = {0, 25, 50, 75, 90, 95, 99};
+    const int pktlen = 100;
+    struct timespec t0;
+
+    printf("\n  used   ns/packet   (%d bytes, %d slots)\n", pktlen, slots(pktlen));
+    for (int p=0; p < sizeof(percent)/sizeof(percent[0]); p++) {
+        int nused = FBUF_SLOTS * percent[p] / 100;
+        if (nused > FBUF_SLOTS - slots(pktlen))
+            nused = FBUF_SLOTS - slots(pktlen);
+
+        /* Fill the pool and release a random set of slots */
+        for (int i=0; i<FBUF_SLOTS; i++)
+            fbuf_new(&all[i], 0);
+        for (int n = FBUF_SLOTS; n > nused; ) {
+            int k = rand() % FBUF_SLOTS;
+            if (all[k].head != NILPTR) {
+                fbuf_release(&all[k]);
+                n--;
+            }
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (int r=0; r<BENCH_ROUNDS; r++) {
+            FBUF b;
+            fbuf_new(&b, 0);
+            fbuf_write(&b, text, pktlen);
+            fbuf_release(&b);
+        }
+        double t = elapsed(&t0);
+        printf("  %3d%%  %8.1f\n", percent[p], t * 1e9 / BENCH_ROUNDS);
+
+        for (int i=0; i<FBUF_SLOTS; i++)
+            fbuf_release(&all[i]);
+    }
+}
+
+
+
+/*******************************************************
+ * Checksum of a packet, like heardlist does, byte by
+ * byte and segment by segment.
+ *******************************************************/
+
+static void bench_segments()
+{
+    static const int sizes[] = {20, 64, 100, 200};
+    struct timespec t0;
+    uint32_t sum = 0;
+
+    printf("\n  size   getChar          segments\n");
+    for (int s=0; s < sizeof(sizes)/sizeof(sizes[0]); s++) {
+        int len = sizes[s];
+        double t_char, t_seg;
+        FBUF b;
+        fbuf_new(&b, 0);
+        fbuf_write(&b, text, len);
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (int r=0; r<BENCH_ROUNDS; r++) {
+            fbuf_reset(&b);
+            for (int j=0; j<len; j++)
+                sum = sum * 31 + (uint8_t) fbuf_getChar(&b);
+        }
+        t_char = elapsed(&t0);
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (int r=0; r<BENCH_ROUNDS; r++) {
+            fbseg_t seg[FBUF_MAXSEGS];
+            uint8_t n = fbuf_segments(&b, 0, seg, FBUF_MAXSEGS);
+            for (int k=0; k<n; k++)
+                for (int j=0; j<seg[k].length; j++)
+                    sum = sum * 31 + (uint8_t) seg[k].data[j];
+        }
+        t_seg = elapsed(&t0);
+
+        printf("  %4d  %7.1f MB/s   %7.1f MB/s (%.1fx)\n", len,
+            (double) len * BENCH_ROUNDS / t_char / 1e6,
+            (double) len * BENCH_ROUNDS / t_seg / 1e6, t_char / t_seg);
+        fbuf_release(&b);
+    }
+    if (sum == 0)
+        printf("(zero checksum)\n");
+}
+
+
+
+int main(int argc, char** argv)
+{
+    fbuf_init();
+    for (int i=0; i<MAXPKT; i++)
+        text[i] = rand();
+
+    int fails = check_exhaust();
+    fails += check_counts();
+    fails += check_write();
+    fails += check_segments();
+    fails += check_threads();
+    printf("%d slots, %d random tests, %d threads, %d failures\n",
+        FBUF_SLOTS, 3 * RANDOM_TESTS, NPROD + NSUB, fails);
+    if (fails > 0)
+        return 1;
+    bench();
+    bench_segments();
+    return 0;
+}